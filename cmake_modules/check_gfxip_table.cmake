@@ -0,0 +1,64 @@
+################################################################################
+##
+## Copyright (c) 2021 Advanced Micro Devices, Inc. All rights reserved.
+##
+## MIT LICENSE:
+## Permission is hereby granted, free of charge, to any person obtaining a copy of
+## this software and associated documentation files (the "Software"), to deal in
+## the Software without restriction, including without limitation the rights to
+## use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+## of the Software, and to permit persons to whom the Software is furnished to do
+## so, subject to the following conditions:
+##
+## The above copyright notice and this permission notice shall be included in all
+## copies or substantial portions of the Software.
+##
+## THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+## IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+## FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+## AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+## LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+## OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+## SOFTWARE.
+##
+################################################################################
+
+## Checks that gfxip_lookup_table in SOURCE is sorted by device ID without
+## duplicates, which find_hsa_gfxip_device's binary search relies on.
+## Touches STAMP on success.
+##
+##   cmake -DSOURCE=src/topology.c -DSTAMP=gfxip_table.stamp -P check_gfxip_table.cmake
+
+file ( READ ${SOURCE} CONTENTS )
+
+string ( FIND "${CONTENTS}" "gfxip_lookup_table[] = {" TABLE_START )
+if ( TABLE_START EQUAL -1 )
+    message ( FATAL_ERROR "gfxip_lookup_table not found in ${SOURCE}" )
+endif ()
+string ( SUBSTRING "${CONTENTS}" ${TABLE_START} -1 TABLE )
+string ( FIND "${TABLE}" "};" TABLE_END )
+string ( SUBSTRING "${TABLE}" 0 ${TABLE_END} TABLE )
+
+string ( REGEX MATCHALL "{ *0[xX][0-9a-fA-F]+" ENTRIES "${TABLE}" )
+set ( PREV "" )
+foreach ( ENTRY ${ENTRIES} )
+    string ( REGEX REPLACE "{ *0[xX]" "" ID "${ENTRY}" )
+    string ( TOUPPER "${ID}" ID )
+    ## Zero pad to four digits so string order is numeric order
+    string ( LENGTH "${ID}" LEN )
+    while ( LEN LESS 4 )
+        set ( ID "0${ID}" )
+        math ( EXPR LEN "${LEN} + 1" )
+    endwhile ()
+
+    if ( NOT "${PREV}" STREQUAL "" AND NOT "${PREV}" STRLESS "${ID}" )
+        if ( "${PREV}" STREQUAL "${ID}" )
+            message ( FATAL_ERROR "gfxip_lookup_table: duplicate device ID 0x${ID}" )
+        endif ()
+        message ( FATAL_ERROR "gfxip_lookup_table: device ID 0x${ID} after 0x${PREV}, "
+                              "the table must be sorted by device ID" )
+    endif ()
+    set ( PREV "${ID}" )
+endforeach ()
+
+file ( WRITE ${STAMP} "" )
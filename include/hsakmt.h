@@ -172,6 +172,71 @@ hsaKmtGetNodeIoLinkProperties(
     HsaIoLinkProperties* IoLinkProperties  //OUT
     );
 
+/**
+  Returns a read-only pointer to the current topology snapshot taken by
+  hsaKmtAcquireSystemProperties(). The snapshot is immutable and holds all
+  node, memory, cache and IO link properties, so they can be read without
+  copies or locking. Acquiring briefly takes a library mutex to take the
+  reference, releasing doesn't lock. Each successful call takes a reference
+  that must be dropped with hsaKmtReleaseTopologySnapshot().
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtAcquireTopologySnapshot(
+    const HsaTopologySnapshot** Snapshot    //OUT
+    );
+
+/**
+  Drops a reference taken by hsaKmtAcquireTopologySnapshot()
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtReleaseTopologySnapshot(
+    const HsaTopologySnapshot*  Snapshot    //IN
+    );
+
+/**
+  Retrieves the shortest paths between all pairs of HSA nodes, computed once
+  per topology snapshot. The memory pointer passed as Distances is sized as
+  NumNodes * NumNodes * sizeof(HsaNodeDistance), NumNodes must match
+  HsaSystemProperties.NumNodes. The path from node From to node To is stored
+  at Distances[From * NumNodes + To].
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtGetNodeDistanceMatrix(
+    HSAuint32           NumNodes,           //IN
+    HsaNodeDistance*    Distances           //OUT
+    );
+
+/**
+  Ranks the nodes a buffer used by the ConsumerNodes can be allocated from,
+  based on the current topology snapshot. Only nodes with system or VRAM
+  memory that every consumer can access are candidates. Remote VRAM must be
+  in the same XGMI hive or visible through a large BAR.
+
+  Candidates are sorted by the highest aggregate bandwidth to the consumers,
+  then by the lowest link weight. TrafficShares optionally gives each
+  consumer's relative share of the traffic, NULL weighs all consumers the
+  same. On input, NumCandidates is the size of the Candidates array, on
+  output the number of candidates returned. If Candidates is NULL, only the
+  number of candidates is returned.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtGetPlacementAdvice(
+    HSAuint32               NumConsumers,   //IN
+    const HSAuint32*        ConsumerNodes,  //IN
+    const HSAuint32*        TrafficShares,  //IN, optional
+    HSA_PLACEMENT_TRAFFIC   Traffic,        //IN
+    HSAuint32*              NumCandidates,  //IN/OUT
+    HsaPlacementCandidate*  Candidates      //OUT, optional
+    );
+
 
 
 /**
@@ -330,6 +395,54 @@ hsaKmtSetQueueCUMask(
     HSAuint32*          QueueCUMask     //IN
     );
 
+/**
+  Builds a CU mask with NumCUs CUs of the node enabled, the low NumCUs bits
+  of the mask. KFD interleaves the mask bits over the shader engines and
+  arrays, so these CUs are spread evenly over them. The result is suitable
+  for hsaKmtSetQueueCUMask. CUMaskCount is the size of QueueCUMask in bits; it
+  must be a multiple of 32 and cover all CUs of the node.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtBuildQueueCUMask(
+    HSAuint32           NodeId,         //IN
+    HSAuint32           NumCUs,         //IN
+    HSAuint32           CUMaskCount,    //IN
+    HSAuint32*          QueueCUMask     //OUT
+    );
+
+/**
+  Same as hsaKmtBuildQueueCUMask, with the number of CUs given as a
+  percentage (1-100) of the CUs of the node
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtBuildQueueCUMaskByPercentage(
+    HSAuint32           NodeId,         //IN
+    HSAuint32           CUPercentage,   //IN
+    HSAuint32           CUMaskCount,    //IN
+    HSAuint32*          QueueCUMask     //OUT
+    );
+
+/**
+  Splits the CUs of a node into NumPartitions disjoint CU masks of
+  (almost) equal size for spatial partitioning of the GPU. When the number
+  of shader engines is a multiple of NumPartitions, each partition gets
+  whole shader engines. QueueCUMasks receives NumPartitions consecutive
+  masks of CUMaskCount bits each.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtPartitionQueueCUMask(
+    HSAuint32           NodeId,         //IN
+    HSAuint32           NumPartitions,  //IN
+    HSAuint32           CUMaskCount,    //IN
+    HSAuint32*          QueueCUMasks    //OUT
+    );
+
 HSAKMT_STATUS
 HSAKMTAPI
 hsaKmtGetQueueInfo(
@@ -363,6 +476,29 @@ hsaKmtAllocMemory(
     void**          MemoryAddress           //IN/OUT (page-aligned)
     );
 
+/**
+  Allocates system memory like hsaKmtAllocMemory, but spreads it over the NUMA
+  nodes of several HSA nodes instead of one preferred node. CPU nodes are
+  used as is, GPU nodes are replaced by the CPU node they are directly
+  attached to, or else by the nearest CPU node with memory. A GPU that
+  reaches no such node fails with HSAKMT_STATUS_INVALID_NODE_UNIT. With
+  HSA_NUMA_POLICY_SPLIT, each GPU's part of a buffer can be
+  placed next to it. The NoSubstitute flag decides whether a part must be on
+  its node or may fall back to others, as with hsaKmtAllocMemory.
+  Scratch, GDSMemory and NoNUMABind are not allowed.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtAllocMemoryNUMA(
+    HSAuint32       NumNodes,               //IN
+    const HSAuint32* Nodes,                 //IN
+    HSA_NUMA_POLICY Policy,                 //IN
+    HSAuint64       SizeInBytes,            //IN  (multiple of page size)
+    HsaMemFlags     MemFlags,               //IN
+    void**          MemoryAddress           //IN/OUT (page-aligned)
+    );
+
 /**
   Frees a memory buffer
 */
@@ -756,6 +892,124 @@ hsaKmtPmcStopTrace(
     HSATraceId  TraceId     //IN
     );
 
+/**
+  Starts sampling all counters of a started trace every IntervalUs microseconds
+  (at least 100) on a library thread. Samples go to a ring of NumRingSamples
+  entries that the application drains with hsaKmtPmcReadSamples. Clocks gets
+  the clock counters of the trace's node at the start, to correlate the CPU
+  timestamps of the samples with GPU time.
+  Stopping the trace stops the sampling thread, the samples left in the ring
+  can still be read until hsaKmtPmcStopSampling.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtPmcStartSampling(
+    HSATraceId          TraceId,            //IN
+    HSAuint32           IntervalUs,         //IN
+    HSAuint32           NumRingSamples,     //IN
+    HsaClockCounters*   Clocks,             //OUT (optional)
+    HSAuint32*          SampleSizeBytes     //OUT
+    );
+
+/**
+  Moves up to MaxSamples of the oldest samples out of the ring into Samples,
+  SampleSizeBytes apart. Must not be called from several threads at once for
+  the same trace.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtPmcReadSamples(
+    HSATraceId  TraceId,        //IN
+    HSAuint32   MaxSamples,     //IN
+    void*       Samples,        //OUT
+    HSAuint32*  NumSamples      //OUT
+    );
+
+/**
+  Stops sampling the counters of a trace and frees the ring. Samples that were
+  not read are lost.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtPmcStopSampling(
+    HSATraceId  TraceId     //IN
+    );
+
+/**
+  Compiles derived metrics over counters that the caller collects.
+  Metrics are arithmetic expressions (+ - * / and parentheses) over numbers
+  and counters written as BLOCK:ID, e.g. "TCC:3 * 100 / (TCC:2 + TCC:3)".
+  Any counter of the node's blocks can be used. Division by 0 gives 0.
+  Counters describes the layout of the samples passed to
+  hsaKmtPmcEvaluateMetrics: sample entry i holds the value of the counter
+  with the BlockIndex and CounterId of Counters[i]. Every counter used by
+  the metrics must be in the layout. Free the metrics with
+  hsaKmtPmcUnregisterMetrics.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtPmcCompileMetrics(
+    HSAuint32           NodeId,         //IN
+    HSAuint32           NumMetrics,     //IN
+    const char**        Expressions,    //IN
+    HSAuint32           NumCounters,    //IN
+    const HsaCounter*   Counters,       //IN
+    HSAMetricsId*       MetricsId       //OUT
+    );
+
+/**
+  Compiles derived metrics like hsaKmtPmcCompileMetrics and registers a
+  trace of the counters they use, e.g. "IOMMUV2:2 * 100 / (IOMMUV2:1 + IOMMUV2:2)".
+  Only privileged counters, which the thunk traces itself, can be used.
+  TraceRoot describes the registered trace, which is acquired, started,
+  queried or sampled as any other trace, and whose buffer is the sample
+  layout.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtPmcRegisterMetrics(
+    HSAuint32           NodeId,         //IN
+    HSAuint32           NumMetrics,     //IN
+    const char**        Expressions,    //IN
+    HsaPmcTraceRoot*    TraceRoot,      //OUT
+    HSAMetricsId*       MetricsId       //OUT
+    );
+
+/**
+  Unregisters the trace of a set of metrics, if they have one, and frees
+  the metrics
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtPmcUnregisterMetrics(
+    HSAuint32       NodeId,     //IN
+    HSAMetricsId    MetricsId   //IN
+    );
+
+/**
+  Evaluates every metric for NumSamples samples of the metrics' trace, or
+  of the caller's layout for hsaKmtPmcCompileMetrics. Samples points to the
+  first trace buffer, or to the Counters of the first HsaPmcSample, and
+  SampleStrideBytes is the distance between samples (0 for back to back
+  samples). Values gets NumSamples x NumMetrics results, sample by sample.
+*/
+
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtPmcEvaluateMetrics(
+    HSAMetricsId    MetricsId,          //IN
+    const void*     Samples,            //IN
+    HSAuint32       NumSamples,         //IN
+    HSAuint64       SampleStrideBytes,  //IN
+    double*         Values              //OUT
+    );
+
 /**
   Sets trap handler and trap buffer to be used for all queues associated with the specified NodeId within this process context
 */
@@ -835,6 +1089,124 @@ hsaKmtSPMSetDestBuffer(
 	bool        *isSPMDataLoss		//OUT
     );
 
+/**
+  Streams the SPM data of a node into a sink. The library rotates
+  NumBuffers destination buffers of BufferSizeBytes through
+  hsaKmtSPMSetDestBuffer on a drain thread and hands filled buffers to the
+  sink on a consumer thread. If no buffer is free for TimeoutMs because the
+  sink falls behind, the oldest filled buffer is reused and counted as
+  dropped. SPM must have been acquired with
+  hsaKmtSPMAcquire, and must not be used otherwise while the stream runs.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtSPMStartStream(
+    HSAuint32               PreferredNode,      //IN
+    HSAuint32               NumBuffers,         //IN, at least 2
+    HSAuint32               BufferSizeBytes,    //IN
+    HSAuint32               TimeoutMs,          //IN, longest wait for one buffer
+    const HsaSpmStreamSink  *Sink,              //IN
+    HSASpmStreamId          *StreamId           //OUT
+    );
+
+/**
+  Returns the drop counters and throughput of a stream
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtSPMGetStreamStats(
+    HSASpmStreamId          StreamId,           //IN
+    HsaSpmStreamStats       *Stats              //OUT
+    );
+
+/**
+  Stops copying SPM data, delivers the buffers that are still filled and
+  frees the stream. Returns the first error the stream ran into.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtSPMStopStream(
+    HSASpmStreamId          StreamId            //IN
+    );
+
+/**
+  Creates a decoder for SPM buffers whose samples have the given layout.
+  The counters must exist on the node.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtSPMCreateDecoder(
+    HSAuint32                   NodeId,         //IN
+    const HsaSpmSampleLayout    *Layout,        //IN
+    HSASpmDecoderId             *DecoderId      //OUT
+    );
+
+/**
+  Destroys an SPM decoder
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtSPMDestroyDecoder(
+    HSASpmDecoderId             DecoderId       //IN
+    );
+
+/**
+  Decodes up to MaxSamples whole samples of SPM data into per-counter time
+  series: Timestamps[s] and Values[c * MaxSamples + s] for counter c of the
+  layout. SizeConsumed returns the bytes decoded, a trailing partial sample
+  must be passed again with the following data.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtSPMDecode(
+    HSASpmDecoderId             DecoderId,      //IN
+    const void                  *Data,          //IN
+    HSAuint32                   SizeBytes,      //IN
+    HSAuint32                   MaxSamples,     //IN
+    HSAuint64                   *Timestamps,    //OUT
+    HSAuint64                   *Values,        //OUT
+    HSAuint32                   *NumSamples,    //OUT
+    HSAuint32                   *SizeConsumed   //OUT, optional
+    );
+
+/**
+  Compresses decoded time series, Values[c * ColumnStride + s], into a chunk
+  that stores every column as delta-encoded varints. ColumnStride of 0 means
+  NumSamples. A capture file is a sequence of chunks. On input ChunkSize is
+  the size of the Chunk buffer, which must hold the largest possible chunk.
+  If Chunk is NULL, that largest size is returned, else the chunk's size.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtSPMEncodeChunk(
+    HSAuint32                   NumCounters,    //IN
+    HSAuint32                   NumSamples,     //IN
+    const HSAuint64             *Timestamps,    //IN
+    const HSAuint64             *Values,        //IN
+    HSAuint32                   ColumnStride,   //IN
+    void                        *Chunk,         //OUT
+    HSAuint64                   *ChunkSize      //IN/OUT
+    );
+
+/**
+  Decompresses the chunk at the start of Chunk into Timestamps[s] and
+  Values[c * MaxSamples + s]. NumCounters, NumSamples and ChunkSize, the
+  offset of the next chunk, are returned even if Timestamps and Values are
+  NULL, to size the arrays or skip the chunk.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtSPMDecodeChunk(
+    const void                  *Chunk,         //IN
+    HSAuint64                   SizeBytes,      //IN
+    HSAuint32                   MaxSamples,     //IN
+    HSAuint64                   *Timestamps,    //OUT
+    HSAuint64                   *Values,        //OUT
+    HSAuint32                   *NumCounters,   //OUT
+    HSAuint32                   *NumSamples,    //OUT
+    HSAuint64                   *ChunkSize      //OUT, optional
+    );
+
 /* Helper functions for calling KFD SVM ioctl */
 HSAKMT_STATUS
 HSAKMTAPI
@@ -845,6 +1217,21 @@ hsaKmtSVMSetAttr(
     HSA_SVM_ATTRIBUTE *attrs  // IN: array of attributes
 );
 
+/**
+  Sets attributes on many ranges with as few SVM ioctls as possible.
+  Adjacent ranges with the same attributes are set together, and disjoint
+  ranges may be set in any order. If ranges overlap, they are set in array
+  order. On failure, FailedRange is a range that wasn't set, other ranges
+  may have been set already.
+*/
+HSAKMT_STATUS
+HSAKMTAPI
+hsaKmtSVMSetAttrBatch(
+    HSAuint32 NumRanges,                    // IN: number of ranges
+    const HsaSVMRangeAttributes *Ranges,    // IN: ranges and their attributes
+    HSAuint32 *FailedRange                  // OUT: optional, failed range index
+);
+
 HSAKMT_STATUS
 HSAKMTAPI
 hsaKmtSVMGetAttr(
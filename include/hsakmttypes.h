@@ -501,6 +501,76 @@ typedef struct _HsaIoLinkProperties
     HSA_LINKPROPERTY Flags;          // override flags (may be active for specific platforms)
 } HsaIoLinkProperties;
 
+//
+// Shortest path from one node to another over the direct IO links reported
+// by the kernel, see hsaKmtGetNodeDistanceMatrix. Paths with the lowest
+// total weight are chosen, ties go to the path with the fewest hops.
+//
+
+#define HSA_NODE_DISTANCE_UNREACHABLE 0xFFFFFFFF
+
+typedef struct _HsaNodeDistance
+{
+    HSAuint32       Weight;             // sum of the link weights, 0 from a node to itself,
+                                        // HSA_NODE_DISTANCE_UNREACHABLE if there is no path
+    HSAuint32       NumHops;            // number of IO links on the path
+    HSAuint32       NextHop;            // first node after NodeFrom on the path, NodeTo for a direct link
+    HSAuint32       MinimumBandwidth;   // smallest MinimumBandwidth of the links on the path in MB/s
+    HSAuint32       MaximumBandwidth;   // smallest MaximumBandwidth of the links on the path in MB/s,
+                                        // i.e. the bottleneck. 0 if a link doesn't report it
+    HSA_IOLINKTYPE  IoLinkType;         // type of the first link on the path
+} HsaNodeDistance;
+
+//
+// Placement advice for a buffer, see hsaKmtGetPlacementAdvice
+//
+
+typedef enum _HSA_PLACEMENT_TRAFFIC
+{
+    HSA_PLACEMENT_TRAFFIC_READ       = 0,   // consumers mostly read the buffer
+    HSA_PLACEMENT_TRAFFIC_WRITE      = 1,   // consumers mostly write the buffer
+    HSA_PLACEMENT_TRAFFIC_READ_WRITE = 2,   // both, each link direction must carry the traffic
+} HSA_PLACEMENT_TRAFFIC;
+
+typedef struct _HsaPlacementCandidate
+{
+    HSAuint32   NodeId;             // node to allocate the buffer's memory from
+    HSAuint32   CopyNodeId;         // GPU node whose copy engines have the highest bandwidth to NodeId
+    HSAuint64   Bandwidth;          // sum of each consumer's bandwidth to the memory in MB/s, times its
+                                    // traffic share. Unknown link or memory bandwidths count as 0
+    HSAuint32   Weight;             // sum of each consumer's link weight to NodeId, times its traffic share
+    HSAuint32   NumRemoteConsumers; // consumers that access the memory over an IO link
+} HsaPlacementCandidate;
+
+//
+// Read-only view of one node in a topology snapshot. The contents match
+// what hsaKmtGetNodeProperties, hsaKmtGetNodeMemoryProperties,
+// hsaKmtGetNodeCacheProperties and hsaKmtGetNodeIoLinkProperties return.
+// The arrays hold Node.NumMemoryBanks, Node.NumCaches and Node.NumIOLinks
+// elements respectively.
+//
+
+typedef struct _HsaNodeSnapshot
+{
+    HsaNodeProperties           Node;
+    const HsaMemoryProperties*  MemoryProperties;
+    const HsaCacheProperties*   CacheProperties;
+    const HsaIoLinkProperties*  IoLinkProperties;
+} HsaNodeSnapshot;
+
+//
+// Immutable, reference counted topology snapshot. It stays valid until
+// released with hsaKmtReleaseTopologySnapshot, even if the topology is
+// refreshed or released in the meantime.
+//
+
+typedef struct _HsaTopologySnapshot
+{
+    HsaSystemProperties     SystemProperties;
+    const HsaNodeSnapshot*  Nodes;           // SystemProperties.NumNodes elements
+    const HsaNodeDistance*  Distances;       // NumNodes * NumNodes elements, [NodeFrom * NumNodes + NodeTo]
+} HsaTopologySnapshot;
+
 //
 // Memory allocation definitions for the KFD HSA interface
 //
@@ -567,6 +637,17 @@ typedef struct _HsaMemFlags
     };
 } HsaMemFlags;
 
+//
+// NUMA placement of system memory, see hsaKmtAllocMemoryNUMA
+//
+
+typedef enum _HSA_NUMA_POLICY
+{
+    HSA_NUMA_POLICY_INTERLEAVE = 0,  // interleave the pages across the NUMA nodes of all Nodes
+    HSA_NUMA_POLICY_SPLIT      = 1,  // split the memory into NumNodes contiguous parts of equal size,
+                                     // part i is placed on the NUMA node of Nodes[i]
+} HSA_NUMA_POLICY;
+
 typedef struct _HsaMemMapFlags
 {
     union
@@ -1270,6 +1351,8 @@ typedef struct _HsaCounterProperties
 
 typedef HSAuint64   HSATraceId;
 
+typedef HSAuint64   HSAMetricsId;
+
 typedef struct _HsaPmcTraceRoot
 {
     HSAuint64                   TraceBufferMinSizeBytes;// (page aligned)
@@ -1277,6 +1360,71 @@ typedef struct _HsaPmcTraceRoot
     HSATraceId                  TraceId;
 } HsaPmcTraceRoot;
 
+//
+// One sample of a trace taken by the counter sampler. Samples are
+// SampleSizeBytes apart, see hsaKmtPmcStartSampling.
+//
+typedef struct _HsaPmcSample
+{
+    HSAuint64                   CPUClockCounter;// CLOCK_MONOTONIC_RAW in ns, same clock as
+                                                // HsaClockCounters.CPUClockCounter
+    HSAuint32                   Pass;           // pass whose counters were read
+    HSAuint32                   NumDropped;     // samples lost just before this one
+                                                // because the ring was full
+    HSAuint64                   Counters[1];    // trace buffer layout, counters of
+                                                // other passes are 0
+} HsaPmcSample;
+
+typedef HSAuint64   HSASpmStreamId;
+
+//
+// Called on the stream's consumer thread with the SPM data of one filled
+// buffer. Data is only valid until the callback returns.
+//
+typedef void (*HsaSpmStreamCallback)(void *UserData, const void *Data,
+                                     HSAuint32 SizeBytes, bool DataLoss);
+
+typedef struct _HsaSpmStreamSink
+{
+    HsaSpmStreamCallback        Callback;       // NULL to write the data to Fd
+    void*                       UserData;       // passed to Callback
+    HSAint32                    Fd;             // file descriptor, used if Callback is NULL
+} HsaSpmStreamSink;
+
+typedef struct _HsaSpmStreamStats
+{
+    HSAuint64                   BytesDelivered;   // bytes handed to the sink
+    HSAuint64                   BuffersDelivered;
+    HSAuint64                   BuffersDropped;   // filled buffers reused before the sink
+                                                  // consumed them, or lost by a failed sink
+    HSAuint64                   BytesDropped;
+    HSAuint64                   DataLossEvents;   // buffers the kernel flagged with data loss
+    HSAuint64                   ElapsedNs;        // since the stream was started
+    HSAuint64                   BytesPerSecond;   // average delivery rate
+} HsaSpmStreamStats;
+
+typedef HSAuint64   HSASpmDecoderId;
+
+//
+// Where one counter sits in an SPM sample, which depends on how SPM was
+// programmed. BlockIndex and CounterId are as in HsaCounter.
+//
+typedef struct _HsaSpmCounterLayout
+{
+    HSAuint32                   BlockIndex;
+    HSAuint64                   CounterId;
+    HSAuint32                   Offset;         // byte offset in the sample
+    HSAuint32                   SizeInBits;     // 16 or 32
+} HsaSpmCounterLayout;
+
+typedef struct _HsaSpmSampleLayout
+{
+    HSAuint32                   SampleSizeBytes;
+    HSAuint32                   TimestampOffset;// byte offset of the 64-bit GPU timestamp
+    HSAuint32                   NumCounters;
+    const HsaSpmCounterLayout*  Counters;       // NumCounters elements
+} HsaSpmSampleLayout;
+
 typedef struct _HsaGpuTileConfig
 {
     HSAuint32 *TileConfig;
@@ -1352,6 +1500,13 @@ typedef struct _HSA_SVM_ATTRIBUTE {
 	HSAuint32 value; // attribute value
 } HSA_SVM_ATTRIBUTE;
 
+typedef struct _HsaSVMRangeAttributes {
+	void               *StartAddress;    // Start of the range (page-aligned)
+	HSAuint64          SizeInBytes;      // Size of the range (page-aligned)
+	HSAuint32          NumAttributes;    // Number of attributes
+	HSA_SVM_ATTRIBUTE  *Attributes;      // Attributes to set on the range
+} HsaSVMRangeAttributes;
+
 #pragma pack(pop, hsakmttypes_h)
 
 
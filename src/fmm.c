@@ -1447,8 +1447,11 @@ void *fmm_allocate_doorbell(uint32_t gpu_id, uint64_t MemorySizeInBytes,
 	return mem;
 }
 
+static int bind_mem_to_numa(uint32_t node_id, void *mem, uint64_t SizeInBytes,
+			    HsaMemFlags mflags, const fmm_numa_policy_t *numa);
+
 static void *fmm_allocate_host_cpu(void *address, uint64_t MemorySizeInBytes,
-				HsaMemFlags mflags)
+				HsaMemFlags mflags, const fmm_numa_policy_t *numa)
 {
 	void *mem = NULL;
 	vm_object_t *vm_obj;
@@ -1472,6 +1475,12 @@ static void *fmm_allocate_host_cpu(void *address, uint64_t MemorySizeInBytes,
 	if (mem == MAP_FAILED)
 		return NULL;
 
+	/* Without a policy, APUs have only one NUMA node to bind to */
+	if (numa && bind_mem_to_numa(0, mem, MemorySizeInBytes, mflags, numa)) {
+		munmap(mem, MemorySizeInBytes);
+		return NULL;
+	}
+
 	pthread_mutex_lock(&cpuvm_aperture.fmm_mutex);
 	vm_obj = aperture_allocate_object(&cpuvm_aperture, mem, 0,
 				      MemorySizeInBytes, mflags);
@@ -1482,13 +1491,106 @@ static void *fmm_allocate_host_cpu(void *address, uint64_t MemorySizeInBytes,
 	return mem;
 }
 
-static int bind_mem_to_numa(uint32_t node_id, void *mem,
-			    uint64_t SizeInBytes, HsaMemFlags mflags)
+static void numa_mask_set_node(struct bitmask *node_mask, uint32_t node_id)
+{
+#ifdef __PPC64__
+	numa_bitmask_setbit(node_mask, node_id * 8);
+#else
+	numa_bitmask_setbit(node_mask, node_id);
+#endif
+}
+
+static int mbind_mem(void *mem, uint64_t SizeInBytes, int mode,
+		     struct bitmask *node_mask, int num_node, HsaMemFlags mflags)
+{
+	long r;
+
+	r = mbind(mem, SizeInBytes, mode, node_mask->maskp, num_node + 1, 0);
+	if (r) {
+		/* If applcation is running inside docker, still return
+		 * ok because docker seccomp blocks mbind by default,
+		 * otherwise application cannot allocate system memory.
+		 */
+		if (errno == EPERM) {
+			pr_err_once("mbind is blocked by seccomp\n");
+
+			return 0;
+		}
+
+		/* Ignore mbind failure if no memory available on node */
+		if (!mflags.ui32.NoSubstitute)
+			return 0;
+
+		pr_warn_once("Failed to set NUMA policy for %p: %s\n", mem,
+			     strerror(errno));
+
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/* Interleaves the pages across all NUMA nodes of @numa, or splits the
+ * memory into one contiguous part per node. Parts are aligned to huge
+ * pages when the memory is large enough, so that no huge page straddles
+ * two nodes. Invalid NUMA nodes are ignored, like in bind_mem_to_numa.
+ */
+static int bind_mem_to_numa_policy(const fmm_numa_policy_t *numa, void *mem,
+				   uint64_t SizeInBytes, HsaMemFlags mflags,
+				   int num_node)
+{
+	int mode = MPOL_F_STATIC_NODES;
+	struct bitmask *node_mask;
+	uint64_t start, end, align;
+	uint32_t i;
+	int r = 0;
+
+	node_mask = numa_bitmask_alloc(num_node);
+	if (!node_mask)
+		return -ENOMEM;
+
+	if (numa->policy == HSA_NUMA_POLICY_INTERLEAVE) {
+		for (i = 0; i < numa->num_nodes; i++)
+			if (numa->numa_nodes[i] < (unsigned)num_node)
+				numa_mask_set_node(node_mask, numa->numa_nodes[i]);
+		if (numa_bitmask_weight(node_mask))
+			r = mbind_mem(mem, SizeInBytes, mode | MPOL_INTERLEAVE,
+				      node_mask, num_node, mflags);
+		goto out;
+	}
+
+	align = SizeInBytes >= (uint64_t)numa->num_nodes * GPU_HUGE_PAGE_SIZE ?
+		GPU_HUGE_PAGE_SIZE : (uint64_t)PAGE_SIZE;
+	mode |= mflags.ui32.NoSubstitute ? MPOL_BIND : MPOL_PREFERRED;
+
+	for (i = 0; i < numa->num_nodes; i++) {
+		start = (SizeInBytes * i / numa->num_nodes) & ~(align - 1);
+		end = i + 1 < numa->num_nodes ?
+			(SizeInBytes * (i + 1) / numa->num_nodes) & ~(align - 1) :
+			SizeInBytes;
+		if (end <= start || numa->numa_nodes[i] >= (unsigned)num_node)
+			continue;
+
+		numa_bitmask_clearall(node_mask);
+		numa_mask_set_node(node_mask, numa->numa_nodes[i]);
+		r = mbind_mem(VOID_PTR_ADD(mem, start), end - start, mode,
+			      node_mask, num_node, mflags);
+		if (r)
+			break;
+	}
+
+out:
+	numa_bitmask_free(node_mask);
+	return r;
+}
+
+static int bind_mem_to_numa(uint32_t node_id, void *mem, uint64_t SizeInBytes,
+			    HsaMemFlags mflags, const fmm_numa_policy_t *numa)
 {
 	int mode = MPOL_F_STATIC_NODES;
 	struct bitmask *node_mask;
 	int num_node;
-	long r;
+	int r;
 
 	pr_debug("%s mem %p flags 0x%x size 0x%lx node_id %d\n", __func__,
 		mem, mflags.Value, SizeInBytes, node_id);
@@ -1501,6 +1603,10 @@ static int bind_mem_to_numa(uint32_t node_id, void *mem,
 
 	num_node = numa_max_node() + 1;
 
+	if (numa)
+		return num_node > 1 ? bind_mem_to_numa_policy(numa, mem, SizeInBytes,
+							      mflags, num_node) : 0;
+
 	/* Ignore binding requests to invalid nodes IDs */
 	if (node_id >= (unsigned)num_node) {
 		pr_warn("node_id %d >= num_node %d\n", node_id, num_node);
@@ -1514,41 +1620,17 @@ static int bind_mem_to_numa(uint32_t node_id, void *mem,
 	if (!node_mask)
 		return -ENOMEM;
 
-#ifdef __PPC64__
-	numa_bitmask_setbit(node_mask, node_id * 8);
-#else
-	numa_bitmask_setbit(node_mask, node_id);
-#endif
+	numa_mask_set_node(node_mask, node_id);
 	mode |= mflags.ui32.NoSubstitute ? MPOL_BIND : MPOL_PREFERRED;
-	r = mbind(mem, SizeInBytes, mode, node_mask->maskp, num_node + 1, 0);
+	r = mbind_mem(mem, SizeInBytes, mode, node_mask, num_node, mflags);
 	numa_bitmask_free(node_mask);
 
-	if (r) {
-		/* If applcation is running inside docker, still return
-		 * ok because docker seccomp blocks mbind by default,
-		 * otherwise application cannot allocate system memory.
-		 */
-		if (errno == EPERM) {
-			pr_err_once("mbind is blocked by seccomp\n");
-
-			return 0;
-		}
-
-		/* Ignore mbind failure if no memory available on node */
-		if (!mflags.ui32.NoSubstitute)
-			return 0;
-
-		pr_warn_once("Failed to set NUMA policy for %p: %s\n", mem,
-			     strerror(errno));
-
-		return -EFAULT;
-	}
-
-	return 0;
+	return r;
 }
 
 static void *fmm_allocate_host_gpu(uint32_t node_id, void *address,
-				   uint64_t MemorySizeInBytes, HsaMemFlags mflags)
+				   uint64_t MemorySizeInBytes, HsaMemFlags mflags,
+				   const fmm_numa_policy_t *numa)
 {
 	void *mem;
 	manageable_aperture_t *aperture;
@@ -1601,7 +1683,7 @@ static void *fmm_allocate_host_gpu(uint32_t node_id, void *address,
 			goto out_release_area;
 
 		/* Bind to NUMA node */
-		if (bind_mem_to_numa(node_id, mem, MemorySizeInBytes, mflags))
+		if (bind_mem_to_numa(node_id, mem, MemorySizeInBytes, mflags, numa))
 			goto out_release_area;
 
 		/* Mappings in the DGPU aperture don't need to be copied on
@@ -1670,11 +1752,13 @@ out_release_area:
 }
 
 void *fmm_allocate_host(uint32_t node_id, void *address,
-			uint64_t MemorySizeInBytes, HsaMemFlags mflags)
+			uint64_t MemorySizeInBytes, HsaMemFlags mflags,
+			const fmm_numa_policy_t *numa)
 {
 	if (is_dgpu)
-		return fmm_allocate_host_gpu(node_id, address, MemorySizeInBytes, mflags);
-	return fmm_allocate_host_cpu(address, MemorySizeInBytes, mflags);
+		return fmm_allocate_host_gpu(node_id, address, MemorySizeInBytes,
+					     mflags, numa);
+	return fmm_allocate_host_cpu(address, MemorySizeInBytes, mflags, numa);
 }
 
 static int __fmm_release(vm_object_t *object, manageable_aperture_t *aperture)
@@ -1823,7 +1907,7 @@ static int drm_render_fds[DRM_LAST_RENDER_NODE + 1 - DRM_FIRST_RENDER_NODE];
 int open_drm_render_device(int minor)
 {
 	char path[128];
-	int index, fd;
+	int index, fd, cached_fd;
 
 	if (minor < DRM_FIRST_RENDER_NODE || minor > DRM_LAST_RENDER_NODE) {
 		pr_err("DRM render minor %d out of range [%d, %d]\n", minor,
@@ -1833,8 +1917,9 @@ int open_drm_render_device(int minor)
 	index = minor - DRM_FIRST_RENDER_NODE;
 
 	/* If the render node was already opened, keep using the same FD */
-	if (drm_render_fds[index])
-		return drm_render_fds[index];
+	cached_fd = __atomic_load_n(&drm_render_fds[index], __ATOMIC_ACQUIRE);
+	if (cached_fd)
+		return cached_fd;
 
 	sprintf(path, "/dev/dri/renderD%d", minor);
 	fd = open(path, O_RDWR | O_CLOEXEC);
@@ -1846,7 +1931,15 @@ int open_drm_render_device(int minor)
 		}
 		return -errno;
 	}
-	drm_render_fds[index] = fd;
+
+	/* Topology snapshots probe render nodes from several threads. If
+	 * another thread opened the same node first, use its FD.
+	 */
+	if (!__atomic_compare_exchange_n(&drm_render_fds[index], &cached_fd, fd,
+					 false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(fd);
+		return cached_fd;
+	}
 
 	return fd;
 }
@@ -39,6 +39,13 @@ typedef enum {
 	FMM_LAST_APERTURE_TYPE
 } aperture_type_e;
 
+/* NUMA placement of host memory, see hsaKmtAllocMemoryNUMA */
+typedef struct {
+	HSA_NUMA_POLICY policy;
+	uint32_t num_nodes;
+	const uint32_t *numa_nodes;	/* NUMA node of each part */
+} fmm_numa_policy_t;
+
 typedef struct {
 	aperture_type_e app_type;
 	uint64_t size;
@@ -54,7 +61,7 @@ void *fmm_allocate_device(uint32_t gpu_id, uint32_t node_id, void *address,
 			uint64_t MemorySizeInBytes, HsaMemFlags flags);
 void *fmm_allocate_doorbell(uint32_t gpu_id, uint64_t MemorySizeInBytes, uint64_t doorbell_offset);
 void *fmm_allocate_host(uint32_t node_id, void *address, uint64_t MemorySizeInBytes,
-			HsaMemFlags flags);
+			HsaMemFlags flags, const fmm_numa_policy_t *numa);
 void fmm_print(uint32_t node);
 HSAKMT_STATUS fmm_release(void *address);
 int fmm_map_to_gpu(void *address, uint64_t size, uint64_t *gpuvm_address);
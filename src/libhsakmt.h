@@ -37,6 +37,9 @@ extern unsigned long kfd_open_count;
 extern bool hsakmt_forked;
 extern pthread_mutex_t hsakmt_mutex;
 extern bool is_dgpu;
+extern bool premap_doorbells;
+extern const char *hsakmt_sysfs_root;
+extern const char *hsakmt_procfs_root;
 
 extern HsaVersionInfo kfd_version_info;
 
@@ -164,6 +167,7 @@ HSAKMT_STATUS init_kfd_version(void);
 
 HSAKMT_STATUS validate_nodeid(uint32_t nodeid, uint32_t *gpu_id);
 HSAKMT_STATUS gpuid_to_nodeid(uint32_t gpu_id, uint32_t* node_id);
+HSAKMT_STATUS get_node_gpu_ids(uint32_t **gpu_ids, uint32_t *num_nodes);
 uint32_t get_gfxv_by_node_id(HSAuint32 node_id);
 bool prefer_ats(HSAuint32 node_id);
 uint16_t get_device_id_by_node_id(HSAuint32 node_id);
@@ -179,6 +183,12 @@ HSAKMT_STATUS topology_sysfs_get_node_props(uint32_t node_id, HsaNodeProperties
 HSAKMT_STATUS topology_sysfs_get_system_props(HsaSystemProperties *props);
 void topology_setup_is_dgpu_param(HsaNodeProperties *props);
 bool topology_is_svm_needed(HSA_ENGINE_ID EngineId);
+bool topology_cache_file(const char *suffix, char *path, size_t size,
+			 uint64_t *key);
+
+#define FNV1A_OFFSET 0xcbf29ce484222325ULL
+#define FNV1A_PRIME 0x100000001b3ULL
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size);
 
 HSAuint32 PageSizeFromFlags(unsigned int pageSizeFlags);
 
@@ -193,6 +203,9 @@ void destroy_device_debugging_memory(void);
 HSAKMT_STATUS init_counter_props(unsigned int NumNodes);
 void destroy_counter_props(void);
 uint32_t *convert_queue_ids(HSAuint32 NumQueues, HSA_QUEUEID *Queues);
+uint32_t get_live_queue_handles(HSA_QUEUEID *QueueIds, uint32_t MaxQueues);
+void destroy_live_queues(void);
+void clear_queue_handles(void);
 
 extern int kmtIoctl(int fd, unsigned long request, void *arg);
 
@@ -159,7 +159,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemory(HSAuint32 PreferredNode,
 			MemFlags.ui32.CoarseGrain = 1;
 
 		*MemoryAddress = fmm_allocate_host(PreferredNode,  *MemoryAddress,
-						   SizeInBytes,	MemFlags);
+						   SizeInBytes,	MemFlags, NULL);
 
 		if (!(*MemoryAddress)) {
 			pr_err("[%s] failed to allocate %lu bytes from host\n",
@@ -184,6 +184,119 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemory(HSAuint32 PreferredNode,
 
 }
 
+/* The CPU node with system memory that GPU @gpu_node reaches with the
+ * lowest link weight, for GPUs without a direct link to such a node.
+ * INVALID_NODEID if the GPU reaches none.
+ */
+static uint32_t get_nearest_cpu_node(uint32_t gpu_node)
+{
+	const HsaTopologySnapshot *snap;
+	const HsaNodeDistance *d;
+	uint32_t i, j, num_nodes, best = INVALID_NODEID;
+	uint32_t best_weight = HSA_NODE_DISTANCE_UNREACHABLE;
+
+	if (hsaKmtAcquireTopologySnapshot(&snap) != HSAKMT_STATUS_SUCCESS)
+		return INVALID_NODEID;
+
+	num_nodes = snap->SystemProperties.NumNodes;
+	for (i = 0; i < num_nodes && gpu_node < num_nodes; i++) {
+		const HsaNodeSnapshot *node = &snap->Nodes[i];
+
+		if (node->Node.NumFComputeCores)
+			continue;
+		for (j = 0; j < node->Node.NumMemoryBanks; j++)
+			if (node->MemoryProperties[j].HeapType == HSA_HEAPTYPE_SYSTEM &&
+			    node->MemoryProperties[j].SizeInBytes)
+				break;
+		if (j == node->Node.NumMemoryBanks)
+			continue;
+
+		d = &snap->Distances[gpu_node * num_nodes + i];
+		if (d->Weight < best_weight) {
+			best_weight = d->Weight;
+			best = i;
+		}
+	}
+
+	hsaKmtReleaseTopologySnapshot(snap);
+	return best;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtAllocMemoryNUMA(HSAuint32 NumNodes,
+					      const HSAuint32 *Nodes,
+					      HSA_NUMA_POLICY Policy,
+					      HSAuint64 SizeInBytes,
+					      HsaMemFlags MemFlags,
+					      void **MemoryAddress)
+{
+	HSAKMT_STATUS result = HSAKMT_STATUS_SUCCESS;
+	fmm_numa_policy_t numa;
+	uint32_t *numa_nodes;
+	HSAuint64 page_size;
+	uint32_t gpu_id, i;
+
+	CHECK_KFD_OPEN();
+
+	pr_debug("[%s] %u nodes policy %d\n", __func__, NumNodes, Policy);
+
+	page_size = PageSizeFromFlags(MemFlags.ui32.PageSize);
+
+	if (!NumNodes || !Nodes || Policy > HSA_NUMA_POLICY_SPLIT ||
+	    !MemoryAddress || !SizeInBytes || (SizeInBytes & (page_size-1)) ||
+	    MemFlags.ui32.Scratch || MemFlags.ui32.GDSMemory ||
+	    MemFlags.ui32.NoNUMABind)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (MemFlags.ui32.FixedAddress) {
+		if (*MemoryAddress == NULL)
+			return HSAKMT_STATUS_INVALID_PARAMETER;
+	} else
+		*MemoryAddress = NULL;
+
+	numa_nodes = malloc(NumNodes * sizeof(*numa_nodes));
+	if (!numa_nodes)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	/* GPUs are placed on the CPU node they are directly attached to, or
+	 * else on the nearest one
+	 */
+	for (i = 0; i < NumNodes; i++) {
+		result = validate_nodeid(Nodes[i], &gpu_id);
+		if (result != HSAKMT_STATUS_SUCCESS) {
+			pr_err("[%s] invalid node ID: %d\n", __func__, Nodes[i]);
+			goto out;
+		}
+		if (!gpu_id) {
+			numa_nodes[i] = Nodes[i];
+			continue;
+		}
+		numa_nodes[i] = get_direct_link_cpu(Nodes[i]);
+		if (numa_nodes[i] == INVALID_NODEID)
+			numa_nodes[i] = get_nearest_cpu_node(Nodes[i]);
+		if (numa_nodes[i] == INVALID_NODEID) {
+			pr_err("[%s] node %d reaches no CPU node with memory\n",
+				__func__, Nodes[i]);
+			result = HSAKMT_STATUS_INVALID_NODE_UNIT;
+			goto out;
+		}
+	}
+
+	numa.policy = Policy;
+	numa.num_nodes = NumNodes;
+	numa.numa_nodes = numa_nodes;
+	*MemoryAddress = fmm_allocate_host(Nodes[0], *MemoryAddress,
+					   SizeInBytes, MemFlags, &numa);
+	if (!(*MemoryAddress)) {
+		pr_err("[%s] failed to allocate %lu bytes from host\n",
+			__func__, SizeInBytes);
+		result = HSAKMT_STATUS_ERROR;
+	}
+
+out:
+	free(numa_nodes);
+	return result;
+}
+
 HSAKMT_STATUS HSAKMTAPI hsaKmtFreeMemory(void *MemoryAddress,
 					 HSAuint64 SizeInBytes)
 {
@@ -43,6 +43,15 @@ bool hsakmt_forked;
 /* zfb is mainly used during emulation */
 int zfb_support;
 
+/* Map all doorbell pages when KFD is opened instead of on first use */
+bool premap_doorbells;
+
+/* Prefixes of the sysfs and procfs paths the topology is read from. They
+ * are empty unless a synthetic tree is used for testing.
+ */
+const char *hsakmt_sysfs_root = "";
+const char *hsakmt_procfs_root = "";
+
 /* is_forked_child detects when the process has forked since the last
  * time this function was called. We cannot rely on pthread_atfork
  * because the process can fork without calling the fork function in
@@ -93,6 +102,7 @@ static void child_fork_handler(void)
  */
 static void clear_after_fork(void)
 {
+	clear_queue_handles();
 	clear_process_doorbells();
 	clear_events_page();
 	fmm_clear_all_mem();
@@ -135,6 +145,16 @@ static HSAKMT_STATUS init_vars_from_env(void)
 	if (envvar)
 		zfb_support = atoi(envvar);
 
+	/* Check whether to map the doorbells of all GPUs at open time */
+	envvar = getenv("HSAKMT_PREMAP_DOORBELLS");
+	premap_doorbells = envvar && atoi(envvar);
+
+	/* Read the topology from a different sysfs and procfs tree */
+	envvar = getenv("HSAKMT_SYSFS_ROOT");
+	hsakmt_sysfs_root = envvar ? envvar : "";
+	envvar = getenv("HSAKMT_PROCFS_ROOT");
+	hsakmt_procfs_root = envvar ? envvar : "";
+
 	return HSAKMT_STATUS_SUCCESS;
 }
 
@@ -235,6 +255,8 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtCloseKFD(void)
 		if (--kfd_open_count == 0) {
 			destroy_counter_props();
 			destroy_device_debugging_memory();
+			destroy_live_queues();
+			clear_queue_handles();
 			destroy_process_doorbells();
 			fmm_destroy_process_apertures();
 			if (kfd_fd) {
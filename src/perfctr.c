@@ -25,7 +25,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <linux/perf_event.h>
 #include <sys/syscall.h>
 #include "libhsakmt.h"
@@ -35,6 +38,7 @@
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <semaphore.h>
 
@@ -42,6 +46,8 @@
 
 #define HSA_PERF_MAGIC4CC	0x54415348
 
+#define PMC_SAMPLING_MIN_INTERVAL_US	100
+
 enum perf_trace_state {
 	PERF_TRACE_STATE__STOPPED = 0,
 	PERF_TRACE_STATE__STARTED
@@ -52,13 +58,48 @@ struct perf_trace_block {
 	uint32_t num_counters;
 	uint64_t *counter_id;
 	int *perf_event_fd;
+	/* perf_event_fd[0] leads a group of all the block's counters */
+	bool grouped;
+	uint64_t *group_buf;	/* PERF_FORMAT_GROUP read buffer */
+	/* Pass in which these counters are traced. Counter i goes to
+	 * trace buffer entry buf_offset + i * buf_stride.
+	 */
+	uint32_t pass;
+	uint32_t buf_offset;
+	uint32_t buf_stride;
+};
+
+/* Continuous sampling of a trace. The sampler thread is the only writer
+ * of the ring and the application the only reader, so head and tail are
+ * all the synchronization needed.
+ */
+struct perf_sampler {
+	pthread_t thread;
+	bool running;		/* thread created and not joined yet */
+	bool stop;		/* asks the thread to exit */
+	HSAKMT_STATUS status;	/* why the thread exited on its own */
+	uint64_t interval_ns;
+	uint32_t sample_size;
+	uint32_t num_slots;	/* power of 2 */
+	uint32_t dropped;	/* samples lost since the last one written */
+	uint64_t head;		/* samples written by the thread */
+	uint64_t tail;		/* samples read by the application */
+	uint64_t *group_buf;	/* the thread's PERF_FORMAT_GROUP read buffer */
+	uint8_t *ring;
 };
 
 struct perf_trace {
 	uint32_t magic4cc;
 	uint32_t gpu_id;
+	uint32_t node_id;
 	enum perf_trace_state state;
 	uint32_t num_blocks;
+	uint32_t num_counters;	/* uint64_t entries in the trace buffer */
+	struct perf_sampler *sampler;
+	uint32_t num_passes;
+	uint32_t current_pass;
+	bool pass_open;		/* perf events of current_pass are open */
+	bool pass_done;		/* current_pass was stopped, start the next */
 	void *buf;
 	uint64_t buf_size;
 	struct perf_trace_block blocks[0];
@@ -74,6 +115,17 @@ struct perf_shared_table {
 	uint32_t iommu_slots_left;
 };
 
+/* read() format of a group leader with PERF_FORMAT_GROUP */
+struct perf_group_values {
+	uint64_t nr;
+	uint64_t ena;
+	uint64_t run;
+	uint64_t values[];
+};
+
+#define PERF_GROUP_BUF_SIZE(num_counters) \
+	(sizeof(struct perf_group_values) + sizeof(uint64_t) * (num_counters))
+
 struct perf_counts_values {
 	union {
 		struct {
@@ -85,8 +137,15 @@ struct perf_counts_values {
 	};
 };
 
+/* Counter properties are the same for all GPUs of a family, so there is
+ * one table per family, shared by the nodes in counter_props.
+ */
 static HsaCounterProperties **counter_props;
 static unsigned int counter_props_count;
+static HsaCounterProperties *family_props[PMC_FAMILY_MAX];
+static size_t family_props_size[PMC_FAMILY_MAX];
+/* family_props or the IOMMU block changed since the cache was loaded */
+static bool counter_props_dirty;
 static const char shmem_name[] = "/hsakmt_shared_mem";
 static int shmem_fd;
 static const char sem_name[] = "hsakmt_semaphore";
@@ -114,6 +173,30 @@ static ssize_t readn(int fd, void *buf, size_t n)
 	return n;
 }
 
+/* Writes all @n bytes unless write fails. Returns the number of bytes
+ * written or -errno.
+ */
+static ssize_t writen(int fd, const void *buf, size_t n)
+{
+	size_t left = n;
+	ssize_t bytes;
+
+	while (left) {
+		bytes = write(fd, buf, left);
+		if (!bytes) /* no progress, e.g. the disk is full */
+			return (n - left);
+		if (bytes < 0) {
+			if (errno == EINTR) /* write got interrupted */
+				continue;
+			else
+				return -errno;
+		}
+		left -= bytes;
+		buf = (const char *)buf + bytes;
+	}
+	return n;
+}
+
 static HSAKMT_STATUS init_shared_region(void)
 {
 	sem = sem_open(sem_name, O_CREAT, 0666, 1);
@@ -181,6 +264,234 @@ static void init_perf_shared_table(void)
 	sem_post(sem);
 }
 
+/* Optional cache of the counter property tables and the IOMMU block, kept
+ * next to the topology cache (see HSAKMT_TOPOLOGY_CACHE) and valid for the
+ * same key. It spares processes the IOMMU sysfs scan and rebuilding the
+ * tables of the GPUs in the system.
+ */
+#define PMC_CACHE_SUFFIX ".pmc"
+#define PMC_CACHE_MAGIC 0x434d5048		/* "HPMC" */
+#define PMC_CACHE_VERSION 1
+
+struct pmc_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	/* The cache is only valid for the same structure layouts */
+	uint16_t props_size;
+	uint16_t block_size;
+	uint16_t counter_size;
+	uint16_t reserved;
+	uint32_t iommu_slots;
+	uint32_t num_iommu_counters;
+	uint32_t num_tables;
+	uint32_t reserved2;
+	uint64_t key;
+	uint64_t total_size;
+	uint64_t checksum;	/* of everything after the header */
+};
+
+/* The header is followed by, each padded to 8 bytes:
+ *	the IOMMU counter IDs (uint32_t)
+ *	for each table: struct pmc_cache_table, then the table
+ */
+struct pmc_cache_table {
+	uint32_t family;
+	uint32_t size;
+};
+
+#define PMC_CACHE_ALIGN(x) ALIGN_UP(x, 8)
+
+/* Size of a counter property table, or 0 if it doesn't fit in @max bytes */
+static size_t counter_props_size(const HsaCounterProperties *props, size_t max)
+{
+	const HsaCounterBlockProperties *block;
+	size_t size;
+	uint32_t i;
+
+	size = sizeof(*props) - sizeof(props->Blocks);
+	if (size > max)
+		return 0;
+	for (i = 0; i < props->NumBlocks; i++) {
+		block = (const HsaCounterBlockProperties *)((const char *)props + size);
+		if (size + sizeof(*block) > max)
+			return 0;
+		size += sizeof(*block) - sizeof(block->Counters);
+		if (block->NumCounters > (max - size) / sizeof(HsaCounter))
+			return 0;
+		size += sizeof(HsaCounter) * block->NumCounters;
+	}
+
+	return size;
+}
+
+static HSAKMT_STATUS load_counter_props_cache(void)
+{
+	const struct pmc_cache_header *header;
+	const struct pmc_cache_table *table;
+	char path[PATH_MAX];
+	HSAKMT_STATUS ret = HSAKMT_STATUS_ERROR;
+	size_t offset, size;
+	struct stat st;
+	uint64_t key;
+	char *buf = NULL;
+	uint32_t i;
+	int fd;
+
+	if (!topology_cache_file(PMC_CACHE_SUFFIX, path, sizeof(path), &key))
+		return HSAKMT_STATUS_UNAVAILABLE;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return HSAKMT_STATUS_ERROR;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*header))
+		goto out;
+	size = st.st_size;
+	buf = malloc(size);
+	if (!buf || readn(fd, buf, size) != (ssize_t)size)
+		goto out;
+
+	header = (const struct pmc_cache_header *)buf;
+	if (header->magic != PMC_CACHE_MAGIC ||
+	    header->version != PMC_CACHE_VERSION ||
+	    header->props_size != sizeof(HsaCounterProperties) ||
+	    header->block_size != sizeof(HsaCounterBlockProperties) ||
+	    header->counter_size != sizeof(HsaCounter) ||
+	    header->key != key || header->total_size != size ||
+	    header->num_tables > PMC_FAMILY_MAX ||
+	    header->checksum != fnv1a(FNV1A_OFFSET, buf + PMC_CACHE_ALIGN(sizeof(*header)),
+				      size - PMC_CACHE_ALIGN(sizeof(*header))))
+		goto out;
+
+	offset = PMC_CACHE_ALIGN(sizeof(*header));
+	if (header->num_iommu_counters > (size - offset) / sizeof(uint32_t))
+		goto out;
+	ret = pmc_table_set_iommu_block(header->iommu_slots,
+					header->num_iommu_counters,
+					(const uint32_t *)(buf + offset));
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto out;
+	offset += PMC_CACHE_ALIGN(sizeof(uint32_t) * header->num_iommu_counters);
+
+	ret = HSAKMT_STATUS_ERROR;
+	for (i = 0; i < header->num_tables; i++) {
+		if (offset + sizeof(*table) > size)
+			goto err_tables;
+		table = (const struct pmc_cache_table *)(buf + offset);
+		offset += PMC_CACHE_ALIGN(sizeof(*table));
+		if (table->family >= PMC_FAMILY_MAX || family_props[table->family] ||
+		    table->size > size - offset ||
+		    counter_props_size((const HsaCounterProperties *)(buf + offset),
+				       table->size) != table->size)
+			goto err_tables;
+
+		family_props[table->family] = malloc(table->size);
+		if (!family_props[table->family]) {
+			ret = HSAKMT_STATUS_NO_MEMORY;
+			goto err_tables;
+		}
+		memcpy(family_props[table->family], buf + offset, table->size);
+		family_props_size[table->family] = table->size;
+		offset += PMC_CACHE_ALIGN(table->size);
+	}
+
+	pr_debug("Loaded %u counter property tables from %s\n",
+		 header->num_tables, path);
+	ret = HSAKMT_STATUS_SUCCESS;
+	goto out;
+
+err_tables:
+	for (i = 0; i < PMC_FAMILY_MAX; i++) {
+		free(family_props[i]);
+		family_props[i] = NULL;
+	}
+	free_pmc_blocks();
+out:
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+static void save_counter_props_cache(void)
+{
+	struct pmc_cache_header header = {0};
+	struct pmc_cache_table table;
+	struct perf_counter_block iommu;
+	char path[PATH_MAX], tmp_path[PATH_MAX + 8];
+	size_t size, offset;
+	uint64_t key;
+	uint32_t i;
+	char *buf;
+	int fd;
+
+	if (!topology_cache_file(PMC_CACHE_SUFFIX, path, sizeof(path), &key))
+		return;
+	if (get_block_properties(0, PERFCOUNTER_BLOCKID__IOMMUV2, &iommu) !=
+	    HSAKMT_STATUS_SUCCESS)
+		return;
+
+	header.magic = PMC_CACHE_MAGIC;
+	header.version = PMC_CACHE_VERSION;
+	header.props_size = sizeof(HsaCounterProperties);
+	header.block_size = sizeof(HsaCounterBlockProperties);
+	header.counter_size = sizeof(HsaCounter);
+	header.iommu_slots = iommu.num_of_slots;
+	header.num_iommu_counters = iommu.num_of_counters;
+	header.key = key;
+
+	size = PMC_CACHE_ALIGN(sizeof(header)) +
+		PMC_CACHE_ALIGN(sizeof(uint32_t) * iommu.num_of_counters);
+	for (i = 0; i < PMC_FAMILY_MAX; i++) {
+		if (!family_props[i])
+			continue;
+		size += PMC_CACHE_ALIGN(sizeof(table)) +
+			PMC_CACHE_ALIGN(family_props_size[i]);
+		header.num_tables++;
+	}
+	header.total_size = size;
+
+	buf = calloc(1, size);
+	if (!buf)
+		return;
+
+	offset = PMC_CACHE_ALIGN(sizeof(header));
+	if (iommu.num_of_counters)
+		memcpy(buf + offset, iommu.counter_ids,
+		       sizeof(uint32_t) * iommu.num_of_counters);
+	offset += PMC_CACHE_ALIGN(sizeof(uint32_t) * iommu.num_of_counters);
+	for (i = 0; i < PMC_FAMILY_MAX; i++) {
+		if (!family_props[i])
+			continue;
+		table.family = i;
+		table.size = family_props_size[i];
+		memcpy(buf + offset, &table, sizeof(table));
+		offset += PMC_CACHE_ALIGN(sizeof(table));
+		memcpy(buf + offset, family_props[i], family_props_size[i]);
+		offset += PMC_CACHE_ALIGN(family_props_size[i]);
+	}
+	header.checksum = fnv1a(FNV1A_OFFSET, buf + PMC_CACHE_ALIGN(sizeof(header)),
+				size - PMC_CACHE_ALIGN(sizeof(header)));
+	memcpy(buf, &header, sizeof(header));
+
+	/* Write a temporary file and rename it, so that concurrent readers
+	 * see either the old or the new cache. A short write must not be
+	 * published as a truncated cache.
+	 */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		pr_debug("Failed to create counter cache %s\n", tmp_path);
+		goto out;
+	}
+	if (writen(fd, buf, size) != (ssize_t)size || rename(tmp_path, path)) {
+		pr_debug("Failed to write counter cache %s\n", path);
+		unlink(tmp_path);
+	}
+	close(fd);
+
+out:
+	free(buf);
+}
+
 HSAKMT_STATUS init_counter_props(unsigned int NumNodes)
 {
 	counter_props = calloc(NumNodes, sizeof(struct HsaCounterProperties *));
@@ -190,7 +501,11 @@ HSAKMT_STATUS init_counter_props(unsigned int NumNodes)
 	}
 
 	counter_props_count = NumNodes;
-	alloc_pmc_blocks();
+	counter_props_dirty = false;
+	if (load_counter_props_cache() != HSAKMT_STATUS_SUCCESS) {
+		alloc_pmc_blocks();
+		counter_props_dirty = true;
+	}
 
 	if (init_shared_region() != HSAKMT_STATUS_SUCCESS) {
 		pr_warn("Profiling of privileged blocks is not available.\n");
@@ -210,13 +525,16 @@ void destroy_counter_props(void)
 	if (!counter_props)
 		return;
 
-	for (i = 0; i < counter_props_count; i++)
-		if (counter_props[i]) {
-			free(counter_props[i]);
-			counter_props[i] = NULL;
-		}
+	if (counter_props_dirty)
+		save_counter_props_cache();
+
+	for (i = 0; i < PMC_FAMILY_MAX; i++) {
+		free(family_props[i]);
+		family_props[i] = NULL;
+	}
 
 	free(counter_props);
+	counter_props = NULL;
 	free_pmc_blocks();
 }
 
@@ -309,16 +627,7 @@ static int blockid2uuid(enum perf_block_id block_id, HSA_UUID *uuid)
 static HSAuint32 get_block_concurrent_limit(uint32_t node_id,
 						HSAuint32 block_id)
 {
-	uint32_t i;
-	HsaCounterBlockProperties *block = &counter_props[node_id]->Blocks[0];
-
-	for (i = 0; i < PERFCOUNTER_BLOCKID__MAX; i++) {
-		if (block->Counters[0].BlockIndex == block_id)
-			return block->NumConcurrent;
-		block = (HsaCounterBlockProperties *)&block->Counters[block->NumCounters];
-	}
-
-	return 0;
+	return pmc_table_get_num_slots(node_id, block_id);
 }
 
 static HSAKMT_STATUS update_block_slots(enum perf_trace_action action,
@@ -370,15 +679,21 @@ static unsigned int get_perf_event_type(enum perf_block_id block_id)
 {
 	FILE *file = NULL;
 	unsigned int type = 0;
+	char path[256];
 
 	if (block_id == PERFCOUNTER_BLOCKID__IOMMUV2) {
 		/* Starting from kernel 4.12, amd_iommu_0 is used */
-		file = fopen("/sys/bus/event_source/devices/amd_iommu_0/type",
-			 "r");
-		if (!file)
-			file = fopen(/* kernel 4.11 and older */
-				"/sys/bus/event_source/devices/amd_iommu/type",
-				"r");
+		snprintf(path, sizeof(path),
+			 "%s/sys/bus/event_source/devices/amd_iommu_0/type",
+			 hsakmt_sysfs_root);
+		file = fopen(path, "r");
+		if (!file) {
+			/* kernel 4.11 and older */
+			snprintf(path, sizeof(path),
+				 "%s/sys/bus/event_source/devices/amd_iommu/type",
+				 hsakmt_sysfs_root);
+			file = fopen(path, "r");
+		}
 	}
 
 	if (!file)
@@ -410,6 +725,36 @@ static void close_perf_event_fd(struct perf_trace_block *block)
 		}
 }
 
+/* open_perf_event_group - Open the block's counters as one group.
+ * The first counter leads the group, so that the whole block is enabled,
+ * disabled and read with a single syscall, and all values are sampled at
+ * the same time.
+ */
+static HSAKMT_STATUS open_perf_event_group(struct perf_trace_block *block,
+					   struct perf_event_attr *attr)
+{
+	uint32_t i;
+
+	for (i = 0; i < block->num_counters; i++) {
+		attr->config = block->counter_id[i];
+		attr->read_format = PERF_FORMAT_GROUP |
+					PERF_FORMAT_TOTAL_TIME_ENABLED |
+					PERF_FORMAT_TOTAL_TIME_RUNNING;
+		/* Members follow the leader's enabled state */
+		attr->disabled = i == 0;
+
+		block->perf_event_fd[i] = syscall(__NR_perf_event_open, attr,
+					-1, 0, i ? block->perf_event_fd[0] : -1, 0);
+		if (block->perf_event_fd[i] < 0) {
+			close_perf_event_fd(block);
+			return HSAKMT_STATUS_ERROR;
+		}
+	}
+
+	block->grouped = true;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
 /* open_perf_event_fd - Open FDs required for this block.
  * If one of them fails, we should close all FDs that have been
  * opened because RT has no ideas about those FDs successfully
@@ -433,14 +778,20 @@ static HSAKMT_STATUS open_perf_event_fd(struct perf_trace_block *block)
 	attr.type = get_perf_event_type(block->block_id);
 	if (!attr.type)
 		return HSAKMT_STATUS_ERROR;
+	attr.size = sizeof(struct perf_event_attr);
+	attr.inherit = 1;
+
+	/* Fall back to one event per counter if the PMU can't group them */
+	block->grouped = false;
+	if (block->num_counters > 1 &&
+	    open_perf_event_group(block, &attr) == HSAKMT_STATUS_SUCCESS)
+		return HSAKMT_STATUS_SUCCESS;
 
 	for (i = 0; i < block->num_counters; i++) {
-		attr.size = sizeof(struct perf_event_attr);
 		attr.config = block->counter_id[i];
 		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
 					PERF_FORMAT_TOTAL_TIME_RUNNING;
 		attr.disabled = 1;
-		attr.inherit = 1;
 
 		/* We are profiling system wide, not per cpu, so no threads,
 		 * no groups -> pid=-1 and group_fd=-1. cpu = 0
@@ -464,6 +815,14 @@ static HSAKMT_STATUS perf_trace_ioctl(struct perf_trace_block *block,
 {
 	uint32_t i;
 
+	if (block->grouped) {
+		if (block->perf_event_fd[0] < 0)
+			return HSAKMT_STATUS_UNAVAILABLE;
+		if (ioctl(block->perf_event_fd[0], cmd, PERF_IOC_FLAG_GROUP))
+			return HSAKMT_STATUS_ERROR;
+		return HSAKMT_STATUS_SUCCESS;
+	}
+
 	for (i = 0; i < block->num_counters; i++) {
 		if (block->perf_event_fd[i] < 0)
 			return HSAKMT_STATUS_UNAVAILABLE;
@@ -487,34 +846,128 @@ static HSAKMT_STATUS query_trace(int fd, uint64_t *buf)
 	return HSAKMT_STATUS_SUCCESS;
 }
 
-HSAKMT_STATUS HSAKMTAPI hsaKmtPmcGetCounterProperties(HSAuint32 NodeId,
-						      HsaCounterProperties **CounterProperties)
+/* query_trace_group - Read all counters of a grouped block at once */
+static HSAKMT_STATUS query_trace_group(struct perf_trace_block *block,
+				       uint64_t *group_buf, uint64_t *buf)
+{
+	struct perf_group_values *group = (struct perf_group_values *)group_buf;
+	size_t size = PERF_GROUP_BUF_SIZE(block->num_counters);
+	uint32_t i;
+
+	if (block->perf_event_fd[0] < 0)
+		return HSAKMT_STATUS_ERROR;
+	if (readn(block->perf_event_fd[0], group, size) != (ssize_t)size ||
+	    group->nr != block->num_counters)
+		return HSAKMT_STATUS_ERROR;
+
+	for (i = 0; i < block->num_counters; i++)
+		buf[i * block->buf_stride] = group->values[i];
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* stop_sampler - Wait for the sampler thread to exit. The ring is kept,
+ * so the application can still read the samples.
+ */
+static void stop_sampler(struct perf_trace *trace)
+{
+	struct perf_sampler *sampler = trace->sampler;
+
+	if (!sampler || !sampler->running)
+		return;
+
+	__atomic_store_n(&sampler->stop, true, __ATOMIC_RELEASE);
+	pthread_join(sampler->thread, NULL);
+	sampler->running = false;
+}
+
+static void free_sampler(struct perf_trace *trace)
+{
+	stop_sampler(trace);
+	free(trace->sampler);
+	trace->sampler = NULL;
+}
+
+/* close_trace_pass - Close the perf events of the current pass and give
+ * back its slots.
+ */
+static void close_trace_pass(struct perf_trace *trace)
+{
+	uint32_t i;
+
+	if (!trace->pass_open)
+		return;
+
+	for (i = 0; i < trace->num_blocks; i++) {
+		if (trace->blocks[i].pass != trace->current_pass)
+			continue;
+		update_block_slots(PERF_TRACE_ACTION__RELEASE,
+				trace->blocks[i].block_id,
+				trace->blocks[i].num_counters);
+		close_perf_event_fd(&trace->blocks[i]);
+	}
+	trace->pass_open = false;
+}
+
+/* open_trace_pass - Reserve the slots of the current pass and open its
+ * perf events. On failure nothing stays reserved or open.
+ */
+static HSAKMT_STATUS open_trace_pass(struct perf_trace *trace)
+{
+	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
+	uint32_t i;
+	int j;
+
+	for (i = 0; i < trace->num_blocks; i++) {
+		if (trace->blocks[i].pass != trace->current_pass)
+			continue;
+		ret = update_block_slots(PERF_TRACE_ACTION__ACQUIRE,
+					trace->blocks[i].block_id,
+					trace->blocks[i].num_counters);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			goto out;
+		ret = open_perf_event_fd(&trace->blocks[i]);
+		if (ret != HSAKMT_STATUS_SUCCESS) {
+			i++; /* to release slots just reserved */
+			goto out;
+		}
+	}
+
+out:
+	if (ret != HSAKMT_STATUS_SUCCESS) {
+		for (j = i-1; j >= 0; j--) {
+			if (trace->blocks[j].pass != trace->current_pass)
+				continue;
+			update_block_slots(PERF_TRACE_ACTION__RELEASE,
+					trace->blocks[j].block_id,
+					trace->blocks[j].num_counters);
+			close_perf_event_fd(&trace->blocks[j]);
+		}
+		return ret;
+	}
+
+	trace->pass_open = true;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* build_counter_props - Build the counter property table of a node in one
+ * contiguous allocation
+ */
+static HSAKMT_STATUS build_counter_props(uint32_t node_id,
+					 HsaCounterProperties **props_out,
+					 size_t *size_out)
 {
 	HSAKMT_STATUS rc = HSAKMT_STATUS_SUCCESS;
-	uint32_t gpu_id, i, block_id;
+	uint32_t i, block_id;
 	uint32_t counter_props_size = 0;
 	uint32_t total_counters = 0;
 	uint32_t total_concurrent = 0;
 	struct perf_counter_block block = {0};
 	uint32_t total_blocks = 0;
 	HsaCounterBlockProperties *block_prop;
-
-	if (!counter_props)
-		return HSAKMT_STATUS_NO_MEMORY;
-
-	if (!CounterProperties)
-		return HSAKMT_STATUS_INVALID_PARAMETER;
-
-	if (validate_nodeid(NodeId, &gpu_id) != HSAKMT_STATUS_SUCCESS)
-		return HSAKMT_STATUS_INVALID_NODE_UNIT;
-
-	if (counter_props[NodeId]) {
-		*CounterProperties = counter_props[NodeId];
-		return HSAKMT_STATUS_SUCCESS;
-	}
+	HsaCounterProperties *props;
 
 	for (i = 0; i < PERFCOUNTER_BLOCKID__MAX; i++) {
-		rc = get_block_properties(NodeId, i, &block);
+		rc = get_block_properties(node_id, i, &block);
 		if (rc != HSAKMT_STATUS_SUCCESS)
 			return rc;
 		total_concurrent += block.num_of_slots;
@@ -528,19 +981,18 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcGetCounterProperties(HSAuint32 NodeId,
 			sizeof(HsaCounterBlockProperties) * (total_blocks - 1) +
 			sizeof(HsaCounter) * (total_counters - total_blocks);
 
-	counter_props[NodeId] = malloc(counter_props_size);
-	if (!counter_props[NodeId])
+	props = calloc(1, counter_props_size);
+	if (!props)
 		return HSAKMT_STATUS_NO_MEMORY;
 
-	counter_props[NodeId]->NumBlocks = total_blocks;
-	counter_props[NodeId]->NumConcurrent = total_concurrent;
+	props->NumBlocks = total_blocks;
+	props->NumConcurrent = total_concurrent;
 
-	block_prop = &counter_props[NodeId]->Blocks[0];
+	block_prop = &props->Blocks[0];
 	for (block_id = 0; block_id < PERFCOUNTER_BLOCKID__MAX; block_id++) {
-		rc = get_block_properties(NodeId, block_id, &block);
+		rc = get_block_properties(node_id, block_id, &block);
 		if (rc != HSAKMT_STATUS_SUCCESS) {
-			free(counter_props[NodeId]);
-			counter_props[NodeId] = NULL;
+			free(props);
 			return rc;
 		}
 
@@ -565,6 +1017,46 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcGetCounterProperties(HSAuint32 NodeId,
 		block_prop = (HsaCounterBlockProperties *)&block_prop->Counters[block_prop->NumCounters];
 	}
 
+	*props_out = props;
+	*size_out = counter_props_size;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtPmcGetCounterProperties(HSAuint32 NodeId,
+						      HsaCounterProperties **CounterProperties)
+{
+	HSAKMT_STATUS rc;
+	enum pmc_family family;
+	uint32_t gpu_id;
+
+	if (!counter_props)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	if (!CounterProperties)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (validate_nodeid(NodeId, &gpu_id) != HSAKMT_STATUS_SUCCESS)
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+
+	if (counter_props[NodeId]) {
+		*CounterProperties = counter_props[NodeId];
+		return HSAKMT_STATUS_SUCCESS;
+	}
+
+	/* GPUs of the same family share one table */
+	family = pmc_table_get_family(NodeId);
+	if (family == PMC_FAMILY_MAX)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (!family_props[family]) {
+		rc = build_counter_props(NodeId, &family_props[family],
+					 &family_props_size[family]);
+		if (rc != HSAKMT_STATUS_SUCCESS)
+			return rc;
+		counter_props_dirty = true;
+	}
+
+	counter_props[NodeId] = family_props[family];
 	*CounterProperties = counter_props[NodeId];
 
 	return HSAKMT_STATUS_SUCCESS;
@@ -576,15 +1068,17 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcRegisterTrace(HSAuint32 NodeId,
 					       HsaCounter *Counters,
 					       HsaPmcTraceRoot *TraceRoot)
 {
-	uint32_t gpu_id, i, j;
+	uint32_t gpu_id, i, j, k;
 	uint64_t min_buf_size = 0;
 	struct perf_trace *trace = NULL;
 	uint32_t concurrent_limit;
-	const uint32_t MAX_COUNTERS = 512;
-	uint64_t counter_id[PERFCOUNTER_BLOCKID__MAX][MAX_COUNTERS];
 	uint32_t num_counters[PERFCOUNTER_BLOCKID__MAX] = {0};
+	/* first trace block of each block ID, and counters placed so far */
+	uint32_t first_block[PERFCOUNTER_BLOCKID__MAX];
+	uint32_t num_placed[PERFCOUNTER_BLOCKID__MAX] = {0};
 	uint32_t block, num_blocks = 0, total_counters = 0;
-	uint64_t *counter_id_ptr;
+	uint32_t pass, num_passes = 1, buf_offset;
+	uint64_t *counter_id_ptr, *group_buf_ptr;
 	int *fd_ptr;
 
 	pr_debug("[%s] Number of counters %d\n", __func__, NumberOfCounters);
@@ -598,29 +1092,29 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcRegisterTrace(HSAuint32 NodeId,
 	if (validate_nodeid(NodeId, &gpu_id) != HSAKMT_STATUS_SUCCESS)
 		return HSAKMT_STATUS_INVALID_NODE_UNIT;
 
-	if (NumberOfCounters > MAX_COUNTERS) {
-		pr_err("MAX_COUNTERS is too small for %d.\n",
-			NumberOfCounters);
-		return HSAKMT_STATUS_NO_MEMORY;
-	}
-
-	/* Calculating the minimum buffer size */
+	/* Counting sort by block: count the counters of each block and
+	 * calculate the minimum buffer size here, place them in the trace
+	 * once it is allocated.
+	 */
 	for (i = 0; i < NumberOfCounters; i++) {
 		if (Counters[i].BlockIndex >= PERFCOUNTER_BLOCKID__MAX)
 			return HSAKMT_STATUS_INVALID_PARAMETER;
 		/* Only privileged counters need to register */
 		if (Counters[i].Type > HSA_PROFILE_TYPE_PRIVILEGED_STREAMING)
 			continue;
+		if (!pmc_table_counter_valid(NodeId, Counters[i].BlockIndex,
+					     Counters[i].CounterId)) {
+			pr_err("Invalid counter %lu of block %d\n",
+				Counters[i].CounterId, Counters[i].BlockIndex);
+			return HSAKMT_STATUS_INVALID_PARAMETER;
+		}
 		min_buf_size += Counters[i].CounterSizeInBits/BITS_PER_BYTE;
-		/* j: the first blank entry in the block to record counter_id */
-		j = num_counters[Counters[i].BlockIndex];
-		counter_id[Counters[i].BlockIndex][j] = Counters[i].CounterId;
 		num_counters[Counters[i].BlockIndex]++;
 		total_counters++;
 	}
 
-	/* Verify that the number of counters per block is not larger than the
-	 * number of slots.
+	/* Work out how many passes are needed so that no block traces more
+	 * counters than it has slots in one pass.
 	 */
 	for (i = 0; i < PERFCOUNTER_BLOCKID__MAX; i++) {
 		if (!num_counters[i])
@@ -630,23 +1124,28 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcRegisterTrace(HSAuint32 NodeId,
 			pr_err("Invalid block ID: %d\n", i);
 			return HSAKMT_STATUS_INVALID_PARAMETER;
 		}
-		if (num_counters[i] > concurrent_limit) {
-			pr_err("Counters exceed the limit.\n");
-			return HSAKMT_STATUS_INVALID_PARAMETER;
-		}
-		num_blocks++;
+		num_passes = MAX(num_passes,
+				 (num_counters[i] + concurrent_limit - 1) / concurrent_limit);
 	}
 
+	/* Counter j of a block is traced in pass j % num_passes, which keeps
+	 * the passes balanced. Every block with counters in a pass has its
+	 * own trace block for that pass.
+	 */
+	for (i = 0; i < PERFCOUNTER_BLOCKID__MAX; i++)
+		num_blocks += MIN(num_counters[i], num_passes);
+
 	if (!num_blocks)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
-	/* Now we have sorted blocks/counters information in
-	 * num_counters[block_id] and counter_id[block_id][]. Allocate trace
+	/* Now we know how many counters each block has. Allocate trace
 	 * and record the information.
 	 */
 	trace = (struct perf_trace *)calloc(sizeof(struct perf_trace)
 			+ sizeof(struct perf_trace_block) * num_blocks
 			+ sizeof(uint64_t) * total_counters
+			+ PERF_GROUP_BUF_SIZE(0) * num_blocks
+			+ sizeof(uint64_t) * total_counters
 			+ sizeof(int) * total_counters,
 			1);
 	if (!trace)
@@ -663,6 +1162,10 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcRegisterTrace(HSAuint32 NodeId,
 	 * | block 0's counter IDs(uint64_t) |
 	 * | ......                          |
 	 * | block N-1's counter IDs         |
+	 * |---------------------------------| <-- group_buf_ptr starts here
+	 * | block 0's group read buffer     |
+	 * | ......                          |
+	 * | block N-1's group read buffer   |
 	 * |---------------------------------| <-- perf_event_fd starts here
 	 * | block 0's perf_event_fds(int)   |
 	 * | ......                          |
@@ -670,38 +1173,71 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcRegisterTrace(HSAuint32 NodeId,
 	 * +---------------------------------+
 	 */
 	block = 0;
+	buf_offset = 0;
 	counter_id_ptr = (uint64_t *)((char *)
 			trace + sizeof(struct perf_trace)
 			+ sizeof(struct perf_trace_block) * num_blocks);
-	fd_ptr = (int *)(counter_id_ptr + total_counters);
-	/* Fill in each block's information to the TraceId */
+	group_buf_ptr = counter_id_ptr + total_counters;
+	fd_ptr = (int *)(group_buf_ptr +
+			 (PERF_GROUP_BUF_SIZE(0) * num_blocks +
+			  sizeof(uint64_t) * total_counters) / sizeof(uint64_t));
+	/* Fill in each block's information to the TraceId. The trace buffer
+	 * keeps the counters of a block together, in the order they were
+	 * requested, whichever pass they are traced in.
+	 */
 	for (i = 0; i < PERFCOUNTER_BLOCKID__MAX; i++) {
-		if (!num_counters[i]) /* not a block to trace */
+		first_block[i] = block;
+		for (pass = 0; pass < MIN(num_counters[i], num_passes); pass++) {
+			struct perf_trace_block *b = &trace->blocks[block];
+
+			/* Following perf_trace + perf_trace_block x N are
+			 * those counter_id arrays. Assign the counter_id array
+			 * belonging to this block, filled in below.
+			 */
+			b->counter_id = counter_id_ptr;
+			/* Counters pass, pass + num_passes, ... of the block */
+			k = (num_counters[i] - pass + num_passes - 1) / num_passes;
+			b->perf_event_fd = fd_ptr;
+			b->group_buf = group_buf_ptr;
+			/* how many counters to trace */
+			b->num_counters = k;
+			/* block index in "enum perf_block_id" */
+			b->block_id = i;
+			b->pass = pass;
+			b->buf_offset = buf_offset + pass;
+			b->buf_stride = num_passes;
+			block++; /* move to next */
+			counter_id_ptr += k;
+			group_buf_ptr += PERF_GROUP_BUF_SIZE(k) / sizeof(uint64_t);
+			fd_ptr += k;
+		}
+		buf_offset += num_counters[i];
+	}
+
+	/* Place each counter ID in its block's array for its pass, keeping
+	 * the order of the request.
+	 */
+	for (i = 0; i < NumberOfCounters; i++) {
+		if (Counters[i].Type > HSA_PROFILE_TYPE_PRIVILEGED_STREAMING)
 			continue;
-		/* Following perf_trace + perf_trace_block x N are those
-		 * counter_id arrays. Assign the counter_id array belonging to
-		 * this block.
-		 */
-		trace->blocks[block].counter_id = counter_id_ptr;
-		/* Fill in counter IDs to the counter_id array. */
-		for (j = 0; j < num_counters[i]; j++)
-			trace->blocks[block].counter_id[j] = counter_id[i][j];
-		trace->blocks[block].perf_event_fd = fd_ptr;
-		/* how many counters to trace */
-		trace->blocks[block].num_counters = num_counters[i];
-		/* block index in "enum perf_block_id" */
-		trace->blocks[block].block_id = i;
-		block++; /* move to next */
-		counter_id_ptr += num_counters[i];
-		fd_ptr += num_counters[i];
+		block = Counters[i].BlockIndex;
+		j = num_placed[block]++;
+		trace->blocks[first_block[block] + j % num_passes]
+			.counter_id[j / num_passes] = Counters[i].CounterId;
 	}
 
 	trace->magic4cc = HSA_PERF_MAGIC4CC;
 	trace->gpu_id = gpu_id;
+	trace->node_id = NodeId;
 	trace->state = PERF_TRACE_STATE__STOPPED;
 	trace->num_blocks = num_blocks;
+	trace->num_counters = total_counters;
+	trace->num_passes = num_passes;
 
-	TraceRoot->NumberOfPasses = 1;
+	pr_debug("[%s] %d counters in %d passes\n", __func__,
+		 total_counters, num_passes);
+
+	TraceRoot->NumberOfPasses = num_passes;
 	TraceRoot->TraceBufferMinSizeBytes = PAGE_ALIGN_UP(min_buf_size);
 	TraceRoot->TraceId = PORT_VPTR_TO_UINT64(trace);
 
@@ -740,6 +1276,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcUnregisterTrace(HSAuint32 NodeId,
 			return status;
 	}
 
+	free_sampler(trace);
 	free(trace);
 
 	return HSAKMT_STATUS_SUCCESS;
@@ -749,9 +1286,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcAcquireTraceAccess(HSAuint32 NodeId,
 						    HSATraceId TraceId)
 {
 	struct perf_trace *trace;
-	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
-	uint32_t gpu_id, i;
-	int j;
+	uint32_t gpu_id;
 
 	pr_debug("[%s] Trace ID 0x%lx\n", __func__, TraceId);
 
@@ -766,37 +1301,14 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcAcquireTraceAccess(HSAuint32 NodeId,
 	if (validate_nodeid(NodeId, &gpu_id) != HSAKMT_STATUS_SUCCESS)
 		return HSAKMT_STATUS_INVALID_NODE_UNIT;
 
-	for (i = 0; i < trace->num_blocks; i++) {
-		ret = update_block_slots(PERF_TRACE_ACTION__ACQUIRE,
-					trace->blocks[i].block_id,
-					trace->blocks[i].num_counters);
-		if (ret != HSAKMT_STATUS_SUCCESS)
-			goto out;
-		ret = open_perf_event_fd(&trace->blocks[i]);
-		if (ret != HSAKMT_STATUS_SUCCESS) {
-			i++; /* to release slots just reserved */
-			goto out;
-		}
-	}
-
-out:
-	if (ret != HSAKMT_STATUS_SUCCESS) {
-		for (j = i-1; j >= 0; j--) {
-			update_block_slots(PERF_TRACE_ACTION__RELEASE,
-					trace->blocks[j].block_id,
-					trace->blocks[j].num_counters);
-			close_perf_event_fd(&trace->blocks[j]);
-		}
-	}
-
-	return ret;
+	/* Only the counters of the current pass need to be accessible */
+	return open_trace_pass(trace);
 }
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtPmcReleaseTraceAccess(HSAuint32 NodeId,
 						    HSATraceId TraceId)
 {
 	struct perf_trace *trace;
-	uint32_t i;
 
 	pr_debug("[%s] Trace ID 0x%lx\n", __func__, TraceId);
 
@@ -808,12 +1320,8 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcReleaseTraceAccess(HSAuint32 NodeId,
 	if (trace->magic4cc != HSA_PERF_MAGIC4CC)
 		return HSAKMT_STATUS_INVALID_HANDLE;
 
-	for (i = 0; i < trace->num_blocks; i++) {
-		update_block_slots(PERF_TRACE_ACTION__RELEASE,
-				trace->blocks[i].block_id,
-				trace->blocks[i].num_counters);
-		close_perf_event_fd(&trace->blocks[i]);
-	}
+	stop_sampler(trace);
+	close_trace_pass(trace);
 
 	return HSAKMT_STATUS_SUCCESS;
 }
@@ -838,7 +1346,25 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcStartTrace(HSATraceId TraceId,
 	if (trace->magic4cc != HSA_PERF_MAGIC4CC)
 		return HSAKMT_STATUS_INVALID_HANDLE;
 
+	/* Each start after a stop traces the next pass. Switching the
+	 * counter sets here rather than at stop time lets the stopped pass
+	 * still be queried.
+	 */
+	if (trace->pass_done && trace->num_passes > 1) {
+		if (!trace->pass_open)
+			return HSAKMT_STATUS_UNAVAILABLE;
+		close_trace_pass(trace);
+		trace->current_pass = (trace->current_pass + 1) % trace->num_passes;
+		trace->pass_done = false;
+		ret = open_trace_pass(trace);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			return ret;
+	}
+	trace->pass_done = false;
+
 	for (i = 0; i < trace->num_blocks; i++) {
+		if (trace->blocks[i].pass != trace->current_pass)
+			continue;
 		ret = perf_trace_ioctl(&trace->blocks[i],
 					PERF_EVENT_IOC_ENABLE);
 		if (ret != HSAKMT_STATUS_SUCCESS)
@@ -848,11 +1374,14 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcStartTrace(HSATraceId TraceId,
 		/* Disable enabled blocks before returning the failure. */
 		j = (int32_t)i;
 		while (--j >= 0)
-			perf_trace_ioctl(&trace->blocks[j],
-					PERF_EVENT_IOC_DISABLE);
+			if (trace->blocks[j].pass == trace->current_pass)
+				perf_trace_ioctl(&trace->blocks[j],
+						PERF_EVENT_IOC_DISABLE);
 		return ret;
 	}
 
+	pr_debug("[%s] Pass %d of %d\n", __func__, trace->current_pass + 1,
+		 trace->num_passes);
 	trace->state = PERF_TRACE_STATE__STARTED;
 	trace->buf = TraceBuffer;
 	trace->buf_size = TraceBufferSizeBytes;
@@ -861,16 +1390,60 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcStartTrace(HSATraceId TraceId,
 }
 
 
+/* read_trace_pass - Read the counters of the current pass into their
+ * places in @buf. Grouped blocks are read through @group_buf if given,
+ * so that the sampler thread doesn't share the blocks' read buffers.
+ */
+static HSAKMT_STATUS read_trace_pass(struct perf_trace *trace,
+				     uint64_t *group_buf, uint64_t *buf,
+				     uint64_t buf_size)
+{
+	HSAKMT_STATUS ret;
+	uint64_t buf_filled;
+	uint64_t *block_buf;
+	uint32_t i, j;
+
+	for (i = 0; i < trace->num_blocks; i++) {
+		struct perf_trace_block *block = &trace->blocks[i];
+
+		if (block->pass != trace->current_pass)
+			continue;
+
+		/* Offset past the block's last counter in the trace buffer */
+		buf_filled = sizeof(uint64_t) * (block->buf_offset + 1 +
+				(uint64_t)(block->num_counters - 1) * block->buf_stride);
+		if (buf_filled > buf_size)
+			return HSAKMT_STATUS_NO_MEMORY;
+
+		block_buf = buf + block->buf_offset;
+		if (block->grouped) {
+			ret = query_trace_group(block, group_buf ? group_buf :
+						block->group_buf, block_buf);
+			if (ret != HSAKMT_STATUS_SUCCESS)
+				return ret;
+			continue;
+		}
+
+		for (j = 0; j < block->num_counters; j++) {
+			ret = query_trace(block->perf_event_fd[j],
+					&block_buf[j * block->buf_stride]);
+			if (ret != HSAKMT_STATUS_SUCCESS)
+				return ret;
+		}
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
 /*Forces an update of all the counters that a previously started trace operation has registered */
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtPmcQueryTrace(HSATraceId TraceId)
 {
 	struct perf_trace *trace =
 			(struct perf_trace *)PORT_UINT64_TO_VPTR(TraceId);
-	uint32_t i, j;
-	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
+	uint32_t i;
+	HSAKMT_STATUS ret;
 	uint64_t *buf;
-	uint64_t buf_filled = 0;
 
 	if (TraceId == 0)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
@@ -878,20 +1451,17 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcQueryTrace(HSATraceId TraceId)
 	if (trace->magic4cc != HSA_PERF_MAGIC4CC)
 		return HSAKMT_STATUS_INVALID_HANDLE;
 
+	/* Only the current pass's counters are updated, the others keep the
+	 * values of the pass that traced them.
+	 */
 	buf = (uint64_t *)trace->buf;
+	ret = read_trace_pass(trace, NULL, buf, trace->buf_size);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
 	pr_debug("[%s] Trace buffer(%p): ", __func__, buf);
-	for (i = 0; i < trace->num_blocks; i++)
-		for (j = 0; j < trace->blocks[i].num_counters; j++) {
-			buf_filled += sizeof(uint64_t);
-			if (buf_filled > trace->buf_size)
-				return HSAKMT_STATUS_NO_MEMORY;
-			ret = query_trace(trace->blocks[i].perf_event_fd[j],
-					buf);
-			if (ret != HSAKMT_STATUS_SUCCESS)
-				return ret;
-			pr_debug("%lu_", *buf);
-			buf++;
-		}
+	for (i = 0; i < MIN(trace->num_counters, trace->buf_size / sizeof(uint64_t)); i++)
+		pr_debug("%lu_", buf[i]);
 	pr_debug("\n");
 
 	return HSAKMT_STATUS_SUCCESS;
@@ -914,7 +1484,12 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcStopTrace(HSATraceId TraceId)
 	if (trace->magic4cc != HSA_PERF_MAGIC4CC)
 		return HSAKMT_STATUS_INVALID_HANDLE;
 
+	/* The sampler must not read counters that are switched off */
+	stop_sampler(trace);
+
 	for (i = 0; i < trace->num_blocks; i++) {
+		if (trace->blocks[i].pass != trace->current_pass)
+			continue;
 		ret = perf_trace_ioctl(&trace->blocks[i],
 					PERF_EVENT_IOC_DISABLE);
 		if (ret != HSAKMT_STATUS_SUCCESS)
@@ -922,6 +1497,207 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtPmcStopTrace(HSATraceId TraceId)
 	}
 
 	trace->state = PERF_TRACE_STATE__STOPPED;
+	trace->pass_done = true;
+
+	return ret;
+}
+
+static uint64_t timespec_to_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void *sampler_thread(void *arg)
+{
+	struct perf_trace *trace = arg;
+	struct perf_sampler *sampler = trace->sampler;
+	uint64_t head, next_ns, now_ns;
+	struct timespec ts;
+	HsaPmcSample *sample;
+	HSAKMT_STATUS ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	next_ns = timespec_to_ns(&ts);
+
+	while (!__atomic_load_n(&sampler->stop, __ATOMIC_ACQUIRE)) {
+		head = sampler->head;
+		if (head - __atomic_load_n(&sampler->tail, __ATOMIC_ACQUIRE) ==
+		    sampler->num_slots) {
+			/* Ring is full, the application is falling behind */
+			sampler->dropped++;
+		} else {
+			sample = (HsaPmcSample *)(sampler->ring + sampler->sample_size *
+					(head & (sampler->num_slots - 1)));
+			memset(sample->Counters, 0,
+			       sizeof(uint64_t) * trace->num_counters);
+			clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+			sample->CPUClockCounter = timespec_to_ns(&ts);
+			sample->Pass = trace->current_pass;
+			sample->NumDropped = sampler->dropped;
+
+			ret = read_trace_pass(trace, sampler->group_buf,
+					sample->Counters,
+					sizeof(uint64_t) * trace->num_counters);
+			if (ret != HSAKMT_STATUS_SUCCESS) {
+				pr_err("Counter sampling stopped: %d\n", ret);
+				__atomic_store_n(&sampler->status, ret,
+						 __ATOMIC_RELEASE);
+				break;
+			}
+
+			sampler->dropped = 0;
+			__atomic_store_n(&sampler->head, head + 1, __ATOMIC_RELEASE);
+		}
+
+		/* Don't try to catch up on missed intervals */
+		next_ns += sampler->interval_ns;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now_ns = timespec_to_ns(&ts);
+		if (next_ns < now_ns)
+			next_ns = now_ns;
+		ts.tv_sec = next_ns / 1000000000;
+		ts.tv_nsec = next_ns % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	return NULL;
+}
+
+/* Starts sampling the counters of a started trace on a library thread */
+HSAKMT_STATUS HSAKMTAPI hsaKmtPmcStartSampling(HSATraceId TraceId,
+					       HSAuint32 IntervalUs,
+					       HSAuint32 NumRingSamples,
+					       HsaClockCounters *Clocks,
+					       HSAuint32 *SampleSizeBytes)
+{
+	struct perf_trace *trace =
+			(struct perf_trace *)PORT_UINT64_TO_VPTR(TraceId);
+	struct perf_sampler *sampler;
+	uint32_t num_slots = 1, sample_size;
+	HSAKMT_STATUS ret;
+
+	pr_debug("[%s] Trace ID 0x%lx every %u us\n", __func__, TraceId,
+		 IntervalUs);
+
+	if (TraceId == 0 || !SampleSizeBytes || !NumRingSamples ||
+	    NumRingSamples > (1U << 31) ||
+	    IntervalUs < PMC_SAMPLING_MIN_INTERVAL_US)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (trace->magic4cc != HSA_PERF_MAGIC4CC)
+		return HSAKMT_STATUS_INVALID_HANDLE;
+
+	if (trace->state != PERF_TRACE_STATE__STARTED)
+		return HSAKMT_STATUS_UNAVAILABLE;
+
+	if (trace->sampler && trace->sampler->running)
+		return HSAKMT_STATUS_ERROR;
+	free_sampler(trace);
+
+	while (num_slots < NumRingSamples)
+		num_slots <<= 1;
+	sample_size = offsetof(HsaPmcSample, Counters) +
+			sizeof(uint64_t) * trace->num_counters;
+
+	/* The group read buffer fits the largest block of the trace */
+	sampler = calloc(1, sizeof(*sampler)
+			 + PERF_GROUP_BUF_SIZE(trace->num_counters)
+			 + (uint64_t)sample_size * num_slots);
+	if (!sampler)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	sampler->interval_ns = (uint64_t)IntervalUs * 1000;
+	sampler->sample_size = sample_size;
+	sampler->num_slots = num_slots;
+	sampler->group_buf = (uint64_t *)(sampler + 1);
+	sampler->ring = (uint8_t *)sampler->group_buf +
+			PERF_GROUP_BUF_SIZE(trace->num_counters);
+	trace->sampler = sampler;
 
+	if (Clocks) {
+		ret = hsaKmtGetClockCounters(trace->node_id, Clocks);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			goto err;
+	}
+
+	if (pthread_create(&sampler->thread, NULL, sampler_thread, trace)) {
+		ret = HSAKMT_STATUS_ERROR;
+		goto err;
+	}
+	sampler->running = true;
+
+	*SampleSizeBytes = sample_size;
+	return HSAKMT_STATUS_SUCCESS;
+
+err:
+	free_sampler(trace);
 	return ret;
 }
+
+/* Moves the oldest samples out of the ring */
+HSAKMT_STATUS HSAKMTAPI hsaKmtPmcReadSamples(HSATraceId TraceId,
+					     HSAuint32 MaxSamples,
+					     void *Samples,
+					     HSAuint32 *NumSamples)
+{
+	struct perf_trace *trace =
+			(struct perf_trace *)PORT_UINT64_TO_VPTR(TraceId);
+	struct perf_sampler *sampler;
+	uint64_t head, tail;
+	uint32_t num, first, slot;
+
+	if (TraceId == 0 || !NumSamples || (MaxSamples && !Samples))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (trace->magic4cc != HSA_PERF_MAGIC4CC)
+		return HSAKMT_STATUS_INVALID_HANDLE;
+
+	sampler = trace->sampler;
+	if (!sampler)
+		return HSAKMT_STATUS_UNAVAILABLE;
+
+	tail = sampler->tail;
+	head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+	num = MIN(head - tail, MaxSamples);
+
+	/* Copy in up to two pieces, the ring may wrap */
+	if (num) {
+		slot = tail & (sampler->num_slots - 1);
+		first = MIN(num, sampler->num_slots - slot);
+		memcpy(Samples, sampler->ring + (uint64_t)sampler->sample_size * slot,
+		       (uint64_t)sampler->sample_size * first);
+		memcpy(VOID_PTR_ADD(Samples, (uint64_t)sampler->sample_size * first),
+		       sampler->ring, (uint64_t)sampler->sample_size * (num - first));
+	}
+
+	__atomic_store_n(&sampler->tail, tail + num, __ATOMIC_RELEASE);
+	*NumSamples = num;
+
+	/* Report why the thread exited once everything has been read */
+	if (!num && MaxSamples)
+		return __atomic_load_n(&sampler->status, __ATOMIC_ACQUIRE);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Stops sampling the counters of a trace and frees its samples */
+HSAKMT_STATUS HSAKMTAPI hsaKmtPmcStopSampling(HSATraceId TraceId)
+{
+	struct perf_trace *trace =
+			(struct perf_trace *)PORT_UINT64_TO_VPTR(TraceId);
+
+	pr_debug("[%s] Trace ID 0x%lx\n", __func__, TraceId);
+
+	if (TraceId == 0)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (trace->magic4cc != HSA_PERF_MAGIC4CC)
+		return HSAKMT_STATUS_INVALID_HANDLE;
+
+	if (!trace->sampler)
+		return HSAKMT_STATUS_UNAVAILABLE;
+
+	free_sampler(trace);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
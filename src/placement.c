@@ -0,0 +1,288 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "libhsakmt.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Placement advice is computed from a topology snapshot only, so it always
+ * sees a consistent topology. Acquiring the snapshot briefly takes the
+ * snapshot lock, the ranking itself runs without any lock held.
+ */
+
+/* Bandwidths of 0 are unknown and count as 0, so missing sysfs data never
+ * makes a node look faster than one whose bandwidths are known
+ */
+static uint32_t bandwidth_min(uint32_t a, uint32_t b)
+{
+	return a < b ? a : b;
+}
+
+static bool node_is_gpu(const HsaNodeSnapshot *node)
+{
+	return node->Node.NumFComputeCores != 0;
+}
+
+/* Peak bandwidth of the node's own memory in MB/s, 0 if unknown */
+static uint32_t node_memory_bandwidth(const HsaNodeSnapshot *node)
+{
+	uint64_t bw, max_bw = 0;
+	uint32_t i;
+
+	for (i = 0; i < node->Node.NumMemoryBanks; i++) {
+		const HsaMemoryProperties *mem = &node->MemoryProperties[i];
+
+		if (mem->HeapType != HSA_HEAPTYPE_SYSTEM &&
+		    mem->HeapType != HSA_HEAPTYPE_FRAME_BUFFER_PUBLIC &&
+		    mem->HeapType != HSA_HEAPTYPE_FRAME_BUFFER_PRIVATE)
+			continue;
+		/* MHz times bytes per clock */
+		bw = (uint64_t)mem->MemoryClockMax * (mem->Width / 8);
+		if (bw > max_bw)
+			max_bw = bw;
+	}
+
+	return max_bw > UINT32_MAX ? UINT32_MAX : (uint32_t)max_bw;
+}
+
+static bool node_has_memory(const HsaNodeSnapshot *node)
+{
+	uint32_t i;
+
+	for (i = 0; i < node->Node.NumMemoryBanks; i++)
+		if (node->MemoryProperties[i].SizeInBytes &&
+		    (node->MemoryProperties[i].HeapType == HSA_HEAPTYPE_SYSTEM ||
+		     node->MemoryProperties[i].HeapType == HSA_HEAPTYPE_FRAME_BUFFER_PUBLIC ||
+		     node->MemoryProperties[i].HeapType == HSA_HEAPTYPE_FRAME_BUFFER_PRIVATE))
+			return true;
+
+	return false;
+}
+
+/* Large BAR: all of the GPU's VRAM is visible to the host and its peers */
+static bool node_has_public_vram(const HsaNodeSnapshot *node)
+{
+	uint32_t i;
+
+	for (i = 0; i < node->Node.NumMemoryBanks; i++)
+		if (node->MemoryProperties[i].HeapType == HSA_HEAPTYPE_FRAME_BUFFER_PUBLIC)
+			return true;
+
+	return false;
+}
+
+/* Whether @consumer can access memory of node @mem, and how fast. The
+ * bandwidth is limited by the path between the two nodes and by the memory
+ * itself.
+ */
+static bool consumer_bandwidth(const HsaTopologySnapshot *snap, uint32_t mem,
+			       uint32_t consumer, HSA_PLACEMENT_TRAFFIC traffic,
+			       uint32_t mem_bw, uint32_t *bw, uint32_t *weight)
+{
+	const uint32_t num_nodes = snap->SystemProperties.NumNodes;
+	const HsaNodeSnapshot *mem_node = &snap->Nodes[mem];
+	const HsaNodeSnapshot *consumer_node = &snap->Nodes[consumer];
+	const HsaNodeDistance *to_consumer = &snap->Distances[mem * num_nodes + consumer];
+	const HsaNodeDistance *from_consumer = &snap->Distances[consumer * num_nodes + mem];
+	bool same_hive;
+
+	if (mem == consumer) {
+		*bw = mem_bw;
+		*weight = 0;
+		return true;
+	}
+
+	if (to_consumer->Weight == HSA_NODE_DISTANCE_UNREACHABLE ||
+	    from_consumer->Weight == HSA_NODE_DISTANCE_UNREACHABLE)
+		return false;
+
+	/* Remote VRAM is reachable over XGMI within a hive, otherwise only
+	 * through a large BAR
+	 */
+	same_hive = mem_node->Node.HiveID &&
+		    mem_node->Node.HiveID == consumer_node->Node.HiveID;
+	if (node_is_gpu(mem_node) && !same_hive && !node_has_public_vram(mem_node))
+		return false;
+
+	switch (traffic) {
+	case HSA_PLACEMENT_TRAFFIC_READ:
+		*bw = to_consumer->MaximumBandwidth;
+		*weight = to_consumer->Weight;
+		break;
+	case HSA_PLACEMENT_TRAFFIC_WRITE:
+		*bw = from_consumer->MaximumBandwidth;
+		*weight = from_consumer->Weight;
+		break;
+	default:
+		*bw = bandwidth_min(to_consumer->MaximumBandwidth,
+				    from_consumer->MaximumBandwidth);
+		*weight = to_consumer->Weight + from_consumer->Weight;
+		break;
+	}
+	*bw = bandwidth_min(*bw, mem_bw);
+
+	return true;
+}
+
+/* Whether GPU @node reaches node @mem faster than the best one so far */
+static bool copy_node_better(const HsaTopologySnapshot *snap, uint32_t node,
+			     uint32_t mem, const HsaNodeDistance **best)
+{
+	const uint32_t num_nodes = snap->SystemProperties.NumNodes;
+	const HsaNodeDistance *d = &snap->Distances[node * num_nodes + mem];
+
+	if (!node_is_gpu(&snap->Nodes[node]) ||
+	    d->Weight == HSA_NODE_DISTANCE_UNREACHABLE)
+		return false;
+	if (*best && (d->MaximumBandwidth < (*best)->MaximumBandwidth ||
+		      (d->MaximumBandwidth == (*best)->MaximumBandwidth &&
+		       d->Weight >= (*best)->Weight)))
+		return false;
+
+	*best = d;
+	return true;
+}
+
+/* The GPU whose copy engines reach node @mem with the highest bandwidth:
+ * @mem itself, else one of the consumers, else any GPU. @mem if there is
+ * no GPU at all.
+ */
+static uint32_t best_copy_node(const HsaTopologySnapshot *snap, uint32_t mem,
+			       uint32_t num_consumers, const HSAuint32 *consumers)
+{
+	const HsaNodeDistance *best = NULL;
+	uint32_t i, best_node = mem;
+
+	if (node_is_gpu(&snap->Nodes[mem]))
+		return mem;
+
+	for (i = 0; i < num_consumers; i++)
+		if (copy_node_better(snap, consumers[i], mem, &best))
+			best_node = consumers[i];
+
+	if (best)
+		return best_node;
+
+	for (i = 0; i < snap->SystemProperties.NumNodes; i++)
+		if (copy_node_better(snap, i, mem, &best))
+			best_node = i;
+
+	return best_node;
+}
+
+static int candidate_cmp(const void *a, const void *b)
+{
+	const HsaPlacementCandidate *c1 = a, *c2 = b;
+
+	if (c1->Bandwidth != c2->Bandwidth)
+		return c1->Bandwidth > c2->Bandwidth ? -1 : 1;
+	if (c1->Weight != c2->Weight)
+		return c1->Weight < c2->Weight ? -1 : 1;
+	if (c1->NumRemoteConsumers != c2->NumRemoteConsumers)
+		return c1->NumRemoteConsumers < c2->NumRemoteConsumers ? -1 : 1;
+	return c1->NodeId < c2->NodeId ? -1 : (c1->NodeId > c2->NodeId);
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtGetPlacementAdvice(HSAuint32 NumConsumers,
+						 const HSAuint32 *ConsumerNodes,
+						 const HSAuint32 *TrafficShares,
+						 HSA_PLACEMENT_TRAFFIC Traffic,
+						 HSAuint32 *NumCandidates,
+						 HsaPlacementCandidate *Candidates)
+{
+	const HsaTopologySnapshot *snap;
+	HsaPlacementCandidate *ranked;
+	uint32_t num_nodes, num_ranked = 0;
+	uint32_t mem, i, bw, weight, mem_bw;
+	HSAKMT_STATUS ret;
+
+	if (!NumConsumers || !ConsumerNodes || !NumCandidates ||
+	    (*NumCandidates && !Candidates) ||
+	    Traffic > HSA_PLACEMENT_TRAFFIC_READ_WRITE)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	ret = hsaKmtAcquireTopologySnapshot(&snap);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
+	num_nodes = snap->SystemProperties.NumNodes;
+	for (i = 0; i < NumConsumers; i++) {
+		if (ConsumerNodes[i] >= num_nodes) {
+			ret = HSAKMT_STATUS_INVALID_NODE_UNIT;
+			goto out;
+		}
+	}
+
+	ranked = calloc(num_nodes, sizeof(*ranked));
+	if (!ranked) {
+		ret = HSAKMT_STATUS_NO_MEMORY;
+		goto out;
+	}
+
+	for (mem = 0; mem < num_nodes; mem++) {
+		HsaPlacementCandidate *c = &ranked[num_ranked];
+		uint64_t total_bw = 0, total_weight = 0;
+		uint32_t share;
+
+		if (!node_has_memory(&snap->Nodes[mem]))
+			continue;
+		mem_bw = node_memory_bandwidth(&snap->Nodes[mem]);
+
+		/* Every consumer must be able to access the buffer */
+		for (i = 0; i < NumConsumers; i++) {
+			if (!consumer_bandwidth(snap, mem, ConsumerNodes[i], Traffic,
+						mem_bw, &bw, &weight))
+				break;
+			share = TrafficShares ? TrafficShares[i] : 1;
+			total_bw += (uint64_t)bw * share;
+			total_weight += (uint64_t)weight * share;
+			if (ConsumerNodes[i] != mem)
+				c->NumRemoteConsumers++;
+		}
+		if (i < NumConsumers) {
+			memset(c, 0, sizeof(*c));
+			continue;
+		}
+
+		c->NodeId = mem;
+		c->CopyNodeId = best_copy_node(snap, mem, NumConsumers, ConsumerNodes);
+		c->Bandwidth = total_bw;
+		c->Weight = total_weight > UINT32_MAX ? UINT32_MAX : (uint32_t)total_weight;
+		num_ranked++;
+	}
+
+	qsort(ranked, num_ranked, sizeof(*ranked), candidate_cmp);
+
+	/* Without an array, only report how many candidates there are */
+	if (*NumCandidates > num_ranked || !Candidates)
+		*NumCandidates = num_ranked;
+	if (Candidates && *NumCandidates)
+		memcpy(Candidates, ranked, *NumCandidates * sizeof(*Candidates));
+	free(ranked);
+
+out:
+	hsaKmtReleaseTopologySnapshot(snap);
+	return ret;
+}
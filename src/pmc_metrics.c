@@ -0,0 +1,687 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "libhsakmt.h"
+#include "pmc_table.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Derived metrics are arithmetic expressions over counters, written as
+ * BLOCK:ID, e.g. "IOMMUV2:2 * 100 / (IOMMUV2:1 + IOMMUV2:2)". Every metric
+ * is compiled to a small stack program. Programs are run over a batch of
+ * samples at a time, so each operation is a simple loop over an array that
+ * the compiler can vectorize.
+ *
+ * Compiling doesn't depend on who collects the counters. Metrics compiled
+ * with hsaKmtPmcCompileMetrics read the counters from the caller's sample
+ * layout, hsaKmtPmcRegisterMetrics also registers a thunk trace of the
+ * counters and reads them from its trace buffer.
+ */
+
+#define HSA_METRICS_MAGIC4CC	0x5254454d	/* "METR" */
+
+/* Samples evaluated by one run of a program */
+#define METRIC_BATCH		64
+
+/* Deepest nesting of parentheses, the parser recurses once per level */
+#define METRIC_MAX_NESTING	64
+
+enum metric_opcode {
+	METRIC_OP_CONST = 0,
+	METRIC_OP_COUNTER,
+	METRIC_OP_ADD,
+	METRIC_OP_SUB,
+	METRIC_OP_MUL,
+	METRIC_OP_DIV,
+	METRIC_OP_NEG
+};
+
+struct metric_op {
+	enum metric_opcode op;
+	uint32_t counter;	/* METRIC_OP_COUNTER: index in counters[] */
+	double value;		/* METRIC_OP_CONST */
+};
+
+struct metric_counter {
+	enum perf_block_id block_id;
+	uint64_t counter_id;
+	uint32_t index;		/* entry in a sample */
+};
+
+struct pmc_metrics {
+	uint32_t magic4cc;
+	uint32_t node_id;
+	HSATraceId trace_id;	/* 0 if the caller collects the counters */
+	uint32_t num_values;	/* counter values in a sample */
+	uint32_t num_metrics;
+	uint32_t max_depth;	/* deepest stack of all programs */
+	uint32_t num_counters;
+	struct metric_counter *counters;
+	uint32_t *num_ops;	/* per metric */
+	struct metric_op **ops;	/* per metric */
+};
+
+struct metric_parser {
+	const char *expr;
+	const char *pos;
+	uint32_t node_id;
+	struct pmc_metrics *metrics;
+	struct metric_op *ops;
+	uint32_t num_ops;
+	uint32_t depth;
+	uint32_t max_depth;
+	uint32_t nesting;	/* open parentheses */
+	HSAKMT_STATUS status;
+};
+
+static const char *const block_names[PERFCOUNTER_BLOCKID__MAX] = {
+	[PERFCOUNTER_BLOCKID__CB] = "CB",
+	[PERFCOUNTER_BLOCKID__CPC] = "CPC",
+	[PERFCOUNTER_BLOCKID__CPF] = "CPF",
+	[PERFCOUNTER_BLOCKID__CPG] = "CPG",
+	[PERFCOUNTER_BLOCKID__DB] = "DB",
+	[PERFCOUNTER_BLOCKID__GDS] = "GDS",
+	[PERFCOUNTER_BLOCKID__GRBM] = "GRBM",
+	[PERFCOUNTER_BLOCKID__GRBMSE] = "GRBMSE",
+	[PERFCOUNTER_BLOCKID__IA] = "IA",
+	[PERFCOUNTER_BLOCKID__MC] = "MC",
+	[PERFCOUNTER_BLOCKID__PASC] = "PASC",
+	[PERFCOUNTER_BLOCKID__PASU] = "PASU",
+	[PERFCOUNTER_BLOCKID__SPI] = "SPI",
+	[PERFCOUNTER_BLOCKID__SRBM] = "SRBM",
+	[PERFCOUNTER_BLOCKID__SQ] = "SQ",
+	[PERFCOUNTER_BLOCKID__SX] = "SX",
+	[PERFCOUNTER_BLOCKID__TA] = "TA",
+	[PERFCOUNTER_BLOCKID__TCA] = "TCA",
+	[PERFCOUNTER_BLOCKID__TCC] = "TCC",
+	[PERFCOUNTER_BLOCKID__TCP] = "TCP",
+	[PERFCOUNTER_BLOCKID__TCS] = "TCS",
+	[PERFCOUNTER_BLOCKID__TD] = "TD",
+	[PERFCOUNTER_BLOCKID__VGT] = "VGT",
+	[PERFCOUNTER_BLOCKID__WD] = "WD",
+	[PERFCOUNTER_BLOCKID__IOMMUV2] = "IOMMUV2",
+};
+
+static void parse_error(struct metric_parser *p, const char *msg)
+{
+	if (p->status != HSAKMT_STATUS_SUCCESS)
+		return;
+	pr_err("Metric \"%s\" at offset %ld: %s\n", p->expr,
+		(long)(p->pos - p->expr), msg);
+	p->status = HSAKMT_STATUS_INVALID_PARAMETER;
+}
+
+static void skip_spaces(struct metric_parser *p)
+{
+	while (isspace((unsigned char)*p->pos))
+		p->pos++;
+}
+
+static void emit(struct metric_parser *p, enum metric_opcode op,
+		 uint32_t counter, double value)
+{
+	struct metric_op *ops;
+
+	if (p->status != HSAKMT_STATUS_SUCCESS)
+		return;
+
+	ops = realloc(p->ops, sizeof(*ops) * (p->num_ops + 1));
+	if (!ops) {
+		p->status = HSAKMT_STATUS_NO_MEMORY;
+		return;
+	}
+	p->ops = ops;
+	ops[p->num_ops].op = op;
+	ops[p->num_ops].counter = counter;
+	ops[p->num_ops].value = value;
+	p->num_ops++;
+
+	/* Constants and counters push, binary operations pop one */
+	if (op == METRIC_OP_CONST || op == METRIC_OP_COUNTER) {
+		if (++p->depth > p->max_depth)
+			p->max_depth = p->depth;
+	} else if (op != METRIC_OP_NEG) {
+		p->depth--;
+	}
+}
+
+/* Index of the counter in metrics->counters, added if it is new */
+static uint32_t find_counter(struct metric_parser *p,
+			     enum perf_block_id block_id, uint64_t counter_id)
+{
+	struct pmc_metrics *metrics = p->metrics;
+	struct metric_counter *counters;
+	uint32_t i;
+
+	for (i = 0; i < metrics->num_counters; i++)
+		if (metrics->counters[i].block_id == block_id &&
+		    metrics->counters[i].counter_id == counter_id)
+			return i;
+
+	counters = realloc(metrics->counters,
+			   sizeof(*counters) * (metrics->num_counters + 1));
+	if (!counters) {
+		p->status = HSAKMT_STATUS_NO_MEMORY;
+		return 0;
+	}
+	metrics->counters = counters;
+	counters[i].block_id = block_id;
+	counters[i].counter_id = counter_id;
+	metrics->num_counters++;
+
+	return i;
+}
+
+static void parse_counter(struct metric_parser *p)
+{
+	const char *name = p->pos;
+	size_t len;
+	uint64_t counter_id;
+	uint32_t block_id;
+	char *end;
+
+	while (isalnum((unsigned char)*p->pos))
+		p->pos++;
+	len = p->pos - name;
+
+	for (block_id = 0; block_id < PERFCOUNTER_BLOCKID__MAX; block_id++)
+		if (strlen(block_names[block_id]) == len &&
+		    !strncasecmp(block_names[block_id], name, len))
+			break;
+	if (block_id == PERFCOUNTER_BLOCKID__MAX) {
+		p->pos = name;
+		parse_error(p, "unknown block");
+		return;
+	}
+
+	if (*p->pos != ':' || !isdigit((unsigned char)p->pos[1])) {
+		parse_error(p, "expected BLOCK:ID");
+		return;
+	}
+	counter_id = strtoull(p->pos + 1, &end, 0);
+	p->pos = end;
+
+	if (!pmc_table_counter_valid(p->node_id, block_id, counter_id)) {
+		p->pos = name;
+		parse_error(p, "no such counter on this node");
+		return;
+	}
+
+	emit(p, METRIC_OP_COUNTER, find_counter(p, block_id, counter_id), 0);
+}
+
+static void parse_expr(struct metric_parser *p);
+
+static void parse_primary(struct metric_parser *p)
+{
+	char *end;
+	double value;
+
+	skip_spaces(p);
+	if (*p->pos == '(') {
+		if (++p->nesting > METRIC_MAX_NESTING) {
+			parse_error(p, "too many nested parentheses");
+			return;
+		}
+		p->pos++;
+		parse_expr(p);
+		p->nesting--;
+		skip_spaces(p);
+		if (*p->pos != ')') {
+			parse_error(p, "expected ')'");
+			return;
+		}
+		p->pos++;
+	} else if (isdigit((unsigned char)*p->pos) || *p->pos == '.') {
+		value = strtod(p->pos, &end);
+		p->pos = end;
+		emit(p, METRIC_OP_CONST, 0, value);
+	} else if (isalpha((unsigned char)*p->pos)) {
+		parse_counter(p);
+	} else {
+		parse_error(p, "expected a number, a counter or '('");
+	}
+}
+
+/* Any number of leading '-', which cancel out in pairs */
+static void parse_unary(struct metric_parser *p)
+{
+	bool negate = false;
+
+	skip_spaces(p);
+	while (*p->pos == '-') {
+		negate = !negate;
+		p->pos++;
+		skip_spaces(p);
+	}
+	parse_primary(p);
+	if (negate)
+		emit(p, METRIC_OP_NEG, 0, 0);
+}
+
+static void parse_term(struct metric_parser *p)
+{
+	char op;
+
+	parse_unary(p);
+	while (p->status == HSAKMT_STATUS_SUCCESS) {
+		skip_spaces(p);
+		op = *p->pos;
+		if (op != '*' && op != '/')
+			break;
+		p->pos++;
+		parse_unary(p);
+		emit(p, op == '*' ? METRIC_OP_MUL : METRIC_OP_DIV, 0, 0);
+	}
+}
+
+static void parse_expr(struct metric_parser *p)
+{
+	char op;
+
+	parse_term(p);
+	while (p->status == HSAKMT_STATUS_SUCCESS) {
+		skip_spaces(p);
+		op = *p->pos;
+		if (op != '+' && op != '-')
+			break;
+		p->pos++;
+		parse_term(p);
+		emit(p, op == '+' ? METRIC_OP_ADD : METRIC_OP_SUB, 0, 0);
+	}
+}
+
+static HSAKMT_STATUS compile_metric(struct pmc_metrics *metrics,
+				    uint32_t metric, const char *expr)
+{
+	struct metric_parser p = {
+		.expr = expr,
+		.pos = expr,
+		.node_id = metrics->node_id,
+		.metrics = metrics,
+		.status = HSAKMT_STATUS_SUCCESS,
+	};
+
+	parse_expr(&p);
+	skip_spaces(&p);
+	if (*p.pos)
+		parse_error(&p, "unexpected character");
+	if (p.status != HSAKMT_STATUS_SUCCESS) {
+		free(p.ops);
+		return p.status;
+	}
+
+	metrics->ops[metric] = p.ops;
+	metrics->num_ops[metric] = p.num_ops;
+	metrics->max_depth = MAX(metrics->max_depth, p.max_depth);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+static void free_metrics(struct pmc_metrics *metrics)
+{
+	uint32_t i;
+
+	for (i = 0; i < metrics->num_metrics; i++)
+		free(metrics->ops[i]);
+	free(metrics->ops);
+	free(metrics->num_ops);
+	free(metrics->counters);
+	free(metrics);
+}
+
+static int counter_cmp(const void *a, const void *b)
+{
+	const struct metric_counter *c1 = a, *c2 = b;
+
+	if (c1->block_id != c2->block_id)
+		return c1->block_id < c2->block_id ? -1 : 1;
+	return c1->counter_id < c2->counter_id ? -1 :
+		(c1->counter_id > c2->counter_id);
+}
+
+/* Registers the counters used by the metrics as one trace. The trace keeps
+ * the counters of a block together and blocks in the order of their IDs,
+ * so the counters are registered sorted by block and their place in the
+ * trace buffer is their place in the sorted array.
+ */
+static HSAKMT_STATUS register_metric_counters(struct pmc_metrics *metrics,
+					      HsaPmcTraceRoot *TraceRoot)
+{
+	struct perf_counter_block block;
+	struct metric_counter *sorted;
+	HsaCounter *counters;
+	HSAKMT_STATUS ret;
+	uint32_t i;
+
+	sorted = malloc(sizeof(*sorted) * metrics->num_counters);
+	counters = calloc(metrics->num_counters, sizeof(*counters));
+	if (!sorted || !counters) {
+		ret = HSAKMT_STATUS_NO_MEMORY;
+		goto out;
+	}
+
+	memcpy(sorted, metrics->counters, sizeof(*sorted) * metrics->num_counters);
+	for (i = 0; i < metrics->num_counters; i++)
+		sorted[i].index = i;
+	qsort(sorted, metrics->num_counters, sizeof(*sorted), counter_cmp);
+
+	for (i = 0; i < metrics->num_counters; i++) {
+		ret = get_block_properties(metrics->node_id, sorted[i].block_id,
+					   &block);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			goto out;
+		metrics->counters[sorted[i].index].index = i;
+		counters[i].Type = HSA_PROFILE_TYPE_PRIVILEGED_IMMEDIATE;
+		counters[i].CounterId = sorted[i].counter_id;
+		counters[i].CounterSizeInBits = block.counter_size_in_bits;
+		counters[i].CounterMask = block.counter_mask;
+		counters[i].Flags.ui32.Global = 1;
+		counters[i].BlockIndex = sorted[i].block_id;
+	}
+
+	ret = hsaKmtPmcRegisterTrace(metrics->node_id, metrics->num_counters,
+				     counters, TraceRoot);
+
+out:
+	free(counters);
+	free(sorted);
+	return ret;
+}
+
+/* Allocates metrics and compiles all expressions. Programs still refer to
+ * counters by their index in metrics->counters.
+ */
+static HSAKMT_STATUS compile_metrics(HSAuint32 NodeId, HSAuint32 NumMetrics,
+				     const char **Expressions,
+				     struct pmc_metrics **metrics_out)
+{
+	struct pmc_metrics *metrics;
+	HSAKMT_STATUS ret;
+	uint32_t gpu_id, i;
+
+	if (validate_nodeid(NodeId, &gpu_id) != HSAKMT_STATUS_SUCCESS)
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+
+	metrics = calloc(1, sizeof(*metrics));
+	if (!metrics)
+		return HSAKMT_STATUS_NO_MEMORY;
+	metrics->magic4cc = HSA_METRICS_MAGIC4CC;
+	metrics->node_id = NodeId;
+	metrics->num_metrics = NumMetrics;
+	metrics->ops = calloc(NumMetrics, sizeof(*metrics->ops));
+	metrics->num_ops = calloc(NumMetrics, sizeof(*metrics->num_ops));
+	if (!metrics->ops || !metrics->num_ops) {
+		ret = HSAKMT_STATUS_NO_MEMORY;
+		goto err;
+	}
+
+	for (i = 0; i < NumMetrics; i++) {
+		if (!Expressions[i]) {
+			ret = HSAKMT_STATUS_INVALID_PARAMETER;
+			goto err;
+		}
+		ret = compile_metric(metrics, i, Expressions[i]);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			goto err;
+	}
+
+	*metrics_out = metrics;
+	return HSAKMT_STATUS_SUCCESS;
+
+err:
+	free_metrics(metrics);
+	return ret;
+}
+
+/* Makes the programs refer to counters by their entry in a sample */
+static void link_metrics(struct pmc_metrics *metrics)
+{
+	struct metric_op *op;
+	uint32_t i;
+
+	for (i = 0; i < metrics->num_metrics; i++)
+		for (op = metrics->ops[i]; op < metrics->ops[i] + metrics->num_ops[i]; op++)
+			if (op->op == METRIC_OP_COUNTER)
+				op->counter = metrics->counters[op->counter].index;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtPmcCompileMetrics(HSAuint32 NodeId,
+						HSAuint32 NumMetrics,
+						const char **Expressions,
+						HSAuint32 NumCounters,
+						const HsaCounter *Counters,
+						HSAMetricsId *MetricsId)
+{
+	struct pmc_metrics *metrics;
+	HSAKMT_STATUS ret;
+	uint32_t i, j;
+
+	if (!NumMetrics || !Expressions || !NumCounters || !Counters ||
+	    !MetricsId)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	ret = compile_metrics(NodeId, NumMetrics, Expressions, &metrics);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
+	/* Each counter is read from its first entry in the caller's layout */
+	for (i = 0; i < metrics->num_counters; i++) {
+		struct metric_counter *c = &metrics->counters[i];
+
+		for (j = 0; j < NumCounters; j++)
+			if (Counters[j].BlockIndex == c->block_id &&
+			    Counters[j].CounterId == c->counter_id)
+				break;
+		if (j == NumCounters) {
+			pr_err("Counter %lu of block %s is not in the sample layout\n",
+				c->counter_id, block_names[c->block_id]);
+			free_metrics(metrics);
+			return HSAKMT_STATUS_INVALID_PARAMETER;
+		}
+		c->index = j;
+	}
+	metrics->num_values = NumCounters;
+	link_metrics(metrics);
+
+	*MetricsId = PORT_VPTR_TO_UINT64(metrics);
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtPmcRegisterMetrics(HSAuint32 NodeId,
+						 HSAuint32 NumMetrics,
+						 const char **Expressions,
+						 HsaPmcTraceRoot *TraceRoot,
+						 HSAMetricsId *MetricsId)
+{
+	struct pmc_metrics *metrics;
+	HSAKMT_STATUS ret;
+	uint32_t i;
+
+	if (!NumMetrics || !Expressions || !TraceRoot || !MetricsId)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	ret = compile_metrics(NodeId, NumMetrics, Expressions, &metrics);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
+	/* A metric needs at least one counter to be traced */
+	if (!metrics->num_counters) {
+		ret = HSAKMT_STATUS_INVALID_PARAMETER;
+		goto err;
+	}
+
+	/* The thunk only traces privileged counters, the others are collected
+	 * by the caller, see hsaKmtPmcCompileMetrics
+	 */
+	for (i = 0; i < metrics->num_counters; i++) {
+		if (metrics->counters[i].block_id != PERFCOUNTER_BLOCKID__IOMMUV2) {
+			pr_err("Counters of block %s can't be traced by the thunk\n",
+				block_names[metrics->counters[i].block_id]);
+			ret = HSAKMT_STATUS_INVALID_PARAMETER;
+			goto err;
+		}
+	}
+
+	ret = register_metric_counters(metrics, TraceRoot);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto err;
+	metrics->trace_id = TraceRoot->TraceId;
+	metrics->num_values = metrics->num_counters;
+	link_metrics(metrics);
+
+	*MetricsId = PORT_VPTR_TO_UINT64(metrics);
+	return HSAKMT_STATUS_SUCCESS;
+
+err:
+	free_metrics(metrics);
+	return ret;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtPmcUnregisterMetrics(HSAuint32 NodeId,
+						   HSAMetricsId MetricsId)
+{
+	struct pmc_metrics *metrics;
+	HSAKMT_STATUS ret;
+
+	if (MetricsId == 0)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	metrics = (struct pmc_metrics *)PORT_UINT64_TO_VPTR(MetricsId);
+	if (metrics->magic4cc != HSA_METRICS_MAGIC4CC)
+		return HSAKMT_STATUS_INVALID_HANDLE;
+
+	if (metrics->trace_id) {
+		ret = hsaKmtPmcUnregisterTrace(NodeId, metrics->trace_id);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			return ret;
+	}
+
+	metrics->magic4cc = 0;
+	free_metrics(metrics);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* run_program - Evaluate one metric over @n samples. The result is left in
+ * stack[0 .. n-1].
+ */
+static void run_program(const struct metric_op *ops, uint32_t num_ops,
+			const uint8_t *samples, uint64_t stride, uint32_t n,
+			double *stack)
+{
+	double *top = stack - METRIC_BATCH, *a, *b;
+	const struct metric_op *op;
+	uint32_t s;
+
+	for (op = ops; op < ops + num_ops; op++) {
+		switch (op->op) {
+		case METRIC_OP_CONST:
+			top += METRIC_BATCH;
+			for (s = 0; s < n; s++)
+				top[s] = op->value;
+			break;
+		case METRIC_OP_COUNTER:
+			top += METRIC_BATCH;
+			for (s = 0; s < n; s++)
+				top[s] = (double)((const uint64_t *)(samples +
+						s * stride))[op->counter];
+			break;
+		case METRIC_OP_NEG:
+			for (s = 0; s < n; s++)
+				top[s] = -top[s];
+			break;
+		default:
+			b = top;
+			top -= METRIC_BATCH;
+			a = top;
+			switch (op->op) {
+			case METRIC_OP_ADD:
+				for (s = 0; s < n; s++)
+					a[s] += b[s];
+				break;
+			case METRIC_OP_SUB:
+				for (s = 0; s < n; s++)
+					a[s] -= b[s];
+				break;
+			case METRIC_OP_MUL:
+				for (s = 0; s < n; s++)
+					a[s] *= b[s];
+				break;
+			default:
+				/* Ratios of idle counters are 0, not NaN */
+				for (s = 0; s < n; s++)
+					a[s] = b[s] != 0.0 ? a[s] / b[s] : 0.0;
+				break;
+			}
+			break;
+		}
+	}
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtPmcEvaluateMetrics(HSAMetricsId MetricsId,
+						 const void *Samples,
+						 HSAuint32 NumSamples,
+						 HSAuint64 SampleStrideBytes,
+						 double *Values)
+{
+	const struct pmc_metrics *metrics;
+	const uint8_t *samples = Samples;
+	uint32_t base, n, m, s;
+	double *stack;
+
+	if (MetricsId == 0 || !Samples || !Values)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	metrics = (const struct pmc_metrics *)PORT_UINT64_TO_VPTR(MetricsId);
+	if (metrics->magic4cc != HSA_METRICS_MAGIC4CC)
+		return HSAKMT_STATUS_INVALID_HANDLE;
+
+	/* Back to back samples by default */
+	if (!SampleStrideBytes)
+		SampleStrideBytes = sizeof(uint64_t) * metrics->num_values;
+
+	stack = malloc(sizeof(double) * METRIC_BATCH * metrics->max_depth);
+	if (!stack)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	for (base = 0; base < NumSamples; base += METRIC_BATCH) {
+		n = MIN(NumSamples - base, METRIC_BATCH);
+		for (m = 0; m < metrics->num_metrics; m++) {
+			run_program(metrics->ops[m], metrics->num_ops[m],
+				    samples + base * SampleStrideBytes,
+				    SampleStrideBytes, n, stack);
+			for (s = 0; s < n; s++)
+				Values[(uint64_t)(base + s) * metrics->num_metrics + m] =
+					stack[s];
+		}
+	}
+
+	free(stack);
+	return HSAKMT_STATUS_SUCCESS;
+}
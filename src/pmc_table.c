@@ -1958,11 +1958,95 @@ static struct perf_counter_block navi_blocks[PERFCOUNTER_BLOCKID__MAX] = {
 	},
 };
 
+/* Flat (family, block) descriptor table. The family of a node is worked
+ * out once from its GFX version and device ID, so that looking up a block
+ * is a plain array index.
+ */
+static const struct perf_counter_block *const pmc_family_blocks[PMC_FAMILY_MAX] = {
+	[PMC_FAMILY_KAVERI] = kaveri_blocks,
+	[PMC_FAMILY_HAWAII] = hawaii_blocks,
+	[PMC_FAMILY_CARRIZO] = carrizo_blocks,
+	[PMC_FAMILY_FIJI] = fiji_blocks,
+	[PMC_FAMILY_POLARIS] = polaris_blocks,
+	[PMC_FAMILY_VEGA] = vega_blocks,
+	[PMC_FAMILY_NAVI] = navi_blocks,
+};
+
+/* Bitmaps of the valid counter IDs of each (family, block), built once from
+ * the counter_ids tables above, so that checking a counter ID doesn't scan
+ * them. IOMMU counter IDs are 8 bits, see alloc_pmc_blocks_iommu.
+ */
+#define PMC_MAX_COUNTER_ID	1023
+#define PMC_BITMAP_WORDS	((PMC_MAX_COUNTER_ID + 64) / 64)
+
+static uint64_t pmc_counter_bitmap[PMC_FAMILY_MAX][PERFCOUNTER_BLOCKID__MAX][PMC_BITMAP_WORDS];
+static uint64_t iommu_counter_bitmap[PMC_BITMAP_WORDS];
+
 /* Current APUs only have one IOMMU. If NUMA is introduced to APUs, we'll need
  * to expand the struct here to an array.
  */
 static struct perf_counter_block iommu_block;
 
+static void pmc_bitmap_set(uint64_t *bitmap, const struct perf_counter_block *block)
+{
+	uint32_t i, id;
+
+	for (i = 0; i < block->num_of_counters; i++) {
+		id = block->counter_ids[i];
+		/* This should never happen. If it does, grow the bitmaps. */
+		if (id > PMC_MAX_COUNTER_ID) {
+			pr_err("PMC_MAX_COUNTER_ID %d is too small for %d.\n",
+				PMC_MAX_COUNTER_ID, id);
+			continue;
+		}
+		bitmap[id / 64] |= 1ULL << (id % 64);
+	}
+}
+
+static void build_pmc_bitmaps(void)
+{
+	uint32_t family, block_id;
+
+	for (family = 0; family < PMC_FAMILY_MAX; family++)
+		for (block_id = 0; block_id < PERFCOUNTER_BLOCKID__MAX; block_id++)
+			pmc_bitmap_set(pmc_counter_bitmap[family][block_id],
+				       &pmc_family_blocks[family][block_id]);
+}
+
+/* Returns PMC_FAMILY_MAX if the node has no known counters */
+enum pmc_family pmc_table_get_family(uint32_t node_id)
+{
+	uint32_t gfxv = get_gfxv_by_node_id(node_id);
+	uint16_t dev_id;
+
+	/* Major GFX Version */
+	switch (gfxv >> 16) {
+	case 7:
+		if (gfxv == GFX_VERSION_KAVERI)
+			return PMC_FAMILY_KAVERI;
+		return PMC_FAMILY_HAWAII;
+	case 8:
+		if (gfxv == GFX_VERSION_TONGA)
+			return PMC_FAMILY_MAX;
+		if (gfxv == GFX_VERSION_CARRIZO)
+			return PMC_FAMILY_CARRIZO;
+		/*
+		 * Fiji/Polaris/VegaM cards are of the same GFXIP Engine Version (8.0.3).
+		 * Only way to differentiate b/t Fiji and Polaris/VegaM is via DID.
+		 */
+		dev_id = get_device_id_by_node_id(node_id);
+		if (dev_id == 0x7300 || dev_id == 0x730F)
+			return PMC_FAMILY_FIJI;
+		return PMC_FAMILY_POLARIS;
+	case 9:
+		return PMC_FAMILY_VEGA;
+	case 10:
+		return PMC_FAMILY_NAVI;
+	default:
+		return PMC_FAMILY_MAX;
+	}
+}
+
 uint32_t pmc_table_get_max_concurrent(int block_id)
 {
 	switch (block_id) {
@@ -1977,8 +2061,7 @@ static HSAKMT_STATUS alloc_pmc_blocks_iommu(void)
 {
 	DIR *dir;
 	struct dirent *dent;
-	const char *sysfs_amdiommu_event_path =
-			"/sys/bus/event_source/devices/amd_iommu_0/events";
+	char sysfs_amdiommu_event_path[256];
 	/* Counter source in IOMMU's Counter Bank Addressing register is 8 bits,
 	 * so the biggest counter number/id possible is 0xff.
 	 */
@@ -1993,12 +2076,18 @@ static HSAKMT_STATUS alloc_pmc_blocks_iommu(void)
 	struct perf_counter_block *block = &iommu_block;
 
 	memset(block, 0, sizeof(struct perf_counter_block));
+	memset(iommu_counter_bitmap, 0, sizeof(iommu_counter_bitmap));
 
+	snprintf(sysfs_amdiommu_event_path, sizeof(sysfs_amdiommu_event_path),
+		 "%s/sys/bus/event_source/devices/amd_iommu_0/events",
+		 hsakmt_sysfs_root);
 	dir = opendir(sysfs_amdiommu_event_path);
 	if (!dir) {
 		/* Before kernel 4.12, amd_iommu is the path */
-		sysfs_amdiommu_event_path =
-			"/sys/bus/event_source/devices/amd_iommu/events";
+		snprintf(sysfs_amdiommu_event_path,
+			 sizeof(sysfs_amdiommu_event_path),
+			 "%s/sys/bus/event_source/devices/amd_iommu/events",
+			 hsakmt_sysfs_root);
 		dir = opendir(sysfs_amdiommu_event_path);
 		if (!dir)
 			goto out;
@@ -2047,8 +2136,9 @@ static HSAKMT_STATUS alloc_pmc_blocks_iommu(void)
 			++ptr;
 		}
 	}
+	pmc_bitmap_set(iommu_counter_bitmap, block);
 
-	if (snprintf(path, len, "%s/%d/%s",
+	if (snprintf(path, len, "%s%s/%d/%s", hsakmt_sysfs_root,
 		"/sys/devices/virtual/kfd/kfd/topology/nodes",
 		0, /* IOMMU is in node 0. Change this if NUMA is introduced to APU. */
 		"perf/iommu/max_concurrent") >= len) {
@@ -2071,27 +2161,65 @@ out:
 	return ret;
 }
 
+static void build_pmc_bitmaps_once(void)
+{
+	static bool bitmaps_built;
+
+	/* The GPU tables never change, build their bitmaps only once */
+	if (!bitmaps_built) {
+		build_pmc_bitmaps();
+		bitmaps_built = true;
+	}
+}
+
 HSAKMT_STATUS alloc_pmc_blocks(void)
 {
+	build_pmc_bitmaps_once();
+
 	return alloc_pmc_blocks_iommu();
 }
 
+/* Sets up the IOMMU block from a copy saved earlier, instead of reading it
+ * from sysfs with alloc_pmc_blocks.
+ */
+HSAKMT_STATUS pmc_table_set_iommu_block(uint32_t num_slots, uint32_t num_counters,
+					const uint32_t *counter_ids)
+{
+	struct perf_counter_block *block = &iommu_block;
+
+	build_pmc_bitmaps_once();
+	free_pmc_blocks();
+
+	if (num_counters) {
+		block->counter_ids = malloc(sizeof(uint32_t) * num_counters);
+		if (!block->counter_ids)
+			return HSAKMT_STATUS_NO_MEMORY;
+		memcpy(block->counter_ids, counter_ids,
+		       sizeof(uint32_t) * num_counters);
+	}
+	block->num_of_counters = num_counters;
+	block->num_of_slots = num_slots;
+	pmc_bitmap_set(iommu_counter_bitmap, block);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
 void free_pmc_blocks(void)
 {
 	if (iommu_block.counter_ids)
 		free(iommu_block.counter_ids);
 	iommu_block.counter_ids = NULL;
 	iommu_block.num_of_counters = 0;
+	memset(iommu_counter_bitmap, 0, sizeof(iommu_counter_bitmap));
 }
 
 HSAKMT_STATUS get_block_properties(uint32_t node_id,
 				   enum perf_block_id block_id,
 				   struct perf_counter_block *block)
 {
-	uint32_t gfxv = get_gfxv_by_node_id(node_id);
-	uint16_t dev_id = get_device_id_by_node_id(node_id);
+	enum pmc_family family;
 
-	if (block_id > PERFCOUNTER_BLOCKID__MAX ||
+	if (block_id >= PERFCOUNTER_BLOCKID__MAX ||
 			block_id < PERFCOUNTER_BLOCKID__FIRST)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
@@ -2100,39 +2228,52 @@ HSAKMT_STATUS get_block_properties(uint32_t node_id,
 		return HSAKMT_STATUS_SUCCESS;
 	}
 
-	/* Major GFX Version */
-	switch (gfxv >> 16) {
-	case 7:
-		if (gfxv == GFX_VERSION_KAVERI)
-			*block = kaveri_blocks[block_id];
-		else
-			*block = hawaii_blocks[block_id];
-		break;
-	case 8:
-		if (gfxv == GFX_VERSION_TONGA)
-			return HSAKMT_STATUS_INVALID_PARAMETER;
-		else if (gfxv == GFX_VERSION_CARRIZO)
-			*block = carrizo_blocks[block_id];
-		else {
-			/*
-			 * Fiji/Polaris/VegaM cards are of the same GFXIP Engine Version (8.0.3).
-			 * Only way to differentiate b/t Fiji and Polaris/VegaM is via DID.
-			 */
-			if (dev_id == 0x7300 || dev_id == 0x730F)
-				*block = fiji_blocks[block_id];
-			else
-				*block = polaris_blocks[block_id];
-		}
-		break;
-	case 9:
-		*block = vega_blocks[block_id];
-		break;
-	case 10:
-		*block = navi_blocks[block_id];
-		break;
-	default:
+	family = pmc_table_get_family(node_id);
+	if (family == PMC_FAMILY_MAX)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
-	}
+
+	*block = pmc_family_blocks[family][block_id];
 
 	return HSAKMT_STATUS_SUCCESS;
 }
+
+uint32_t pmc_table_get_num_slots(uint32_t node_id, enum perf_block_id block_id)
+{
+	enum pmc_family family;
+
+	if (block_id >= PERFCOUNTER_BLOCKID__MAX ||
+			block_id < PERFCOUNTER_BLOCKID__FIRST)
+		return 0;
+
+	if (block_id == PERFCOUNTER_BLOCKID__IOMMUV2)
+		return iommu_block.num_of_slots;
+
+	family = pmc_table_get_family(node_id);
+	if (family == PMC_FAMILY_MAX)
+		return 0;
+
+	return pmc_family_blocks[family][block_id].num_of_slots;
+}
+
+bool pmc_table_counter_valid(uint32_t node_id, enum perf_block_id block_id,
+			     uint64_t counter_id)
+{
+	const uint64_t *bitmap;
+	enum pmc_family family;
+
+	if (block_id >= PERFCOUNTER_BLOCKID__MAX ||
+			block_id < PERFCOUNTER_BLOCKID__FIRST ||
+			counter_id > PMC_MAX_COUNTER_ID)
+		return false;
+
+	if (block_id == PERFCOUNTER_BLOCKID__IOMMUV2) {
+		bitmap = iommu_counter_bitmap;
+	} else {
+		family = pmc_table_get_family(node_id);
+		if (family == PMC_FAMILY_MAX)
+			return false;
+		bitmap = pmc_counter_bitmap[family][block_id];
+	}
+
+	return !!(bitmap[counter_id / 64] & (1ULL << (counter_id % 64)));
+}
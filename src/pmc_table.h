@@ -60,6 +60,18 @@ enum perf_block_id {
 	PERFCOUNTER_BLOCKID__MAX
 };
 
+/* ASICs with the same counter tables */
+enum pmc_family {
+	PMC_FAMILY_KAVERI = 0,
+	PMC_FAMILY_HAWAII,
+	PMC_FAMILY_CARRIZO,
+	PMC_FAMILY_FIJI,
+	PMC_FAMILY_POLARIS,
+	PMC_FAMILY_VEGA,
+	PMC_FAMILY_NAVI,
+	PMC_FAMILY_MAX		/* no known GPU counters */
+};
+
 struct perf_counter_block {
 	uint32_t    num_of_slots;
 	uint32_t    num_of_counters;
@@ -70,10 +82,20 @@ struct perf_counter_block {
 
 HSAKMT_STATUS alloc_pmc_blocks(void);
 void free_pmc_blocks(void);
+HSAKMT_STATUS pmc_table_set_iommu_block(uint32_t num_slots, uint32_t num_counters,
+					const uint32_t *counter_ids);
+enum pmc_family pmc_table_get_family(uint32_t node_id);
 uint32_t pmc_table_get_max_concurrent(int block_id);
 
 HSAKMT_STATUS get_block_properties(uint32_t node_id,
 				   enum perf_block_id block_id,
 				   struct perf_counter_block *block);
 
+/* Slots of the block on the node, 0 if the node doesn't have the block */
+uint32_t pmc_table_get_num_slots(uint32_t node_id, enum perf_block_id block_id);
+
+/* Whether the block of the node has a counter with this ID, in O(1) */
+bool pmc_table_counter_valid(uint32_t node_id, enum perf_block_id block_id,
+			     uint64_t counter_id);
+
 #endif // PMC_TABLE_H
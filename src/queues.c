@@ -76,9 +76,208 @@ struct queue {
 	uint32_t cu_mask[0];
 };
 
+/* Queue handles returned to the application are not pointers but indices
+ * into a table of queue slots, tagged with the generation of the slot in
+ * the upper 32 bits. Every time a slot is released its generation is
+ * bumped, so stale handles of destroyed queues fail the lookup instead of
+ * dereferencing freed memory.
+ *
+ * Slots are allocated in chunks that are never moved or freed while KFD is
+ * open. This makes lookups lock-free: a lookup is two acquire loads and a
+ * compare. Only allocating and releasing slots takes queue_handle_mutex.
+ */
+#define QUEUE_HANDLE_CHUNK_SHIFT	8
+#define QUEUE_HANDLE_CHUNK_SIZE		(1U << QUEUE_HANDLE_CHUNK_SHIFT)
+#define QUEUE_HANDLE_MAX_CHUNKS		64
+#define QUEUE_HANDLE_MAX		(QUEUE_HANDLE_CHUNK_SIZE * QUEUE_HANDLE_MAX_CHUNKS)
+#define QUEUE_HANDLE_NO_SLOT		0xFFFFFFFF
+
+#define QUEUE_HANDLE(index, gen)	(((HSA_QUEUEID)(gen) << 32) | (index))
+#define QUEUE_HANDLE_INDEX(handle)	((uint32_t)(handle))
+#define QUEUE_HANDLE_GEN(handle)	((uint32_t)((handle) >> 32))
+
+struct queue_handle_slot {
+	struct queue *q;
+	uint32_t generation;
+	uint32_t next_free;
+};
+
+static struct queue_handle_slot *queue_handle_chunks[QUEUE_HANDLE_MAX_CHUNKS];
+/* Number of slots ever handed out, bounds enumeration */
+static uint32_t queue_handle_count;
+static uint32_t queue_handle_free_list = QUEUE_HANDLE_NO_SLOT;
+static pthread_mutex_t queue_handle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct queue_handle_slot *queue_handle_slot(uint32_t index)
+{
+	struct queue_handle_slot *chunk;
+
+	if (index >= QUEUE_HANDLE_MAX)
+		return NULL;
+
+	chunk = __atomic_load_n(&queue_handle_chunks[index >> QUEUE_HANDLE_CHUNK_SHIFT],
+				__ATOMIC_ACQUIRE);
+	if (!chunk)
+		return NULL;
+
+	return &chunk[index & (QUEUE_HANDLE_CHUNK_SIZE - 1)];
+}
+
+static HSA_QUEUEID alloc_queue_handle(struct queue *q)
+{
+	struct queue_handle_slot *slot;
+	uint32_t index;
+	HSA_QUEUEID handle = INVALID_QUEUEID;
+
+	pthread_mutex_lock(&queue_handle_mutex);
+
+	if (queue_handle_free_list != QUEUE_HANDLE_NO_SLOT) {
+		index = queue_handle_free_list;
+		slot = queue_handle_slot(index);
+		queue_handle_free_list = slot->next_free;
+	} else {
+		uint32_t chunk = queue_handle_count >> QUEUE_HANDLE_CHUNK_SHIFT;
+
+		if (queue_handle_count >= QUEUE_HANDLE_MAX) {
+			pr_err("Queue handle table is full\n");
+			goto out;
+		}
+
+		if (!queue_handle_chunks[chunk]) {
+			struct queue_handle_slot *slots;
+
+			slots = calloc(QUEUE_HANDLE_CHUNK_SIZE, sizeof(*slots));
+			if (!slots)
+				goto out;
+			/* Generation 0 is never used so that a zero handle
+			 * is always invalid
+			 */
+			for (index = 0; index < QUEUE_HANDLE_CHUNK_SIZE; index++)
+				slots[index].generation = 1;
+			__atomic_store_n(&queue_handle_chunks[chunk], slots,
+					 __ATOMIC_RELEASE);
+		}
+
+		index = queue_handle_count;
+		slot = queue_handle_slot(index);
+		__atomic_store_n(&queue_handle_count, index + 1, __ATOMIC_RELEASE);
+	}
+
+	slot->next_free = QUEUE_HANDLE_NO_SLOT;
+	__atomic_store_n(&slot->q, q, __ATOMIC_RELEASE);
+	handle = QUEUE_HANDLE(index, slot->generation);
+
+out:
+	pthread_mutex_unlock(&queue_handle_mutex);
+	return handle;
+}
+
+static void release_queue_handle(HSA_QUEUEID QueueId)
+{
+	uint32_t index = QUEUE_HANDLE_INDEX(QueueId);
+	struct queue_handle_slot *slot = queue_handle_slot(index);
+	uint32_t generation;
+
+	if (!slot)
+		return;
+
+	pthread_mutex_lock(&queue_handle_mutex);
+
+	if (slot->generation == QUEUE_HANDLE_GEN(QueueId) && slot->q) {
+		__atomic_store_n(&slot->q, NULL, __ATOMIC_RELEASE);
+		generation = slot->generation + 1;
+		if (!generation)
+			generation = 1;
+		__atomic_store_n(&slot->generation, generation, __ATOMIC_RELEASE);
+		slot->next_free = queue_handle_free_list;
+		queue_handle_free_list = index;
+	}
+
+	pthread_mutex_unlock(&queue_handle_mutex);
+}
+
+/* Lock-free translation of a queue handle. Returns NULL for handles that
+ * were never allocated or whose queue has been destroyed.
+ */
+static struct queue *find_queue(HSA_QUEUEID QueueId)
+{
+	struct queue_handle_slot *slot = queue_handle_slot(QUEUE_HANDLE_INDEX(QueueId));
+	struct queue *q;
+
+	if (!slot)
+		return NULL;
+
+	q = __atomic_load_n(&slot->q, __ATOMIC_ACQUIRE);
+	if (!q || __atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) !=
+			QUEUE_HANDLE_GEN(QueueId))
+		return NULL;
+
+	return q;
+}
+
+/* Fills QueueIds with the handles of up to MaxQueues live queues and
+ * returns the total number of live queues.
+ */
+uint32_t get_live_queue_handles(HSA_QUEUEID *QueueIds, uint32_t MaxQueues)
+{
+	uint32_t count = __atomic_load_n(&queue_handle_count, __ATOMIC_ACQUIRE);
+	uint32_t index, num_live = 0;
+
+	for (index = 0; index < count; index++) {
+		struct queue_handle_slot *slot = queue_handle_slot(index);
+		uint32_t generation;
+
+		if (!__atomic_load_n(&slot->q, __ATOMIC_ACQUIRE))
+			continue;
+		generation = __atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE);
+		if (QueueIds && num_live < MaxQueues)
+			QueueIds[num_live] = QUEUE_HANDLE(index, generation);
+		num_live++;
+	}
+
+	return num_live;
+}
+
+/* Invalidates all queue handles. Called when KFD is closed and from the
+ * child process after a fork(), when no other thread can be using the
+ * table. The queues themselves go away with the KFD file descriptor and
+ * the process' GPU memory. Slots are kept and their generations bumped so
+ * handles from before the close are not mistaken for new queues after
+ * KFD is reopened.
+ */
+void clear_queue_handles(void)
+{
+	uint32_t index;
+
+	/* After a fork the mutex may have been held by another parent thread */
+	pthread_mutex_init(&queue_handle_mutex, NULL);
+
+	queue_handle_free_list = QUEUE_HANDLE_NO_SLOT;
+	for (index = queue_handle_count; index-- > 0; ) {
+		struct queue_handle_slot *slot = queue_handle_slot(index);
+
+		if (slot->q) {
+			slot->q = NULL;
+			if (!++slot->generation)
+				slot->generation = 1;
+		}
+		slot->next_free = queue_handle_free_list;
+		queue_handle_free_list = index;
+	}
+}
+
+/* mmap offset of the doorbell page of a GPU, as returned by KFD in the
+ * upper bits of the create queue doorbell_offset
+ */
+#define KFD_MMAP_TYPE_DOORBELL		(0x3ULL << 62)
+#define KFD_MMAP_GPU_ID(gpu_id)		(((uint64_t)(gpu_id) & 0xFFFF) << 46)
+
 struct process_doorbells {
 	bool use_gpuvm;
 	uint32_t size;
+	/* Set with release semantics once the doorbell page is mapped.
+	 * A non-NULL acquire load means size and use_gpuvm are valid, too.
+	 */
 	void *mapping;
 	pthread_mutex_t mutex;
 };
@@ -86,6 +285,36 @@ struct process_doorbells {
 static unsigned int num_doorbells;
 static struct process_doorbells *doorbells;
 
+static HSAKMT_STATUS map_doorbell(HSAuint32 NodeId, HSAuint32 gpu_id,
+				  uint32_t gfxv, HSAuint64 doorbell_mmap_offset);
+
+/* Map the doorbell pages of all GPU nodes up front, so that creating the
+ * first queue on each GPU doesn't have to. Enabled with
+ * HSAKMT_PREMAP_DOORBELLS. Failures are not fatal, the doorbells are
+ * mapped on demand at queue creation instead.
+ */
+static void premap_process_doorbells(unsigned int NumNodes)
+{
+	HsaNodeProperties props;
+	unsigned int i;
+	uint32_t gpu_id;
+
+	for (i = 0; i < NumNodes; i++) {
+		/* topology_sysfs_get_node_props succeeds even if the GPU ID
+		 * can't be read, the node is skipped then
+		 */
+		gpu_id = 0;
+		if (topology_sysfs_get_node_props(i, &props, &gpu_id, NULL, NULL) !=
+		    HSAKMT_STATUS_SUCCESS || !gpu_id)
+			continue;
+
+		if (map_doorbell(i, gpu_id, HSA_GET_GFX_VERSION_FULL(props.EngineId.ui32),
+				 KFD_MMAP_TYPE_DOORBELL | KFD_MMAP_GPU_ID(gpu_id)) !=
+		    HSAKMT_STATUS_SUCCESS)
+			pr_info("Failed to pre-map doorbells of node %u\n", i);
+	}
+}
+
 HSAKMT_STATUS init_process_doorbells(unsigned int NumNodes)
 {
 	unsigned int i;
@@ -107,17 +336,19 @@ HSAKMT_STATUS init_process_doorbells(unsigned int NumNodes)
 
 	num_doorbells = NumNodes;
 
+	if (premap_doorbells)
+		premap_process_doorbells(NumNodes);
+
 	return ret;
 }
 
-static void get_doorbell_map_info(uint32_t node_id,
+static void get_doorbell_map_info(uint32_t gfxv,
 				  struct process_doorbells *doorbell)
 {
 	/*
 	 * GPUVM doorbell on Tonga requires a workaround for VM TLB ACTIVE bit
 	 * lookup bug. Remove ASIC check when this is implemented in amdgpu.
 	 */
-	uint32_t gfxv = get_gfxv_by_node_id(node_id);
 	doorbell->use_gpuvm = (is_dgpu && gfxv != GFX_VERSION_TONGA);
 	doorbell->size = DOORBELLS_PAGE_SIZE(DOORBELL_SIZE(gfxv));
 
@@ -132,7 +363,7 @@ void destroy_process_doorbells(void)
 		return;
 
 	for (i = 0; i < num_doorbells; i++) {
-		if (!doorbells[i].size)
+		if (!doorbells[i].mapping)
 			continue;
 
 		if (doorbells[i].use_gpuvm) {
@@ -158,7 +389,7 @@ void clear_process_doorbells(void)
 		return;
 
 	for (i = 0; i < num_doorbells; i++) {
-		if (!doorbells[i].size)
+		if (!doorbells[i].mapping)
 			continue;
 
 		if (!doorbells[i].use_gpuvm)
@@ -170,8 +401,8 @@ void clear_process_doorbells(void)
 	num_doorbells = 0;
 }
 
-static HSAKMT_STATUS map_doorbell_apu(HSAuint32 NodeId, HSAuint32 gpu_id,
-				      HSAuint64 doorbell_mmap_offset)
+static void *map_doorbell_apu(HSAuint32 NodeId, HSAuint32 gpu_id,
+			      HSAuint64 doorbell_mmap_offset)
 {
 	void *ptr;
 
@@ -179,15 +410,13 @@ static HSAKMT_STATUS map_doorbell_apu(HSAuint32 NodeId, HSAuint32 gpu_id,
 		   MAP_SHARED, kfd_fd, doorbell_mmap_offset);
 
 	if (ptr == MAP_FAILED)
-		return HSAKMT_STATUS_ERROR;
-
-	doorbells[NodeId].mapping = ptr;
+		return NULL;
 
-	return HSAKMT_STATUS_SUCCESS;
+	return ptr;
 }
 
-static HSAKMT_STATUS map_doorbell_dgpu(HSAuint32 NodeId, HSAuint32 gpu_id,
-				       HSAuint64 doorbell_mmap_offset)
+static void *map_doorbell_dgpu(HSAuint32 NodeId, HSAuint32 gpu_id,
+			       HSAuint64 doorbell_mmap_offset)
 {
 	void *ptr;
 
@@ -195,50 +424,56 @@ static HSAKMT_STATUS map_doorbell_dgpu(HSAuint32 NodeId, HSAuint32 gpu_id,
 				doorbell_mmap_offset);
 
 	if (!ptr)
-		return HSAKMT_STATUS_ERROR;
+		return NULL;
 
 	/* map for GPU access */
 	if (fmm_map_to_gpu(ptr, doorbells[NodeId].size, NULL)) {
 		fmm_release(ptr);
-		return HSAKMT_STATUS_ERROR;
+		return NULL;
 	}
 
-	doorbells[NodeId].mapping = ptr;
-
-	return HSAKMT_STATUS_SUCCESS;
+	return ptr;
 }
 
 static HSAKMT_STATUS map_doorbell(HSAuint32 NodeId, HSAuint32 gpu_id,
-				  HSAuint64 doorbell_mmap_offset)
+				  uint32_t gfxv, HSAuint64 doorbell_mmap_offset)
 {
-	HSAKMT_STATUS status = HSAKMT_STATUS_SUCCESS;
+	void *ptr = NULL;
+
+	/* Fast path: the doorbell page is mapped only once per node, don't
+	 * serialize concurrent queue creation after that
+	 */
+	if (__atomic_load_n(&doorbells[NodeId].mapping, __ATOMIC_ACQUIRE))
+		return HSAKMT_STATUS_SUCCESS;
 
 	pthread_mutex_lock(&doorbells[NodeId].mutex);
-	if (doorbells[NodeId].size) {
+	if (doorbells[NodeId].mapping) {
 		pthread_mutex_unlock(&doorbells[NodeId].mutex);
 		return HSAKMT_STATUS_SUCCESS;
 	}
 
-	get_doorbell_map_info(NodeId, &doorbells[NodeId]);
+	get_doorbell_map_info(gfxv, &doorbells[NodeId]);
 
 	if (doorbells[NodeId].use_gpuvm) {
-		status = map_doorbell_dgpu(NodeId, gpu_id, doorbell_mmap_offset);
-		if (status != HSAKMT_STATUS_SUCCESS) {
+		ptr = map_doorbell_dgpu(NodeId, gpu_id, doorbell_mmap_offset);
+		if (!ptr) {
 			/* Fall back to the old method if KFD doesn't
 			 * support doorbells in GPUVM
 			 */
 			doorbells[NodeId].use_gpuvm = false;
-			status = map_doorbell_apu(NodeId, gpu_id, doorbell_mmap_offset);
+			ptr = map_doorbell_apu(NodeId, gpu_id, doorbell_mmap_offset);
 		}
 	} else
-		status = map_doorbell_apu(NodeId, gpu_id, doorbell_mmap_offset);
+		ptr = map_doorbell_apu(NodeId, gpu_id, doorbell_mmap_offset);
 
-	if (status != HSAKMT_STATUS_SUCCESS)
+	if (ptr)
+		__atomic_store_n(&doorbells[NodeId].mapping, ptr, __ATOMIC_RELEASE);
+	else
 		doorbells[NodeId].size = 0;
 
 	pthread_mutex_unlock(&doorbells[NodeId].mutex);
 
-	return status;
+	return ptr ? HSAKMT_STATUS_SUCCESS : HSAKMT_STATUS_ERROR;
 }
 
 static void *allocate_exec_aligned_memory_cpu(uint32_t size)
@@ -261,17 +496,23 @@ static void *allocate_exec_aligned_memory_cpu(uint32_t size)
 /* The bool return indicate whether the queue needs a context-save-restore area*/
 static bool update_ctx_save_restore_size(uint32_t nodeid, struct queue *q)
 {
-	HsaNodeProperties node;
+	const HsaTopologySnapshot *topo;
+	const HsaNodeProperties *node;
+	bool ret = false;
 
 	if (q->gfxv < GFX_VERSION_CARRIZO)
 		return false;
-	if (hsaKmtGetNodeProperties(nodeid, &node))
+	if (hsaKmtAcquireTopologySnapshot(&topo))
 		return false;
-	if (node.NumFComputeCores && node.NumSIMDPerCU) {
+	if (nodeid >= topo->SystemProperties.NumNodes)
+		goto out;
+
+	node = &topo->Nodes[nodeid].Node;
+	if (node->NumFComputeCores && node->NumSIMDPerCU) {
 		uint32_t ctl_stack_size, wg_data_size;
-		uint32_t cu_num = node.NumFComputeCores / node.NumSIMDPerCU;
+		uint32_t cu_num = node->NumFComputeCores / node->NumSIMDPerCU;
 		uint32_t wave_num = (q->gfxv < GFX_VERSION_NAVI10)
-			? MIN(cu_num * 40, node.NumShaderBanks / node.NumArrays * 512)
+			? MIN(cu_num * 40, node->NumShaderBanks / node->NumArrays * 512)
 			: cu_num * 32;
 
 		ctl_stack_size = wave_num * CNTL_STACK_BYTES_PER_WAVE(q->gfxv) + 8;
@@ -292,9 +533,12 @@ static bool update_ctx_save_restore_size(uint32_t nodeid, struct queue *q)
 
 		q->ctx_save_restore_size = q->ctl_stack_size
 					+ PAGE_ALIGN_UP(wg_data_size);
-		return true;
+		ret = true;
 	}
-	return false;
+
+out:
+	hsaKmtReleaseTopologySnapshot(topo);
+	return ret;
 }
 
 void *allocate_exec_aligned_memory_gpu(uint32_t size, uint32_t align,
@@ -455,6 +699,15 @@ static int handle_concrete_asic(struct queue *q,
 	return HSAKMT_STATUS_SUCCESS;
 }
 
+static int destroy_kfd_queue(uint32_t queue_id)
+{
+	struct kfd_ioctl_destroy_queue_args args = {0};
+
+	args.queue_id = queue_id;
+
+	return kmtIoctl(kfd_fd, AMDKFD_IOC_DESTROY_QUEUE, &args);
+}
+
 /* A map to translate thunk queue priority (-3 to +3)
  * to KFD queue priority (0 to 15)
  * Indexed by thunk_queue_priority+3
@@ -473,9 +726,10 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtCreateQueue(HSAuint32 NodeId,
 	HSAKMT_STATUS result;
 	uint32_t gpu_id;
 	uint64_t doorbell_mmap_offset;
-	unsigned int doorbell_offset;
+	unsigned int doorbell_offset, doorbell_page_size;
 	int err;
-	HsaNodeProperties props;
+	const HsaTopologySnapshot *topo;
+	const HsaNodeProperties *props;
 	uint32_t cu_num, i;
 	bool use_ats;
 
@@ -506,10 +760,16 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtCreateQueue(HSAuint32 NodeId,
 	/* By default, CUs are all turned on. Initialize cu_mask to '1
 	 * for all CU bits.
 	 */
-	if (hsaKmtGetNodeProperties(NodeId, &props))
+	if (hsaKmtAcquireTopologySnapshot(&topo))
 		q->cu_mask_count = 0;
 	else {
-		cu_num = props.NumFComputeCores / props.NumSIMDPerCU;
+		if (NodeId < topo->SystemProperties.NumNodes) {
+			props = &topo->Nodes[NodeId].Node;
+			cu_num = props->NumFComputeCores / props->NumSIMDPerCU;
+		} else
+			cu_num = 0;
+		hsaKmtReleaseTopologySnapshot(topo);
+
 		/* cu_mask_count counts bits. It must be multiple of 32 */
 		q->cu_mask_count = ALIGN_UP_32(cu_num, 32);
 		for (i = 0; i < cu_num; i++)
@@ -563,6 +823,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtCreateQueue(HSAuint32 NodeId,
 	}
 
 	q->queue_id = args.queue_id;
+	doorbell_page_size = DOORBELLS_PAGE_SIZE(DOORBELL_SIZE(q->gfxv));
 
 	if (IS_SOC15(q->gfxv)) {
 		/* On SOC15 chips, the doorbell offset within the
@@ -572,9 +833,9 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtCreateQueue(HSAuint32 NodeId,
 		 * rather than based on the its process queue ID.
 		 */
 		doorbell_mmap_offset = args.doorbell_offset &
-			~(HSAuint64)(doorbells[NodeId].size - 1);
+			~(HSAuint64)(doorbell_page_size - 1);
 		doorbell_offset = args.doorbell_offset &
-			(doorbells[NodeId].size - 1);
+			(doorbell_page_size - 1);
 	} else {
 		/* On older chips, the doorbell offset within the
 		 * doorbell page is based on the queue ID.
@@ -583,18 +844,23 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtCreateQueue(HSAuint32 NodeId,
 		doorbell_offset = q->queue_id * DOORBELL_SIZE(q->gfxv);
 	}
 
-	err = map_doorbell(NodeId, gpu_id, doorbell_mmap_offset);
-	if (err != HSAKMT_STATUS_SUCCESS) {
-		hsaKmtDestroyQueue(q->queue_id);
-		free_queue(q);
-		return HSAKMT_STATUS_ERROR;
-	}
+	err = map_doorbell(NodeId, gpu_id, q->gfxv, doorbell_mmap_offset);
+	if (err != HSAKMT_STATUS_SUCCESS)
+		goto destroy_queue;
+
+	QueueResource->QueueId = alloc_queue_handle(q);
+	if (QueueResource->QueueId == INVALID_QUEUEID)
+		goto destroy_queue;
 
-	QueueResource->QueueId = PORT_VPTR_TO_UINT64(q);
 	QueueResource->Queue_DoorBell = VOID_PTR_ADD(doorbells[NodeId].mapping,
 						     doorbell_offset);
 
 	return HSAKMT_STATUS_SUCCESS;
+
+destroy_queue:
+	destroy_kfd_queue(q->queue_id);
+	free_queue(q);
+	return HSAKMT_STATUS_ERROR;
 }
 
 
@@ -606,7 +872,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtUpdateQueue(HSA_QUEUEID QueueId,
 					  HsaEvent *Event)
 {
 	struct kfd_ioctl_update_queue_args arg = {0};
-	struct queue *q = PORT_UINT64_TO_VPTR(QueueId);
+	struct queue *q = find_queue(QueueId);
 
 	CHECK_KFD_OPEN();
 
@@ -630,39 +896,68 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtUpdateQueue(HSA_QUEUEID QueueId,
 	return HSAKMT_STATUS_SUCCESS;
 }
 
-HSAKMT_STATUS HSAKMTAPI hsaKmtDestroyQueue(HSA_QUEUEID QueueId)
+static HSAKMT_STATUS destroy_queue(HSA_QUEUEID QueueId)
 {
-	CHECK_KFD_OPEN();
-
-	struct queue *q = PORT_UINT64_TO_VPTR(QueueId);
-	struct kfd_ioctl_destroy_queue_args args = {0};
+	struct queue *q = find_queue(QueueId);
 
 	if (!q)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
-	args.queue_id = q->queue_id;
-
-	int err = kmtIoctl(kfd_fd, AMDKFD_IOC_DESTROY_QUEUE, &args);
+	int err = destroy_kfd_queue(q->queue_id);
 
 	if (err == -1) {
 		pr_err("Failed to destroy queue: %s\n", strerror(errno));
 		return HSAKMT_STATUS_ERROR;
 	}
 
+	release_queue_handle(QueueId);
 	free_queue(q);
 	return HSAKMT_STATUS_SUCCESS;
 }
 
+HSAKMT_STATUS HSAKMTAPI hsaKmtDestroyQueue(HSA_QUEUEID QueueId)
+{
+	CHECK_KFD_OPEN();
+
+	return destroy_queue(QueueId);
+}
+
+/* Destroys the queues the application left behind when KFD is closed, so
+ * that their ring buffer memory is freed before the apertures go away.
+ * Handles that can't be destroyed are still invalidated by
+ * clear_queue_handles.
+ */
+void destroy_live_queues(void)
+{
+	HSA_QUEUEID *handles;
+	uint32_t i, num_live;
+
+	num_live = get_live_queue_handles(NULL, 0);
+	if (!num_live)
+		return;
+
+	handles = malloc(num_live * sizeof(*handles));
+	if (!handles)
+		return;
+
+	num_live = MIN(get_live_queue_handles(handles, num_live), num_live);
+	pr_debug("Destroying %u queues left at close\n", num_live);
+	for (i = 0; i < num_live; i++)
+		destroy_queue(handles[i]);
+
+	free(handles);
+}
+
 HSAKMT_STATUS HSAKMTAPI hsaKmtSetQueueCUMask(HSA_QUEUEID QueueId,
 					     HSAuint32 CUMaskCount,
 					     HSAuint32 *QueueCUMask)
 {
-	struct queue *q = PORT_UINT64_TO_VPTR(QueueId);
+	struct queue *q = find_queue(QueueId);
 	struct kfd_ioctl_set_cu_mask_args args = {0};
 
 	CHECK_KFD_OPEN();
 
-	if (CUMaskCount == 0 || !QueueCUMask || ((CUMaskCount % 32) != 0))
+	if (!q || CUMaskCount == 0 || !QueueCUMask || ((CUMaskCount % 32) != 0))
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
 	args.queue_id = q->queue_id;
@@ -680,6 +975,133 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtSetQueueCUMask(HSA_QUEUEID QueueId,
 	return HSAKMT_STATUS_SUCCESS;
 }
 
+/* KFD distributes the bits of a queue CU mask symmetrically over the
+ * shader engines: bit i selects CU i / num_se of shader engine
+ * i % num_se (newer kernels further interleave the shader arrays within
+ * each engine the same way). A mask of the low N bits is therefore
+ * already spread evenly over all shader engines and arrays, only the
+ * partitioner needs to know num_se. num_se may be NULL.
+ */
+static HSAKMT_STATUS get_cu_mask_layout(HSAuint32 NodeId, HSAuint32 CUMaskCount,
+					uint32_t *cu_num, uint32_t *num_se)
+{
+	const HsaTopologySnapshot *topo;
+	const HsaNodeProperties *props;
+	HSAKMT_STATUS ret;
+
+	ret = hsaKmtAcquireTopologySnapshot(&topo);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
+	if (NodeId >= topo->SystemProperties.NumNodes) {
+		hsaKmtReleaseTopologySnapshot(topo);
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+	}
+
+	props = &topo->Nodes[NodeId].Node;
+	*cu_num = props->NumSIMDPerCU ?
+			props->NumFComputeCores / props->NumSIMDPerCU : 0;
+	if (num_se) {
+		*num_se = (props->NumShaderBanks && props->NumArrays) ?
+				props->NumShaderBanks / props->NumArrays : 1;
+		if (!*num_se)
+			*num_se = 1;
+	}
+	hsaKmtReleaseTopologySnapshot(topo);
+
+	if (!*cu_num)
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+
+	if ((CUMaskCount % 32) != 0 || CUMaskCount < *cu_num)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtBuildQueueCUMask(HSAuint32 NodeId,
+					       HSAuint32 NumCUs,
+					       HSAuint32 CUMaskCount,
+					       HSAuint32 *QueueCUMask)
+{
+	uint32_t cu_num, i;
+	HSAKMT_STATUS ret;
+
+	if (!QueueCUMask)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	ret = get_cu_mask_layout(NodeId, CUMaskCount, &cu_num, NULL);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
+	if (NumCUs == 0 || NumCUs > cu_num)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	memset(QueueCUMask, 0, CUMaskCount / 8);
+	for (i = 0; i < NumCUs; i++)
+		QueueCUMask[i / 32] |= 1U << (i % 32);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtBuildQueueCUMaskByPercentage(HSAuint32 NodeId,
+							   HSAuint32 CUPercentage,
+							   HSAuint32 CUMaskCount,
+							   HSAuint32 *QueueCUMask)
+{
+	uint32_t cu_num;
+	HSAKMT_STATUS ret;
+
+	if (CUPercentage == 0 || CUPercentage > 100)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	ret = get_cu_mask_layout(NodeId, CUMaskCount, &cu_num, NULL);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
+	return hsaKmtBuildQueueCUMask(NodeId,
+				      MAX(cu_num * CUPercentage / 100, 1U),
+				      CUMaskCount, QueueCUMask);
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtPartitionQueueCUMask(HSAuint32 NodeId,
+						   HSAuint32 NumPartitions,
+						   HSAuint32 CUMaskCount,
+						   HSAuint32 *QueueCUMasks)
+{
+	uint32_t cu_num, num_se, mask_dwords, i, p;
+	HSAKMT_STATUS ret;
+
+	if (!QueueCUMasks || NumPartitions == 0)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	ret = get_cu_mask_layout(NodeId, CUMaskCount, &cu_num, &num_se);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
+	if (NumPartitions > cu_num)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	mask_dwords = CUMaskCount / 32;
+	memset(QueueCUMasks, 0, (size_t)NumPartitions * mask_dwords * sizeof(HSAuint32));
+
+	for (i = 0; i < cu_num; i++) {
+		if (num_se % NumPartitions == 0)
+			/* Give each partition whole shader engines, so that
+			 * tenants don't share SE-level resources
+			 */
+			p = (i % num_se) / (num_se / NumPartitions);
+		else
+			/* Contiguous runs of the interleaved bit order, each
+			 * spread evenly over the shader engines
+			 */
+			p = (uint32_t)((uint64_t)i * NumPartitions / cu_num);
+
+		QueueCUMasks[p * mask_dwords + i / 32] |= 1U << (i % 32);
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
 HSAKMT_STATUS
 HSAKMTAPI
 hsaKmtGetQueueInfo(
@@ -687,7 +1109,7 @@ hsaKmtGetQueueInfo(
 	HsaQueueInfo *QueueInfo
 )
 {
-	struct queue *q = PORT_UINT64_TO_VPTR(QueueId);
+	struct queue *q = find_queue(QueueId);
 	struct kfd_ioctl_get_queue_wave_state_args args = {0};
 
 	CHECK_KFD_OPEN();
@@ -754,8 +1176,12 @@ uint32_t *convert_queue_ids(HSAuint32 NumQueues, HSA_QUEUEID *Queues)
 		return NULL;
 
 	for (i = 0; i < NumQueues; i++) {
-		struct queue *q = PORT_UINT64_TO_VPTR(Queues[i]);
+		struct queue *q = find_queue(Queues[i]);
 
+		if (!q) {
+			free(queue_ids_ptr);
+			return NULL;
+		}
 		queue_ids_ptr[i] = q->queue_id;
 	}
 	return queue_ids_ptr;
@@ -769,10 +1195,13 @@ hsaKmtAllocQueueGWS(
                 HSAuint32          *firstGWS)
 {
 	struct kfd_ioctl_alloc_queue_gws_args args = {0};
-	struct queue *q = PORT_UINT64_TO_VPTR(QueueId);
+	struct queue *q = find_queue(QueueId);
 
 	CHECK_KFD_OPEN();
 
+	if (!q)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
 	args.queue_id = (HSAuint32)q->queue_id;
 	args.num_gws = nGWS;
 
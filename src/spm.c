@@ -27,6 +27,11 @@
 #include "linux/kfd_ioctl.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 
 HSAKMT_STATUS HSAKMTAPI hsaKmtSPMAcquire(HSAuint32 PreferredNode)
@@ -100,4 +105,408 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtSPMRelease(HSAuint32 PreferredNode)
 	return ret;
 }
 
+#define HSA_SPM_STREAM_MAGIC4CC	0x4d505348	/* "HSPM" */
 
+/* A stream buffer is FREE, owned by the kernel as the SPM destination,
+ * FILLED and queued for the sink, or being CONSUMED by the sink. Only the
+ * drain thread moves buffers to and from the kernel, only the consumer
+ * thread consumes them.
+ */
+enum spm_buffer_state {
+	SPM_BUFFER_FREE,
+	SPM_BUFFER_KERNEL,
+	SPM_BUFFER_FILLED,
+	SPM_BUFFER_CONSUMED
+};
+
+struct spm_buffer {
+	void *addr;
+	enum spm_buffer_state state;
+	uint32_t size_copied;
+	bool data_loss;
+};
+
+struct spm_stream {
+	uint32_t magic4cc;
+	uint32_t node_id;
+	uint32_t buf_size;
+	uint32_t timeout_ms;
+	HsaSpmStreamSink sink;
+	pthread_t drain_thread;
+	pthread_t consumer_thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;		/* Asks the drain thread to finish */
+	bool drain_done;	/* No more buffers will be queued */
+	HSAKMT_STATUS status;	/* First error of either thread */
+	struct timespec start_time;
+	HsaSpmStreamStats stats;
+	/* FIFO of FILLED buffer indices, oldest first */
+	uint32_t num_buffers;
+	uint32_t queue_head;
+	uint32_t num_queued;
+	uint32_t *queue;
+	struct spm_buffer buffers[];
+};
+
+static void stream_set_error(struct spm_stream *stream, HSAKMT_STATUS status)
+{
+	if (stream->status == HSAKMT_STATUS_SUCCESS)
+		stream->status = status;
+}
+
+/* Queue the buffer the kernel just returned. Called with the lock held. */
+static void stream_queue_buffer(struct spm_stream *stream, uint32_t idx,
+				uint32_t size_copied, bool data_loss)
+{
+	struct spm_buffer *buf = &stream->buffers[idx];
+
+	if (data_loss)
+		stream->stats.DataLossEvents++;
+
+	if (!size_copied) {
+		buf->state = SPM_BUFFER_FREE;
+		return;
+	}
+
+	buf->state = SPM_BUFFER_FILLED;
+	buf->size_copied = size_copied;
+	buf->data_loss = data_loss;
+	stream->queue[(stream->queue_head + stream->num_queued) %
+		      stream->num_buffers] = idx;
+	stream->num_queued++;
+	pthread_cond_broadcast(&stream->cond);
+}
+
+/* Next destination for the kernel: a free buffer, waiting for the sink
+ * for up to one timeout while the kernel still fills the current buffer.
+ * Else the oldest filled buffer, whose data is dropped. Returns -1 if the
+ * stream is stopped meanwhile. Called with the lock held.
+ */
+static int stream_next_buffer(struct spm_stream *stream)
+{
+	struct spm_buffer *buf;
+	struct timespec deadline;
+	bool timed_out = false;
+	uint32_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += stream->timeout_ms / 1000;
+	deadline.tv_nsec += (stream->timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	for (;;) {
+		if (stream->stop)
+			return -1;
+
+		for (i = 0; i < stream->num_buffers; i++)
+			if (stream->buffers[i].state == SPM_BUFFER_FREE)
+				return i;
+
+		if (timed_out && stream->num_queued) {
+			i = stream->queue[stream->queue_head];
+			stream->queue_head = (stream->queue_head + 1) %
+					     stream->num_buffers;
+			stream->num_queued--;
+			buf = &stream->buffers[i];
+			stream->stats.BuffersDropped++;
+			stream->stats.BytesDropped += buf->size_copied;
+			return i;
+		}
+
+		if (timed_out)
+			pthread_cond_wait(&stream->cond, &stream->lock);
+		else if (pthread_cond_timedwait(&stream->cond, &stream->lock,
+						&deadline) == ETIMEDOUT)
+			timed_out = true;
+	}
+}
+
+static void *spm_drain_thread(void *arg)
+{
+	struct spm_stream *stream = arg;
+	HSAuint32 timeout, size_copied;
+	HSAKMT_STATUS ret;
+	bool data_loss;
+	int cur = -1, next;
+
+	pthread_mutex_lock(&stream->lock);
+	for (;;) {
+		next = stream_next_buffer(stream);
+		if (next < 0)
+			break;
+		stream->buffers[next].state = SPM_BUFFER_KERNEL;
+		pthread_mutex_unlock(&stream->lock);
+
+		/* Hands the next buffer to the kernel once the current one is
+		 * full or the timeout expires, and reports what the current
+		 * one got.
+		 */
+		timeout = stream->timeout_ms;
+		size_copied = 0;
+		data_loss = false;
+		ret = hsaKmtSPMSetDestBuffer(stream->node_id, stream->buf_size,
+					     &timeout, &size_copied,
+					     stream->buffers[next].addr, &data_loss);
+
+		pthread_mutex_lock(&stream->lock);
+		if (ret != HSAKMT_STATUS_SUCCESS) {
+			/* The ioctl result is passed through, so report a
+			 * failure as a plain error
+			 */
+			pr_err("[%s] SPM destination buffer failed: %d\n",
+			       __func__, ret);
+			stream_set_error(stream, HSAKMT_STATUS_ERROR);
+			stream->buffers[next].state = SPM_BUFFER_FREE;
+			break;
+		}
+		if (cur >= 0)
+			stream_queue_buffer(stream, cur, size_copied, data_loss);
+		cur = next;
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	/* Stop copying and collect what the last buffer got */
+	if (cur >= 0) {
+		timeout = 0;
+		size_copied = 0;
+		data_loss = false;
+		ret = hsaKmtSPMSetDestBuffer(stream->node_id, 0, &timeout,
+					     &size_copied, NULL, &data_loss);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			size_copied = 0;
+	}
+
+	pthread_mutex_lock(&stream->lock);
+	if (cur >= 0)
+		stream_queue_buffer(stream, cur, size_copied, data_loss);
+	stream->drain_done = true;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+
+	return NULL;
+}
+
+static HSAKMT_STATUS stream_write_fd(int fd, const uint8_t *data, uint32_t size)
+{
+	ssize_t n;
+
+	while (size) {
+		n = write(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("[%s] SPM stream write failed: %s\n", __func__,
+			       strerror(errno));
+			return HSAKMT_STATUS_ERROR;
+		}
+		data += n;
+		size -= n;
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+static void *spm_consumer_thread(void *arg)
+{
+	struct spm_stream *stream = arg;
+	struct spm_buffer *buf;
+	HSAKMT_STATUS ret;
+	bool sink_failed = false;
+	uint32_t idx;
+
+	pthread_mutex_lock(&stream->lock);
+	for (;;) {
+		while (!stream->num_queued && !stream->drain_done)
+			pthread_cond_wait(&stream->cond, &stream->lock);
+		if (!stream->num_queued)
+			break;
+
+		idx = stream->queue[stream->queue_head];
+		stream->queue_head = (stream->queue_head + 1) % stream->num_buffers;
+		stream->num_queued--;
+		buf = &stream->buffers[idx];
+		buf->state = SPM_BUFFER_CONSUMED;
+		pthread_mutex_unlock(&stream->lock);
+
+		ret = HSAKMT_STATUS_SUCCESS;
+		if (sink_failed)
+			ret = HSAKMT_STATUS_ERROR;
+		else if (stream->sink.Callback)
+			stream->sink.Callback(stream->sink.UserData, buf->addr,
+					      buf->size_copied, buf->data_loss);
+		else
+			ret = stream_write_fd(stream->sink.Fd, buf->addr,
+					      buf->size_copied);
+
+		pthread_mutex_lock(&stream->lock);
+		if (ret == HSAKMT_STATUS_SUCCESS) {
+			stream->stats.BuffersDelivered++;
+			stream->stats.BytesDelivered += buf->size_copied;
+		} else {
+			/* A failed sink stays failed, its data is dropped */
+			if (!sink_failed)
+				stream_set_error(stream, ret);
+			sink_failed = true;
+			stream->stats.BuffersDropped++;
+			stream->stats.BytesDropped += buf->size_copied;
+		}
+		buf->state = SPM_BUFFER_FREE;
+		pthread_cond_broadcast(&stream->cond);
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	return NULL;
+}
+
+static void free_stream(struct spm_stream *stream)
+{
+	uint32_t i;
+
+	for (i = 0; i < stream->num_buffers; i++)
+		free(stream->buffers[i].addr);
+	pthread_cond_destroy(&stream->cond);
+	pthread_mutex_destroy(&stream->lock);
+	stream->magic4cc = 0;
+	free(stream);
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtSPMStartStream(HSAuint32 PreferredNode,
+					     HSAuint32 NumBuffers,
+					     HSAuint32 BufferSizeBytes,
+					     HSAuint32 TimeoutMs,
+					     const HsaSpmStreamSink *Sink,
+					     HSASpmStreamId *StreamId)
+{
+	struct spm_stream *stream;
+	pthread_condattr_t cond_attr;
+	HSAKMT_STATUS ret;
+	uint32_t gpu_id, i;
+
+	CHECK_KFD_OPEN();
+
+	if (NumBuffers < 2 || NumBuffers > 1024 || !BufferSizeBytes ||
+	    !TimeoutMs || !Sink || (!Sink->Callback && Sink->Fd < 0) ||
+	    !StreamId)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	ret = validate_nodeid(PreferredNode, &gpu_id);
+	if (ret != HSAKMT_STATUS_SUCCESS) {
+		pr_err("[%s] invalid node ID: %d\n", __func__, PreferredNode);
+		return ret;
+	}
+
+	stream = calloc(1, sizeof(*stream) +
+			   NumBuffers * (sizeof(struct spm_buffer) + sizeof(uint32_t)));
+	if (!stream)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	stream->magic4cc = HSA_SPM_STREAM_MAGIC4CC;
+	stream->node_id = PreferredNode;
+	stream->buf_size = BufferSizeBytes;
+	stream->timeout_ms = TimeoutMs;
+	stream->sink = *Sink;
+	stream->num_buffers = NumBuffers;
+	stream->queue = (uint32_t *)&stream->buffers[NumBuffers];
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&stream->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	/* The kernel copies SPM data to user addresses, so the buffers are
+	 * plain page-aligned host memory.
+	 */
+	for (i = 0; i < NumBuffers; i++) {
+		if (posix_memalign(&stream->buffers[i].addr, PAGE_SIZE,
+				   BufferSizeBytes)) {
+			ret = HSAKMT_STATUS_NO_MEMORY;
+			goto err_free;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stream->start_time);
+
+	if (pthread_create(&stream->consumer_thread, NULL, spm_consumer_thread,
+			   stream)) {
+		ret = HSAKMT_STATUS_ERROR;
+		goto err_free;
+	}
+	if (pthread_create(&stream->drain_thread, NULL, spm_drain_thread,
+			   stream)) {
+		ret = HSAKMT_STATUS_ERROR;
+		goto err_consumer;
+	}
+
+	*StreamId = PORT_VPTR_TO_UINT64(stream);
+	return HSAKMT_STATUS_SUCCESS;
+
+err_consumer:
+	pthread_mutex_lock(&stream->lock);
+	stream->drain_done = true;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+	pthread_join(stream->consumer_thread, NULL);
+err_free:
+	free_stream(stream);
+	return ret;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtSPMGetStreamStats(HSASpmStreamId StreamId,
+						HsaSpmStreamStats *Stats)
+{
+	struct spm_stream *stream =
+			(struct spm_stream *)PORT_UINT64_TO_VPTR(StreamId);
+	struct timespec now;
+	uint64_t elapsed_ns;
+
+	if (!StreamId || !Stats)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (stream->magic4cc != HSA_SPM_STREAM_MAGIC4CC)
+		return HSAKMT_STATUS_INVALID_HANDLE;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ns = (now.tv_sec - stream->start_time.tv_sec) * 1000000000ULL +
+		     now.tv_nsec - stream->start_time.tv_nsec;
+
+	pthread_mutex_lock(&stream->lock);
+	*Stats = stream->stats;
+	pthread_mutex_unlock(&stream->lock);
+
+	Stats->ElapsedNs = elapsed_ns;
+	Stats->BytesPerSecond = elapsed_ns ?
+		(uint64_t)((double)Stats->BytesDelivered * 1e9 / elapsed_ns) : 0;
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtSPMStopStream(HSASpmStreamId StreamId)
+{
+	struct spm_stream *stream =
+			(struct spm_stream *)PORT_UINT64_TO_VPTR(StreamId);
+	HSAKMT_STATUS ret;
+
+	if (!StreamId)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (stream->magic4cc != HSA_SPM_STREAM_MAGIC4CC)
+		return HSAKMT_STATUS_INVALID_HANDLE;
+
+	/* The drain thread notices once its current wait times out */
+	pthread_mutex_lock(&stream->lock);
+	stream->stop = true;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+
+	pthread_join(stream->drain_thread, NULL);
+	pthread_join(stream->consumer_thread, NULL);
+
+	ret = stream->status;
+	free_stream(stream);
+
+	return ret;
+}
@@ -0,0 +1,434 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "libhsakmt.h"
+#include "pmc_table.h"
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* SPM samples are fixed-size records in the order the counters were muxed
+ * by whoever programmed SPM, so the decoder is given that layout and turns
+ * the records into columns: one array of timestamps and one per counter.
+ *
+ * Columns compress well as deltas between consecutive samples. A chunk
+ * stores each column as zigzag-encoded deltas in LEB128 varints, after a
+ * header and a table of column offsets:
+ *
+ *	struct spm_chunk_header
+ *	uint32_t column_end[num_counters + 1]	end of each column in the payload
+ *	timestamp column, then one column per counter
+ *
+ * The header and the table are stored little endian, whatever the host's
+ * byte order. A file is a sequence of chunks.
+ */
+
+#define HSA_SPM_DECODER_MAGIC4CC	0x43445053	/* "SPDC" */
+
+#define SPM_CHUNK_MAGIC		0x43505348	/* "HSPC" */
+#define SPM_CHUNK_VERSION	1
+
+/* A 64-bit value takes up to 10 varint bytes */
+#define VARINT_MAX_BYTES	10
+
+struct spm_chunk_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t num_counters;
+	uint32_t num_samples;
+	uint64_t payload_size;	/* Column offsets and columns */
+	uint64_t checksum;	/* FNV-1a of the payload */
+};
+
+struct spm_counter {
+	uint32_t offset;
+	uint32_t size;		/* In bytes, 2 or 4 */
+};
+
+struct spm_decoder {
+	uint32_t magic4cc;
+	uint32_t sample_size;
+	uint32_t timestamp_offset;
+	uint32_t num_counters;
+	struct spm_counter counters[];
+};
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtSPMCreateDecoder(HSAuint32 NodeId,
+					       const HsaSpmSampleLayout *Layout,
+					       HSASpmDecoderId *DecoderId)
+{
+	struct spm_decoder *decoder;
+	const HsaSpmCounterLayout *c;
+	uint32_t gpu_id, i;
+
+	if (!Layout || !DecoderId || !Layout->NumCounters || !Layout->Counters ||
+	    Layout->SampleSizeBytes < sizeof(uint64_t) ||
+	    Layout->TimestampOffset > Layout->SampleSizeBytes - sizeof(uint64_t))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (validate_nodeid(NodeId, &gpu_id) != HSAKMT_STATUS_SUCCESS)
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+
+	for (i = 0; i < Layout->NumCounters; i++) {
+		c = &Layout->Counters[i];
+		if ((c->SizeInBits != 16 && c->SizeInBits != 32) ||
+		    c->Offset > Layout->SampleSizeBytes - c->SizeInBits / 8) {
+			pr_err("[%s] counter %u doesn't fit in a sample\n",
+			       __func__, i);
+			return HSAKMT_STATUS_INVALID_PARAMETER;
+		}
+		if (c->BlockIndex >= PERFCOUNTER_BLOCKID__MAX ||
+		    !pmc_table_counter_valid(NodeId, c->BlockIndex, c->CounterId)) {
+			pr_err("[%s] no counter %lu in block %u on node %u\n",
+			       __func__, c->CounterId, c->BlockIndex, NodeId);
+			return HSAKMT_STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	decoder = calloc(1, sizeof(*decoder) +
+			    sizeof(struct spm_counter) * Layout->NumCounters);
+	if (!decoder)
+		return HSAKMT_STATUS_NO_MEMORY;
+
+	decoder->magic4cc = HSA_SPM_DECODER_MAGIC4CC;
+	decoder->sample_size = Layout->SampleSizeBytes;
+	decoder->timestamp_offset = Layout->TimestampOffset;
+	decoder->num_counters = Layout->NumCounters;
+	for (i = 0; i < Layout->NumCounters; i++) {
+		decoder->counters[i].offset = Layout->Counters[i].Offset;
+		decoder->counters[i].size = Layout->Counters[i].SizeInBits / 8;
+	}
+
+	*DecoderId = PORT_VPTR_TO_UINT64(decoder);
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtSPMDestroyDecoder(HSASpmDecoderId DecoderId)
+{
+	struct spm_decoder *decoder =
+			(struct spm_decoder *)PORT_UINT64_TO_VPTR(DecoderId);
+
+	if (!DecoderId)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (decoder->magic4cc != HSA_SPM_DECODER_MAGIC4CC)
+		return HSAKMT_STATUS_INVALID_HANDLE;
+
+	decoder->magic4cc = 0;
+	free(decoder);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Decodes whole samples into columns. A trailing partial sample is left
+ * for the caller to prepend to the next buffer.
+ */
+HSAKMT_STATUS HSAKMTAPI hsaKmtSPMDecode(HSASpmDecoderId DecoderId,
+					const void *Data,
+					HSAuint32 SizeBytes,
+					HSAuint32 MaxSamples,
+					HSAuint64 *Timestamps,
+					HSAuint64 *Values,
+					HSAuint32 *NumSamples,
+					HSAuint32 *SizeConsumed)
+{
+	struct spm_decoder *decoder =
+			(struct spm_decoder *)PORT_UINT64_TO_VPTR(DecoderId);
+	const uint8_t *data = Data;
+	uint32_t num, c, s, stride;
+	uint64_t *column;
+	uint16_t v16;
+	uint32_t v32;
+
+	if (!DecoderId || (SizeBytes && !Data) || !NumSamples ||
+	    (MaxSamples && (!Timestamps || !Values)))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (decoder->magic4cc != HSA_SPM_DECODER_MAGIC4CC)
+		return HSAKMT_STATUS_INVALID_HANDLE;
+
+	stride = decoder->sample_size;
+	num = MIN(SizeBytes / stride, MaxSamples);
+
+	for (s = 0; s < num; s++)
+		memcpy(&Timestamps[s], data + s * stride + decoder->timestamp_offset,
+		       sizeof(uint64_t));
+
+	/* One column at a time, so each loop is a strided gather at a fixed
+	 * offset
+	 */
+	for (c = 0; c < decoder->num_counters; c++) {
+		const uint8_t *src = data + decoder->counters[c].offset;
+
+		column = &Values[(uint64_t)c * MaxSamples];
+		if (decoder->counters[c].size == sizeof(uint16_t)) {
+			for (s = 0; s < num; s++) {
+				memcpy(&v16, src + s * stride, sizeof(v16));
+				column[s] = v16;
+			}
+		} else {
+			for (s = 0; s < num; s++) {
+				memcpy(&v32, src + s * stride, sizeof(v32));
+				column[s] = v32;
+			}
+		}
+	}
+
+	*NumSamples = num;
+	if (SizeConsumed)
+		*SizeConsumed = num * stride;
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+
+	return p;
+}
+
+static uint8_t *put_column(uint8_t *p, const uint64_t *values, uint32_t num)
+{
+	uint64_t prev = 0;
+	int64_t delta;
+	uint32_t i;
+
+	for (i = 0; i < num; i++) {
+		delta = (int64_t)(values[i] - prev);
+		p = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+		prev = values[i];
+	}
+
+	return p;
+}
+
+static uint64_t spm_chunk_max_size(uint32_t num_counters, uint32_t num_samples)
+{
+	return sizeof(struct spm_chunk_header) +
+	       sizeof(uint32_t) * (num_counters + 1ULL) +
+	       VARINT_MAX_BYTES * (num_counters + 1ULL) * num_samples;
+}
+
+/* Encodes a chunk of columns, Values[c * ColumnStride + s]. The chunk
+ * buffer must hold the largest size the chunk can take, which is returned
+ * if there is no buffer.
+ */
+HSAKMT_STATUS HSAKMTAPI hsaKmtSPMEncodeChunk(HSAuint32 NumCounters,
+					     HSAuint32 NumSamples,
+					     const HSAuint64 *Timestamps,
+					     const HSAuint64 *Values,
+					     HSAuint32 ColumnStride,
+					     void *Chunk,
+					     HSAuint64 *ChunkSize)
+{
+	struct spm_chunk_header header;
+	uint8_t *table, *payload, *p;
+	uint64_t max_size, payload_size;
+	uint32_t c, end;
+
+	if (!NumCounters || !ChunkSize || (NumSamples && (!Timestamps || !Values)))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+	if (!ColumnStride)
+		ColumnStride = NumSamples;
+	if (ColumnStride < NumSamples)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	max_size = spm_chunk_max_size(NumCounters, NumSamples);
+	if (!Chunk) {
+		*ChunkSize = max_size;
+		return HSAKMT_STATUS_SUCCESS;
+	}
+	if (*ChunkSize < max_size)
+		return HSAKMT_STATUS_BUFFER_TOO_SMALL;
+
+	table = (uint8_t *)Chunk + sizeof(header);
+	payload = table + sizeof(uint32_t) * (NumCounters + 1ULL);
+	p = payload;
+
+	for (c = 0; c <= NumCounters; c++) {
+		const uint64_t *column = c ? &Values[(uint64_t)(c - 1) * ColumnStride]
+					   : Timestamps;
+
+		p = put_column(p, column, NumSamples);
+		if (p - payload > UINT32_MAX)
+			return HSAKMT_STATUS_INVALID_PARAMETER;
+		end = htole32(p - payload);
+		memcpy(table + sizeof(uint32_t) * c, &end, sizeof(end));
+	}
+
+	payload_size = p - table;
+	header.magic = htole32(SPM_CHUNK_MAGIC);
+	header.version = htole16(SPM_CHUNK_VERSION);
+	header.header_size = htole16(sizeof(header));
+	header.num_counters = htole32(NumCounters);
+	header.num_samples = htole32(NumSamples);
+	header.payload_size = htole64(payload_size);
+	header.checksum = htole64(fnv1a(FNV1A_OFFSET, table, payload_size));
+	memcpy(Chunk, &header, sizeof(header));
+
+	*ChunkSize = sizeof(header) + payload_size;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Decodes one column of num varints and undoes the zigzag deltas. Returns
+ * false if the column is malformed.
+ */
+static bool get_column(const uint8_t *p, const uint8_t *end, uint64_t *values,
+		       uint32_t num)
+{
+	uint64_t prev = 0, v;
+	uint32_t i = 0, shift, n;
+	uint64_t word;
+
+	while (i < num) {
+		/* Runs of small deltas are one byte each, recognize them
+		 * several bytes at a time
+		 */
+#if defined(__SSE2__)
+		if (num - i >= 16 && end - p >= 16 &&
+		    !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)))
+			n = 16;
+		else
+#endif
+		if (num - i >= 8 && end - p >= 8) {
+			memcpy(&word, p, sizeof(word));
+			n = (word & 0x8080808080808080ULL) ? 0 : 8;
+		} else {
+			n = 0;
+		}
+
+		if (n) {
+			for (; n; n--, i++) {
+				v = *p++;
+				prev += (v >> 1) ^ -(v & 1);
+				values[i] = prev;
+			}
+			continue;
+		}
+
+		v = 0;
+		for (shift = 0; ; shift += 7) {
+			if (p == end || shift >= 64)
+				return false;
+			v |= (uint64_t)(*p & 0x7f) << shift;
+			if (!(*p++ & 0x80))
+				break;
+		}
+		prev += (v >> 1) ^ -(v & 1);
+		values[i++] = prev;
+	}
+
+	return p == end;
+}
+
+/* Decodes a chunk into Values[c * MaxSamples + s]. Without output arrays,
+ * only the chunk's counters, samples and size are returned.
+ */
+HSAKMT_STATUS HSAKMTAPI hsaKmtSPMDecodeChunk(const void *Chunk,
+					     HSAuint64 SizeBytes,
+					     HSAuint32 MaxSamples,
+					     HSAuint64 *Timestamps,
+					     HSAuint64 *Values,
+					     HSAuint32 *NumCounters,
+					     HSAuint32 *NumSamples,
+					     HSAuint64 *ChunkSize)
+{
+	struct spm_chunk_header header;
+	const uint8_t *table, *payload;
+	uint32_t c, begin, end;
+	uint64_t table_size;
+	uint32_t *ends;
+
+	if (!Chunk || !NumCounters || !NumSamples || !!Timestamps != !!Values)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	if (SizeBytes < sizeof(header))
+		return HSAKMT_STATUS_BUFFER_TOO_SMALL;
+	memcpy(&header, Chunk, sizeof(header));
+	header.magic = le32toh(header.magic);
+	header.version = le16toh(header.version);
+	header.header_size = le16toh(header.header_size);
+	header.num_counters = le32toh(header.num_counters);
+	header.num_samples = le32toh(header.num_samples);
+	header.payload_size = le64toh(header.payload_size);
+	header.checksum = le64toh(header.checksum);
+	if (header.magic != SPM_CHUNK_MAGIC ||
+	    header.version != SPM_CHUNK_VERSION ||
+	    header.header_size != sizeof(header) || !header.num_counters)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	*NumCounters = header.num_counters;
+	*NumSamples = header.num_samples;
+	if (ChunkSize)
+		*ChunkSize = sizeof(header) + header.payload_size;
+
+	if (!Timestamps)
+		return HSAKMT_STATUS_SUCCESS;
+	if (MaxSamples < header.num_samples ||
+	    SizeBytes - sizeof(header) < header.payload_size)
+		return HSAKMT_STATUS_BUFFER_TOO_SMALL;
+
+	table_size = sizeof(uint32_t) * (header.num_counters + 1ULL);
+	table = (const uint8_t *)Chunk + sizeof(header);
+	payload = table + table_size;
+	if (header.payload_size < table_size ||
+	    fnv1a(FNV1A_OFFSET, table, header.payload_size) != header.checksum) {
+		pr_err("[%s] corrupted SPM chunk\n", __func__);
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+	}
+
+	/* The chunk may not be aligned in the caller's buffer */
+	ends = malloc(table_size);
+	if (!ends)
+		return HSAKMT_STATUS_NO_MEMORY;
+	memcpy(ends, table, table_size);
+
+	for (c = 0, begin = 0; c <= header.num_counters; c++, begin = end) {
+		uint64_t *column = c ? &Values[(uint64_t)(c - 1) * MaxSamples]
+				     : Timestamps;
+
+		end = le32toh(ends[c]);
+		if (end < begin || end > header.payload_size - table_size ||
+		    !get_column(payload + begin, payload + end, column,
+				header.num_samples)) {
+			pr_err("[%s] corrupted SPM chunk column %u\n", __func__, c);
+			free(ends);
+			return HSAKMT_STATUS_INVALID_PARAMETER;
+		}
+	}
+	free(ends);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
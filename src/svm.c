@@ -36,35 +36,20 @@
 
 /* Helper functions for calling KFD SVM ioctl */
 
-HSAKMT_STATUS HSAKMTAPI
-hsaKmtSVMSetAttr(void *start_addr, HSAuint64 size, unsigned int nattr,
-		 HSA_SVM_ATTRIBUTE *attrs)
+/* Translates the node IDs of location and access attributes to GPU IDs,
+ * through the gpu_ids table of num_nodes nodes if there is one, else by
+ * validating each node.
+ */
+static HSAKMT_STATUS svm_translate_set_attrs(const HSA_SVM_ATTRIBUTE *attrs,
+					     unsigned int nattr,
+					     struct kfd_ioctl_svm_attribute *out,
+					     const uint32_t *gpu_ids,
+					     uint32_t num_nodes)
 {
-	struct kfd_ioctl_svm_args *args;
-	HSAuint64 s_attr;
 	HSAKMT_STATUS r;
 	HSAuint32 i;
 
-	CHECK_KFD_OPEN();
-	CHECK_KFD_MINOR_VERSION(5);
-
-	pr_debug("%s: address 0x%p size 0x%lx\n", __func__, start_addr, size);
-
-	if (!start_addr || !size)
-		return HSAKMT_STATUS_INVALID_PARAMETER;
-	if ((uint64_t)start_addr & (PAGE_SIZE - 1))
-		return HSAKMT_STATUS_INVALID_PARAMETER;
-	if (size & (PAGE_SIZE - 1))
-		return HSAKMT_STATUS_INVALID_PARAMETER;
-
-	s_attr = sizeof(*attrs) * nattr;
-	args = alloca(sizeof(*args) + s_attr);
-
-	args->start_addr = (uint64_t)start_addr;
-	args->size = size;
-	args->op = KFD_IOCTL_SVM_OP_SET_ATTR;
-	args->nattr = nattr;
-	memcpy(args->attrs, attrs, s_attr);
+	memcpy(out, attrs, sizeof(*attrs) * nattr);
 
 	for (i = 0; i < nattr; i++) {
 		if (attrs[i].type != KFD_IOCTL_SVM_ATTR_PREFERRED_LOC &&
@@ -76,15 +61,22 @@ hsaKmtSVMSetAttr(void *start_addr, HSAuint64 size, unsigned int nattr,
 
 		if (attrs[i].type == KFD_IOCTL_SVM_ATTR_PREFERRED_LOC &&
 		    attrs[i].value == INVALID_NODEID) {
-			args->attrs[i].value = KFD_IOCTL_SVM_LOCATION_UNDEFINED;
+			out[i].value = KFD_IOCTL_SVM_LOCATION_UNDEFINED;
 			continue;
 		}
 
-		r = validate_nodeid(attrs[i].value, &args->attrs[i].value);
+		if (!gpu_ids)
+			r = validate_nodeid(attrs[i].value, &out[i].value);
+		else if (attrs[i].value < num_nodes) {
+			out[i].value = gpu_ids[attrs[i].value];
+			r = HSAKMT_STATUS_SUCCESS;
+		} else
+			r = HSAKMT_STATUS_INVALID_NODE_UNIT;
+
 		if (r != HSAKMT_STATUS_SUCCESS) {
 			pr_debug("invalid node ID: %d\n", attrs[i].value);
 			return r;
-		} else if (!args->attrs[i].value &&
+		} else if (!out[i].value &&
 			   (attrs[i].type == KFD_IOCTL_SVM_ATTR_ACCESS ||
 			    attrs[i].type == KFD_IOCTL_SVM_ATTR_ACCESS_IN_PLACE ||
 			    attrs[i].type == KFD_IOCTL_SVM_ATTR_NO_ACCESS)) {
@@ -93,9 +85,23 @@ hsaKmtSVMSetAttr(void *start_addr, HSAuint64 size, unsigned int nattr,
 		}
 	}
 
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+/* Sets the translated attributes in args->attrs on a range */
+static HSAKMT_STATUS svm_set_attr_ioctl(struct kfd_ioctl_svm_args *args,
+					uint64_t start_addr, uint64_t size,
+					unsigned int nattr)
+{
+	HSAuint64 s_attr = sizeof(args->attrs[0]) * nattr;
+
+	args->start_addr = start_addr;
+	args->size = size;
+	args->op = KFD_IOCTL_SVM_OP_SET_ATTR;
+	args->nattr = nattr;
+
 	/* Driver does one copy_from_user, with extra attrs size */
-	r = kmtIoctl(kfd_fd, AMDKFD_IOC_SVM + (s_attr << _IOC_SIZESHIFT), args);
-	if (r) {
+	if (kmtIoctl(kfd_fd, AMDKFD_IOC_SVM + (s_attr << _IOC_SIZESHIFT), args)) {
 		pr_debug("op set range attrs failed %s\n", strerror(errno));
 		return HSAKMT_STATUS_ERROR;
 	}
@@ -103,6 +109,188 @@ hsaKmtSVMSetAttr(void *start_addr, HSAuint64 size, unsigned int nattr,
 	return HSAKMT_STATUS_SUCCESS;
 }
 
+HSAKMT_STATUS HSAKMTAPI
+hsaKmtSVMSetAttr(void *start_addr, HSAuint64 size, unsigned int nattr,
+		 HSA_SVM_ATTRIBUTE *attrs)
+{
+	struct kfd_ioctl_svm_args *args;
+	HSAKMT_STATUS r;
+
+	CHECK_KFD_OPEN();
+	CHECK_KFD_MINOR_VERSION(5);
+
+	pr_debug("%s: address 0x%p size 0x%lx\n", __func__, start_addr, size);
+
+	if (!start_addr || !size)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+	if ((uint64_t)start_addr & (PAGE_SIZE - 1))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+	if (size & (PAGE_SIZE - 1))
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	args = alloca(sizeof(*args) + sizeof(*attrs) * nattr);
+
+	r = svm_translate_set_attrs(attrs, nattr, args->attrs, NULL, 0);
+	if (r != HSAKMT_STATUS_SUCCESS)
+		return r;
+
+	return svm_set_attr_ioctl(args, (uint64_t)start_addr, size, nattr);
+}
+
+struct svm_batch_range {
+	uint64_t start;
+	uint64_t size;
+	uint32_t nattr;
+	uint32_t index;		/* In the caller's array */
+	struct kfd_ioctl_svm_attribute *attrs;	/* Translated */
+};
+
+static int svm_range_cmp_start(const void *a, const void *b)
+{
+	const struct svm_batch_range *r1 = a, *r2 = b;
+
+	if (r1->start != r2->start)
+		return r1->start < r2->start ? -1 : 1;
+	return r1->index < r2->index ? -1 : (r1->index > r2->index);
+}
+
+static int svm_range_cmp_index(const void *a, const void *b)
+{
+	const struct svm_batch_range *r1 = a, *r2 = b;
+
+	return r1->index < r2->index ? -1 : (r1->index > r2->index);
+}
+
+/* Groups ranges with the same attributes, by address within a group */
+static int svm_range_cmp_attrs(const void *a, const void *b)
+{
+	const struct svm_batch_range *r1 = a, *r2 = b;
+	int cmp;
+
+	if (r1->nattr != r2->nattr)
+		return r1->nattr < r2->nattr ? -1 : 1;
+	cmp = memcmp(r1->attrs, r2->attrs, sizeof(*r1->attrs) * r1->nattr);
+	if (cmp)
+		return cmp;
+	return svm_range_cmp_start(a, b);
+}
+
+static bool svm_range_mergeable(const struct svm_batch_range *r1,
+				const struct svm_batch_range *r2)
+{
+	return r1->start + r1->size == r2->start && r1->nattr == r2->nattr &&
+	       !memcmp(r1->attrs, r2->attrs, sizeof(*r1->attrs) * r1->nattr);
+}
+
+HSAKMT_STATUS HSAKMTAPI
+hsaKmtSVMSetAttrBatch(HSAuint32 NumRanges,
+		      const HsaSVMRangeAttributes *Ranges,
+		      HSAuint32 *FailedRange)
+{
+	struct kfd_ioctl_svm_args *args = NULL;
+	struct kfd_ioctl_svm_attribute *attrs;
+	struct svm_batch_range *ranges, *r;
+	uint32_t *gpu_ids, num_nodes, i, j, max_nattr = 0, num_ioctls = 0;
+	uint64_t total_attrs = 0, end, size;
+	bool overlap = false;
+	HSAKMT_STATUS ret;
+
+	CHECK_KFD_OPEN();
+	CHECK_KFD_MINOR_VERSION(5);
+
+	pr_debug("%s: %u ranges\n", __func__, NumRanges);
+
+	if (!NumRanges || !Ranges)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	for (i = 0; i < NumRanges; i++) {
+		if (!Ranges[i].StartAddress || !Ranges[i].SizeInBytes ||
+		    ((uint64_t)Ranges[i].StartAddress & (PAGE_SIZE - 1)) ||
+		    (Ranges[i].SizeInBytes & (PAGE_SIZE - 1)) ||
+		    (Ranges[i].NumAttributes && !Ranges[i].Attributes)) {
+			if (FailedRange)
+				*FailedRange = i;
+			return HSAKMT_STATUS_INVALID_PARAMETER;
+		}
+		total_attrs += Ranges[i].NumAttributes;
+		max_nattr = MAX(max_nattr, Ranges[i].NumAttributes);
+	}
+
+	ret = get_node_gpu_ids(&gpu_ids, &num_nodes);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
+	ranges = malloc(sizeof(*ranges) * NumRanges + sizeof(*attrs) * total_attrs);
+	if (!ranges) {
+		ret = HSAKMT_STATUS_NO_MEMORY;
+		goto out;
+	}
+
+	/* Translate every node ID once, up front, through the table */
+	attrs = (struct kfd_ioctl_svm_attribute *)&ranges[NumRanges];
+	for (i = 0; i < NumRanges; i++) {
+		r = &ranges[i];
+		r->start = (uint64_t)Ranges[i].StartAddress;
+		r->size = Ranges[i].SizeInBytes;
+		r->nattr = Ranges[i].NumAttributes;
+		r->index = i;
+		r->attrs = attrs;
+		attrs += r->nattr;
+
+		ret = svm_translate_set_attrs(Ranges[i].Attributes, r->nattr,
+					      r->attrs, gpu_ids, num_nodes);
+		if (ret != HSAKMT_STATUS_SUCCESS) {
+			if (FailedRange)
+				*FailedRange = i;
+			goto out;
+		}
+	}
+
+	/* Disjoint ranges can be set in any order, so ranges with the same
+	 * attributes are grouped to merge all the adjacent ones. If ranges
+	 * overlap, later ones must win, so only ranges that follow each
+	 * other in the caller's order are merged.
+	 */
+	qsort(ranges, NumRanges, sizeof(*ranges), svm_range_cmp_start);
+	for (i = 1; i < NumRanges && !overlap; i++)
+		overlap = ranges[i].start < ranges[i - 1].start + ranges[i - 1].size;
+	qsort(ranges, NumRanges, sizeof(*ranges),
+	      overlap ? svm_range_cmp_index : svm_range_cmp_attrs);
+
+	args = malloc(sizeof(*args) + sizeof(*attrs) * max_nattr);
+	if (!args) {
+		ret = HSAKMT_STATUS_NO_MEMORY;
+		goto out;
+	}
+
+	for (i = 0; i < NumRanges; i = j) {
+		end = ranges[i].start + ranges[i].size;
+		for (j = i + 1; j < NumRanges &&
+		     svm_range_mergeable(&ranges[j - 1], &ranges[j]); j++)
+			end = ranges[j].start + ranges[j].size;
+		size = end - ranges[i].start;
+
+		memcpy(args->attrs, ranges[i].attrs,
+		       sizeof(*attrs) * ranges[i].nattr);
+		ret = svm_set_attr_ioctl(args, ranges[i].start, size,
+					 ranges[i].nattr);
+		if (ret != HSAKMT_STATUS_SUCCESS) {
+			if (FailedRange)
+				*FailedRange = ranges[i].index;
+			goto out;
+		}
+		num_ioctls++;
+	}
+	pr_debug("%s: %u ranges set with %u ioctls\n", __func__, NumRanges,
+		 num_ioctls);
+
+out:
+	free(args);
+	free(ranges);
+	free(gpu_ids);
+	return ret;
+}
+
 HSAKMT_STATUS HSAKMTAPI
 hsaKmtSVMGetAttr(void *start_addr, HSAuint64 size, unsigned int nattr,
 		 HSA_SVM_ATTRIBUTE *attrs)
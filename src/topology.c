@@ -34,6 +34,13 @@
 #include <ctype.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <xf86drm.h>
 #include <amdgpu.h>
@@ -42,6 +49,10 @@
 #include "libhsakmt.h"
 #include "fmm.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
 /* Number of memory banks added by thunk on top of topology
  * This only includes static heaps like LDS, scratch and SVM,
  * not for MMIO_REMAP heap. MMIO_REMAP memory bank is reported
@@ -61,6 +72,12 @@ typedef struct {
 	HsaMemoryProperties *mem;     /* node->NumBanks elements */
 	HsaCacheProperties *cache;
 	HsaIoLinkProperties *link;
+	uint32_t num_direct_links;    /* link[] entries read from io_links */
+	/* State to reuse the node in the next snapshot, see topology_reuse_node */
+	uint32_t num_sysfs_links;     /* link[] entries read from sysfs */
+	uint32_t sysfs_node_id;
+	bool p2p_links;               /* the node reports p2p_links */
+	uint64_t hash;                /* of the node's sysfs files, 0 if unknown */
 } node_props_t;
 
 static HsaSystemProperties *g_system;
@@ -90,8 +107,17 @@ static const char *supported_processor_vendor_name[] = {
 static HSAKMT_STATUS topology_take_snapshot(void);
 static HSAKMT_STATUS topology_drop_snapshot(void);
 
+static uint64_t topology_hash_node(uint32_t sysfs_node_id);
+static uint64_t topology_finish_node_hash(uint64_t hash);
+
+struct topology_snapshot;
+static struct topology_snapshot *topology_create_snapshot(void);
+static void topology_replace_snapshot(struct topology_snapshot *snap);
+
+/* Sorted by device ID for find_hsa_gfxip_device. The build checks that the
+ * IDs are strictly ascending, see cmake_modules/check_gfxip_table.cmake.
+ */
 static const struct hsa_gfxip_table gfxip_lookup_table[] = {
-	/* Kaveri Family */
 	{ 0x1304, 7, 0, 0, "Spectre" },
 	{ 0x1305, 7, 0, 0, "Spectre" },
 	{ 0x1306, 7, 0, 0, "Spectre" },
@@ -114,7 +140,28 @@ static const struct hsa_gfxip_table gfxip_lookup_table[] = {
 	{ 0x131B, 7, 0, 0, "Spectre" },
 	{ 0x131C, 7, 0, 0, "Spectre" },
 	{ 0x131D, 7, 0, 0, "Spectre" },
-	/* Hawaii Family */
+	{ 0x13F9, 10, 1, 3, "cyan_skillfish" },
+	{ 0x13FA, 10, 1, 3, "cyan_skillfish" },
+	{ 0x13FB, 10, 1, 3, "cyan_skillfish" },
+	{ 0x13FC, 10, 1, 3, "cyan_skillfish" },
+	{ 0x13FE, 10, 1, 3, "cyan_skillfish" },
+	{ 0x143F, 10, 1, 3, "cyan_skillfish" },
+	{ 0x15D8, 9, 0, 2, "Raven" },
+	{ 0x15DD, 9, 0, 2, "Raven" },
+	{ 0x15E7, 9, 0, 12, "Renoir" },
+	{ 0x1636, 9, 0, 12, "Renoir" },
+	{ 0x1638, 9, 0, 12, "Renoir" },
+	{ 0x163F, 10, 3, 3, "VanGogh" },
+	{ 0x164C, 9, 0, 12, "Renoir" },
+	{ 0x164D, 10, 3, 5, "YELLOW_CARP" },
+	{ 0x1681, 10, 3, 5, "YELLOW_CARP" },
+	{ 0x66A0, 9, 0, 6, "Vega20" },
+	{ 0x66A1, 9, 0, 6, "Vega20" },
+	{ 0x66A2, 9, 0, 6, "Vega20" },
+	{ 0x66A3, 9, 0, 6, "Vega20" },
+	{ 0x66A4, 9, 0, 6, "Vega20" },
+	{ 0x66A7, 9, 0, 6, "Vega20" },
+	{ 0x66AF, 9, 0, 6, "Vega20" },
 	{ 0x67A0, 7, 0, 1, "Hawaii" },
 	{ 0x67A1, 7, 0, 1, "Hawaii" },
 	{ 0x67A2, 7, 0, 1, "Hawaii" },
@@ -127,26 +174,6 @@ static const struct hsa_gfxip_table gfxip_lookup_table[] = {
 	{ 0x67B9, 7, 0, 1, "Hawaii" },
 	{ 0x67BA, 7, 0, 1, "Hawaii" },
 	{ 0x67BE, 7, 0, 1, "Hawaii" },
-	/* Carrizo Family */
-	{ 0x9870, 8, 0, 1, "Carrizo" },
-	{ 0x9874, 8, 0, 1, "Carrizo" },
-	{ 0x9875, 8, 0, 1, "Carrizo" },
-	{ 0x9876, 8, 0, 1, "Carrizo" },
-	{ 0x9877, 8, 0, 1, "Carrizo" },
-	/* Tonga Family */
-	{ 0x6920, 8, 0, 2, "Tonga" },
-	{ 0x6921, 8, 0, 2, "Tonga" },
-	{ 0x6928, 8, 0, 2, "Tonga" },
-	{ 0x6929, 8, 0, 2, "Tonga" },
-	{ 0x692B, 8, 0, 2, "Tonga" },
-	{ 0x692F, 8, 0, 2, "Tonga" },
-	{ 0x6930, 8, 0, 2, "Tonga" },
-	{ 0x6938, 8, 0, 2, "Tonga" },
-	{ 0x6939, 8, 0, 2, "Tonga" },
-	/* Fiji */
-	{ 0x7300, 8, 0, 3, "Fiji" },
-	{ 0x730F, 8, 0, 3, "Fiji" },
-	/* Polaris10 */
 	{ 0x67C0, 8, 0, 3, "Polaris10" },
 	{ 0x67C1, 8, 0, 3, "Polaris10" },
 	{ 0x67C2, 8, 0, 3, "Polaris10" },
@@ -159,8 +186,6 @@ static const struct hsa_gfxip_table gfxip_lookup_table[] = {
 	{ 0x67CF, 8, 0, 3, "Polaris10" },
 	{ 0x67D0, 8, 0, 3, "Polaris10" },
 	{ 0x67DF, 8, 0, 3, "Polaris10" },
-	{ 0x6FDF, 8, 0, 3, "Polaris10" },
-	/* Polaris11 */
 	{ 0x67E0, 8, 0, 3, "Polaris11" },
 	{ 0x67E1, 8, 0, 3, "Polaris11" },
 	{ 0x67E3, 8, 0, 3, "Polaris11" },
@@ -170,20 +195,6 @@ static const struct hsa_gfxip_table gfxip_lookup_table[] = {
 	{ 0x67EB, 8, 0, 3, "Polaris11" },
 	{ 0x67EF, 8, 0, 3, "Polaris11" },
 	{ 0x67FF, 8, 0, 3, "Polaris11" },
-	/* Polaris12 */
-	{ 0x6980, 8, 0, 3, "Polaris12" },
-	{ 0x6981, 8, 0, 3, "Polaris12" },
-	{ 0x6985, 8, 0, 3, "Polaris12" },
-	{ 0x6986, 8, 0, 3, "Polaris12" },
-	{ 0x6987, 8, 0, 3, "Polaris12" },
-	{ 0x6995, 8, 0, 3, "Polaris12" },
-	{ 0x6997, 8, 0, 3, "Polaris12" },
-	{ 0x699F, 8, 0, 3, "Polaris12" },
-	/* VegaM */
-	{ 0x694C, 8, 0, 3, "VegaM" },
-	{ 0x694E, 8, 0, 3, "VegaM" },
-	{ 0x694F, 8, 0, 3, "VegaM" },
-	/* Vega10 */
 	{ 0x6860, 9, 0, 0, "Vega10" },
 	{ 0x6861, 9, 0, 0, "Vega10" },
 	{ 0x6862, 9, 0, 0, "Vega10" },
@@ -198,60 +209,49 @@ static const struct hsa_gfxip_table gfxip_lookup_table[] = {
 	{ 0x686D, 9, 0, 0, "Vega10" },
 	{ 0x686E, 9, 0, 0, "Vega10" },
 	{ 0x687F, 9, 0, 0, "Vega10" },
-	/* Vega12 */
+	{ 0x6920, 8, 0, 2, "Tonga" },
+	{ 0x6921, 8, 0, 2, "Tonga" },
+	{ 0x6928, 8, 0, 2, "Tonga" },
+	{ 0x6929, 8, 0, 2, "Tonga" },
+	{ 0x692B, 8, 0, 2, "Tonga" },
+	{ 0x692F, 8, 0, 2, "Tonga" },
+	{ 0x6930, 8, 0, 2, "Tonga" },
+	{ 0x6938, 8, 0, 2, "Tonga" },
+	{ 0x6939, 8, 0, 2, "Tonga" },
+	{ 0x694C, 8, 0, 3, "VegaM" },
+	{ 0x694E, 8, 0, 3, "VegaM" },
+	{ 0x694F, 8, 0, 3, "VegaM" },
+	{ 0x6980, 8, 0, 3, "Polaris12" },
+	{ 0x6981, 8, 0, 3, "Polaris12" },
+	{ 0x6985, 8, 0, 3, "Polaris12" },
+	{ 0x6986, 8, 0, 3, "Polaris12" },
+	{ 0x6987, 8, 0, 3, "Polaris12" },
+	{ 0x6995, 8, 0, 3, "Polaris12" },
+	{ 0x6997, 8, 0, 3, "Polaris12" },
+	{ 0x699F, 8, 0, 3, "Polaris12" },
 	{ 0x69A0, 9, 0, 4, "Vega12" },
 	{ 0x69A1, 9, 0, 4, "Vega12" },
 	{ 0x69A2, 9, 0, 4, "Vega12" },
 	{ 0x69A3, 9, 0, 4, "Vega12" },
 	{ 0x69Af, 9, 0, 4, "Vega12" },
-	/* Raven */
-	{ 0x15DD, 9, 0, 2, "Raven" },
-	{ 0x15D8, 9, 0, 2, "Raven" },
-	/* Vega20 */
-	{ 0x66A0, 9, 0, 6, "Vega20" },
-	{ 0x66A1, 9, 0, 6, "Vega20" },
-	{ 0x66A2, 9, 0, 6, "Vega20" },
-	{ 0x66A3, 9, 0, 6, "Vega20" },
-	{ 0x66A4, 9, 0, 6, "Vega20" },
-	{ 0x66A7, 9, 0, 6, "Vega20" },
-	{ 0x66AF, 9, 0, 6, "Vega20" },
-	/* Arcturus */
-	{ 0x7388, 9, 0, 8, "Arcturus" },
-	{ 0x738C, 9, 0, 8, "Arcturus" },
-	{ 0x738E, 9, 0, 8, "Arcturus" },
-	{ 0x7390, 9, 0, 8, "Arcturus" },
-	/* Aldebaran */
-	{ 0x7408, 9, 0, 10, "Aldebaran" },
-	{ 0x740C, 9, 0, 10, "Aldebaran" },
-	{ 0x740F, 9, 0, 10, "Aldebaran" },
-	{ 0x7410, 9, 0, 10, "Aldebaran" },
-	/* Renoir */
-	{ 0x15E7, 9, 0, 12, "Renoir" },
-	{ 0x1636, 9, 0, 12, "Renoir" },
-	{ 0x1638, 9, 0, 12, "Renoir" },
-	{ 0x164C, 9, 0, 12, "Renoir" },
-	/* Navi10 */
+	{ 0x6FDF, 8, 0, 3, "Polaris10" },
+	{ 0x7300, 8, 0, 3, "Fiji" },
+	{ 0x730F, 8, 0, 3, "Fiji" },
 	{ 0x7310, 10, 1, 0, "Navi10" },
 	{ 0x7312, 10, 1, 0, "Navi10" },
 	{ 0x7318, 10, 1, 0, "Navi10" },
 	{ 0x731A, 10, 1, 0, "Navi10" },
 	{ 0x731E, 10, 1, 0, "Navi10" },
 	{ 0x731F, 10, 1, 0, "Navi10" },
-	/* cyan_skillfish */
-	{ 0x13F9, 10, 1, 3, "cyan_skillfish" },
-	{ 0x13FA, 10, 1, 3, "cyan_skillfish" },
-	{ 0x13FB, 10, 1, 3, "cyan_skillfish" },
-	{ 0x13FC, 10, 1, 3, "cyan_skillfish" },
-	{ 0x13FE, 10, 1, 3, "cyan_skillfish" },
-	{ 0x143F, 10, 1, 3, "cyan_skillfish" },
-	/* Navi14 */
 	{ 0x7340, 10, 1, 2, "Navi14" },
 	{ 0x7341, 10, 1, 2, "Navi14" },
 	{ 0x7347, 10, 1, 2, "Navi14" },
-	/* Navi12 */
 	{ 0x7360, 10, 1, 1, "Navi12" },
 	{ 0x7362, 10, 1, 1, "Navi12" },
-	/* SIENNA_CICHLID */
+	{ 0x7388, 9, 0, 8, "Arcturus" },
+	{ 0x738C, 9, 0, 8, "Arcturus" },
+	{ 0x738E, 9, 0, 8, "Arcturus" },
+	{ 0x7390, 9, 0, 8, "Arcturus" },
 	{ 0x73A0, 10, 3, 0, "SIENNA_CICHLID" },
 	{ 0x73A1, 10, 3, 0, "SIENNA_CICHLID" },
 	{ 0x73A2, 10, 3, 0, "SIENNA_CICHLID" },
@@ -259,12 +259,11 @@ static const struct hsa_gfxip_table gfxip_lookup_table[] = {
 	{ 0x73A5, 10, 3, 0, "SIENNA_CICHLID" },
 	{ 0x73A8, 10, 3, 0, "SIENNA_CICHLID" },
 	{ 0x73A9, 10, 3, 0, "SIENNA_CICHLID" },
+	{ 0x73AB, 10, 3, 0, "SIENNA_CICHLID" },
 	{ 0x73AC, 10, 3, 0, "SIENNA_CICHLID" },
 	{ 0x73AD, 10, 3, 0, "SIENNA_CICHLID" },
-	{ 0x73AB, 10, 3, 0, "SIENNA_CICHLID" },
 	{ 0x73AE, 10, 3, 0, "SIENNA_CICHLID" },
 	{ 0x73BF, 10, 3, 0, "SIENNA_CICHLID" },
-	/* NAVY_FLOUNDER */
 	{ 0x73C0, 10, 3, 1, "NAVY_FLOUNDER" },
 	{ 0x73C1, 10, 3, 1, "NAVY_FLOUNDER" },
 	{ 0x73C3, 10, 3, 1, "NAVY_FLOUNDER" },
@@ -274,7 +273,6 @@ static const struct hsa_gfxip_table gfxip_lookup_table[] = {
 	{ 0x73DD, 10, 3, 1, "NAVY_FLOUNDER" },
 	{ 0x73DE, 10, 3, 1, "NAVY_FLOUNDER" },
 	{ 0x73DF, 10, 3, 1, "NAVY_FLOUNDER" },
-	/* DIMGREY_CAVEFISH */
 	{ 0x73E0, 10, 3, 2, "DIMGREY_CAVEFISH" },
 	{ 0x73E1, 10, 3, 2, "DIMGREY_CAVEFISH" },
 	{ 0x73E2, 10, 3, 2, "DIMGREY_CAVEFISH" },
@@ -286,17 +284,20 @@ static const struct hsa_gfxip_table gfxip_lookup_table[] = {
 	{ 0x73ED, 10, 3, 2, "DIMGREY_CAVEFISH" },
 	{ 0x73EF, 10, 3, 2, "DIMGREY_CAVEFISH" },
 	{ 0x73FF, 10, 3, 2, "DIMGREY_CAVEFISH" },
-	/* VanGogh */
-	{ 0x163F, 10, 3, 3, "VanGogh" },
-	/* BEIGE_GOBY */
+	{ 0x7408, 9, 0, 10, "Aldebaran" },
+	{ 0x740C, 9, 0, 10, "Aldebaran" },
+	{ 0x740F, 9, 0, 10, "Aldebaran" },
+	{ 0x7410, 9, 0, 10, "Aldebaran" },
 	{ 0x7420, 10, 3, 4, "BEIGE_GOBY" },
 	{ 0x7421, 10, 3, 4, "BEIGE_GOBY" },
 	{ 0x7422, 10, 3, 4, "BEIGE_GOBY" },
 	{ 0x7423, 10, 3, 4, "BEIGE_GOBY" },
 	{ 0x743F, 10, 3, 4, "BEIGE_GOBY" },
-	/* Yellow_Carp */
-	{ 0x164D, 10, 3, 5, "YELLOW_CARP" },
-	{ 0x1681, 10, 3, 5, "YELLOW_CARP" },
+	{ 0x9870, 8, 0, 1, "Carrizo" },
+	{ 0x9874, 8, 0, 1, "Carrizo" },
+	{ 0x9875, 8, 0, 1, "Carrizo" },
+	{ 0x9876, 8, 0, 1, "Carrizo" },
+	{ 0x9877, 8, 0, 1, "Carrizo" },
 };
 
 /* information from /proc/cpuinfo */
@@ -336,7 +337,7 @@ static void free_properties(node_props_t *props, int size)
  *		Use blank string, "", to count all.
  *	Return - number of sub-directories
  */
-static int num_subdirs(char *dirpath, char *prefix)
+static int num_subdirs(const char *dirpath, const char *prefix)
 {
 	int count = 0;
 	DIR *dirp;
@@ -446,6 +447,181 @@ static HSAKMT_STATUS fscanf_size(char *file, uint32_t *bytes)
 	return ret;
 }
 
+/* Properties files in the KFD sysfs topology are lists of "name value"
+ * lines. They are parsed with sysfs_read_props, which reads the file into
+ * a stack buffer and looks each name up in a table sorted by name. Table
+ * entries with a size store the value straight into the target struct,
+ * the others are passed to a handler along with the raw value string.
+ */
+#define SYSFS_PROPS_BUF_SIZE 4096
+
+struct sysfs_prop_desc {
+	const char *name;
+	uint16_t offset;	/* Offset of the field in the target struct */
+	uint8_t size;		/* Size of the field, 0 for handled properties */
+	uint8_t id;		/* Handler specific id */
+};
+
+#define SYSFS_PROP(name, type, field) \
+	{ name, offsetof(type, field), sizeof(((type *)0)->field), 0 }
+#define SYSFS_PROP_HANDLED(name, id) { name, 0, 0, id }
+
+typedef HSAKMT_STATUS (*sysfs_prop_handler)(uint8_t id, uint64_t val,
+					    const char *str, void *data);
+
+/* Adds the hash of a node file read from @path to @hash. File hashes are
+ * summed, so a node's hash doesn't depend on the order its files are read.
+ */
+static void topology_hash_file(uint64_t *hash, const char *path,
+			       const void *buf, size_t len)
+{
+	if (hash)
+		*hash += fnv1a(fnv1a(FNV1A_OFFSET, path, strlen(path)), buf, len);
+}
+
+/* Cached fd of KFD_SYSFS_PATH_NODES, all node files are opened relative to it */
+static int nodes_dir_fd = -1;
+
+/* Returns @path below HSAKMT_SYSFS_ROOT or HSAKMT_PROCFS_ROOT, if set */
+static const char *topology_path(char *buf, size_t size, const char *path)
+{
+	const char *root = strncmp(path, "/proc/", 6) ? hsakmt_sysfs_root :
+							hsakmt_procfs_root;
+
+	if (!*root)
+		return path;
+
+	snprintf(buf, size, "%s%s", root, path);
+	return buf;
+}
+
+static const struct sysfs_prop_desc *sysfs_find_prop(
+		const struct sysfs_prop_desc *table, uint32_t table_size,
+		const char *name)
+{
+	uint32_t lo = 0, hi = table_size;
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		int cmp = strcmp(name, table[mid].name);
+
+		if (!cmp)
+			return &table[mid];
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+static void sysfs_store_prop(void *target, const struct sysfs_prop_desc *desc,
+			     uint64_t val)
+{
+	char *field = (char *)target + desc->offset;
+	uint32_t val32 = (uint32_t)val;
+	uint16_t val16 = (uint16_t)val;
+	uint8_t val8 = (uint8_t)val;
+
+	switch (desc->size) {
+	case 1:
+		memcpy(field, &val8, 1);
+		break;
+	case 2:
+		memcpy(field, &val16, 2);
+		break;
+	case 4:
+		memcpy(field, &val32, 4);
+		break;
+	case 8:
+		memcpy(field, &val, 8);
+		break;
+	default:
+		break;
+	}
+}
+
+/* sysfs_read_props - parse a properties file into a struct
+ *	@dir_fd [IN ] directory @path is relative to, or AT_FDCWD
+ *	@path [IN ] file to read
+ *	@table [IN ] known properties, sorted by name
+ *	@target [OUT] struct receiving the values
+ *	@handler [IN ] called for properties with a zero size, may be NULL
+ *	@hash [OUT] if not NULL, the file's contents are added to it
+ *	Return - HSAKMT_STATUS_NOT_SUPPORTED if access to the file is denied,
+ *		 the first error returned by @handler, or success
+ */
+static HSAKMT_STATUS sysfs_read_props(int dir_fd, const char *path,
+				      const struct sysfs_prop_desc *table,
+				      uint32_t table_size, void *target,
+				      sysfs_prop_handler handler, void *data,
+				      uint64_t *hash)
+{
+	char buf[SYSFS_PROPS_BUF_SIZE];
+	const struct sysfs_prop_desc *desc;
+	char *p, *end, *name, *value;
+	HSAKMT_STATUS ret;
+	ssize_t n;
+	size_t len = 0;
+	uint64_t val;
+	int fd;
+
+	fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return HSAKMT_STATUS_ERROR;
+
+	do {
+		n = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (n > 0)
+			len += n;
+	} while ((n > 0 || (n < 0 && errno == EINTR)) && len < sizeof(buf) - 1);
+	if (n < 0 || !len) {
+		ret = (errno == EPERM) ? HSAKMT_STATUS_NOT_SUPPORTED :
+					 HSAKMT_STATUS_ERROR;
+		close(fd);
+		return ret;
+	}
+	close(fd);
+	buf[len] = 0;
+	topology_hash_file(hash, path, buf, len);
+
+	for (p = buf; *p; p = end) {
+		end = strchr(p, '\n');
+		if (end)
+			*end++ = 0;
+		else
+			end = p + strlen(p);
+
+		name = p;
+		value = strchr(p, ' ');
+		if (!value)
+			continue;
+		*value++ = 0;
+		while (*value == ' ')
+			value++;
+
+		desc = sysfs_find_prop(table, table_size, name);
+		if (!desc)
+			continue;
+
+		val = 0;
+		for (p = value; *p >= '0' && *p <= '9'; p++)
+			val = val * 10 + (*p - '0');
+
+		if (desc->size) {
+			if (p != value)
+				sysfs_store_prop(target, desc, val);
+		} else if (handler) {
+			ret = handler(desc->id, val, value, data);
+			if (ret != HSAKMT_STATUS_SUCCESS)
+				return ret;
+		}
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
 /* cpumap_to_cpu_ci - translate shared_cpu_map string + cpuinfo->apicid into
  *		      SiblingMap in cache
  *	@shared_cpu_map [IN ] shared_cpu_map string
@@ -458,15 +634,17 @@ static void cpumap_to_cpu_ci(char *shared_cpu_map,
 {
 	int num_hexs, bit;
 	uint32_t proc, apicid, mask;
-	char *ch_ptr;
+	char *ch_ptr, *saveptr;
 
 	/* shared_cpu_map is shown as ...X3,X2,X1 Each X is a hex without 0x
 	 * and it's up to 8 characters(32 bits). For the first 32 CPUs(actually
 	 * procs), it's presented in X1. The next 32 is in X2, and so on.
+	 * CPU nodes are read on parallel threads, so the tokenizer state must
+	 * be local.
 	 */
 	num_hexs = (strlen(shared_cpu_map) + 8) / 9; /* 8 characters + "," */
-	ch_ptr = strtok(shared_cpu_map, ",");
-	while (num_hexs-- > 0) {
+	ch_ptr = strtok_r(shared_cpu_map, ",", &saveptr);
+	while (ch_ptr && num_hexs-- > 0) {
 		mask = strtol(ch_ptr, NULL, 16); /* each X */
 		for (bit = 0; bit < 32; bit++) {
 			if (!((1 << bit) & mask))
@@ -480,7 +658,7 @@ static void cpumap_to_cpu_ci(char *shared_cpu_map,
 			}
 			this_cache->SiblingMap[apicid] = 1;
 		}
-		ch_ptr = strtok(NULL, ",");
+		ch_ptr = strtok_r(NULL, ",", &saveptr);
 	}
 }
 
@@ -575,11 +753,12 @@ static int get_cpu_cache_info(const char *prefix, struct proc_cpuinfo *cpuinfo,
 
 static HSAKMT_STATUS topology_sysfs_get_generation(uint32_t *gen)
 {
+	char path[PATH_MAX];
 	FILE *fd;
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
 
 	assert(gen);
-	fd = fopen(KFD_SYSFS_PATH_GENERATION_ID, "r");
+	fd = fopen(topology_path(path, sizeof(path), KFD_SYSFS_PATH_GENERATION_ID), "r");
 	if (!fd)
 		return HSAKMT_STATUS_ERROR;
 	if (fscanf(fd, "%ul", gen) != 1) {
@@ -601,21 +780,29 @@ static HSAKMT_STATUS topology_sysfs_map_node_id(uint32_t node_id, uint32_t *sys_
 	return HSAKMT_STATUS_SUCCESS;
 }
 
-static HSAKMT_STATUS topology_sysfs_get_gpu_id(uint32_t sysfs_node_id, uint32_t *gpu_id)
+static HSAKMT_STATUS topology_sysfs_get_gpu_id(uint32_t sysfs_node_id, uint32_t *gpu_id,
+					       uint64_t *hash)
 {
-	FILE *fd;
-	char path[256];
+	char path[256], buf[32];
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
+	ssize_t n;
+	int fd;
 
 	assert(gpu_id);
-	snprintf(path, 256, "%s/%d/gpu_id", KFD_SYSFS_PATH_NODES, sysfs_node_id);
-	fd = fopen(path, "r");
-	if (!fd)
+	snprintf(path, 256, "%u/gpu_id", sysfs_node_id);
+	fd = openat(nodes_dir_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
 		return HSAKMT_STATUS_ERROR;
-	if (fscanf(fd, "%ul", gpu_id) != 1)
-		ret = (errno == EPERM) ? HSAKMT_STATUS_NOT_SUPPORTED :
-					 HSAKMT_STATUS_ERROR;
-	fclose(fd);
+	n = read(fd, buf, sizeof(buf) - 1);
+	if (n > 0) {
+		buf[n] = 0;
+		topology_hash_file(hash, path, buf, n);
+		if (sscanf(buf, "%u", gpu_id) != 1)
+			ret = HSAKMT_STATUS_ERROR;
+	} else
+		ret = (n < 0 && errno == EPERM) ? HSAKMT_STATUS_NOT_SUPPORTED :
+						  HSAKMT_STATUS_ERROR;
+	close(fd);
 
 	return ret;
 }
@@ -629,14 +816,11 @@ static HSAKMT_STATUS topology_sysfs_get_gpu_id(uint32_t sysfs_node_id, uint32_t
  */
 static HSAKMT_STATUS topology_sysfs_check_node_supported(uint32_t sysfs_node_id, bool *is_node_supported)
 {
+	static const struct sysfs_prop_desc render_minor_table[] = {
+		{ "drm_render_minor", 0, sizeof(uint32_t), 0 },
+	};
 	uint32_t gpu_id;
-	FILE *fd;
-	char *read_buf, *p;
-	int read_size;
-	char prop_name[256];
 	char path[256];
-	unsigned long long prop_val;
-	uint32_t prog;
 	uint32_t drm_render_minor = 0;
 	int ret_value;
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
@@ -644,7 +828,7 @@ static HSAKMT_STATUS topology_sysfs_check_node_supported(uint32_t sysfs_node_id,
 	*is_node_supported = false;
 
 	/* Retrieve the GPU ID */
-	ret = topology_sysfs_get_gpu_id(sysfs_node_id, &gpu_id);
+	ret = topology_sysfs_get_gpu_id(sysfs_node_id, &gpu_id, NULL);
 	if (ret == HSAKMT_STATUS_NOT_SUPPORTED)
 		return HSAKMT_STATUS_SUCCESS;
 	if (ret != HSAKMT_STATUS_SUCCESS)
@@ -655,42 +839,14 @@ static HSAKMT_STATUS topology_sysfs_check_node_supported(uint32_t sysfs_node_id,
 		return HSAKMT_STATUS_SUCCESS;
 	}
 
-	read_buf = malloc(PAGE_SIZE);
-	if (!read_buf)
-		return HSAKMT_STATUS_NO_MEMORY;
-
 	/* Retrieve the node properties */
-	snprintf(path, 256, "%s/%d/properties", KFD_SYSFS_PATH_NODES, sysfs_node_id);
-	fd = fopen(path, "r");
-	if (!fd) {
-		ret = HSAKMT_STATUS_ERROR;
-		goto err;
-	}
-
-	read_size = fread(read_buf, 1, PAGE_SIZE, fd);
-	if (read_size <= 0) {
-		ret = HSAKMT_STATUS_ERROR;
-		goto err;
-	}
-
-	/* Since we're using the buffer as a string, we make sure the string terminates */
-	if (read_size >= PAGE_SIZE)
-		read_size = PAGE_SIZE - 1;
-	read_buf[read_size] = 0;
-
-	/* Read the node properties */
-	prog = 0;
-	p = read_buf;
-	while (sscanf(p += prog, "%s %llu\n%n", prop_name, &prop_val, &prog) == 2) {
-		if (strcmp(prop_name, "drm_render_minor") == 0) {
-			drm_render_minor = (int32_t)prop_val;
-			break;
-		}
-	}
-	if (!drm_render_minor) {
-		ret = HSAKMT_STATUS_ERROR;
-		goto err;
-	}
+	snprintf(path, 256, "%u/properties", sysfs_node_id);
+	ret = sysfs_read_props(nodes_dir_fd, path, render_minor_table, 1,
+			       &drm_render_minor, NULL, NULL, NULL);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return HSAKMT_STATUS_ERROR;
+	if (!drm_render_minor)
+		return HSAKMT_STATUS_ERROR;
 
 	/* Open DRM Render device */
 	ret_value = open_drm_render_device(drm_render_minor);
@@ -699,64 +855,45 @@ static HSAKMT_STATUS topology_sysfs_check_node_supported(uint32_t sysfs_node_id,
 	else if (ret_value != -ENOENT && ret_value != -EPERM)
 		ret = HSAKMT_STATUS_ERROR;
 
-err:
-	free(read_buf);
-	fclose(fd);
 	return ret;
 }
 
+static const struct sysfs_prop_desc system_prop_table[] = {
+	SYSFS_PROP("platform_id", HsaSystemProperties, PlatformId),
+	SYSFS_PROP("platform_oem", HsaSystemProperties, PlatformOem),
+	SYSFS_PROP("platform_rev", HsaSystemProperties, PlatformRev),
+};
+
 HSAKMT_STATUS topology_sysfs_get_system_props(HsaSystemProperties *props)
 {
-	FILE *fd;
-	char *read_buf, *p;
-	char prop_name[256];
-	unsigned long long prop_val;
-	uint32_t prog;
-	int read_size;
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
 	bool is_node_supported = true;
 	uint32_t num_supported_nodes = 0;
+	char path[PATH_MAX];
+	const char *nodes_path;
 
 	assert(props);
-	fd = fopen(KFD_SYSFS_PATH_SYSTEM_PROPERTIES, "r");
-	if (!fd)
+	ret = sysfs_read_props(AT_FDCWD,
+			       topology_path(path, sizeof(path), KFD_SYSFS_PATH_SYSTEM_PROPERTIES),
+			       system_prop_table, ARRAY_LEN(system_prop_table),
+			       props, NULL, NULL, NULL);
+	if (ret != HSAKMT_STATUS_SUCCESS)
 		return HSAKMT_STATUS_ERROR;
 
-	read_buf = malloc(PAGE_SIZE);
-	if (!read_buf) {
-		ret = HSAKMT_STATUS_NO_MEMORY;
-		goto err1;
-	}
-
-	read_size = fread(read_buf, 1, PAGE_SIZE, fd);
-	if (read_size <= 0) {
-		ret = HSAKMT_STATUS_ERROR;
-		goto err2;
-	}
-
-	/* Since we're using the buffer as a string, we make sure the string terminates */
-	if (read_size >= PAGE_SIZE)
-		read_size = PAGE_SIZE - 1;
-	read_buf[read_size] = 0;
-
-	/* Read the system properties */
-	prog = 0;
-	p = read_buf;
-	while (sscanf(p += prog, "%s %llu\n%n", prop_name, &prop_val, &prog) == 2) {
-		if (strcmp(prop_name, "platform_oem") == 0)
-			props->PlatformOem = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "platform_id") == 0)
-			props->PlatformId = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "platform_rev") == 0)
-			props->PlatformRev = (uint32_t)prop_val;
-	}
+	/* (Re)open the nodes directory, the KFD may have been reloaded */
+	if (nodes_dir_fd >= 0)
+		close(nodes_dir_fd);
+	nodes_path = topology_path(path, sizeof(path), KFD_SYSFS_PATH_NODES);
+	nodes_dir_fd = open(nodes_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (nodes_dir_fd < 0)
+		return HSAKMT_STATUS_ERROR;
 
 	/*
 	 * Discover the number of sysfs nodes:
 	 * Assuming that inside nodes folder there are only folders
 	 * which represent the node numbers
 	 */
-	num_sysfs_nodes = num_subdirs(KFD_SYSFS_PATH_NODES, "");
+	num_sysfs_nodes = num_subdirs(nodes_path, "");
 
 	if (map_user_to_sysfs_node_id == NULL) {
 		/* Trade off - num_sysfs_nodes includes all CPU and GPU nodes.
@@ -765,7 +902,7 @@ HSAKMT_STATUS topology_sysfs_get_system_props(HsaSystemProperties *props)
 		map_user_to_sysfs_node_id = calloc(num_sysfs_nodes, sizeof(uint32_t));
 		if (map_user_to_sysfs_node_id == NULL) {
 			ret = HSAKMT_STATUS_NO_MEMORY;
-			goto err2;
+			goto err;
 		}
 		map_user_to_sysfs_node_id_size = num_sysfs_nodes;
 	} else if (num_sysfs_nodes > map_user_to_sysfs_node_id_size) {
@@ -773,7 +910,7 @@ HSAKMT_STATUS topology_sysfs_get_system_props(HsaSystemProperties *props)
 		map_user_to_sysfs_node_id = calloc(num_sysfs_nodes, sizeof(uint32_t));
 		if (map_user_to_sysfs_node_id == NULL) {
 			ret = HSAKMT_STATUS_NO_MEMORY;
-			goto err2;
+			goto err;
 		}
 		map_user_to_sysfs_node_id_size = num_sysfs_nodes;
 	}
@@ -787,29 +924,32 @@ HSAKMT_STATUS topology_sysfs_get_system_props(HsaSystemProperties *props)
 	}
 	props->NumNodes = num_supported_nodes;
 
-	free(read_buf);
-	fclose(fd);
 	return ret;
 
 sysfs_parse_failed:
 	free(map_user_to_sysfs_node_id);
 	map_user_to_sysfs_node_id = NULL;
-err2:
-	free(read_buf);
-err1:
-	fclose(fd);
+err:
+	close(nodes_dir_fd);
+	nodes_dir_fd = -1;
 	return ret;
 }
 
 static const struct hsa_gfxip_table *find_hsa_gfxip_device(uint16_t device_id)
 {
-	uint32_t i, table_size;
+	uint32_t lo = 0, hi = ARRAY_LEN(gfxip_lookup_table);
 
-	table_size = sizeof(gfxip_lookup_table)/sizeof(struct hsa_gfxip_table);
-	for (i = 0; i < table_size; i++) {
-		if (gfxip_lookup_table[i].device_id == device_id)
-			return &gfxip_lookup_table[i];
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+
+		if (gfxip_lookup_table[mid].device_id == device_id)
+			return &gfxip_lookup_table[mid];
+		if (device_id < gfxip_lookup_table[mid].device_id)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
+
 	return NULL;
 }
 
@@ -883,7 +1023,8 @@ static HSAKMT_STATUS topology_parse_cpuinfo(struct proc_cpuinfo *cpuinfo,
 	char *p;
 	uint32_t proc = 0;
 	size_t p_len;
-	const char *proc_cpuinfo_path = "/proc/cpuinfo";
+	char path[PATH_MAX];
+	const char *proc_cpuinfo_path = topology_path(path, sizeof(path), "/proc/cpuinfo");
 
 	if (!cpuinfo) {
 		pr_err("CPU information will be missing\n");
@@ -1005,22 +1146,252 @@ exit:
 	return ret;
 }
 
-static int topology_get_marketing_name(int minor, uint16_t *marketing_name)
+#if defined(__x86_64__) || defined(__i386__)
+/* cpulist_index - position of @cpu in a sysfs CPU list like "0-3,8"
+ * Return: number of CPUs in @list below @cpu
+ */
+static uint32_t cpulist_index(const char *list, uint32_t cpu)
 {
-	int drm_fd;
-	uint32_t major_version;
-	uint32_t minor_version;
-	amdgpu_device_handle device_handle;
+	unsigned long first, last;
+	uint32_t index = 0;
+	char *end;
+
+	while (*list) {
+		first = strtoul(list, &end, 10);
+		last = first;
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		if (first < cpu)
+			index += (last < cpu ? last : cpu - 1) - first + 1;
+		if (*end != ',')
+			break;
+		list = end + 1;
+	}
+
+	return index;
+}
+
+static int apicid_cmp(const void *a, const void *b)
+{
+	uint32_t id1 = *(const uint32_t *)a, id2 = *(const uint32_t *)b;
+
+	return id1 < id2 ? -1 : (id1 > id2);
+}
+
+/* topology_get_x86_cpuinfo - Fill up @cpuinfo from cpuid and the sysfs CPU
+ *			topology instead of parsing /proc/cpuinfo
+ *	The model name of all processors is the cpuid brand string, which is
+ *	what /proc/cpuinfo shows. APIC IDs are rebuilt from the package, core
+ *	and thread IDs in /sys/devices/system/cpu/cpuN/topology and the ID
+ *	field widths in cpuid leaf 0xB, which the kernel derives those IDs from.
+ *	That only holds for Intel CPUs with a single die per package: with
+ *	dies, modules or tiles, or on AMD, core_id is relative to a die or
+ *	has gaps that aren't in the APIC ID. Any CPU whose rebuilt ID can't
+ *	be right makes the caller fall back to /proc/cpuinfo.
+ * Return: HSAKMT_STATUS_NOT_SUPPORTED if the APIC IDs can't be rebuilt
+ */
+static HSAKMT_STATUS topology_get_x86_cpuinfo(struct proc_cpuinfo *cpuinfo,
+					      uint32_t num_procs)
+{
+	uint32_t eax, ebx, ecx, edx, level, max_leaf, i;
+	uint32_t smt_shift = 0, pkg_shift = 0;
+	uint32_t package, core, thread, die, cur_cpu, cur_cpu_after, cur_apicid;
+	uint32_t *apicids;
+	uint32_t brand_regs[12];
+	char vendor[14], brand[49], path[PATH_MAX], str[256];
 	const char *name;
-	int i;
 
-	if (marketing_name == NULL)
-		return -1;
-	drm_fd = drmOpenRender(minor);
-	if (drm_fd < 0)
-		return -1;
-	if (amdgpu_device_initialize(drm_fd,
-		&major_version, &minor_version, &device_handle) < 0) {
+	if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx) || eax < 0xB)
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+	max_leaf = eax;
+	memcpy(vendor, &ebx, 4);
+	memcpy(vendor + 4, &edx, 4);
+	memcpy(vendor + 8, &ecx, 4);
+	strcpy(vendor + 12, "\n");
+	if (topology_search_processor_vendor(vendor) != GENUINE_INTEL)
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+
+	/* Leaf 0x1F also reports module, tile and die levels between the
+	 * core and the package, which sysfs core_id doesn't account for
+	 */
+	if (max_leaf >= 0x1F) {
+		for (level = 0; ; level++) {
+			__cpuid_count(0x1F, level, eax, ebx, ecx, edx);
+			if (!((ecx >> 8) & 0xff))
+				break;
+			if (((ecx >> 8) & 0xff) > 2)
+				return HSAKMT_STATUS_NOT_SUPPORTED;
+		}
+	}
+
+	/* Each level reports the shift of the APIC ID to the next level */
+	for (level = 0; ; level++) {
+		__cpuid_count(0xB, level, eax, ebx, ecx, edx);
+		if (!((ecx >> 8) & 0xff))
+			break;
+		if (((ecx >> 8) & 0xff) == 1)
+			smt_shift = eax & 0x1f;
+		pkg_shift = eax & 0x1f;
+	}
+	if (!level)
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+
+	memset(brand_regs, 0, sizeof(brand_regs));
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) && eax >= 0x80000004) {
+		for (i = 0; i < 3; i++)
+			__get_cpuid(0x80000002 + i, &brand_regs[i * 4], &brand_regs[i * 4 + 1],
+				    &brand_regs[i * 4 + 2], &brand_regs[i * 4 + 3]);
+	}
+	memcpy(brand, brand_regs, sizeof(brand_regs));
+	brand[sizeof(brand_regs)] = '\0';
+	for (i = strlen(brand); i > 0 && brand[i - 1] == ' '; i--)
+		brand[i - 1] = '\0';
+	for (name = brand; *name == ' '; name++)
+		;
+
+	if (smt_shift > pkg_shift)
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+
+	for (i = 0; i < num_procs; i++) {
+		snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu%u/topology/die_id",
+			 hsakmt_sysfs_root, i);
+		if (fscanf_dec(path, &die) == HSAKMT_STATUS_SUCCESS && die)
+			return HSAKMT_STATUS_NOT_SUPPORTED;
+		snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu%u/topology/physical_package_id",
+			 hsakmt_sysfs_root, i);
+		if (fscanf_dec(path, &package) != HSAKMT_STATUS_SUCCESS)
+			return HSAKMT_STATUS_NOT_SUPPORTED;
+		snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu%u/topology/core_id",
+			 hsakmt_sysfs_root, i);
+		if (fscanf_dec(path, &core) != HSAKMT_STATUS_SUCCESS)
+			return HSAKMT_STATUS_NOT_SUPPORTED;
+		snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list",
+			 hsakmt_sysfs_root, i);
+		if (fscanf_str(path, str) != HSAKMT_STATUS_SUCCESS)
+			return HSAKMT_STATUS_NOT_SUPPORTED;
+		thread = cpulist_index(str, i);
+
+		/* IDs that don't fit their APIC ID fields weren't derived
+		 * from them
+		 */
+		if (thread >> smt_shift || core >> (pkg_shift - smt_shift) ||
+		    (pkg_shift && package >> (32 - pkg_shift)))
+			return HSAKMT_STATUS_NOT_SUPPORTED;
+
+		cpuinfo[i].proc_num = i;
+		cpuinfo[i].apicid = (package << pkg_shift) | (core << smt_shift) | thread;
+		strncpy(cpuinfo[i].model_name, name, HSA_PUBLIC_NAME_SIZE - 1);
+	}
+
+	/* Every CPU must have its own APIC ID */
+	apicids = malloc(num_procs * sizeof(*apicids));
+	if (!apicids)
+		return HSAKMT_STATUS_NO_MEMORY;
+	for (i = 0; i < num_procs; i++)
+		apicids[i] = cpuinfo[i].apicid;
+	qsort(apicids, num_procs, sizeof(*apicids), apicid_cmp);
+	for (i = 1; i < num_procs && apicids[i] != apicids[i - 1]; i++)
+		;
+	free(apicids);
+	if (i < num_procs) {
+		pr_debug("Rebuilt APIC IDs aren't unique\n");
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+	}
+
+	/* Check the result against the APIC ID of the CPU we run on. Kernels
+	 * that number cores differently fall back to /proc/cpuinfo.
+	 */
+	do {
+		if (syscall(__NR_getcpu, &cur_cpu, NULL, NULL))
+			return HSAKMT_STATUS_NOT_SUPPORTED;
+		__cpuid_count(0xB, 0, eax, ebx, ecx, cur_apicid);
+		if (syscall(__NR_getcpu, &cur_cpu_after, NULL, NULL))
+			return HSAKMT_STATUS_NOT_SUPPORTED;
+	} while (cur_cpu != cur_cpu_after);
+	if (!hsakmt_sysfs_root[0] &&
+	    (cur_cpu >= num_procs || cpuinfo[cur_cpu].apicid != cur_apicid)) {
+		pr_debug("APIC ID of CPU %u doesn't match the sysfs topology\n", cur_cpu);
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+	}
+
+	processor_vendor = topology_search_processor_vendor(vendor);
+	if (processor_vendor < 0)
+		processor_vendor = GENUINE_INTEL;
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+#endif
+
+/* CPU information of all processors. It is only needed for CPU nodes,
+ * so it is read when the first CPU node is, and kept for later snapshots.
+ * If that fails, the next CPU node tries again.
+ */
+static struct proc_cpuinfo *cpuinfo_cache;
+static uint32_t cpuinfo_cache_len;
+static pthread_mutex_t cpuinfo_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void topology_init_cpuinfo(void)
+{
+	const uint32_t num_procs = get_nprocs();
+	struct proc_cpuinfo *cpuinfo;
+
+	cpuinfo = calloc(num_procs, sizeof(struct proc_cpuinfo));
+	if (!cpuinfo) {
+		pr_err("Fail to allocate memory for CPU info\n");
+		return;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (topology_get_x86_cpuinfo(cpuinfo, num_procs) != HSAKMT_STATUS_SUCCESS) {
+		memset(cpuinfo, 0, num_procs * sizeof(struct proc_cpuinfo));
+		topology_parse_cpuinfo(cpuinfo, num_procs);
+	}
+#else
+	topology_parse_cpuinfo(cpuinfo, num_procs);
+#endif
+
+	cpuinfo_cache_len = num_procs;
+	__atomic_store_n(&cpuinfo_cache, cpuinfo, __ATOMIC_RELEASE);
+}
+
+static HSAKMT_STATUS topology_get_cpuinfo(struct proc_cpuinfo **cpuinfo,
+					  uint32_t *num_procs)
+{
+	struct proc_cpuinfo *cache;
+
+	/* Node snapshot workers get here concurrently */
+	cache = __atomic_load_n(&cpuinfo_cache, __ATOMIC_ACQUIRE);
+	if (!cache) {
+		pthread_mutex_lock(&cpuinfo_cache_mutex);
+		if (!cpuinfo_cache)
+			topology_init_cpuinfo();
+		cache = cpuinfo_cache;
+		pthread_mutex_unlock(&cpuinfo_cache_mutex);
+		if (!cache)
+			return HSAKMT_STATUS_NO_MEMORY;
+	}
+
+	*cpuinfo = cache;
+	*num_procs = cpuinfo_cache_len;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+static int topology_get_marketing_name(int minor, uint16_t *marketing_name)
+{
+	int drm_fd;
+	uint32_t major_version;
+	uint32_t minor_version;
+	amdgpu_device_handle device_handle;
+	const char *name;
+	int i;
+
+	if (marketing_name == NULL)
+		return -1;
+	drm_fd = drmOpenRender(minor);
+	if (drm_fd < 0)
+		return -1;
+	if (amdgpu_device_initialize(drm_fd,
+		&major_version, &minor_version, &device_handle) < 0) {
 		drmClose(drm_fd);
 		return -1;
 	}
@@ -1035,23 +1406,108 @@ static int topology_get_marketing_name(int minor, uint16_t *marketing_name)
 	return 0;
 }
 
-HSAKMT_STATUS topology_sysfs_get_node_props(uint32_t node_id,
-					    HsaNodeProperties *props,
-					    uint32_t *gpu_id,
-					    bool *p2p_links,
-					    uint32_t *num_p2pLinks)
+enum {
+	NODE_PROP_P2P_LINKS_COUNT,
+	NODE_PROP_FW_VERSION,
+	NODE_PROP_SDMA_FW_VERSION,
+	NODE_PROP_GFX_TARGET_VERSION,
+};
+
+static const struct sysfs_prop_desc node_prop_table[] = {
+	SYSFS_PROP("array_count", HsaNodeProperties, NumShaderBanks),
+	SYSFS_PROP("caches_count", HsaNodeProperties, NumCaches),
+	SYSFS_PROP("capability", HsaNodeProperties, Capability.Value),
+	SYSFS_PROP("cpu_core_id_base", HsaNodeProperties, CComputeIdLo),
+	SYSFS_PROP("cpu_cores_count", HsaNodeProperties, NumCPUCores),
+	SYSFS_PROP("cu_per_simd_array", HsaNodeProperties, NumCUPerArray),
+	SYSFS_PROP("debug_prop", HsaNodeProperties, DebugProperties.Value),
+	SYSFS_PROP("device_id", HsaNodeProperties, DeviceId),
+	SYSFS_PROP("domain", HsaNodeProperties, Domain),
+	SYSFS_PROP("drm_render_minor", HsaNodeProperties, DrmRenderMinor),
+	SYSFS_PROP_HANDLED("fw_version", NODE_PROP_FW_VERSION),
+	SYSFS_PROP("gds_size_in_kb", HsaNodeProperties, GDSSizeInKB),
+	SYSFS_PROP_HANDLED("gfx_target_version", NODE_PROP_GFX_TARGET_VERSION),
+	SYSFS_PROP("hive_id", HsaNodeProperties, HiveID),
+	SYSFS_PROP("io_links_count", HsaNodeProperties, NumIOLinks),
+	SYSFS_PROP("lds_size_in_kb", HsaNodeProperties, LDSSizeInKB),
+	SYSFS_PROP("local_mem_size", HsaNodeProperties, LocalMemSize),
+	SYSFS_PROP("location_id", HsaNodeProperties, LocationId),
+	SYSFS_PROP("max_engine_clk_ccompute", HsaNodeProperties, MaxEngineClockMhzCCompute),
+	SYSFS_PROP("max_engine_clk_fcompute", HsaNodeProperties, MaxEngineClockMhzFCompute),
+	SYSFS_PROP("max_slots_scratch_cu", HsaNodeProperties, MaxSlotsScratchCU),
+	SYSFS_PROP("max_waves_per_simd", HsaNodeProperties, MaxWavesPerSIMD),
+	SYSFS_PROP("mem_banks_count", HsaNodeProperties, NumMemoryBanks),
+	SYSFS_PROP("num_cp_queues", HsaNodeProperties, NumCpQueues),
+	SYSFS_PROP("num_gws", HsaNodeProperties, NumGws),
+	SYSFS_PROP("num_sdma_engines", HsaNodeProperties, NumSdmaEngines),
+	SYSFS_PROP("num_sdma_queues_per_engine", HsaNodeProperties, NumSdmaQueuesPerEngine),
+	SYSFS_PROP("num_sdma_xgmi_engines", HsaNodeProperties, NumSdmaXgmiEngines),
+	SYSFS_PROP_HANDLED("p2p_links_count", NODE_PROP_P2P_LINKS_COUNT),
+	SYSFS_PROP_HANDLED("sdma_fw_version", NODE_PROP_SDMA_FW_VERSION),
+	SYSFS_PROP("simd_arrays_per_engine", HsaNodeProperties, NumArrays),
+	SYSFS_PROP("simd_count", HsaNodeProperties, NumFComputeCores),
+	SYSFS_PROP("simd_id_base", HsaNodeProperties, FComputeIdLo),
+	SYSFS_PROP("simd_per_cu", HsaNodeProperties, NumSIMDPerCU),
+	SYSFS_PROP("unique_id", HsaNodeProperties, UniqueID),
+	SYSFS_PROP("vendor_id", HsaNodeProperties, VendorId),
+	SYSFS_PROP("wave_front_size", HsaNodeProperties, WaveFrontSize),
+};
+
+struct node_prop_ctx {
+	HsaNodeProperties *props;
+	bool *p2p_links;
+	uint32_t *num_p2pLinks;
+	uint32_t gfxv;
+};
+
+static HSAKMT_STATUS node_prop_handler(uint8_t id, uint64_t val,
+				       const char *str, void *data)
 {
-	FILE *fd;
-	char *read_buf, *p, *envvar, dummy;
-	char prop_name[256];
+	struct node_prop_ctx *ctx = data;
+
+	switch (id) {
+	case NODE_PROP_P2P_LINKS_COUNT:
+		ctx->props->NumIOLinks += (uint32_t)val;
+		if (ctx->num_p2pLinks)
+			*ctx->num_p2pLinks = (uint32_t)val;
+		if (ctx->p2p_links)
+			*ctx->p2p_links = true;
+		break;
+	case NODE_PROP_FW_VERSION:
+		ctx->props->EngineId.Value = (uint32_t)val & 0x3ff;
+		break;
+	case NODE_PROP_SDMA_FW_VERSION:
+		ctx->props->uCodeEngineVersions.Value = (uint32_t)val & 0x3ff;
+		break;
+	case NODE_PROP_GFX_TARGET_VERSION:
+		ctx->gfxv = (uint32_t)val;
+		break;
+	default:
+		break;
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+static HSAKMT_STATUS topology_read_node_props(uint32_t node_id,
+					      HsaNodeProperties *props,
+					      uint32_t *gpu_id,
+					      bool *p2p_links,
+					      uint32_t *num_p2pLinks,
+					      uint64_t *hash)
+{
+	char *envvar, dummy;
 	char path[256];
-	unsigned long long prop_val;
-	uint32_t prog, major, minor, step;
-	int read_size;
+	uint32_t major, minor, step;
 	const struct hsa_gfxip_table *hsa_gfxip;
 	uint32_t sys_node_id;
-	uint32_t gfxv = 0;
+	uint32_t gfxv;
 	uint8_t gfxv_major, gfxv_minor, gfxv_stepping;
+	struct node_prop_ctx ctx = {
+		.props = props,
+		.p2p_links = p2p_links,
+		.num_p2pLinks = num_p2pLinks,
+	};
 
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
 
@@ -1062,114 +1518,16 @@ HSAKMT_STATUS topology_sysfs_get_node_props(uint32_t node_id,
 		return ret;
 
 	/* Retrieve the GPU ID */
-	ret = topology_sysfs_get_gpu_id(sys_node_id, gpu_id);
-
-	read_buf = malloc(PAGE_SIZE);
-	if (!read_buf)
-		return HSAKMT_STATUS_NO_MEMORY;
+	ret = topology_sysfs_get_gpu_id(sys_node_id, gpu_id, hash);
 
 	/* Retrieve the node properties */
-	snprintf(path, 256, "%s/%d/properties", KFD_SYSFS_PATH_NODES, sys_node_id);
-	fd = fopen(path, "r");
-	if (!fd) {
-		free(read_buf);
+	snprintf(path, 256, "%u/properties", sys_node_id);
+	ret = sysfs_read_props(nodes_dir_fd, path, node_prop_table,
+			       ARRAY_LEN(node_prop_table), props,
+			       node_prop_handler, &ctx, hash);
+	if (ret != HSAKMT_STATUS_SUCCESS)
 		return HSAKMT_STATUS_ERROR;
-	}
-
-	read_size = fread(read_buf, 1, PAGE_SIZE, fd);
-	if (read_size <= 0) {
-		ret = HSAKMT_STATUS_ERROR;
-		goto err;
-	}
-
-	/* Since we're using the buffer as a string, we make sure the string terminates */
-	if (read_size >= PAGE_SIZE)
-		read_size = PAGE_SIZE - 1;
-	read_buf[read_size] = 0;
-
-	/* Read the node properties */
-	prog = 0;
-	p = read_buf;
-	while (sscanf(p += prog, "%s %llu\n%n", prop_name, &prop_val, &prog) == 2) {
-		if (strcmp(prop_name, "cpu_cores_count") == 0)
-			props->NumCPUCores = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "simd_count") == 0)
-			props->NumFComputeCores = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "mem_banks_count") == 0)
-			props->NumMemoryBanks = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "caches_count") == 0)
-			props->NumCaches = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "io_links_count") == 0)
-			props->NumIOLinks = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "p2p_links_count") == 0) {
-			props->NumIOLinks += (uint32_t)prop_val;
-			if (num_p2pLinks)
-				*num_p2pLinks = (uint32_t)prop_val;
-			if (p2p_links)
-				*p2p_links = true;
-		} else if (strcmp(prop_name, "cpu_core_id_base") == 0)
-			props->CComputeIdLo = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "simd_id_base") == 0)
-			props->FComputeIdLo = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "capability") == 0)
-			props->Capability.Value = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "debug_prop") == 0)
-			props->DebugProperties.Value = (uint64_t)prop_val;
-		else if (strcmp(prop_name, "max_waves_per_simd") == 0)
-			props->MaxWavesPerSIMD = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "lds_size_in_kb") == 0)
-			props->LDSSizeInKB = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "gds_size_in_kb") == 0)
-			props->GDSSizeInKB = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "wave_front_size") == 0)
-			props->WaveFrontSize = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "array_count") == 0)
-			props->NumShaderBanks = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "simd_arrays_per_engine") == 0)
-			props->NumArrays = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "cu_per_simd_array") == 0)
-			props->NumCUPerArray = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "simd_per_cu") == 0)
-			props->NumSIMDPerCU = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "max_slots_scratch_cu") == 0)
-			props->MaxSlotsScratchCU = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "fw_version") == 0)
-			props->EngineId.Value = (uint32_t)prop_val & 0x3ff;
-		else if (strcmp(prop_name, "vendor_id") == 0)
-			props->VendorId = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "device_id") == 0)
-			props->DeviceId = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "location_id") == 0)
-			props->LocationId = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "domain") == 0)
-			props->Domain = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "max_engine_clk_fcompute") == 0)
-			props->MaxEngineClockMhzFCompute = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "max_engine_clk_ccompute") == 0)
-			props->MaxEngineClockMhzCCompute = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "local_mem_size") == 0)
-			props->LocalMemSize = prop_val;
-		else if (strcmp(prop_name, "drm_render_minor") == 0)
-			props->DrmRenderMinor = (int32_t)prop_val;
-		else if (strcmp(prop_name, "sdma_fw_version") == 0)
-			props->uCodeEngineVersions.Value = (uint32_t)prop_val & 0x3ff;
-		else if (strcmp(prop_name, "hive_id") == 0)
-			props->HiveID = prop_val;
-		else if (strcmp(prop_name, "unique_id") == 0)
-			props->UniqueID = prop_val;
-		else if (strcmp(prop_name, "num_sdma_engines") == 0)
-			props->NumSdmaEngines = prop_val;
-		else if (strcmp(prop_name, "num_sdma_xgmi_engines") == 0)
-			props->NumSdmaXgmiEngines = prop_val;
-		else if (strcmp(prop_name, "num_gws") == 0)
-			props->NumGws = prop_val;
-		else if (strcmp(prop_name, "num_sdma_queues_per_engine") == 0)
-			props->NumSdmaQueuesPerEngine = prop_val;
-		else if (strcmp(prop_name, "num_cp_queues") == 0)
-			props->NumCpQueues = prop_val;
-		else if (strcmp(prop_name, "gfx_target_version") == 0)
-			gfxv = (uint32_t)prop_val;
-	}
+	gfxv = ctx.gfxv;
 
 	gfxv_major = HSA_GET_GFX_VERSION_MAJOR(gfxv);
 	gfxv_minor = HSA_GET_GFX_VERSION_MINOR(gfxv);
@@ -1185,8 +1543,7 @@ HSAKMT_STATUS topology_sysfs_get_node_props(uint32_t node_id,
 				(major > 63 || minor > 255 || step > 255)) {
 				pr_err("HSA_OVERRIDE_GFX_VERSION %s is invalid\n",
 					envvar);
-				ret = HSAKMT_STATUS_ERROR;
-				goto err;
+				return HSAKMT_STATUS_ERROR;
 			}
 			props->EngineId.ui32.Major = major & 0x3f;
 			props->EngineId.ui32.Minor = minor & 0xff;
@@ -1233,23 +1590,33 @@ HSAKMT_STATUS topology_sysfs_get_node_props(uint32_t node_id,
 	if (props->NumFComputeCores)
 		assert(props->EngineId.ui32.Major && "HSA_OVERRIDE_GFX_VERSION may be needed");
 
-err:
-	free(read_buf);
-	fclose(fd);
 	return ret;
 }
 
+HSAKMT_STATUS topology_sysfs_get_node_props(uint32_t node_id,
+					    HsaNodeProperties *props,
+					    uint32_t *gpu_id,
+					    bool *p2p_links,
+					    uint32_t *num_p2pLinks)
+{
+	return topology_read_node_props(node_id, props, gpu_id, p2p_links,
+					num_p2pLinks, NULL);
+}
+
+static const struct sysfs_prop_desc mem_prop_table[] = {
+	SYSFS_PROP("flags", HsaMemoryProperties, Flags.MemoryProperty),
+	SYSFS_PROP("heap_type", HsaMemoryProperties, HeapType),
+	SYSFS_PROP("mem_clk_max", HsaMemoryProperties, MemoryClockMax),
+	SYSFS_PROP("size_in_bytes", HsaMemoryProperties, SizeInBytes),
+	SYSFS_PROP("width", HsaMemoryProperties, Width),
+};
+
 static HSAKMT_STATUS topology_sysfs_get_mem_props(uint32_t node_id,
 						  uint32_t mem_id,
-						  HsaMemoryProperties *props)
+						  HsaMemoryProperties *props,
+						  uint64_t *hash)
 {
-	FILE *fd;
-	char *read_buf, *p;
-	char prop_name[256];
 	char path[256];
-	unsigned long long prop_val;
-	uint32_t prog;
-	int read_size;
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
 	uint32_t sys_node_id;
 
@@ -1258,46 +1625,12 @@ static HSAKMT_STATUS topology_sysfs_get_mem_props(uint32_t node_id,
 	if (ret != HSAKMT_STATUS_SUCCESS)
 		return ret;
 
-	snprintf(path, 256, "%s/%d/mem_banks/%d/properties", KFD_SYSFS_PATH_NODES, sys_node_id, mem_id);
-	fd = fopen(path, "r");
-	if (!fd)
+	snprintf(path, 256, "%u/mem_banks/%u/properties", sys_node_id, mem_id);
+	ret = sysfs_read_props(nodes_dir_fd, path, mem_prop_table,
+			       ARRAY_LEN(mem_prop_table), props, NULL, NULL, hash);
+	if (ret != HSAKMT_STATUS_SUCCESS)
 		return HSAKMT_STATUS_ERROR;
-	read_buf = malloc(PAGE_SIZE);
-	if (!read_buf) {
-		ret = HSAKMT_STATUS_NO_MEMORY;
-		goto err1;
-	}
 
-	read_size = fread(read_buf, 1, PAGE_SIZE, fd);
-	if (read_size <= 0) {
-		ret = HSAKMT_STATUS_ERROR;
-		goto err2;
-	}
-
-	/* Since we're using the buffer as a string, we make sure the string terminates */
-	if (read_size >= PAGE_SIZE)
-		read_size = PAGE_SIZE - 1;
-	read_buf[read_size] = 0;
-
-	prog = 0;
-	p = read_buf;
-	while (sscanf(p += prog, "%s %llu\n%n", prop_name, &prop_val, &prog) == 2) {
-		if (strcmp(prop_name, "heap_type") == 0)
-			props->HeapType = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "size_in_bytes") == 0)
-			props->SizeInBytes = (uint64_t)prop_val;
-		else if (strcmp(prop_name, "flags") == 0)
-			props->Flags.MemoryProperty = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "width") == 0)
-			props->Width = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "mem_clk_max") == 0)
-			props->MemoryClockMax = (uint32_t)prop_val;
-	}
-
-err2:
-	free(read_buf);
-err1:
-	fclose(fd);
 	return ret;
 }
 
@@ -1339,7 +1672,7 @@ static int topology_create_temp_cpu_cache_list(int node,
 	 * which can be present twice in the string above. 29 is for the prefix
 	 * and the +6 is for the cache suffix
 	 */
-	const uint32_t MAXPATHSIZE = 29 + MAXNAMLEN + (MAXNAMLEN + 6);
+	const uint32_t MAXPATHSIZE = strlen(hsakmt_sysfs_root) + 29 + MAXNAMLEN + (MAXNAMLEN + 6);
 	cpu_cacheinfo_t *p_temp_cpu_ci_list; /* a list of cpu_ci */
 	char path[MAXPATHSIZE], node_dir[MAXPATHSIZE];
 	int max_cpus;
@@ -1362,7 +1695,8 @@ static int topology_create_temp_cpu_cache_list(int node,
 			node_real = node * 8;
 		}
 	}
-	snprintf(node_dir, MAXPATHSIZE, "/sys/devices/system/node/node%d", node_real);
+	snprintf(node_dir, MAXPATHSIZE, "%s/sys/devices/system/node/node%d",
+		 hsakmt_sysfs_root, node_real);
 	/* Other than cpuY folders, this dir also has cpulist and cpumap */
 	max_cpus = num_subdirs(node_dir, "cpu");
 	if (max_cpus <= 0) {
@@ -1374,7 +1708,7 @@ static int topology_create_temp_cpu_cache_list(int node,
 			goto exit;
 		}
 		/* Fall back to use /sys/devices/system/cpu */
-		snprintf(node_dir, MAXPATHSIZE, "/sys/devices/system/cpu");
+		snprintf(node_dir, MAXPATHSIZE, "%s/sys/devices/system/cpu", hsakmt_sysfs_root);
 		max_cpus = num_subdirs(node_dir, "cpu");
 		if (max_cpus <= 0) {
 			pr_err("Fail to get cpu* dirs under %s\n", node_dir);
@@ -1467,17 +1801,51 @@ exit:
 	return ret;
 }
 
+enum {
+	CACHE_PROP_SIBLING_MAP,
+};
+
+static const struct sysfs_prop_desc cache_prop_table[] = {
+	SYSFS_PROP("association", HsaCacheProperties, CacheAssociativity),
+	SYSFS_PROP("cache_line_size", HsaCacheProperties, CacheLineSize),
+	SYSFS_PROP("cache_lines_per_tag", HsaCacheProperties, CacheLinesPerTag),
+	SYSFS_PROP("latency", HsaCacheProperties, CacheLatency),
+	SYSFS_PROP("level", HsaCacheProperties, CacheLevel),
+	SYSFS_PROP("processor_id_low", HsaCacheProperties, ProcessorIdLow),
+	SYSFS_PROP_HANDLED("sibling_map", CACHE_PROP_SIBLING_MAP),
+	SYSFS_PROP("size", HsaCacheProperties, CacheSize),
+	SYSFS_PROP("type", HsaCacheProperties, CacheType.Value),
+};
+
+static HSAKMT_STATUS cache_prop_handler(uint8_t id, uint64_t val,
+					const char *str, void *data)
+{
+	HsaCacheProperties *props = data;
+	uint32_t i = 0;
+
+	if (id != CACHE_PROP_SIBLING_MAP)
+		return HSAKMT_STATUS_SUCCESS;
+
+	/* Comma separated list of 0/1 flags, one per sibling */
+	while (i < HSA_CPU_SIBLINGS && *str >= '0' && *str <= '9') {
+		props->SiblingMap[i] = 0;
+		while (*str >= '0' && *str <= '9')
+			props->SiblingMap[i] = props->SiblingMap[i] * 10 + (*str++ - '0');
+		i++;
+		if (*str != ',')
+			break;
+		str++;
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
 static HSAKMT_STATUS topology_sysfs_get_cache_props(uint32_t node_id,
 						    uint32_t cache_id,
-						    HsaCacheProperties *props)
+						    HsaCacheProperties *props,
+						    uint64_t *hash)
 {
-	FILE *fd;
-	char *read_buf, *p;
-	char prop_name[256];
 	char path[256];
-	unsigned long long prop_val;
-	uint32_t i, prog;
-	int read_size;
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
 	uint32_t sys_node_id;
 
@@ -1486,62 +1854,13 @@ static HSAKMT_STATUS topology_sysfs_get_cache_props(uint32_t node_id,
 	if (ret != HSAKMT_STATUS_SUCCESS)
 		return ret;
 
-	snprintf(path, 256, "%s/%d/caches/%d/properties", KFD_SYSFS_PATH_NODES, sys_node_id, cache_id);
-	fd = fopen(path, "r");
-	if (!fd)
+	snprintf(path, 256, "%u/caches/%u/properties", sys_node_id, cache_id);
+	ret = sysfs_read_props(nodes_dir_fd, path, cache_prop_table,
+			       ARRAY_LEN(cache_prop_table), props,
+			       cache_prop_handler, props, hash);
+	if (ret != HSAKMT_STATUS_SUCCESS)
 		return HSAKMT_STATUS_ERROR;
-	read_buf = malloc(PAGE_SIZE);
-	if (!read_buf) {
-		ret = HSAKMT_STATUS_NO_MEMORY;
-		goto err1;
-	}
-
-	read_size = fread(read_buf, 1, PAGE_SIZE, fd);
-	if (read_size <= 0) {
-		ret = HSAKMT_STATUS_ERROR;
-		goto err2;
-	}
-
-	/* Since we're using the buffer as a string, we make sure the string terminates */
-	if (read_size >= PAGE_SIZE)
-		read_size = PAGE_SIZE - 1;
-	read_buf[read_size] = 0;
-
-	prog = 0;
-	p = read_buf;
-	while (sscanf(p += prog, "%s %llu\n%n", prop_name, &prop_val, &prog) == 2) {
-		if (strcmp(prop_name, "processor_id_low") == 0)
-			props->ProcessorIdLow = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "level") == 0)
-			props->CacheLevel = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "size") == 0)
-			props->CacheSize = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "cache_line_size") == 0)
-			props->CacheLineSize = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "cache_lines_per_tag") == 0)
-			props->CacheLinesPerTag = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "association") == 0)
-			props->CacheAssociativity = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "latency") == 0)
-			props->CacheLatency = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "type") == 0)
-			props->CacheType.Value = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "sibling_map") == 0)
-			break;
-	}
 
-	prog = 0;
-	if ((sscanf(p, "sibling_map %n", &prog)) == 0 && prog) {
-		i = 0;
-		while ((i < HSA_CPU_SIBLINGS) &&
-			(sscanf(p += prog, "%u%*[,\n]%n", &props->SiblingMap[i++], &prog) == 1))
-			continue;
-	}
-
-err2:
-	free(read_buf);
-err1:
-	fclose(fd);
 	return ret;
 }
 
@@ -1564,102 +1883,85 @@ static HSAKMT_STATUS topology_map_sysfs_to_user_node_id(uint32_t sys_node_id, ui
  * If node_to specified by the @iolink_id is not accessible the function returns HSAKMT_STATUS_NOT_SUPPORTED.
  * If node_to is accessible, then node_to is mapped from sysfs_node to user_node and returns HSAKMT_STATUS_SUCCESS.
  */
+enum {
+	IOLINK_PROP_NODE_FROM,
+	IOLINK_PROP_NODE_TO,
+};
+
+static const struct sysfs_prop_desc iolink_prop_table[] = {
+	SYSFS_PROP("flags", HsaIoLinkProperties, Flags.LinkProperty),
+	SYSFS_PROP("max_bandwidth", HsaIoLinkProperties, MaximumBandwidth),
+	SYSFS_PROP("max_latency", HsaIoLinkProperties, MaximumLatency),
+	SYSFS_PROP("min_bandwidth", HsaIoLinkProperties, MinimumBandwidth),
+	SYSFS_PROP("min_latency", HsaIoLinkProperties, MinimumLatency),
+	SYSFS_PROP_HANDLED("node_from", IOLINK_PROP_NODE_FROM),
+	SYSFS_PROP_HANDLED("node_to", IOLINK_PROP_NODE_TO),
+	SYSFS_PROP("recommended_transfer_size", HsaIoLinkProperties, RecTransferSize),
+	SYSFS_PROP("type", HsaIoLinkProperties, IoLinkType),
+	SYSFS_PROP("version_major", HsaIoLinkProperties, VersionMajor),
+	SYSFS_PROP("version_minor", HsaIoLinkProperties, VersionMinor),
+	SYSFS_PROP("weight", HsaIoLinkProperties, Weight),
+};
+
+struct iolink_prop_ctx {
+	HsaIoLinkProperties *props;
+	uint32_t node_id;
+	uint32_t sys_node_id;
+};
+
+static HSAKMT_STATUS iolink_prop_handler(uint8_t id, uint64_t val,
+					 const char *str, void *data)
+{
+	struct iolink_prop_ctx *ctx = data;
+	bool is_node_supported;
+	HSAKMT_STATUS ret;
+
+	switch (id) {
+	case IOLINK_PROP_NODE_FROM:
+		if (ctx->sys_node_id != (uint32_t)val)
+			return HSAKMT_STATUS_INVALID_NODE_UNIT;
+		ctx->props->NodeFrom = ctx->node_id;
+		break;
+	case IOLINK_PROP_NODE_TO:
+		ret = topology_sysfs_check_node_supported((uint32_t)val, &is_node_supported);
+		if (!is_node_supported) {
+			memset(ctx->props, 0, sizeof(*ctx->props));
+			return HSAKMT_STATUS_NOT_SUPPORTED;
+		}
+		ret = topology_map_sysfs_to_user_node_id((uint32_t)val, &ctx->props->NodeTo);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			return ret;
+		break;
+	default:
+		break;
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
 static HSAKMT_STATUS topology_sysfs_get_iolink_props(uint32_t node_id,
 						     uint32_t iolink_id,
-						     HsaIoLinkProperties *props, bool p2pLink)
+						     HsaIoLinkProperties *props, bool p2pLink,
+						     uint64_t *hash)
 {
-	FILE *fd;
-	char *read_buf, *p;
-	char prop_name[256];
 	char path[256];
-	unsigned long long prop_val;
-	uint32_t prog;
-	int read_size;
 	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
-	uint32_t sys_node_id;
+	struct iolink_prop_ctx ctx = {
+		.props = props,
+		.node_id = node_id,
+	};
 
 	assert(props);
-	ret = topology_sysfs_map_node_id(node_id, &sys_node_id);
+	ret = topology_sysfs_map_node_id(node_id, &ctx.sys_node_id);
 	if (ret != HSAKMT_STATUS_SUCCESS)
 		return ret;
 
-	if (p2pLink)
-		snprintf(path, 256, "%s/%d/p2p_links/%d/properties", KFD_SYSFS_PATH_NODES, sys_node_id, iolink_id);
-	else
-		snprintf(path, 256, "%s/%d/io_links/%d/properties", KFD_SYSFS_PATH_NODES, sys_node_id, iolink_id);
-
-	fd = fopen(path, "r");
-	if (!fd)
-		return HSAKMT_STATUS_ERROR;
-	read_buf = malloc(PAGE_SIZE);
-	if (!read_buf) {
-		ret = HSAKMT_STATUS_NO_MEMORY;
-		goto err1;
-	}
+	snprintf(path, 256, "%u/%s/%u/properties", ctx.sys_node_id,
+		 p2pLink ? "p2p_links" : "io_links", iolink_id);
 
-	read_size = fread(read_buf, 1, PAGE_SIZE, fd);
-	if (read_size <= 0) {
-		ret = (errno == EPERM) ? HSAKMT_STATUS_NOT_SUPPORTED :
-					 HSAKMT_STATUS_ERROR;
-		goto err2;
-	}
-
-	/* Since we're using the buffer as a string, we make sure the string terminates */
-	if (read_size >= PAGE_SIZE)
-		read_size = PAGE_SIZE - 1;
-	read_buf[read_size] = 0;
-
-	prog = 0;
-	p = read_buf;
-	while (sscanf(p += prog, "%s %llu\n%n", prop_name, &prop_val, &prog) == 2) {
-		if (strcmp(prop_name, "type") == 0)
-			props->IoLinkType = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "version_major") == 0)
-			props->VersionMajor = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "version_minor") == 0)
-			props->VersionMinor = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "node_from") == 0) {
-			if (sys_node_id != (uint32_t)prop_val) {
-				ret = HSAKMT_STATUS_INVALID_NODE_UNIT;
-				goto err2;
-			}
-			props->NodeFrom = node_id;
-		} else if (strcmp(prop_name, "node_to") == 0) {
-			bool is_node_supported;
-			uint32_t sysfs_node_id;
-
-			sysfs_node_id = (uint32_t)prop_val;
-			ret = topology_sysfs_check_node_supported(sysfs_node_id, &is_node_supported);
-			if (!is_node_supported) {
-				ret = HSAKMT_STATUS_NOT_SUPPORTED;
-				memset(props, 0, sizeof(*props));
-				goto err2;
-			}
-			ret = topology_map_sysfs_to_user_node_id(sysfs_node_id, &props->NodeTo);
-			if (ret != HSAKMT_STATUS_SUCCESS)
-				goto err2;
-		} else if (strcmp(prop_name, "weight") == 0)
-			props->Weight = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "min_latency") == 0)
-			props->MinimumLatency = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "max_latency") == 0)
-			props->MaximumLatency = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "min_bandwidth") == 0)
-			props->MinimumBandwidth = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "max_bandwidth") == 0)
-			props->MaximumBandwidth = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "recommended_transfer_size") == 0)
-			props->RecTransferSize = (uint32_t)prop_val;
-		else if (strcmp(prop_name, "flags") == 0)
-			props->Flags.LinkProperty = (uint32_t)prop_val;
-	}
-
-
-err2:
-	free(read_buf);
-err1:
-	fclose(fd);
-	return ret;
+	return sysfs_read_props(nodes_dir_fd, path, iolink_prop_table,
+				ARRAY_LEN(iolink_prop_table), props,
+				iolink_prop_handler, &ctx, hash);
 }
 
 /* topology_get_free_io_link_slot_for_node - For the given node_id, find the
@@ -1887,168 +2189,924 @@ try_alt_dir:
 	}
 }
 
-HSAKMT_STATUS topology_take_snapshot(void)
+/* topology_get_node_snapshot - read all properties of one node
+ *	Fills @props with the node, memory bank, cache and IO link properties
+ *	of user node @node_id. Only touches @props, so it can run for several
+ *	nodes in parallel. Sets @p2p_links if the node reports p2p links.
+ *	The sysfs files read are added to @hash, see topology_hash_node.
+ */
+static HSAKMT_STATUS topology_get_node_snapshot(uint32_t node_id,
+						const HsaSystemProperties *sys_props,
+						node_props_t *props,
+						bool *p2p_links,
+						uint64_t *hash)
 {
-	uint32_t gen_start, gen_end, i, mem_id, cache_id;
-	HsaSystemProperties sys_props;
-	node_props_t *temp_props = 0;
-	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
-	struct proc_cpuinfo *cpuinfo;
-	const uint32_t num_procs = get_nprocs();
-	uint32_t num_ioLinks;
-	bool p2p_links = false;
+	uint32_t mem_id, cache_id, num_ioLinks;
 	uint32_t num_p2pLinks = 0;
+	uint32_t link_id = 0;
+	struct proc_cpuinfo *cpuinfo = NULL;
+	uint32_t num_procs = 0;
+	HSAKMT_STATUS ret;
 
-	cpuinfo = calloc(num_procs, sizeof(struct proc_cpuinfo));
-	if (!cpuinfo) {
-		pr_err("Fail to allocate memory for CPU info\n");
-		return HSAKMT_STATUS_NO_MEMORY;
-	}
-	topology_parse_cpuinfo(cpuinfo, num_procs);
-
-retry:
-	ret = topology_sysfs_get_generation(&gen_start);
-	if (ret != HSAKMT_STATUS_SUCCESS)
-		goto err;
-	ret = topology_sysfs_get_system_props(&sys_props);
+	ret = topology_read_node_props(node_id, &props->node,
+				       &props->gpu_id, p2p_links,
+				       &num_p2pLinks, hash);
 	if (ret != HSAKMT_STATUS_SUCCESS)
-		goto err;
-	if (sys_props.NumNodes > 0) {
-		temp_props = calloc(sys_props.NumNodes * sizeof(node_props_t), 1);
-		if (!temp_props) {
-			ret = HSAKMT_STATUS_NO_MEMORY;
-			goto err;
-		}
-		for (i = 0; i < sys_props.NumNodes; i++) {
-			ret = topology_sysfs_get_node_props(i,
-					&temp_props[i].node,
-					&temp_props[i].gpu_id,
-					&p2p_links, &num_p2pLinks);
-			if (ret != HSAKMT_STATUS_SUCCESS) {
-				free_properties(temp_props, i);
-				goto err;
-			}
+		return ret;
 
-			if (temp_props[i].node.NumCPUCores)
-				topology_get_cpu_model_name(&temp_props[i].node,
-							cpuinfo, num_procs);
-
-			if (temp_props[i].node.NumMemoryBanks) {
-				temp_props[i].mem = calloc(temp_props[i].node.NumMemoryBanks * sizeof(HsaMemoryProperties), 1);
-				if (!temp_props[i].mem) {
-					ret = HSAKMT_STATUS_NO_MEMORY;
-					free_properties(temp_props, i + 1);
-					goto err;
-				}
-				for (mem_id = 0; mem_id < temp_props[i].node.NumMemoryBanks; mem_id++) {
-					ret = topology_sysfs_get_mem_props(i, mem_id, &temp_props[i].mem[mem_id]);
-					if (ret != HSAKMT_STATUS_SUCCESS) {
-						free_properties(temp_props, i + 1);
-						goto err;
-					}
-				}
-			}
+	if (props->node.NumCPUCores || !props->gpu_id) {
+		ret = topology_get_cpuinfo(&cpuinfo, &num_procs);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			return ret;
+	}
 
-			if (temp_props[i].node.NumCaches) {
-				temp_props[i].cache = calloc(temp_props[i].node.NumCaches * sizeof(HsaCacheProperties), 1);
-				if (!temp_props[i].cache) {
-					ret = HSAKMT_STATUS_NO_MEMORY;
-					free_properties(temp_props, i + 1);
-					goto err;
-				}
-				for (cache_id = 0; cache_id < temp_props[i].node.NumCaches; cache_id++) {
-					ret = topology_sysfs_get_cache_props(i, cache_id, &temp_props[i].cache[cache_id]);
-					if (ret != HSAKMT_STATUS_SUCCESS) {
-						free_properties(temp_props, i + 1);
-						goto err;
-					}
-				}
-			} else if (!temp_props[i].gpu_id) { /* a CPU node */
-				ret = topology_get_cpu_cache_props(
-						i, cpuinfo, &temp_props[i]);
-				if (ret != HSAKMT_STATUS_SUCCESS) {
-					free_properties(temp_props, i + 1);
-					goto err;
-				}
-			}
+	if (props->node.NumCPUCores)
+		topology_get_cpu_model_name(&props->node, cpuinfo, num_procs);
 
-			/* To simplify, allocate maximum needed memory for io_links for each node. This
-			 * removes the need for realloc when indirect and QPI links are added later
-			 */
-			temp_props[i].link = calloc(sys_props.NumNodes - 1, sizeof(HsaIoLinkProperties));
-			if (!temp_props[i].link) {
-				ret = HSAKMT_STATUS_NO_MEMORY;
-				free_properties(temp_props, i + 1);
-				goto err;
-			}
-			num_ioLinks = temp_props[i].node.NumIOLinks - num_p2pLinks;
-			uint32_t link_id = 0;
+	if (props->node.NumMemoryBanks) {
+		props->mem = calloc(props->node.NumMemoryBanks * sizeof(HsaMemoryProperties), 1);
+		if (!props->mem)
+			return HSAKMT_STATUS_NO_MEMORY;
+		for (mem_id = 0; mem_id < props->node.NumMemoryBanks; mem_id++) {
+			ret = topology_sysfs_get_mem_props(node_id, mem_id, &props->mem[mem_id],
+							   hash);
+			if (ret != HSAKMT_STATUS_SUCCESS)
+				return ret;
+		}
+	}
 
-			if (num_ioLinks) {
-				uint32_t sys_link_id = 0;
+	if (props->node.NumCaches) {
+		props->cache = calloc(props->node.NumCaches * sizeof(HsaCacheProperties), 1);
+		if (!props->cache)
+			return HSAKMT_STATUS_NO_MEMORY;
+		for (cache_id = 0; cache_id < props->node.NumCaches; cache_id++) {
+			ret = topology_sysfs_get_cache_props(node_id, cache_id, &props->cache[cache_id],
+							     hash);
+			if (ret != HSAKMT_STATUS_SUCCESS)
+				return ret;
+		}
+	} else if (!props->gpu_id) { /* a CPU node */
+		ret = topology_get_cpu_cache_props(node_id, cpuinfo, props);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			return ret;
+	}
 
-				/* Parse all the sysfs specified io links. Skip the ones where the
-				 * remote node (node_to) is not accessible
-				 */
-				while (sys_link_id < num_ioLinks &&
-					link_id < sys_props.NumNodes - 1) {
-					ret = topology_sysfs_get_iolink_props(i, sys_link_id++,
-								&temp_props[i].link[link_id], false);
-					if (ret == HSAKMT_STATUS_NOT_SUPPORTED) {
-						ret = HSAKMT_STATUS_SUCCESS;
-						continue;
-					} else if (ret != HSAKMT_STATUS_SUCCESS) {
-						free_properties(temp_props, i + 1);
-						goto err;
-					}
-					link_id++;
-				}
-				/* sysfs specifies all the io links. Limit the number to valid ones */
-				temp_props[i].node.NumIOLinks = link_id;
-			}
+	/* To simplify, allocate maximum needed memory for io_links for each node. This
+	 * removes the need for realloc when indirect and QPI links are added later
+	 */
+	props->link = calloc(sys_props->NumNodes - 1, sizeof(HsaIoLinkProperties));
+	if (!props->link)
+		return HSAKMT_STATUS_NO_MEMORY;
+	num_ioLinks = props->node.NumIOLinks - num_p2pLinks;
 
-			if (num_p2pLinks) {
-				uint32_t sys_link_id = 0;
+	if (num_ioLinks) {
+		uint32_t sys_link_id = 0;
 
-				/* Parse all the sysfs specified p2p links.
-				 */
-				while (sys_link_id < num_p2pLinks &&
-					link_id < sys_props.NumNodes - 1) {
-					ret = topology_sysfs_get_iolink_props(i, sys_link_id++,
-								&temp_props[i].link[link_id], true);
-					if (ret == HSAKMT_STATUS_NOT_SUPPORTED) {
-						ret = HSAKMT_STATUS_SUCCESS;
-						continue;
-					} else if (ret != HSAKMT_STATUS_SUCCESS) {
-						free_properties(temp_props, i + 1);
-						goto err;
-					}
-					link_id++;
-				}
-				temp_props[i].node.NumIOLinks = link_id;
-			}
+		/* Parse all the sysfs specified io links. Skip the ones where the
+		 * remote node (node_to) is not accessible
+		 */
+		while (sys_link_id < num_ioLinks &&
+			link_id < sys_props->NumNodes - 1) {
+			ret = topology_sysfs_get_iolink_props(node_id, sys_link_id++,
+						&props->link[link_id], false, hash);
+			if (ret == HSAKMT_STATUS_NOT_SUPPORTED) {
+				ret = HSAKMT_STATUS_SUCCESS;
+				continue;
+			} else if (ret != HSAKMT_STATUS_SUCCESS)
+				return ret;
+			link_id++;
 		}
+		/* sysfs specifies all the io links. Limit the number to valid ones */
+		props->node.NumIOLinks = link_id;
 	}
+	props->num_direct_links = link_id;
 
-	if (!p2p_links) {
-		/* All direct IO links are created in the kernel. Here we need to
-		 * connect GPU<->GPU or GPU<->CPU indirect IO links.
+	if (num_p2pLinks) {
+		uint32_t sys_link_id = 0;
+
+		/* Parse all the sysfs specified p2p links.
 		 */
-		topology_create_indirect_gpu_links(&sys_props, temp_props);
+		while (sys_link_id < num_p2pLinks &&
+			link_id < sys_props->NumNodes - 1) {
+			ret = topology_sysfs_get_iolink_props(node_id, sys_link_id++,
+						&props->link[link_id], true, hash);
+			if (ret == HSAKMT_STATUS_NOT_SUPPORTED) {
+				ret = HSAKMT_STATUS_SUCCESS;
+				continue;
+			} else if (ret != HSAKMT_STATUS_SUCCESS)
+				return ret;
+			link_id++;
+		}
+		props->node.NumIOLinks = link_id;
 	}
+	props->num_sysfs_links = link_id;
 
-	ret = topology_sysfs_get_generation(&gen_end);
-	if (ret != HSAKMT_STATUS_SUCCESS) {
-		free_properties(temp_props, sys_props.NumNodes);
-		goto err;
-	}
+	return HSAKMT_STATUS_SUCCESS;
+}
 
-	if (gen_start != gen_end) {
+/* topology_reuse_node - copy a node that didn't change from the previous
+ *	snapshot @old_props. Only the properties read from sysfs are copied,
+ *	the indirect IO links are created again for the new snapshot.
+ *	Returns HSAKMT_STATUS_NOT_SUPPORTED if the node has to be read again,
+ *	because its sysfs files changed or one of its links points to a node
+ *	whose node ID changed.
+ */
+static HSAKMT_STATUS topology_reuse_node(uint32_t node_id, uint32_t sys_node_id,
+					 uint64_t hash,
+					 const HsaSystemProperties *sys_props,
+					 const node_props_t *old_props,
+					 uint32_t num_old_nodes,
+					 node_props_t *props)
+{
+	const node_props_t *old = &old_props[node_id];
+	uint32_t i, to;
+
+	if (node_id >= num_old_nodes || !hash || old->hash != hash ||
+	    old->sysfs_node_id != sys_node_id ||
+	    old->num_sysfs_links > sys_props->NumNodes - 1)
+		return HSAKMT_STATUS_NOT_SUPPORTED;
+
+	for (i = 0; i < old->num_sysfs_links; i++) {
+		to = old->link[i].NodeTo;
+		if (to >= sys_props->NumNodes || to >= num_old_nodes ||
+		    old_props[to].sysfs_node_id != map_user_to_sysfs_node_id[to])
+			return HSAKMT_STATUS_NOT_SUPPORTED;
+	}
+
+	*props = *old;
+	props->node.NumIOLinks = old->num_sysfs_links;
+	props->mem = NULL;
+	props->cache = NULL;
+
+	if (old->node.NumMemoryBanks) {
+		props->mem = malloc(old->node.NumMemoryBanks * sizeof(HsaMemoryProperties));
+		if (!props->mem)
+			goto err;
+		memcpy(props->mem, old->mem,
+		       old->node.NumMemoryBanks * sizeof(HsaMemoryProperties));
+	}
+
+	if (old->node.NumCaches) {
+		props->cache = malloc(old->node.NumCaches * sizeof(HsaCacheProperties));
+		if (!props->cache)
+			goto err;
+		memcpy(props->cache, old->cache,
+		       old->node.NumCaches * sizeof(HsaCacheProperties));
+	}
+
+	/* Same size as a parsed node, see topology_get_node_snapshot */
+	props->link = calloc(sys_props->NumNodes - 1, sizeof(HsaIoLinkProperties));
+	if (!props->link)
+		goto err;
+	if (old->num_sysfs_links)
+		memcpy(props->link, old->link,
+		       old->num_sysfs_links * sizeof(HsaIoLinkProperties));
+
+	return HSAKMT_STATUS_SUCCESS;
+
+err:
+	free(props->mem);
+	free(props->cache);
+	memset(props, 0, sizeof(*props));
+	return HSAKMT_STATUS_NO_MEMORY;
+}
+
+/* Nodes of the previous snapshot can only be reused if every node kept its
+ * node ID and no sysfs node that already existed became supported. Such a
+ * node would add IO links to other nodes without changing their files.
+ */
+static bool topology_nodes_reusable(const node_props_t *old_props,
+				    uint32_t num_old_nodes,
+				    uint32_t old_num_sysfs_nodes,
+				    const HsaSystemProperties *sys_props)
+{
+	uint32_t i;
+
+	if (!old_props)
+		return false;
+
+	for (i = 0; i < sys_props->NumNodes; i++) {
+		if (i < num_old_nodes ?
+		    old_props[i].sysfs_node_id != map_user_to_sysfs_node_id[i] :
+		    map_user_to_sysfs_node_id[i] < old_num_sysfs_nodes)
+			return false;
+	}
+
+	return true;
+}
+
+/* Upper bound of threads reading node properties in parallel. Node
+ * properties are read from sysfs and the DRM render nodes, which is
+ * mostly waiting on the kernel, so a few threads are enough.
+ */
+#define TOPOLOGY_MAX_SNAPSHOT_THREADS 8
+
+struct node_snapshot_work {
+	const HsaSystemProperties *sys_props;
+	node_props_t *props;
+	const node_props_t *old_props;	/* Previous snapshot, or NULL */
+	uint32_t num_old_nodes;
+	uint32_t next_node;	/* Next node to claim, updated atomically */
+	uint32_t num_reused;
+	bool p2p_links;
+	HSAKMT_STATUS ret;
+};
+
+static void *node_snapshot_worker(void *arg)
+{
+	struct node_snapshot_work *work = arg;
+	HSAKMT_STATUS ret, expected;
+	uint32_t i, sys_node_id;
+	bool p2p_links;
+	uint64_t hash;
+
+	while ((i = __atomic_fetch_add(&work->next_node, 1, __ATOMIC_RELAXED)) <
+	       work->sys_props->NumNodes) {
+		/* Stop early once any node failed */
+		if (__atomic_load_n(&work->ret, __ATOMIC_RELAXED) != HSAKMT_STATUS_SUCCESS)
+			break;
+
+		ret = topology_sysfs_map_node_id(i, &sys_node_id);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			goto fail;
+
+		ret = HSAKMT_STATUS_NOT_SUPPORTED;
+		if (work->old_props)
+			ret = topology_reuse_node(i, sys_node_id,
+						  topology_hash_node(sys_node_id),
+						  work->sys_props, work->old_props,
+						  work->num_old_nodes, &work->props[i]);
+		if (ret == HSAKMT_STATUS_SUCCESS) {
+			__atomic_add_fetch(&work->num_reused, 1, __ATOMIC_RELAXED);
+		} else if (ret == HSAKMT_STATUS_NOT_SUPPORTED) {
+			/* The hash for the next snapshot comes with the read,
+			 * so the first snapshot doesn't read the files twice
+			 */
+			p2p_links = false;
+			hash = 0;
+			ret = topology_get_node_snapshot(i, work->sys_props,
+							 &work->props[i], &p2p_links,
+							 &hash);
+			work->props[i].sysfs_node_id = sys_node_id;
+			work->props[i].p2p_links = p2p_links;
+			work->props[i].hash = topology_finish_node_hash(hash);
+		}
+
+		if (work->props[i].p2p_links)
+			__atomic_store_n(&work->p2p_links, true, __ATOMIC_RELAXED);
+fail:
+		if (ret != HSAKMT_STATUS_SUCCESS) {
+			expected = HSAKMT_STATUS_SUCCESS;
+			__atomic_compare_exchange_n(&work->ret, &expected, ret, false,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+/* topology_get_nodes_snapshot - read the properties of all nodes
+ *	Nodes are claimed one at a time by the calling thread and up to
+ *	TOPOLOGY_MAX_SNAPSHOT_THREADS - 1 helper threads. Each node is written
+ *	to its own slot of @props, so the result does not depend on which
+ *	thread read it. Nodes whose sysfs files didn't change are copied
+ *	from @old_props instead of being read again, if it is not NULL.
+ */
+static HSAKMT_STATUS topology_get_nodes_snapshot(const HsaSystemProperties *sys_props,
+						 node_props_t *props,
+						 const node_props_t *old_props,
+						 uint32_t num_old_nodes,
+						 bool *p2p_links)
+{
+	pthread_t threads[TOPOLOGY_MAX_SNAPSHOT_THREADS - 1];
+	struct node_snapshot_work work = {
+		.sys_props = sys_props,
+		.props = props,
+		.old_props = old_props,
+		.num_old_nodes = num_old_nodes,
+		.ret = HSAKMT_STATUS_SUCCESS,
+	};
+	const uint32_t num_procs = get_nprocs();
+	uint32_t num_threads, i, started = 0;
+	sigset_t set, old_set;
+
+	num_threads = MIN(sys_props->NumNodes, num_procs);
+	num_threads = MIN(num_threads, TOPOLOGY_MAX_SNAPSHOT_THREADS);
+
+	if (num_threads > 1) {
+		/* Helper threads must not handle the application's signals */
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, &old_set);
+		for (i = 0; i < num_threads - 1; i++) {
+			if (pthread_create(&threads[started], NULL,
+					   node_snapshot_worker, &work))
+				break;
+			started++;
+		}
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	}
+
+	node_snapshot_worker(&work);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (old_props)
+		pr_debug("Reused %u of %u topology nodes\n", work.num_reused,
+			 sys_props->NumNodes);
+
+	*p2p_links = work.p2p_links;
+	return work.ret;
+}
+
+/* Optional on-disk cache of the topology snapshot, so short-lived
+ * processes don't have to parse sysfs and /proc/cpuinfo again. It is
+ * enabled with HSAKMT_TOPOLOGY_CACHE, set to 1 to use
+ * $XDG_RUNTIME_DIR/hsakmt-topology.cache or to the path of the cache file.
+ *
+ * A cache file is only used if its key matches the running system. The
+ * key covers the KFD generation_id, the boot ID, stat() data of the
+ * topology node and DRM render node files, the online CPUs, the caller's
+ * credentials and HSA_OVERRIDE_GFX_VERSION.
+ */
+#define TOPOLOGY_CACHE_ENV "HSAKMT_TOPOLOGY_CACHE"
+#define TOPOLOGY_CACHE_NAME "hsakmt-topology.cache"
+#define TOPOLOGY_CACHE_MAGIC 0x43544b48		/* "HKTC" */
+#define TOPOLOGY_CACHE_VERSION 2
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+#define CPU_ONLINE_PATH "/sys/devices/system/cpu/online"
+#define DRM_DEVICE_DIR "/dev/dri"
+
+struct topology_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	/* The cache is only valid for the same structure layouts */
+	uint16_t system_size;
+	uint16_t node_size;
+	uint16_t mem_size;
+	uint16_t cache_size;
+	uint16_t link_size;
+	uint16_t reserved;
+	uint32_t num_nodes;
+	uint32_t num_sysfs_nodes;
+	uint32_t map_size;
+	uint64_t key;
+	uint64_t total_size;
+	uint64_t checksum;	/* of everything after the header */
+};
+
+/* The header is followed by, each padded to 8 bytes:
+ *	HsaSystemProperties
+ *	map_user_to_sysfs_node_id[map_size]
+ *	for each node: struct topology_cache_node, then its
+ *	NumMemoryBanks memory, NumCaches cache and NumIOLinks IO link properties
+ */
+struct topology_cache_node {
+	uint32_t gpu_id;
+	uint32_t num_direct_links;
+	HsaNodeProperties node;
+};
+
+#define CACHE_ALIGN(x) ALIGN_UP(x, 8)
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+
+	while (size--) {
+		hash ^= *p++;
+		hash *= FNV1A_PRIME;
+	}
+
+	return hash;
+}
+
+/* Hashes the contents of @path, relative to @dir_fd. Fails if the file
+ * can't be read or is empty.
+ */
+static bool hash_file_at(uint64_t *hash, int dir_fd, const char *path)
+{
+	char buf[1024];
+	bool read_any = false;
+	ssize_t n;
+	int fd;
+
+	fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		*hash = fnv1a(*hash, buf, n);
+		read_any = true;
+	}
+	close(fd);
+
+	return read_any && n == 0;
+}
+
+/* Hashes stat() data of @file in each entry of @dir_path starting with
+ * @prefix. The entry hashes are summed, so readdir order doesn't matter.
+ */
+static bool hash_dir_stats(uint64_t *hash, const char *dir_path,
+			   const char *prefix, const char *file)
+{
+	size_t prefix_len = strlen(prefix);
+	char path[PATH_MAX];
+	struct dirent *dir;
+	struct stat st;
+	uint64_t sum = 0, h;
+	DIR *dirp;
+
+	dirp = opendir(dir_path);
+	if (!dirp)
+		return false;
+
+	while ((dir = readdir(dirp)) != NULL) {
+		if (dir->d_name[0] == '.' ||
+		    strncmp(dir->d_name, prefix, prefix_len))
+			continue;
+		snprintf(path, sizeof(path), "%s%s%s", dir->d_name,
+			 file ? "/" : "", file ? file : "");
+		if (fstatat(dirfd(dirp), path, &st, 0))
+			continue;
+
+		h = fnv1a(FNV1A_OFFSET, dir->d_name, strlen(dir->d_name));
+		h = fnv1a(h, &st.st_ino, sizeof(st.st_ino));
+		h = fnv1a(h, &st.st_rdev, sizeof(st.st_rdev));
+		h = fnv1a(h, &st.st_mode, sizeof(st.st_mode));
+		h = fnv1a(h, &st.st_uid, sizeof(st.st_uid));
+		h = fnv1a(h, &st.st_gid, sizeof(st.st_gid));
+		h = fnv1a(h, &st.st_size, sizeof(st.st_size));
+		h = fnv1a(h, &st.st_mtim, sizeof(st.st_mtim));
+		sum += h;
+	}
+	closedir(dirp);
+
+	*hash = fnv1a(*hash, &sum, sizeof(sum));
+	return true;
+}
+
+/* topology_finish_node_hash - node hash from the summed hashes of its files
+ *	Adds HSA_OVERRIDE_GFX_VERSION, which changes the parsed properties, and
+ *	never returns 0, which is kept for nodes that can't be read.
+ */
+static uint64_t topology_finish_node_hash(uint64_t hash)
+{
+	const char *envvar = getenv("HSA_OVERRIDE_GFX_VERSION");
+
+	if (envvar)
+		hash += fnv1a(FNV1A_OFFSET, envvar, strlen(envvar));
+
+	return hash ? hash : 1;
+}
+
+/* Adds the properties files of the first @num entries of a node subdirectory */
+static bool topology_hash_subdir(uint64_t *hash, uint32_t sysfs_node_id,
+				 const char *subdir, uint32_t num)
+{
+	char path[256];
+	uint32_t i;
+
+	for (i = 0; i < num; i++) {
+		snprintf(path, sizeof(path), "%u/%s/%u/properties",
+			 sysfs_node_id, subdir, i);
+		if (sysfs_read_props(nodes_dir_fd, path, NULL, 0, NULL, NULL,
+				     NULL, hash) != HSAKMT_STATUS_SUCCESS)
+			return false;
+	}
+
+	return true;
+}
+
+/* topology_hash_node - hash of the sysfs files a node is read from
+ *	Covers the node's properties and gpu_id and the properties of the
+ *	memory banks, caches, IO links and P2P links they list. This is the
+ *	same hash topology_get_node_snapshot computes while reading the node,
+ *	without parsing anything but the node's properties. Returns 0 if the
+ *	node can't be read.
+ */
+static uint64_t topology_hash_node(uint32_t sysfs_node_id)
+{
+	HsaNodeProperties props = {0};
+	uint32_t gpu_id, num_p2pLinks = 0;
+	struct node_prop_ctx ctx = {
+		.props = &props,
+		.num_p2pLinks = &num_p2pLinks,
+	};
+	uint64_t hash = 0;
+	char path[256];
+
+	snprintf(path, sizeof(path), "%u/properties", sysfs_node_id);
+	if (sysfs_read_props(nodes_dir_fd, path, node_prop_table,
+			     ARRAY_LEN(node_prop_table), &props,
+			     node_prop_handler, &ctx, &hash) != HSAKMT_STATUS_SUCCESS ||
+	    topology_sysfs_get_gpu_id(sysfs_node_id, &gpu_id, &hash) != HSAKMT_STATUS_SUCCESS ||
+	    !topology_hash_subdir(&hash, sysfs_node_id, "mem_banks",
+				  props.NumMemoryBanks) ||
+	    !topology_hash_subdir(&hash, sysfs_node_id, "caches",
+				  props.NumCaches) ||
+	    !topology_hash_subdir(&hash, sysfs_node_id, "io_links",
+				  props.NumIOLinks - num_p2pLinks) ||
+	    !topology_hash_subdir(&hash, sysfs_node_id, "p2p_links",
+				  num_p2pLinks))
+		return 0;
+
+	return topology_finish_node_hash(hash);
+}
+
+static bool topology_cache_key(uint32_t gen, uint64_t *key)
+{
+	uint64_t hash = FNV1A_OFFSET;
+	char path[PATH_MAX];
+	gid_t groups[64];
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	const char *envvar;
+	int num_groups;
+
+	hash = fnv1a(hash, &gen, sizeof(gen));
+	if (!hash_file_at(&hash, AT_FDCWD, topology_path(path, sizeof(path), BOOT_ID_PATH)) ||
+	    !hash_file_at(&hash, AT_FDCWD, topology_path(path, sizeof(path), CPU_ONLINE_PATH)) ||
+	    !hash_dir_stats(&hash, topology_path(path, sizeof(path), KFD_SYSFS_PATH_NODES),
+			    "", "properties"))
+		return false;
+	/* Render node permissions decide which GPU nodes are supported */
+	hash_dir_stats(&hash, DRM_DEVICE_DIR, "renderD", NULL);
+
+	hash = fnv1a(hash, &uid, sizeof(uid));
+	hash = fnv1a(hash, &gid, sizeof(gid));
+	num_groups = getgroups(ARRAY_LEN(groups), groups);
+	if (num_groups < 0)
+		return false;
+	hash = fnv1a(hash, groups, num_groups * sizeof(gid_t));
+
+	envvar = getenv("HSA_OVERRIDE_GFX_VERSION");
+	if (envvar)
+		hash = fnv1a(hash, envvar, strlen(envvar) + 1);
+
+	*key = hash;
+	return true;
+}
+
+static bool topology_cache_path(char *path, size_t size)
+{
+	const char *envvar = getenv(TOPOLOGY_CACHE_ENV);
+	const char *dir;
+
+	if (!envvar || !*envvar || !strcmp(envvar, "0"))
+		return false;
+
+	if (strcmp(envvar, "1")) {
+		snprintf(path, size, "%s", envvar);
+		return true;
+	}
+
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (!dir || !*dir)
+		return false;
+	snprintf(path, size, "%s/%s", dir, TOPOLOGY_CACHE_NAME);
+	return true;
+}
+
+/* topology_cache_file - Path and key of a cache kept next to the topology
+ * cache, e.g. for data derived from the topology. @suffix is appended to
+ * the topology cache path. Returns false if caching is disabled.
+ */
+bool topology_cache_file(const char *suffix, char *path, size_t size,
+			 uint64_t *key)
+{
+	char cache_path[PATH_MAX];
+	uint32_t gen;
+
+	if (!topology_cache_path(cache_path, sizeof(cache_path)) ||
+	    topology_sysfs_get_generation(&gen) != HSAKMT_STATUS_SUCCESS ||
+	    !topology_cache_key(gen, key))
+		return false;
+
+	return snprintf(path, size, "%s%s", cache_path, suffix) < (int)size;
+}
+
+static size_t topology_cache_size(const HsaSystemProperties *sys_props,
+				  const node_props_t *props)
+{
+	size_t size;
+	uint32_t i;
+
+	size = CACHE_ALIGN(sizeof(struct topology_cache_header)) +
+		CACHE_ALIGN(sizeof(HsaSystemProperties)) +
+		CACHE_ALIGN(num_sysfs_nodes * sizeof(uint32_t));
+	for (i = 0; i < sys_props->NumNodes; i++)
+		size += CACHE_ALIGN(sizeof(struct topology_cache_node)) +
+			CACHE_ALIGN(props[i].node.NumMemoryBanks * sizeof(HsaMemoryProperties)) +
+			CACHE_ALIGN(props[i].node.NumCaches * sizeof(HsaCacheProperties)) +
+			CACHE_ALIGN(props[i].node.NumIOLinks * sizeof(HsaIoLinkProperties));
+
+	return size;
+}
+
+/* Appends @size bytes at *@offset of @buf and pads to 8 bytes */
+static void cache_put(char *buf, size_t *offset, const void *data, size_t size)
+{
+	if (size)
+		memcpy(buf + *offset, data, size);
+	*offset += CACHE_ALIGN(size);
+}
+
+static void topology_save_cache(const char *path, uint64_t key,
+				const HsaSystemProperties *sys_props,
+				const node_props_t *props)
+{
+	struct topology_cache_header header = {0};
+	struct topology_cache_node node;
+	char tmp_path[PATH_MAX + 8];
+	size_t size, offset = 0;
+	uint32_t i;
+	char *buf;
+	int fd;
+
+	if (map_user_to_sysfs_node_id_size < num_sysfs_nodes)
+		return;
+
+	size = topology_cache_size(sys_props, props);
+	buf = calloc(1, size);
+	if (!buf)
+		return;
+
+	header.magic = TOPOLOGY_CACHE_MAGIC;
+	header.version = TOPOLOGY_CACHE_VERSION;
+	header.system_size = sizeof(HsaSystemProperties);
+	header.node_size = sizeof(struct topology_cache_node);
+	header.mem_size = sizeof(HsaMemoryProperties);
+	header.cache_size = sizeof(HsaCacheProperties);
+	header.link_size = sizeof(HsaIoLinkProperties);
+	header.num_nodes = sys_props->NumNodes;
+	header.num_sysfs_nodes = num_sysfs_nodes;
+	header.map_size = num_sysfs_nodes;
+	header.key = key;
+	header.total_size = size;
+
+	cache_put(buf, &offset, &header, sizeof(header));
+	cache_put(buf, &offset, sys_props, sizeof(*sys_props));
+	cache_put(buf, &offset, map_user_to_sysfs_node_id,
+		  num_sysfs_nodes * sizeof(uint32_t));
+	for (i = 0; i < sys_props->NumNodes; i++) {
+		memset(&node, 0, sizeof(node));
+		node.gpu_id = props[i].gpu_id;
+		node.num_direct_links = props[i].num_direct_links;
+		node.node = props[i].node;
+		cache_put(buf, &offset, &node, sizeof(node));
+		cache_put(buf, &offset, props[i].mem,
+			  props[i].node.NumMemoryBanks * sizeof(HsaMemoryProperties));
+		cache_put(buf, &offset, props[i].cache,
+			  props[i].node.NumCaches * sizeof(HsaCacheProperties));
+		cache_put(buf, &offset, props[i].link,
+			  props[i].node.NumIOLinks * sizeof(HsaIoLinkProperties));
+	}
+	assert(offset == size);
+	((struct topology_cache_header *)buf)->checksum =
+		fnv1a(FNV1A_OFFSET, buf + CACHE_ALIGN(sizeof(header)),
+		      size - CACHE_ALIGN(sizeof(header)));
+
+	/* Write a temporary file and rename it, so that concurrent readers
+	 * see either the old or the new cache
+	 */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		pr_debug("Failed to create topology cache %s\n", tmp_path);
+		goto out;
+	}
+	if (write(fd, buf, size) != (ssize_t)size || rename(tmp_path, path)) {
+		pr_debug("Failed to write topology cache %s\n", path);
+		unlink(tmp_path);
+	}
+	close(fd);
+
+out:
+	free(buf);
+}
+
+/* Returns the @size bytes at *@offset of the cache and advances *@offset,
+ * or NULL if they are out of bounds
+ */
+static const void *cache_get(const char *buf, size_t total, size_t *offset,
+			     size_t size)
+{
+	const void *p = buf + *offset;
+
+	if (size > total || *offset > total - size)
+		return NULL;
+	*offset += CACHE_ALIGN(size);
+
+	return p;
+}
+
+static HSAKMT_STATUS topology_load_cache(const char *path, uint64_t key,
+					 HsaSystemProperties *sys_props,
+					 node_props_t **props_out)
+{
+	struct topology_cache_header header;
+	struct topology_cache_node node;
+	node_props_t *props = NULL;
+	const void *data;
+	HSAKMT_STATUS ret = HSAKMT_STATUS_ERROR;
+	void *map;
+	size_t offset = 0, size;
+	uint32_t *sysfs_map;
+	struct stat st;
+	const char *buf;
+	uint32_t i;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return HSAKMT_STATUS_ERROR;
+
+	/* Only trust caches written by this user and not writable by others */
+	if (fstat(fd, &st) || st.st_uid != getuid() || (st.st_mode & 022) ||
+	    (size_t)st.st_size < sizeof(header)) {
+		close(fd);
+		return HSAKMT_STATUS_ERROR;
+	}
+	size = st.st_size;
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return HSAKMT_STATUS_ERROR;
+	buf = map;
+
+	memcpy(&header, cache_get(buf, size, &offset, sizeof(header)), sizeof(header));
+	if (header.magic != TOPOLOGY_CACHE_MAGIC ||
+	    header.version != TOPOLOGY_CACHE_VERSION ||
+	    header.system_size != sizeof(HsaSystemProperties) ||
+	    header.node_size != sizeof(struct topology_cache_node) ||
+	    header.mem_size != sizeof(HsaMemoryProperties) ||
+	    header.cache_size != sizeof(HsaCacheProperties) ||
+	    header.link_size != sizeof(HsaIoLinkProperties) ||
+	    header.key != key || header.total_size != size ||
+	    header.map_size != header.num_sysfs_nodes ||
+	    header.num_nodes > header.num_sysfs_nodes ||
+	    header.checksum != fnv1a(FNV1A_OFFSET, buf + offset, size - offset))
+		goto out;
+
+	data = cache_get(buf, size, &offset, sizeof(*sys_props));
+	if (!data)
+		goto out;
+	memcpy(sys_props, data, sizeof(*sys_props));
+	if (sys_props->NumNodes != header.num_nodes)
+		goto out;
+
+	data = cache_get(buf, size, &offset, header.map_size * sizeof(uint32_t));
+	if (!data)
+		goto out;
+	sysfs_map = calloc(header.map_size ? header.map_size : 1, sizeof(uint32_t));
+	if (!sysfs_map) {
+		ret = HSAKMT_STATUS_NO_MEMORY;
+		goto out;
+	}
+	memcpy(sysfs_map, data, header.map_size * sizeof(uint32_t));
+
+	props = calloc(sys_props->NumNodes ? sys_props->NumNodes : 1, sizeof(node_props_t));
+	if (!props) {
+		free(sysfs_map);
+		ret = HSAKMT_STATUS_NO_MEMORY;
+		goto out;
+	}
+
+	for (i = 0; i < sys_props->NumNodes; i++) {
+		data = cache_get(buf, size, &offset, sizeof(node));
+		if (!data)
+			goto err_props;
+		memcpy(&node, data, sizeof(node));
+		if (node.node.NumIOLinks > sys_props->NumNodes - 1 ||
+		    node.num_direct_links > node.node.NumIOLinks)
+			goto err_props;
+
+		props[i].gpu_id = node.gpu_id;
+		props[i].num_direct_links = node.num_direct_links;
+		props[i].node = node.node;
+		props[i].mem = calloc(node.node.NumMemoryBanks, sizeof(HsaMemoryProperties));
+		props[i].cache = calloc(node.node.NumCaches, sizeof(HsaCacheProperties));
+		/* Same size as a parsed snapshot, see topology_get_node_snapshot */
+		props[i].link = calloc(sys_props->NumNodes - 1, sizeof(HsaIoLinkProperties));
+		if ((node.node.NumMemoryBanks && !props[i].mem) ||
+		    (node.node.NumCaches && !props[i].cache) ||
+		    (sys_props->NumNodes > 1 && !props[i].link)) {
+			ret = HSAKMT_STATUS_NO_MEMORY;
+			goto err_props;
+		}
+
+		data = cache_get(buf, size, &offset,
+				 node.node.NumMemoryBanks * sizeof(HsaMemoryProperties));
+		if (!data)
+			goto err_props;
+		memcpy(props[i].mem, data, node.node.NumMemoryBanks * sizeof(HsaMemoryProperties));
+
+		data = cache_get(buf, size, &offset,
+				 node.node.NumCaches * sizeof(HsaCacheProperties));
+		if (!data)
+			goto err_props;
+		memcpy(props[i].cache, data, node.node.NumCaches * sizeof(HsaCacheProperties));
+
+		data = cache_get(buf, size, &offset,
+				 node.node.NumIOLinks * sizeof(HsaIoLinkProperties));
+		if (!data)
+			goto err_props;
+		memcpy(props[i].link, data, node.node.NumIOLinks * sizeof(HsaIoLinkProperties));
+	}
+
+	free(map_user_to_sysfs_node_id);
+	map_user_to_sysfs_node_id = sysfs_map;
+	map_user_to_sysfs_node_id_size = header.map_size;
+	num_sysfs_nodes = header.num_sysfs_nodes;
+
+	*props_out = props;
+	ret = HSAKMT_STATUS_SUCCESS;
+	goto out;
+
+err_props:
+	free_properties(props, sys_props->NumNodes);
+	free(sysfs_map);
+out:
+	munmap(map, size);
+	return ret;
+}
+
+HSAKMT_STATUS topology_take_snapshot(void)
+{
+	uint32_t gen_start, gen_end;
+	HsaSystemProperties sys_props;
+	node_props_t *temp_props = 0;
+	HSAKMT_STATUS ret = HSAKMT_STATUS_SUCCESS;
+	bool p2p_links = false;
+	struct topology_snapshot *snapshot;
+	char cache_path[PATH_MAX];
+	bool use_cache;
+	uint64_t cache_key = 0;
+	/* The current snapshot, its nodes are reused if they didn't change */
+	const uint32_t old_num_sysfs_nodes = num_sysfs_nodes;
+	const uint32_t num_old_nodes = g_system && g_props ? g_system->NumNodes : 0;
+	const node_props_t *old_props;
+
+	use_cache = topology_cache_path(cache_path, sizeof(cache_path));
+
+retry:
+	ret = topology_sysfs_get_generation(&gen_start);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto err;
+
+	if (use_cache && topology_cache_key(gen_start, &cache_key)) {
+		if (topology_load_cache(cache_path, cache_key, &sys_props,
+					&temp_props) == HSAKMT_STATUS_SUCCESS)
+			goto publish;
+	} else
+		use_cache = false;
+
+	ret = topology_sysfs_get_system_props(&sys_props);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto err;
+	if (sys_props.NumNodes > 0) {
+		temp_props = calloc(sys_props.NumNodes * sizeof(node_props_t), 1);
+		if (!temp_props) {
+			ret = HSAKMT_STATUS_NO_MEMORY;
+			goto err;
+		}
+		old_props = NULL;
+		if (topology_nodes_reusable(g_props, num_old_nodes,
+					    old_num_sysfs_nodes, &sys_props))
+			old_props = g_props;
+		ret = topology_get_nodes_snapshot(&sys_props, temp_props,
+						  old_props, num_old_nodes,
+						  &p2p_links);
+		if (ret != HSAKMT_STATUS_SUCCESS) {
+			free_properties(temp_props, sys_props.NumNodes);
+			goto err;
+		}
+	}
+
+	if (!p2p_links) {
+		/* All direct IO links are created in the kernel. Here we need to
+		 * connect GPU<->GPU or GPU<->CPU indirect IO links.
+		 */
+		topology_create_indirect_gpu_links(&sys_props, temp_props);
+	}
+
+	ret = topology_sysfs_get_generation(&gen_end);
+	if (ret != HSAKMT_STATUS_SUCCESS) {
+		free_properties(temp_props, sys_props.NumNodes);
+		goto err;
+	}
+
+	if (gen_start != gen_end) {
 		free_properties(temp_props, sys_props.NumNodes);
 		temp_props = 0;
 		goto retry;
 	}
 
+	if (use_cache)
+		topology_save_cache(cache_path, cache_key, &sys_props, temp_props);
+
+publish:
 	if (!g_system) {
 		g_system = malloc(sizeof(HsaSystemProperties));
 		if (!g_system) {
@@ -2059,11 +3117,19 @@ retry:
 	}
 
 	*g_system = sys_props;
-	if (g_props)
-		free(g_props);
+	/* Reused nodes were copied, so the old nodes are freed with their
+	 * arrays. Published snapshots hold their own copies.
+	 */
+	free_properties(g_props, num_old_nodes);
 	g_props = temp_props;
+
+	snapshot = topology_create_snapshot();
+	if (!snapshot) {
+		pr_err("Failed to allocate topology snapshot\n");
+		ret = HSAKMT_STATUS_NO_MEMORY;
+	}
+	topology_replace_snapshot(snapshot);
 err:
-	free(cpuinfo);
 	return ret;
 }
 
@@ -2078,6 +3144,8 @@ HSAKMT_STATUS topology_drop_snapshot(void)
 		goto out;
 	}
 
+	topology_replace_snapshot(NULL);
+
 	if (g_props) {
 		/* Remove state */
 		free_properties(g_props, g_system->NumNodes);
@@ -2093,6 +3161,11 @@ HSAKMT_STATUS topology_drop_snapshot(void)
 		map_user_to_sysfs_node_id_size = 0;
 	}
 
+	if (nodes_dir_fd >= 0) {
+		close(nodes_dir_fd);
+		nodes_dir_fd = -1;
+	}
+
 	err = HSAKMT_STATUS_SUCCESS;
 
 out:
@@ -2109,6 +3182,32 @@ HSAKMT_STATUS validate_nodeid(uint32_t nodeid, uint32_t *gpu_id)
 	return HSAKMT_STATUS_SUCCESS;
 }
 
+/* Copies the GPU IDs of all nodes, 0 for CPU nodes, for callers that
+ * translate many node IDs at once
+ */
+HSAKMT_STATUS get_node_gpu_ids(uint32_t **gpu_ids, uint32_t *num_nodes)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&hsakmt_mutex);
+	if (!g_props || !g_system) {
+		pthread_mutex_unlock(&hsakmt_mutex);
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+	}
+
+	*gpu_ids = malloc(sizeof(uint32_t) * g_system->NumNodes);
+	if (!*gpu_ids) {
+		pthread_mutex_unlock(&hsakmt_mutex);
+		return HSAKMT_STATUS_NO_MEMORY;
+	}
+	for (i = 0; i < g_system->NumNodes; i++)
+		(*gpu_ids)[i] = g_props[i].gpu_id;
+	*num_nodes = g_system->NumNodes;
+	pthread_mutex_unlock(&hsakmt_mutex);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
 HSAKMT_STATUS gpuid_to_nodeid(uint32_t gpu_id, uint32_t *node_id)
 {
 	uint64_t node_idx;
@@ -2162,22 +3261,10 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtReleaseSystemProperties(void)
 	return err;
 }
 
-HSAKMT_STATUS HSAKMTAPI hsaKmtGetNodeProperties(HSAuint32 NodeId,
-						HsaNodeProperties *NodeProperties)
+/* Node properties as reported to the user. Assume lock is held. */
+static void get_exported_node_props(uint32_t NodeId, uint32_t gpu_id,
+				    HsaNodeProperties *NodeProperties)
 {
-	HSAKMT_STATUS err;
-	uint32_t gpu_id;
-
-	if (!NodeProperties)
-		return HSAKMT_STATUS_INVALID_PARAMETER;
-
-	CHECK_KFD_OPEN();
-	pthread_mutex_lock(&hsakmt_mutex);
-
-	err = validate_nodeid(NodeId, &gpu_id);
-	if (err != HSAKMT_STATUS_SUCCESS)
-		goto out;
-
 	*NodeProperties = g_props[NodeId].node;
 	/* For CPU only node don't add any additional GPU memory banks. */
 	if (gpu_id) {
@@ -2190,22 +3277,15 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtGetNodeProperties(HSAuint32 NodeId,
 				&limit) == HSAKMT_STATUS_SUCCESS)
 			NodeProperties->NumMemoryBanks += 1;
 	}
-	err = HSAKMT_STATUS_SUCCESS;
-
-out:
-	pthread_mutex_unlock(&hsakmt_mutex);
-	return err;
 }
 
-HSAKMT_STATUS HSAKMTAPI hsaKmtGetNodeMemoryProperties(HSAuint32 NodeId,
-						      HSAuint32 NumBanks,
-						      HsaMemoryProperties *MemoryProperties)
+HSAKMT_STATUS HSAKMTAPI hsaKmtGetNodeProperties(HSAuint32 NodeId,
+						HsaNodeProperties *NodeProperties)
 {
-	HSAKMT_STATUS err = HSAKMT_STATUS_SUCCESS;
-	uint32_t i, gpu_id;
-	HSAuint64 aperture_limit;
+	HSAKMT_STATUS err;
+	uint32_t gpu_id;
 
-	if (!MemoryProperties)
+	if (!NodeProperties)
 		return HSAKMT_STATUS_INVALID_PARAMETER;
 
 	CHECK_KFD_OPEN();
@@ -2215,6 +3295,24 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtGetNodeMemoryProperties(HSAuint32 NodeId,
 	if (err != HSAKMT_STATUS_SUCCESS)
 		goto out;
 
+	get_exported_node_props(NodeId, gpu_id, NodeProperties);
+	err = HSAKMT_STATUS_SUCCESS;
+
+out:
+	pthread_mutex_unlock(&hsakmt_mutex);
+	return err;
+}
+
+/* Memory banks as reported to the user, including the LDS, scratch, SVM
+ * and MMIO apertures of GPU nodes. Assume lock is held.
+ */
+static void get_exported_mem_props(uint32_t NodeId, uint32_t gpu_id,
+				   uint32_t NumBanks,
+				   HsaMemoryProperties *MemoryProperties)
+{
+	HSAuint64 aperture_limit;
+	uint32_t i;
+
 	memset(MemoryProperties, 0, NumBanks * sizeof(HsaMemoryProperties));
 
 	for (i = 0; i < MIN(g_props[NodeId].node.NumMemoryBanks, NumBanks); i++) {
@@ -2224,7 +3322,7 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtGetNodeMemoryProperties(HSAuint32 NodeId,
 
 	/* The following memory banks does not apply to CPU only node */
 	if (gpu_id == 0)
-		goto out;
+		return;
 
 	/*Add LDS*/
 	if (i < NumBanks &&
@@ -2275,6 +3373,26 @@ HSAKMT_STATUS HSAKMTAPI hsaKmtGetNodeMemoryProperties(HSAuint32 NodeId,
 		MemoryProperties[i].SizeInBytes = (aperture_limit - MemoryProperties[i].VirtualBaseAddress) + 1;
 		i++;
 	}
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtGetNodeMemoryProperties(HSAuint32 NodeId,
+						      HSAuint32 NumBanks,
+						      HsaMemoryProperties *MemoryProperties)
+{
+	HSAKMT_STATUS err = HSAKMT_STATUS_SUCCESS;
+	uint32_t gpu_id;
+
+	if (!MemoryProperties)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	CHECK_KFD_OPEN();
+	pthread_mutex_lock(&hsakmt_mutex);
+
+	err = validate_nodeid(NodeId, &gpu_id);
+	if (err != HSAKMT_STATUS_SUCCESS)
+		goto out;
+
+	get_exported_mem_props(NodeId, gpu_id, NumBanks, MemoryProperties);
 
 out:
 	pthread_mutex_unlock(&hsakmt_mutex);
@@ -2355,6 +3473,259 @@ out:
 	return err;
 }
 
+/* topology_compute_distances - all-pairs shortest paths between nodes
+ *	Runs Floyd-Warshall over the direct IO links reported by the kernel,
+ *	not the indirect ones that already sum up several links. Paths with a
+ *	lower weight win, equal weights are broken by the number of hops.
+ *	@dist holds num_nodes * num_nodes entries, indexed [from * num_nodes + to].
+ */
+static void topology_compute_distances(uint32_t num_nodes, const node_props_t *props,
+				       HsaNodeDistance *dist)
+{
+	uint32_t i, j, k;
+
+	for (i = 0; i < num_nodes; i++) {
+		for (j = 0; j < num_nodes; j++) {
+			HsaNodeDistance *d = &dist[i * num_nodes + j];
+
+			memset(d, 0, sizeof(*d));
+			d->Weight = i == j ? 0 : HSA_NODE_DISTANCE_UNREACHABLE;
+			d->NextHop = j;
+			d->IoLinkType = HSA_IOLINKTYPE_UNDEFINED;
+		}
+
+		for (k = 0; k < props[i].num_direct_links; k++) {
+			const HsaIoLinkProperties *link = &props[i].link[k];
+			HsaNodeDistance *d;
+
+			if (link->NodeTo >= num_nodes || link->NodeTo == i)
+				continue;
+			d = &dist[i * num_nodes + link->NodeTo];
+			/* Keep the lightest of parallel links */
+			if (d->NumHops && d->Weight <= link->Weight)
+				continue;
+			d->Weight = link->Weight;
+			d->NumHops = 1;
+			d->MinimumBandwidth = link->MinimumBandwidth;
+			d->MaximumBandwidth = link->MaximumBandwidth;
+			d->IoLinkType = link->IoLinkType;
+		}
+	}
+
+	for (k = 0; k < num_nodes; k++) {
+		for (i = 0; i < num_nodes; i++) {
+			const HsaNodeDistance *ik = &dist[i * num_nodes + k];
+
+			if (i == k || ik->Weight == HSA_NODE_DISTANCE_UNREACHABLE)
+				continue;
+
+			for (j = 0; j < num_nodes; j++) {
+				const HsaNodeDistance *kj = &dist[k * num_nodes + j];
+				HsaNodeDistance *ij = &dist[i * num_nodes + j];
+				uint64_t weight;
+				uint32_t hops;
+
+				if (i == j || k == j ||
+				    kj->Weight == HSA_NODE_DISTANCE_UNREACHABLE)
+					continue;
+
+				weight = (uint64_t)ik->Weight + kj->Weight;
+				if (weight >= HSA_NODE_DISTANCE_UNREACHABLE)
+					continue;
+				hops = ik->NumHops + kj->NumHops;
+				if (weight > ij->Weight ||
+				    (weight == ij->Weight && hops >= ij->NumHops))
+					continue;
+
+				ij->Weight = (uint32_t)weight;
+				ij->NumHops = hops;
+				ij->NextHop = ik->NextHop;
+				ij->IoLinkType = ik->IoLinkType;
+				ij->MinimumBandwidth = MIN(ik->MinimumBandwidth,
+							   kj->MinimumBandwidth);
+				ij->MaximumBandwidth = MIN(ik->MaximumBandwidth,
+							   kj->MaximumBandwidth);
+			}
+		}
+	}
+}
+
+/* Immutable copy of g_system and g_props, as reported by the
+ * hsaKmtGetNode*Properties functions. The node array, the distance matrix
+ * and all property arrays live in the same allocation, right after the
+ * header.
+ */
+struct topology_snapshot {
+	HsaTopologySnapshot pub;
+	uint32_t refcount;
+};
+
+static struct topology_snapshot *g_snapshot;
+/* Only serializes replacing g_snapshot against taking a new reference */
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Assume lock is held. */
+static struct topology_snapshot *topology_create_snapshot(void)
+{
+	uint32_t i, num_nodes = g_system->NumNodes;
+	struct topology_snapshot *snap;
+	HsaNodeSnapshot *nodes;
+	HsaNodeDistance *distances;
+	HsaNodeProperties props;
+	size_t size;
+	char *p;
+
+	size = ALIGN_UP(sizeof(*snap), 8) +
+		ALIGN_UP(num_nodes * sizeof(HsaNodeSnapshot), 8) +
+		ALIGN_UP((size_t)num_nodes * num_nodes * sizeof(HsaNodeDistance), 8);
+	for (i = 0; i < num_nodes; i++) {
+		get_exported_node_props(i, g_props[i].gpu_id, &props);
+		size += ALIGN_UP(props.NumMemoryBanks * sizeof(HsaMemoryProperties), 8) +
+			ALIGN_UP(props.NumCaches * sizeof(HsaCacheProperties), 8) +
+			ALIGN_UP(props.NumIOLinks * sizeof(HsaIoLinkProperties), 8);
+	}
+
+	snap = calloc(1, size);
+	if (!snap)
+		return NULL;
+
+	p = (char *)snap + ALIGN_UP(sizeof(*snap), 8);
+	nodes = (HsaNodeSnapshot *)p;
+	p += ALIGN_UP(num_nodes * sizeof(HsaNodeSnapshot), 8);
+	distances = (HsaNodeDistance *)p;
+	p += ALIGN_UP((size_t)num_nodes * num_nodes * sizeof(HsaNodeDistance), 8);
+	topology_compute_distances(num_nodes, g_props, distances);
+
+	for (i = 0; i < num_nodes; i++) {
+		HsaMemoryProperties *mem = (HsaMemoryProperties *)p;
+		HsaCacheProperties *cache;
+		HsaIoLinkProperties *link;
+
+		get_exported_node_props(i, g_props[i].gpu_id, &nodes[i].Node);
+
+		get_exported_mem_props(i, g_props[i].gpu_id,
+				       nodes[i].Node.NumMemoryBanks, mem);
+		p += ALIGN_UP(nodes[i].Node.NumMemoryBanks * sizeof(*mem), 8);
+
+		cache = (HsaCacheProperties *)p;
+		if (nodes[i].Node.NumCaches)
+			memcpy(cache, g_props[i].cache,
+			       nodes[i].Node.NumCaches * sizeof(*cache));
+		p += ALIGN_UP(nodes[i].Node.NumCaches * sizeof(*cache), 8);
+
+		link = (HsaIoLinkProperties *)p;
+		if (nodes[i].Node.NumIOLinks)
+			memcpy(link, g_props[i].link,
+			       nodes[i].Node.NumIOLinks * sizeof(*link));
+		p += ALIGN_UP(nodes[i].Node.NumIOLinks * sizeof(*link), 8);
+
+		nodes[i].MemoryProperties = mem;
+		nodes[i].CacheProperties = cache;
+		nodes[i].IoLinkProperties = link;
+	}
+
+	snap->pub.SystemProperties = *g_system;
+	snap->pub.Nodes = nodes;
+	snap->pub.Distances = distances;
+	/* The reference held by g_snapshot */
+	snap->refcount = 1;
+
+	return snap;
+}
+
+static void topology_put_snapshot(struct topology_snapshot *snap)
+{
+	if (__atomic_sub_fetch(&snap->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(snap);
+}
+
+/* Publishes a new snapshot, or none. Readers holding a reference to the
+ * old one keep using it until they release it.
+ */
+static void topology_replace_snapshot(struct topology_snapshot *snap)
+{
+	struct topology_snapshot *old;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	old = g_snapshot;
+	g_snapshot = snap;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	if (old)
+		topology_put_snapshot(old);
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtAcquireTopologySnapshot(const HsaTopologySnapshot **Snapshot)
+{
+	struct topology_snapshot *snap;
+
+	if (!Snapshot)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	CHECK_KFD_OPEN();
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snap = g_snapshot;
+	if (snap)
+		__atomic_add_fetch(&snap->refcount, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	/* No snapshot before hsaKmtAcquireSystemProperties or after
+	 * hsaKmtReleaseSystemProperties
+	 */
+	if (!snap)
+		return HSAKMT_STATUS_INVALID_NODE_UNIT;
+
+	*Snapshot = &snap->pub;
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtReleaseTopologySnapshot(const HsaTopologySnapshot *Snapshot)
+{
+	if (!Snapshot)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	topology_put_snapshot((struct topology_snapshot *)(uintptr_t)Snapshot);
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+HSAKMT_STATUS HSAKMTAPI hsaKmtGetNodeDistanceMatrix(HSAuint32 NumNodes,
+						    HsaNodeDistance *Distances)
+{
+	struct topology_snapshot *snap;
+	HSAKMT_STATUS err;
+
+	if (!Distances)
+		return HSAKMT_STATUS_INVALID_PARAMETER;
+
+	CHECK_KFD_OPEN();
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snap = g_snapshot;
+
+	/* No snapshot before hsaKmtAcquireSystemProperties or after
+	 * hsaKmtReleaseSystemProperties
+	 */
+	if (!snap) {
+		err = HSAKMT_STATUS_INVALID_NODE_UNIT;
+		goto out;
+	}
+
+	if (NumNodes != snap->pub.SystemProperties.NumNodes) {
+		err = HSAKMT_STATUS_INVALID_PARAMETER;
+		goto out;
+	}
+
+	memcpy(Distances, snap->pub.Distances,
+	       (size_t)NumNodes * NumNodes * sizeof(*Distances));
+	err = HSAKMT_STATUS_SUCCESS;
+
+out:
+	pthread_mutex_unlock(&snapshot_mutex);
+	return err;
+}
+
 uint32_t get_gfxv_by_node_id(HSAuint32 node_id)
 {
 	return HSA_GET_GFX_VERSION_FULL(g_props[node_id].node.EngineId.ui32);
@@ -0,0 +1,532 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Preloadable KFD interposer, see kfd_mock.h */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "linux/kfd_ioctl.h"
+#include "kfd_mock.h"
+#include "topology_fixture.h"
+
+#define KFD_DEVICE		"/dev/kfd"
+#define DRM_RENDER_DEVICE	"/dev/dri/renderD"
+
+#define MOCK_MAX_FDS		4096
+#define MOCK_MAX_QUEUES		1024
+
+/* Same encoding KFD uses for mmap offsets on /dev/kfd */
+#define MOCK_MMAP_TYPE_SHIFT	62
+#define MOCK_MMAP_TYPE_DOORBELL	(0x3ULL << MOCK_MMAP_TYPE_SHIFT)
+#define MOCK_MMAP_GPU_ID(gpu_id) (((uint64_t)(gpu_id) & 0xFFFF) << 46)
+
+enum mock_fd_kind {
+	MOCK_FD_NONE = 0,
+	MOCK_FD_KFD,
+	MOCK_FD_RENDER,
+};
+
+static unsigned char fd_kind[MOCK_MAX_FDS];
+static bool mock_enabled;
+static unsigned int mock_num_gpus = 1;
+static char mock_root[PATH_MAX];
+
+static pthread_mutex_t mock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool mock_queue_used[MOCK_MAX_QUEUES];
+static uint64_t mock_next_handle = 1;
+
+static __thread uint64_t stage_ns[KFD_MOCK_STAGE_MAX];
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+static DIR *(*real_opendir)(const char *);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+
+#define RESOLVE(fn) do {					\
+		if (!real_##fn)					\
+			real_##fn = dlsym(RTLD_NEXT, #fn);	\
+	} while (0)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+__attribute__((visibility("default")))
+void kfd_mock_stage_times(uint64_t ns[KFD_MOCK_STAGE_MAX])
+{
+	memcpy(ns, stage_ns, sizeof(stage_ns));
+}
+
+static enum mock_fd_kind get_fd_kind(int fd)
+{
+	if (fd < 0 || fd >= MOCK_MAX_FDS)
+		return MOCK_FD_NONE;
+	return fd_kind[fd];
+}
+
+static void set_fd_kind(int fd, enum mock_fd_kind kind)
+{
+	if (fd >= 0 && fd < MOCK_MAX_FDS)
+		fd_kind[fd] = kind;
+}
+
+static enum mock_fd_kind path_fd_kind(const char *path)
+{
+	if (!strcmp(path, KFD_DEVICE))
+		return MOCK_FD_KFD;
+	if (!strncmp(path, DRM_RENDER_DEVICE, strlen(DRM_RENDER_DEVICE)))
+		return MOCK_FD_RENDER;
+	return MOCK_FD_NONE;
+}
+
+/* Redirects paths in the KFD sysfs topology to the synthetic tree */
+static const char *mock_path(const char *path, char *buf, size_t size)
+{
+	size_t len = strlen(KFD_FIXTURE_TOPOLOGY);
+
+	if (!mock_root[0] || !path || strncmp(path, KFD_FIXTURE_TOPOLOGY, len))
+		return path;
+
+	snprintf(buf, size, "%s%s", mock_root, path);
+	return buf;
+}
+
+static void __attribute__((constructor)) kfd_mock_init(void)
+{
+	const char *env;
+
+	RESOLVE(open);
+	RESOLVE(openat);
+	RESOLVE(fopen);
+	RESOLVE(opendir);
+	RESOLVE(close);
+	RESOLVE(ioctl);
+	RESOLVE(mmap);
+
+	env = getenv("KFD_MOCK");
+	if (!env || !atoi(env))
+		return;
+
+	env = getenv("KFD_MOCK_NUM_GPUS");
+	if (env && atoi(env) > 0)
+		mock_num_gpus = atoi(env) < KFD_FIXTURE_MAX_GPUS ? atoi(env) : KFD_FIXTURE_MAX_GPUS;
+
+	mock_enabled = true;
+
+	/* libhsakmt reads a fixture tree directly, nothing to redirect */
+	if (getenv("HSAKMT_SYSFS_ROOT"))
+		return;
+
+	snprintf(mock_root, sizeof(mock_root), "%s/kfdmock.XXXXXX",
+		 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(mock_root) || kfd_fixture_write(mock_root, mock_num_gpus)) {
+		fprintf(stderr, "kfdmock: failed to create topology in %s\n",
+			mock_root);
+		kfd_fixture_remove(mock_root);
+		mock_enabled = false;
+		mock_root[0] = '\0';
+	}
+}
+
+static void __attribute__((destructor)) kfd_mock_fini(void)
+{
+	if (mock_root[0])
+		kfd_fixture_remove(mock_root);
+}
+
+/*
+ * File system interposers
+ */
+static int mock_open_device(const char *path, int flags)
+{
+	enum mock_fd_kind kind = path_fd_kind(path);
+	int fd;
+
+	if (kind == MOCK_FD_NONE)
+		return -2;
+
+	if (mock_enabled)
+		fd = real_open("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+	else
+		fd = real_open(path, flags);
+
+	if (fd >= 0)
+		set_fd_kind(fd, kind);
+
+	return fd;
+}
+
+static int do_open(const char *path, int flags, mode_t mode)
+{
+	char buf[PATH_MAX];
+	int fd;
+
+	RESOLVE(open);
+	fd = mock_open_device(path, flags);
+	if (fd != -2)
+		return fd;
+
+	return real_open(mock_path(path, buf, sizeof(buf)), flags, mode);
+}
+
+__attribute__((visibility("default")))
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return do_open(path, flags, mode);
+}
+
+__attribute__((visibility("default")))
+int open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return do_open(path, flags, mode);
+}
+
+static int do_openat(int dirfd, const char *path, int flags, mode_t mode)
+{
+	RESOLVE(openat);
+	if (path && path[0] == '/')
+		return do_open(path, flags, mode);
+
+	return real_openat(dirfd, path, flags, mode);
+}
+
+__attribute__((visibility("default")))
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return do_openat(dirfd, path, flags, mode);
+}
+
+__attribute__((visibility("default")))
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return do_openat(dirfd, path, flags, mode);
+}
+
+__attribute__((visibility("default")))
+FILE *fopen(const char *path, const char *mode)
+{
+	char buf[PATH_MAX];
+
+	RESOLVE(fopen);
+	return real_fopen(mock_path(path, buf, sizeof(buf)), mode);
+}
+
+__attribute__((visibility("default")))
+FILE *fopen64(const char *path, const char *mode)
+{
+	return fopen(path, mode);
+}
+
+__attribute__((visibility("default")))
+DIR *opendir(const char *path)
+{
+	char buf[PATH_MAX];
+
+	RESOLVE(opendir);
+	return real_opendir(mock_path(path, buf, sizeof(buf)));
+}
+
+__attribute__((visibility("default")))
+int close(int fd)
+{
+	RESOLVE(close);
+	set_fd_kind(fd, MOCK_FD_NONE);
+	return real_close(fd);
+}
+
+/*
+ * KFD ioctl emulation
+ */
+static enum kfd_mock_stage ioctl_stage(unsigned long request)
+{
+	switch (request) {
+	case AMDKFD_IOC_ALLOC_MEMORY_OF_GPU:
+	case AMDKFD_IOC_FREE_MEMORY_OF_GPU:
+	case AMDKFD_IOC_MAP_MEMORY_TO_GPU:
+	case AMDKFD_IOC_UNMAP_MEMORY_FROM_GPU:
+		return KFD_MOCK_STAGE_MEMORY;
+	case AMDKFD_IOC_CREATE_QUEUE:
+	case AMDKFD_IOC_DESTROY_QUEUE:
+	case AMDKFD_IOC_UPDATE_QUEUE:
+	case AMDKFD_IOC_SET_CU_MASK:
+		return KFD_MOCK_STAGE_QUEUE;
+	default:
+		return KFD_MOCK_STAGE_OTHER;
+	}
+}
+
+static int mock_get_apertures(struct kfd_ioctl_get_process_apertures_new_args *args)
+{
+	struct kfd_process_device_apertures *ap =
+		(struct kfd_process_device_apertures *)(uintptr_t)
+			args->kfd_process_device_apertures_ptr;
+	unsigned int i;
+
+	if (!ap) {
+		args->num_of_nodes = mock_num_gpus;
+		return 0;
+	}
+
+	for (i = 0; i < mock_num_gpus && i < args->num_of_nodes; i++) {
+		memset(&ap[i], 0, sizeof(ap[i]));
+		ap[i].gpu_id = KFD_FIXTURE_GPU_ID(i);
+		ap[i].lds_base = 1ULL << 48;
+		ap[i].lds_limit = ap[i].lds_base + 0xFFFFFFFF;
+		ap[i].scratch_base = 2ULL << 48;
+		ap[i].scratch_limit = ap[i].scratch_base + 0xFFFFFFFF;
+		ap[i].gpuvm_base = 0x10000;
+		ap[i].gpuvm_limit = (1ULL << 47) - 1;
+	}
+	args->num_of_nodes = i;
+
+	return 0;
+}
+
+static int mock_create_queue(struct kfd_ioctl_create_queue_args *args)
+{
+	unsigned int qid;
+
+	pthread_mutex_lock(&mock_mutex);
+	for (qid = 0; qid < MOCK_MAX_QUEUES && mock_queue_used[qid]; qid++)
+		;
+	if (qid < MOCK_MAX_QUEUES)
+		mock_queue_used[qid] = true;
+	pthread_mutex_unlock(&mock_mutex);
+
+	if (qid == MOCK_MAX_QUEUES) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	args->queue_id = qid;
+	/* SOC15: doorbell page offset plus 8 byte doorbell within the page */
+	args->doorbell_offset = MOCK_MMAP_TYPE_DOORBELL |
+				MOCK_MMAP_GPU_ID(args->gpu_id) | (qid * 8);
+
+	return 0;
+}
+
+static int mock_destroy_queue(struct kfd_ioctl_destroy_queue_args *args)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&mock_mutex);
+	if (args->queue_id >= MOCK_MAX_QUEUES || !mock_queue_used[args->queue_id]) {
+		errno = EINVAL;
+		ret = -1;
+	} else
+		mock_queue_used[args->queue_id] = false;
+	pthread_mutex_unlock(&mock_mutex);
+
+	return ret;
+}
+
+static int mock_kfd_ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case AMDKFD_IOC_GET_VERSION: {
+		struct kfd_ioctl_get_version_args *args = arg;
+
+		args->major_version = KFD_IOCTL_MAJOR_VERSION;
+		args->minor_version = KFD_IOCTL_MINOR_VERSION;
+		return 0;
+	}
+	case AMDKFD_IOC_GET_PROCESS_APERTURES_NEW:
+		return mock_get_apertures(arg);
+	case AMDKFD_IOC_ALLOC_MEMORY_OF_GPU: {
+		struct kfd_ioctl_alloc_memory_of_gpu_args *args = arg;
+		uint64_t handle = __atomic_fetch_add(&mock_next_handle, 1,
+						     __ATOMIC_RELAXED);
+
+		args->handle = ((uint64_t)args->gpu_id << 32) | handle;
+		if (!(args->flags & KFD_IOC_ALLOC_MEM_FLAGS_USERPTR))
+			args->mmap_offset = handle << 12;
+		return 0;
+	}
+	case AMDKFD_IOC_MAP_MEMORY_TO_GPU: {
+		struct kfd_ioctl_map_memory_to_gpu_args *args = arg;
+
+		args->n_success = args->n_devices;
+		return 0;
+	}
+	case AMDKFD_IOC_UNMAP_MEMORY_FROM_GPU: {
+		struct kfd_ioctl_unmap_memory_from_gpu_args *args = arg;
+
+		args->n_success = args->n_devices;
+		return 0;
+	}
+	case AMDKFD_IOC_CREATE_QUEUE:
+		return mock_create_queue(arg);
+	case AMDKFD_IOC_DESTROY_QUEUE:
+		return mock_destroy_queue(arg);
+	case AMDKFD_IOC_GET_CLOCK_COUNTERS: {
+		struct kfd_ioctl_get_clock_counters_args *args = arg;
+		uint64_t ns = now_ns();
+
+		args->gpu_clock_counter = ns / 10;
+		args->cpu_clock_counter = ns;
+		args->system_clock_counter = ns;
+		args->system_clock_freq = 1000000000ULL;
+		return 0;
+	}
+	case AMDKFD_IOC_ACQUIRE_VM:
+	case AMDKFD_IOC_FREE_MEMORY_OF_GPU:
+	case AMDKFD_IOC_SET_MEMORY_POLICY:
+	case AMDKFD_IOC_UPDATE_QUEUE:
+	case AMDKFD_IOC_SET_CU_MASK:
+	case AMDKFD_IOC_SET_SCRATCH_BACKING_VA:
+	case AMDKFD_IOC_SET_TRAP_HANDLER:
+		return 0;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+__attribute__((visibility("default")))
+int ioctl(int fd, unsigned long request, ...)
+{
+	enum mock_fd_kind kind = get_fd_kind(fd);
+	uint64_t start;
+	void *arg;
+	va_list ap;
+	int ret;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	RESOLVE(ioctl);
+	if (kind == MOCK_FD_NONE)
+		return real_ioctl(fd, request, arg);
+
+	start = now_ns();
+	if (!mock_enabled)
+		ret = real_ioctl(fd, request, arg);
+	else if (kind == MOCK_FD_KFD)
+		ret = mock_kfd_ioctl(request, arg);
+	else {
+		/* No DRM ioctls are emulated on the render nodes */
+		errno = ENOTTY;
+		ret = -1;
+	}
+	if (kind == MOCK_FD_KFD)
+		stage_ns[ioctl_stage(request)] += now_ns() - start;
+
+	return ret;
+}
+
+/*
+ * mmap of KFD and render node offsets. The mock backs them with shared
+ * anonymous memory.
+ */
+__attribute__((visibility("default")))
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	enum mock_fd_kind kind = get_fd_kind(fd);
+	enum kfd_mock_stage stage;
+	uint64_t start;
+	void *ret;
+
+	RESOLVE(mmap);
+	if (kind == MOCK_FD_NONE)
+		return real_mmap(addr, length, prot, flags, fd, offset);
+
+	stage = (kind == MOCK_FD_KFD &&
+		 ((uint64_t)offset & MOCK_MMAP_TYPE_DOORBELL) == MOCK_MMAP_TYPE_DOORBELL) ?
+		KFD_MOCK_STAGE_DOORBELL : KFD_MOCK_STAGE_MEMORY;
+
+	start = now_ns();
+	if (mock_enabled)
+		ret = real_mmap(addr, length, prot,
+				(flags & ~MAP_PRIVATE) | MAP_SHARED | MAP_ANONYMOUS,
+				-1, 0);
+	else
+		ret = real_mmap(addr, length, prot, flags, fd, offset);
+	stage_ns[stage] += now_ns() - start;
+
+	return ret;
+}
+
+__attribute__((visibility("default")))
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	return mmap(addr, length, prot, flags, fd, offset);
+}
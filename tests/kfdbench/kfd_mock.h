@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef KFD_MOCK_H_INCLUDED
+#define KFD_MOCK_H_INCLUDED
+
+#include <stdint.h>
+
+/* libkfdmock.so is preloaded into the benchmarks. It interposes the
+ * system calls libhsakmt uses to talk to KFD and accounts the time spent
+ * in them per calling thread, split into the stages below.
+ *
+ * With KFD_MOCK=1 it also emulates /dev/kfd, the DRM render nodes and a
+ * synthetic KFD sysfs topology of KFD_MOCK_NUM_GPUS (default 1) GPUs, so
+ * the benchmarks run on machines without a GPU. Without KFD_MOCK the
+ * calls are passed through to the real driver.
+ */
+
+enum kfd_mock_stage {
+	KFD_MOCK_STAGE_MEMORY = 0,	/* alloc/free/(un)map memory ioctls, BO mmaps */
+	KFD_MOCK_STAGE_QUEUE,		/* create/destroy/update queue ioctls */
+	KFD_MOCK_STAGE_DOORBELL,	/* doorbell page mmaps */
+	KFD_MOCK_STAGE_OTHER,		/* all other KFD ioctls */
+	KFD_MOCK_STAGE_MAX
+};
+
+/* Name of the function returning the calling thread's accumulated time
+ * per stage in nanoseconds. Look it up with dlsym(RTLD_DEFAULT, ...), it
+ * is only present when libkfdmock.so is preloaded.
+ */
+#define KFD_MOCK_STAGE_TIMES_FN "kfd_mock_stage_times"
+typedef void (*kfd_mock_stage_times_fn)(uint64_t ns[KFD_MOCK_STAGE_MAX]);
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/* Checks which NUMA nodes hsaKmtAllocMemoryNUMA binds host memory to. mbind
+ * and numa_max_node are interposed, so the test records the policies instead
+ * of applying them and pretends to run on a four node machine. The 8 GPU
+ * fixture is split into hives of two and only every fourth GPU is linked to
+ * the CPU: GPUs 2 and 6 reach the CPU through their hive peer, GPUs 3, 4, 7
+ * and 8 don't reach it at all.
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <numa.h>
+#include <numaif.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hsakmt.h"
+#include "topology_fixture.h"
+
+#ifndef MPOL_F_STATIC_NODES
+/* Missing from older numaif.h, as in fmm.c */
+#define MPOL_F_STATIC_NODES	(1 << 15)
+#endif
+
+/* Set in the child process */
+#define TEST_CHILD_ENV		"NUMA_TEST_CHILD"
+
+#define NUM_GPUS		8
+#define MAX_CALLS		8
+#define HUGE_PAGE_SIZE		(2UL << 20)
+
+static const struct kfd_fixture_opts fixture_opts = { 2, 0, 4, 0 };
+
+static struct mbind_call {
+	void *addr;
+	unsigned long len;
+	int mode;
+	unsigned long mask;
+} calls[MAX_CALLS];
+static unsigned int num_calls;
+static unsigned int num_failures;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, __VA_ARGS__);			\
+			fprintf(stderr, "\n");				\
+			num_failures++;					\
+		}							\
+	} while (0)
+
+long mbind(void *addr, unsigned long len, int mode, const unsigned long *nodemask,
+	   unsigned long maxnode, unsigned int flags)
+{
+	/* Only record the policies applied to new allocations */
+	if ((mode & ~MPOL_F_STATIC_NODES) == MPOL_DEFAULT || num_calls == MAX_CALLS)
+		return 0;
+
+	calls[num_calls].addr = addr;
+	calls[num_calls].len = len;
+	calls[num_calls].mode = mode;
+	calls[num_calls].mask = nodemask ? nodemask[0] : 0;
+	num_calls++;
+
+	return 0;
+}
+
+int numa_max_node(void)
+{
+	return 3;
+}
+
+int numa_available(void)
+{
+	return 0;
+}
+
+static void *alloc_numa(uint32_t num_nodes, const HSAuint32 *nodes,
+			HSA_NUMA_POLICY policy, HSAuint64 size,
+			HSAKMT_STATUS expected)
+{
+	HsaMemFlags flags;
+	HSAKMT_STATUS ret;
+	void *mem = NULL;
+
+	memset(&flags, 0, sizeof(flags));
+	flags.ui32.HostAccess = 1;
+	flags.ui32.CoarseGrain = 1;
+
+	num_calls = 0;
+	ret = hsaKmtAllocMemoryNUMA(num_nodes, nodes, policy, size, flags, &mem);
+	CHECK(ret == expected, "node %u policy %d returned %d, expected %d",
+	      nodes[0], policy, ret, expected);
+	if (ret != HSAKMT_STATUS_SUCCESS) {
+		CHECK(!num_calls, "failed allocation applied %u policies",
+		      num_calls);
+		return NULL;
+	}
+
+	return mem;
+}
+
+static void check_call(unsigned int i, void *addr, unsigned long len, int mode)
+{
+	if (i >= num_calls) {
+		CHECK(false, "policy %u was not applied", i);
+		return;
+	}
+
+	CHECK(calls[i].addr == addr && calls[i].len == len,
+	      "policy %u applied to %p+0x%lx, expected %p+0x%lx", i,
+	      calls[i].addr, calls[i].len, addr, len);
+	CHECK(calls[i].mode == (mode | MPOL_F_STATIC_NODES),
+	      "policy %u has mode 0x%x", i, calls[i].mode);
+	/* The fixture's only CPU node is NUMA node 0 */
+	CHECK(calls[i].mask == 1, "policy %u has node mask 0x%lx", i,
+	      calls[i].mask);
+}
+
+/* Runs in the child process, with libhsakmt pointed at the fixture */
+static int run_test(void)
+{
+	const HSAuint64 size = 2 * HUGE_PAGE_SIZE;
+	HsaSystemProperties sys_props;
+	HSAuint32 nodes[2];
+	void *mem;
+
+	if (hsaKmtOpenKFD() != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to open KFD\n");
+		return 1;
+	}
+	if (hsaKmtAcquireSystemProperties(&sys_props) != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to acquire system properties\n");
+		hsaKmtCloseKFD();
+		return 1;
+	}
+
+	/* GPU 1 is linked to the CPU, GPU 2 only through GPU 1 */
+	nodes[0] = 1;
+	nodes[1] = 2;
+	mem = alloc_numa(2, nodes, HSA_NUMA_POLICY_INTERLEAVE, size,
+			 HSAKMT_STATUS_SUCCESS);
+	if (mem) {
+		CHECK(num_calls == 1, "interleave applied %u policies", num_calls);
+		check_call(0, mem, size, MPOL_INTERLEAVE);
+		hsaKmtFreeMemory(mem, size);
+	}
+
+	/* Each part goes to its own node, the GPU's part to the nearest CPU */
+	nodes[0] = 6;
+	nodes[1] = 0;
+	mem = alloc_numa(2, nodes, HSA_NUMA_POLICY_SPLIT, size,
+			 HSAKMT_STATUS_SUCCESS);
+	if (mem) {
+		CHECK(num_calls == 2, "split applied %u policies", num_calls);
+		check_call(0, mem, HUGE_PAGE_SIZE, MPOL_PREFERRED);
+		check_call(1, (char *)mem + HUGE_PAGE_SIZE, HUGE_PAGE_SIZE,
+			   MPOL_PREFERRED);
+		hsaKmtFreeMemory(mem, size);
+	}
+
+	/* GPUs that reach no CPU node are rejected, not silently skipped */
+	nodes[0] = 3;
+	alloc_numa(1, nodes, HSA_NUMA_POLICY_INTERLEAVE, size,
+		   HSAKMT_STATUS_INVALID_NODE_UNIT);
+	nodes[0] = 1;
+	nodes[1] = 8;
+	alloc_numa(2, nodes, HSA_NUMA_POLICY_SPLIT, size,
+		   HSAKMT_STATUS_INVALID_NODE_UNIT);
+
+	hsaKmtReleaseSystemProperties();
+	hsaKmtCloseKFD();
+
+	return num_failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	char dir[PATH_MAX], root[PATH_MAX + 16];
+	int ret;
+
+	if (getenv(TEST_CHILD_ENV))
+		return run_test();
+
+	snprintf(dir, sizeof(dir), "%s/kfdfixture.XXXXXX",
+		 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	snprintf(root, sizeof(root), "%s/gpu%u", dir, NUM_GPUS);
+	ret = kfd_fixture_write_opts(root, NUM_GPUS, &fixture_opts) ||
+	      kfd_fixture_run_child(argv, root, NUM_GPUS, TEST_CHILD_ENV, "1");
+	printf("NUMA test %s\n", ret ? "failed" : "passed");
+
+	kfd_fixture_remove(dir);
+	return ret;
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/* Checks hsaKmtGetPlacementAdvice on the synthetic 1, 8 and 32 GPU systems.
+ * The 8 and 32 GPU systems are split into several XGMI hives and every
+ * other GPU has a small BAR, so remote VRAM is only a candidate within a
+ * hive or through a large BAR. Like topology_bench, each system is read by
+ * a child process running against the mock KFD.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hsakmt.h"
+#include "topology_fixture.h"
+
+/* Set in the child processes, the index of the system */
+#define TEST_CHILD_ENV		"PLACEMENT_TEST_CHILD"
+
+static const struct test_system {
+	unsigned int num_gpus;
+	struct kfd_fixture_opts opts;
+} systems[] = {
+	{ 1, { 0, 0, 0, 0 } },
+	{ 8, { 4, 2, 0, 0 } },
+	{ 32, { 8, 2, 0, 0 } },
+	{ 8, { 4, 2, 0, 1 } },
+};
+
+static const struct test_system *sys;
+static unsigned int num_failures;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%u GPUs: ", sys->num_gpus);	\
+			fprintf(stderr, __VA_ARGS__);			\
+			fprintf(stderr, "\n");				\
+			num_failures++;					\
+		}							\
+	} while (0)
+
+/* Node 0 is the CPU, node N is GPU N - 1 of the fixture */
+static bool is_gpu(uint32_t node)
+{
+	return node != 0;
+}
+
+static bool large_bar(uint32_t node)
+{
+	return KFD_FIXTURE_LARGE_BAR(&sys->opts, node - 1);
+}
+
+static bool same_hive(uint32_t a, uint32_t b)
+{
+	return sys->num_gpus > 1 &&
+	       KFD_FIXTURE_HIVE(&sys->opts, a - 1) == KFD_FIXTURE_HIVE(&sys->opts, b - 1);
+}
+
+/* Whether @consumer can access memory of node @mem, from the fixture's
+ * layout: system memory always, VRAM of another GPU within its hive or
+ * through a large BAR
+ */
+static bool accessible(uint32_t mem, uint32_t consumer)
+{
+	if (mem == consumer || !is_gpu(mem))
+		return true;
+	return (is_gpu(consumer) && same_hive(mem, consumer)) || large_bar(mem);
+}
+
+/* Whether GPU @node is another GPU in the hive of GPU @consumer */
+static bool hive_peer(uint32_t node, uint32_t consumer)
+{
+	return is_gpu(node) && node != consumer && same_hive(node, consumer);
+}
+
+static bool ranked_before(const HsaPlacementCandidate *a,
+			  const HsaPlacementCandidate *b)
+{
+	if (a->Bandwidth != b->Bandwidth)
+		return a->Bandwidth > b->Bandwidth;
+	if (a->Weight != b->Weight)
+		return a->Weight < b->Weight;
+	if (a->NumRemoteConsumers != b->NumRemoteConsumers)
+		return a->NumRemoteConsumers < b->NumRemoteConsumers;
+	return a->NodeId < b->NodeId;
+}
+
+static void check_advice(uint32_t num_nodes, uint32_t num_consumers,
+			 const HSAuint32 *consumers)
+{
+	HsaPlacementCandidate *cand;
+	HSAuint32 num_cand = 0, count, i, j, remote;
+	bool *seen;
+	HSAKMT_STATUS ret;
+
+	cand = calloc(num_nodes, sizeof(*cand));
+	seen = calloc(num_nodes, sizeof(*seen));
+	if (!cand || !seen) {
+		CHECK(false, "out of memory");
+		goto out;
+	}
+
+	/* Count first, then fetch into an array with room to spare */
+	ret = hsaKmtGetPlacementAdvice(num_consumers, consumers, NULL,
+				       HSA_PLACEMENT_TRAFFIC_READ_WRITE,
+				       &num_cand, NULL);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS, "count failed: %d", ret);
+	count = num_nodes;
+	ret = hsaKmtGetPlacementAdvice(num_consumers, consumers, NULL,
+				       HSA_PLACEMENT_TRAFFIC_READ_WRITE,
+				       &count, cand);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS, "advice failed: %d", ret);
+	CHECK(count == num_cand, "%u candidates, counted %u", count, num_cand);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		const HsaPlacementCandidate *c = &cand[i];
+
+		if (c->NodeId >= num_nodes || seen[c->NodeId]) {
+			CHECK(false, "bad or repeated candidate node %u", c->NodeId);
+			continue;
+		}
+		seen[c->NodeId] = true;
+
+		remote = 0;
+		for (j = 0; j < num_consumers; j++) {
+			CHECK(accessible(c->NodeId, consumers[j]),
+			      "node %u is not accessible from consumer %u",
+			      c->NodeId, consumers[j]);
+			remote += consumers[j] != c->NodeId;
+		}
+		CHECK(c->NumRemoteConsumers == remote,
+		      "node %u has %u remote consumers, expected %u",
+		      c->NodeId, c->NumRemoteConsumers, remote);
+
+		/* GPU memory is copied by its own GPU, system memory by the
+		 * first consumer GPU, all of which reach it equally fast, or
+		 * by the first GPU if no consumer is one
+		 */
+		if (is_gpu(c->NodeId)) {
+			CHECK(c->CopyNodeId == c->NodeId, "node %u copied by %u",
+			      c->NodeId, c->CopyNodeId);
+		} else {
+			for (j = 0; j < num_consumers && !is_gpu(consumers[j]); j++)
+				;
+			CHECK(c->CopyNodeId == (j < num_consumers ? consumers[j] : 1),
+			      "system memory copied by %u", c->CopyNodeId);
+		}
+
+		if (i)
+			CHECK(ranked_before(&cand[i - 1], c),
+			      "node %u ranked before node %u", cand[i - 1].NodeId,
+			      c->NodeId);
+	}
+
+	/* Every accessible node with memory is a candidate */
+	for (i = 0; i < num_nodes; i++) {
+		for (j = 0; j < num_consumers && accessible(i, consumers[j]); j++)
+			;
+		CHECK(seen[i] == (j == num_consumers), "node %u %s a candidate",
+		      i, seen[i] ? "is" : "is not");
+	}
+
+	/* A single GPU ranks its own VRAM first, then the VRAM of its hive.
+	 * Unknown XGMI bandwidths count as 0, which ranks the hive last.
+	 */
+	if (num_consumers == 1 && is_gpu(consumers[0]) && count) {
+		bool unknown_bw = sys->opts.unknown_xgmi_bw;
+
+		CHECK(cand[0].NodeId == consumers[0], "node %u ranked first",
+		      cand[0].NodeId);
+		for (i = 1; i < count &&
+			    hive_peer(cand[i].NodeId, consumers[0]) != unknown_bw; i++)
+			;
+		for (; i < count; i++) {
+			CHECK(hive_peer(cand[i].NodeId, consumers[0]) == unknown_bw,
+			      "node %u ranked after node %u", cand[i].NodeId,
+			      cand[i - 1].NodeId);
+			CHECK(!hive_peer(cand[i].NodeId, consumers[0]) ||
+			      !cand[i].Bandwidth,
+			      "hive peer %u has bandwidth %llu", cand[i].NodeId,
+			      (unsigned long long)cand[i].Bandwidth);
+		}
+	}
+
+out:
+	free(seen);
+	free(cand);
+}
+
+/* Runs in the child process, with libhsakmt pointed at the fixture */
+static int run_system(void)
+{
+	HsaSystemProperties sys_props;
+	HsaPlacementCandidate cand;
+	HSAuint32 consumers[2], num_nodes, n, i;
+	HSAKMT_STATUS ret;
+
+	if (hsaKmtOpenKFD() != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to open KFD\n");
+		return 1;
+	}
+	if (hsaKmtAcquireSystemProperties(&sys_props) != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to acquire system properties\n");
+		hsaKmtCloseKFD();
+		return 1;
+	}
+	num_nodes = sys_props.NumNodes;
+	CHECK(num_nodes == sys->num_gpus + 1, "found %u nodes", num_nodes);
+
+	for (i = 0; i < num_nodes; i++)
+		check_advice(num_nodes, 1, &i);
+
+	/* The first and the last GPU, in different hives on the larger systems */
+	consumers[0] = 1;
+	consumers[1] = num_nodes - 1;
+	check_advice(num_nodes, 2, consumers);
+	consumers[0] = 0;
+	check_advice(num_nodes, 2, consumers);
+
+	n = 1;
+	consumers[0] = num_nodes;
+	ret = hsaKmtGetPlacementAdvice(1, consumers, NULL,
+				       HSA_PLACEMENT_TRAFFIC_READ, &n, &cand);
+	CHECK(ret == HSAKMT_STATUS_INVALID_NODE_UNIT,
+	      "invalid consumer returned %d", ret);
+
+	/* A short array gets the best candidates */
+	consumers[0] = 1;
+	n = 1;
+	ret = hsaKmtGetPlacementAdvice(1, consumers, NULL,
+				       HSA_PLACEMENT_TRAFFIC_READ, &n, &cand);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS && n == 1 && cand.NodeId == 1,
+	      "short array returned %d, %u candidates", ret, n);
+
+	hsaKmtReleaseSystemProperties();
+	hsaKmtCloseKFD();
+
+	return num_failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned int num_systems = sizeof(systems) / sizeof(systems[0]);
+	char dir[PATH_MAX], root[PATH_MAX + 16], env[16];
+	const char *child;
+	unsigned int i;
+	int ret = 0;
+
+	child = getenv(TEST_CHILD_ENV);
+	if (child) {
+		i = strtoul(child, NULL, 0);
+		if (i >= num_systems)
+			return 1;
+		sys = &systems[i];
+		return run_system();
+	}
+
+	snprintf(dir, sizeof(dir), "%s/kfdfixture.XXXXXX",
+		 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	for (i = 0; i < num_systems; i++) {
+		snprintf(root, sizeof(root), "%s/system%u", dir, i);
+		snprintf(env, sizeof(env), "%u", i);
+		if (kfd_fixture_write_opts(root, systems[i].num_gpus, &systems[i].opts) ||
+		    kfd_fixture_run_child(argv, root, systems[i].num_gpus,
+					  TEST_CHILD_ENV, env)) {
+			fprintf(stderr, "Placement test on %u GPUs failed\n",
+				systems[i].num_gpus);
+			ret = 1;
+			continue;
+		}
+		printf("Placement test on %u GPUs passed\n", systems[i].num_gpus);
+	}
+
+	kfd_fixture_remove(dir);
+	return ret;
+}
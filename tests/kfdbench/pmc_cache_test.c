@@ -0,0 +1,274 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/* Round trip of the counter property cache kept next to the topology cache
+ * (HSAKMT_TOPOLOGY_CACHE). A first child process against the mock KFD
+ * builds the counter properties of every GPU, which writes the cache, and
+ * records them. Later children must get the same properties, from the
+ * cache when it is intact, without rewriting it, and rebuilt when the
+ * cache was truncated or corrupted, in which case the cache is rewritten
+ * whole. A child whose writes are cut short by RLIMIT_FSIZE must not
+ * publish a cache at all. No temporary files may be left behind.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "hsakmt.h"
+#include "topology_fixture.h"
+
+/* Set in the child processes, "record", "compare" or a file size limit for
+ * the cache, at which writes fail with EFBIG
+ */
+#define TEST_CHILD_ENV		"PMC_CACHE_TEST_CHILD"
+
+#define CACHE_ENV		"HSAKMT_TOPOLOGY_CACHE"
+#define CACHE_NAME		"cache"
+#define PMC_CACHE_SUFFIX	".pmc"
+/* Where the first child records the counter properties */
+#define RECORD_SUFFIX		".props"
+
+#define NUM_GPUS		2
+
+static unsigned int num_failures;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, __VA_ARGS__);			\
+			fprintf(stderr, "\n");				\
+			num_failures++;					\
+		}							\
+	} while (0)
+
+static size_t counter_props_size(const HsaCounterProperties *props)
+{
+	const HsaCounterBlockProperties *block = &props->Blocks[0];
+	HSAuint32 i;
+
+	for (i = 0; i < props->NumBlocks; i++)
+		block = (const HsaCounterBlockProperties *)&block->Counters[block->NumCounters];
+
+	return (const char *)block - (const char *)props;
+}
+
+/* Runs in the child processes, with libhsakmt pointed at the fixture */
+static int run_test(const char *mode)
+{
+	bool record = !strcmp(mode, "record");
+	HsaSystemProperties sys_props;
+	struct rlimit limit;
+	HsaCounterProperties *props;
+	char path[PATH_MAX];
+	HSAKMT_STATUS ret;
+	char *recorded;
+	size_t size;
+	HSAuint32 node;
+	FILE *f;
+
+	if (!record && strcmp(mode, "compare")) {
+		limit.rlim_cur = limit.rlim_max = strtoul(mode, NULL, 0);
+		signal(SIGXFSZ, SIG_IGN);
+		if (setrlimit(RLIMIT_FSIZE, &limit)) {
+			perror("setrlimit");
+			return 1;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s%s", getenv(CACHE_ENV), RECORD_SUFFIX);
+	f = fopen(path, record ? "w" : "r");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+
+	if (hsaKmtOpenKFD() != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to open KFD\n");
+		fclose(f);
+		return 1;
+	}
+	if (hsaKmtAcquireSystemProperties(&sys_props) != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to acquire system properties\n");
+		hsaKmtCloseKFD();
+		fclose(f);
+		return 1;
+	}
+
+	/* Node 0 is the CPU */
+	for (node = 1; node < sys_props.NumNodes; node++) {
+		ret = hsaKmtPmcGetCounterProperties(node, &props);
+		CHECK(ret == HSAKMT_STATUS_SUCCESS,
+		      "node %u: counter properties returned %d", node, ret);
+		if (ret != HSAKMT_STATUS_SUCCESS)
+			break;
+		size = counter_props_size(props);
+
+		if (record) {
+			CHECK(fwrite(&size, sizeof(size), 1, f) == 1 &&
+			      fwrite(props, size, 1, f) == 1,
+			      "failed to record node %u", node);
+			continue;
+		}
+
+		recorded = malloc(size);
+		CHECK(recorded && fread(&size, sizeof(size), 1, f) == 1 &&
+		      size == counter_props_size(props) &&
+		      fread(recorded, size, 1, f) == 1 &&
+		      !memcmp(recorded, props, size),
+		      "node %u: counter properties differ", node);
+		free(recorded);
+	}
+
+	hsaKmtReleaseSystemProperties();
+	hsaKmtCloseKFD();
+	CHECK(!fclose(f), "failed to close %s", path);
+
+	return num_failures ? 1 : 0;
+}
+
+static int run_child(char **argv, const char *root, const char *mode)
+{
+	if (kfd_fixture_run_child(argv, root, NUM_GPUS, TEST_CHILD_ENV, mode)) {
+		CHECK(false, "%s child failed", mode);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Counts files left next to the cache by an unfinished write */
+static unsigned int count_temp_files(const char *dir)
+{
+	static const char prefix[] = CACHE_NAME PMC_CACHE_SUFFIX ".";
+	struct dirent *entry;
+	unsigned int n = 0;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return 0;
+	while ((entry = readdir(d)))
+		n += !strncmp(entry->d_name, prefix, sizeof(prefix) - 1);
+	closedir(d);
+
+	return n;
+}
+
+/* Damages the cache with @damage, then checks that a child gets the recorded
+ * properties and writes a new cache of the original size
+ */
+static void check_damaged_cache(char **argv, const char *root,
+				const char *path, const struct stat *orig,
+				const char *damage)
+{
+	struct stat st;
+	FILE *f;
+	int c;
+
+	if (!strcmp(damage, "truncated")) {
+		CHECK(!truncate(path, orig->st_size / 2), "truncate: %s",
+		      strerror(errno));
+	} else {
+		/* Flip a bit in the middle of a counter property table */
+		f = fopen(path, "r+");
+		CHECK(f && !fseek(f, orig->st_size / 2, SEEK_SET) &&
+		      (c = fgetc(f)) != EOF && !fseek(f, -1, SEEK_CUR) &&
+		      fputc(c ^ 1, f) != EOF,
+		      "failed to corrupt the cache");
+		if (f)
+			fclose(f);
+	}
+
+	if (run_child(argv, root, "compare"))
+		return;
+	CHECK(!stat(path, &st) && st.st_size == orig->st_size,
+	      "%s cache was not rewritten whole", damage);
+}
+
+int main(int argc, char **argv)
+{
+	char dir[PATH_MAX], root[PATH_MAX + 16], cache[PATH_MAX + 16];
+	char path[PATH_MAX + 32], limit[32];
+	struct stat orig, st;
+
+	if (getenv(TEST_CHILD_ENV))
+		return run_test(getenv(TEST_CHILD_ENV));
+
+	snprintf(dir, sizeof(dir), "%s/kfdfixture.XXXXXX",
+		 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	/* The children inherit the cache path */
+	snprintf(root, sizeof(root), "%s/gpu%u", dir, NUM_GPUS);
+	snprintf(cache, sizeof(cache), "%s/%s", dir, CACHE_NAME);
+	snprintf(path, sizeof(path), "%s%s", cache, PMC_CACHE_SUFFIX);
+	setenv(CACHE_ENV, cache, 1);
+
+	if (kfd_fixture_write(root, NUM_GPUS)) {
+		CHECK(false, "failed to write the fixture");
+		goto out;
+	}
+
+	if (run_child(argv, root, "record"))
+		goto out;
+	CHECK(!stat(path, &orig) && orig.st_size > 0, "no counter cache written");
+	if (num_failures)
+		goto out;
+
+	/* An intact cache is loaded, not written again */
+	if (!run_child(argv, root, "compare"))
+		CHECK(!stat(path, &st) && st.st_ino == orig.st_ino &&
+		      st.st_mtime == orig.st_mtime,
+		      "intact cache was rewritten");
+
+	check_damaged_cache(argv, root, path, &orig, "truncated");
+	check_damaged_cache(argv, root, path, &orig, "corrupted");
+
+	/* A failed write leaves no cache behind, not even a truncated one */
+	unlink(path);
+	snprintf(limit, sizeof(limit), "%lld", (long long)orig.st_size / 2);
+	if (!run_child(argv, root, limit))
+		CHECK(stat(path, &st) && errno == ENOENT,
+		      "cache published despite a failed write");
+
+	CHECK(!count_temp_files(dir), "temporary cache files left behind");
+
+out:
+	printf("PMC cache test %s\n", num_failures ? "failed" : "passed");
+	kfd_fixture_remove(dir);
+	return num_failures ? 1 : 0;
+}
@@ -0,0 +1,338 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/* Checks hsaKmtPmcCompileMetrics and hsaKmtPmcEvaluateMetrics on the GPU of
+ * a synthetic 1 GPU system. Metrics over TCC and SQ counters are evaluated
+ * over a sample layout that lists the counters in a different order than
+ * the expressions use them, with a stride that skips padding, and compared
+ * with the same arithmetic done here. It also checks division by zero, long
+ * chains of unary minus, and that missing counters and too deeply nested
+ * parentheses are rejected. The metrics are compiled in a child process
+ * running against the mock KFD.
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hsakmt.h"
+#include "topology_fixture.h"
+
+/* Set in the child process */
+#define TEST_CHILD_ENV		"PMC_METRICS_TEST_CHILD"
+
+#define NUM_GPUS		1
+#define GPU_NODE		1
+
+/* Not a multiple of the batch libhsakmt evaluates at a time */
+#define NUM_SAMPLES		200
+
+/* Layout entries: SQ, TCC b, TCC c (unused), TCC a, and one of padding */
+#define SAMPLE_VALUES		5
+#define NUM_LAYOUT		4
+
+/* Deepest nesting of parentheses libhsakmt accepts */
+#define MAX_NESTING		64
+
+static unsigned int num_failures;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, __VA_ARGS__);			\
+			fprintf(stderr, "\n");				\
+			num_failures++;					\
+		}							\
+	} while (0)
+
+/* The block with the given ID, NULL if the GPU doesn't have it */
+static const HsaCounterBlockProperties *find_block(const HsaCounterProperties *props,
+						   const HSA_UUID *id)
+{
+	const HsaCounterBlockProperties *block = &props->Blocks[0];
+	HSAuint32 i;
+
+	for (i = 0; i < props->NumBlocks; i++) {
+		if (!memcmp(&block->BlockId, id, sizeof(*id)))
+			return block->NumCounters ? block : NULL;
+		block = (const HsaCounterBlockProperties *)&block->Counters[block->NumCounters];
+	}
+
+	return NULL;
+}
+
+/* Compiles @num_metrics expressions over @layout, expecting @expected */
+static HSAMetricsId compile(HSAuint32 num_metrics, const char **exprs,
+			    const HsaCounter *layout, HSAKMT_STATUS expected)
+{
+	HSAMetricsId id = 0;
+	HSAKMT_STATUS ret;
+
+	ret = hsaKmtPmcCompileMetrics(GPU_NODE, num_metrics, exprs, NUM_LAYOUT,
+				      layout, &id);
+	CHECK(ret == expected, "compiling \"%.64s\" returned %d, expected %d",
+	      exprs[0], ret, expected);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return 0;
+
+	return id;
+}
+
+static void unregister(HSAMetricsId id)
+{
+	HSAKMT_STATUS ret;
+
+	ret = hsaKmtPmcUnregisterMetrics(GPU_NODE, id);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS, "unregister returned %d", ret);
+}
+
+/* Evaluates a metric without counters and checks its value */
+static void check_constant(const char *expr, const HsaCounter *layout,
+			   double expected)
+{
+	uint64_t sample[SAMPLE_VALUES] = { 0 };
+	HSAMetricsId id;
+	HSAKMT_STATUS ret;
+	double value;
+
+	id = compile(1, &expr, layout, HSAKMT_STATUS_SUCCESS);
+	if (!id)
+		return;
+
+	ret = hsaKmtPmcEvaluateMetrics(id, sample, 1, 0, &value);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS && value == expected,
+	      "\"%.64s\" returned %d, %g, expected %g", expr, ret, value,
+	      expected);
+	unregister(id);
+}
+
+/* A string of @num_minus '-', @num_open '(', "7" and @num_close ')' */
+static char *nested_expr(unsigned int num_minus, unsigned int num_open,
+			 unsigned int num_close)
+{
+	char *expr = malloc(num_minus + num_open + num_close + 2);
+
+	if (!expr)
+		return NULL;
+	memset(expr, '-', num_minus);
+	memset(expr + num_minus, '(', num_open);
+	expr[num_minus + num_open] = '7';
+	memset(expr + num_minus + num_open + 1, ')', num_close);
+	expr[num_minus + num_open + num_close + 1] = '\0';
+
+	return expr;
+}
+
+static void check_nesting(const HsaCounter *layout)
+{
+	const char *exprs[1];
+	char *expr;
+
+	/* The deepest nesting allowed, and one level more */
+	expr = nested_expr(0, MAX_NESTING, MAX_NESTING);
+	if (expr)
+		check_constant(expr, layout, 7);
+	free(expr);
+
+	expr = nested_expr(0, MAX_NESTING + 1, MAX_NESTING + 1);
+	if (expr) {
+		exprs[0] = expr;
+		compile(1, exprs, layout, HSAKMT_STATUS_INVALID_PARAMETER);
+	}
+	free(expr);
+
+	/* Unbalanced parentheses */
+	expr = nested_expr(0, 2, 1);
+	if (expr) {
+		exprs[0] = expr;
+		compile(1, exprs, layout, HSAKMT_STATUS_INVALID_PARAMETER);
+	}
+	free(expr);
+
+	/* Unary minus doesn't nest, however long the chain */
+	expr = nested_expr(100001, 0, 0);
+	if (expr)
+		check_constant(expr, layout, -7);
+	free(expr);
+	expr = nested_expr(100000, 1, 1);
+	if (expr)
+		check_constant(expr, layout, 7);
+	free(expr);
+}
+
+/* Runs in the child process, with libhsakmt pointed at the fixture */
+static int run_test(void)
+{
+	const HsaCounterBlockProperties *tcc, *sq;
+	HsaCounterProperties *props;
+	HsaSystemProperties sys_props;
+	HsaCounter layout[NUM_LAYOUT];
+	unsigned long long a, b, c, s;
+	char exprs_buf[4][128];
+	const char *exprs[4];
+	uint64_t *samples;
+	double *values;
+	HSAMetricsId id;
+	HSAKMT_STATUS ret;
+	unsigned int i;
+
+	if (hsaKmtOpenKFD() != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to open KFD\n");
+		return 1;
+	}
+	if (hsaKmtAcquireSystemProperties(&sys_props) != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to acquire system properties\n");
+		hsaKmtCloseKFD();
+		return 1;
+	}
+
+	ret = hsaKmtPmcGetCounterProperties(GPU_NODE, &props);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS, "counter properties returned %d", ret);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto out;
+	tcc = find_block(props, &HSA_PROFILEBLOCK_AMD_TCC);
+	sq = find_block(props, &HSA_PROFILEBLOCK_AMD_SQ);
+	CHECK(tcc && tcc->NumCounters >= 3 && sq, "missing TCC or SQ counters");
+	if (!tcc || tcc->NumCounters < 3 || !sq)
+		goto out;
+
+	/* The layout lists the counters in another order than the metrics use
+	 * them and has a counter that no metric uses
+	 */
+	layout[0] = sq->Counters[0];
+	layout[1] = tcc->Counters[1];
+	layout[2] = tcc->Counters[2];
+	layout[3] = tcc->Counters[0];
+	a = tcc->Counters[0].CounterId;
+	b = tcc->Counters[1].CounterId;
+	c = tcc->Counters[2].CounterId;
+	s = sq->Counters[0].CounterId;
+
+	snprintf(exprs_buf[0], sizeof(exprs_buf[0]),
+		 "TCC:%llu * 100 / (TCC:%llu + TCC:%llu)", a, a, b);
+	snprintf(exprs_buf[1], sizeof(exprs_buf[1]),
+		 "sq:%llu - TCC:%llu * 2.5 + 1", s, b);
+	snprintf(exprs_buf[2], sizeof(exprs_buf[2]),
+		 "TCC:%llu / SQ:%llu", a, s);
+	snprintf(exprs_buf[3], sizeof(exprs_buf[3]),
+		 "- - -TCC:%llu * --(SQ:%llu - -1)", b, s);
+	for (i = 0; i < 4; i++)
+		exprs[i] = exprs_buf[i];
+
+	samples = calloc(NUM_SAMPLES, sizeof(*samples) * SAMPLE_VALUES);
+	values = calloc(NUM_SAMPLES, sizeof(*values) * 4);
+	if (!samples || !values) {
+		CHECK(false, "out of memory");
+		goto free_samples;
+	}
+
+	/* Every 7th sample has idle counters for the division by 0 */
+	for (i = 0; i < NUM_SAMPLES; i++) {
+		uint64_t *sample = &samples[i * SAMPLE_VALUES];
+
+		sample[0] = i % 7 ? i * 3 : 0;		/* SQ */
+		sample[1] = i % 7 ? i * i : 0;		/* TCC b */
+		sample[2] = ~0ULL;			/* TCC c, unused */
+		sample[3] = i % 7 ? i + 11 : 0;		/* TCC a */
+		sample[4] = ~0ULL;			/* padding */
+	}
+
+	id = compile(4, exprs, layout, HSAKMT_STATUS_SUCCESS);
+	if (id) {
+		ret = hsaKmtPmcEvaluateMetrics(id, samples, NUM_SAMPLES,
+					       sizeof(*samples) * SAMPLE_VALUES,
+					       values);
+		CHECK(ret == HSAKMT_STATUS_SUCCESS, "evaluate returned %d", ret);
+		for (i = 0; ret == HSAKMT_STATUS_SUCCESS && i < NUM_SAMPLES; i++) {
+			const uint64_t *sample = &samples[i * SAMPLE_VALUES];
+			double va = sample[3], vb = sample[1], vs = sample[0];
+			double expected[4];
+			unsigned int m;
+
+			expected[0] = va + vb != 0.0 ? va * 100 / (va + vb) : 0.0;
+			expected[1] = vs - vb * 2.5 + 1;
+			expected[2] = vs != 0.0 ? va / vs : 0.0;
+			expected[3] = -vb * (vs + 1);
+			for (m = 0; m < 4; m++)
+				CHECK(values[i * 4 + m] == expected[m],
+				      "sample %u metric %u is %g, expected %g",
+				      i, m, values[i * 4 + m], expected[m]);
+		}
+		unregister(id);
+	}
+
+	/* A counter that isn't in the layout, or not on the GPU at all */
+	layout[2] = sq->Counters[0];
+	snprintf(exprs_buf[0], sizeof(exprs_buf[0]), "TCC:%llu + 1", c);
+	compile(1, exprs, layout, HSAKMT_STATUS_INVALID_PARAMETER);
+	snprintf(exprs_buf[0], sizeof(exprs_buf[0]), "TCC:%u",
+		 tcc->NumCounters + 1000);
+	compile(1, exprs, layout, HSAKMT_STATUS_INVALID_PARAMETER);
+	snprintf(exprs_buf[0], sizeof(exprs_buf[0]), "NOSUCHBLOCK:0");
+	compile(1, exprs, layout, HSAKMT_STATUS_INVALID_PARAMETER);
+
+	/* Division by a constant 0, and a trailing operator */
+	check_constant("1 / 0", layout, 0);
+	check_constant("(2 - 2) / (3 - 3) + 4", layout, 4);
+	exprs[0] = "1 +";
+	compile(1, exprs, layout, HSAKMT_STATUS_INVALID_PARAMETER);
+
+	check_nesting(layout);
+
+free_samples:
+	free(values);
+	free(samples);
+out:
+	hsaKmtReleaseSystemProperties();
+	hsaKmtCloseKFD();
+
+	return num_failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	char dir[PATH_MAX], root[PATH_MAX + 16];
+	int ret;
+
+	if (getenv(TEST_CHILD_ENV))
+		return run_test();
+
+	snprintf(dir, sizeof(dir), "%s/kfdfixture.XXXXXX",
+		 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	snprintf(root, sizeof(root), "%s/gpu%u", dir, NUM_GPUS);
+	ret = kfd_fixture_write(root, NUM_GPUS) ||
+	      kfd_fixture_run_child(argv, root, NUM_GPUS, TEST_CHILD_ENV, "1");
+	printf("PMC metrics test %s\n", ret ? "failed" : "passed");
+
+	kfd_fixture_remove(dir);
+	return ret;
+}
@@ -0,0 +1,647 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Measures hsaKmtCreateQueue/hsaKmtDestroyQueue latency and the cost of
+ * the first doorbell write on a new queue, across a sweep of thread
+ * counts. Results are reported as percentiles in text, JSON or CSV.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hsakmt.h"
+#include "kfd_mock.h"
+
+#define MAX_THREADS		256
+#define QUEUE_SIZE		(64 * 1024)
+#define PAGE_SIZE		4096
+
+enum output_format {
+	FORMAT_TEXT,
+	FORMAT_JSON,
+	FORMAT_CSV,
+};
+
+enum metric {
+	METRIC_CREATE,
+	METRIC_DESTROY,
+	METRIC_DOORBELL,
+	METRIC_MAX
+};
+
+static const char *metric_names[METRIC_MAX] = {
+	"create", "destroy", "doorbell"
+};
+
+static const char *stage_names[KFD_MOCK_STAGE_MAX] = {
+	"memory", "queue_ioctl", "doorbell_mmap", "other_ioctl"
+};
+
+struct bench_config {
+	unsigned int node;
+	unsigned int iterations;
+	unsigned int warmup;
+	unsigned int thread_counts[MAX_THREADS];
+	unsigned int num_thread_counts;
+	HSA_QUEUE_TYPE type;
+	enum output_format format;
+};
+
+struct thread_ctx {
+	pthread_t thread;
+	const struct bench_config *cfg;
+	pthread_barrier_t *barrier;
+	void *ring;
+	HSAuint64 *rw_ptrs;
+	uint64_t *samples[METRIC_MAX];
+	/* Per-stage time spent inside create and destroy */
+	uint64_t stage_ns[METRIC_MAX][KFD_MOCK_STAGE_MAX];
+	unsigned int count;
+	HSAKMT_STATUS status;
+};
+
+struct stats {
+	uint64_t min, p50, p90, p99, p999, max;
+	double mean;
+};
+
+static kfd_mock_stage_times_fn get_stage_times;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void read_stage_times(uint64_t ns[KFD_MOCK_STAGE_MAX])
+{
+	if (get_stage_times)
+		get_stage_times(ns);
+	else
+		memset(ns, 0, sizeof(uint64_t) * KFD_MOCK_STAGE_MAX);
+}
+
+static void add_stage_delta(uint64_t acc[KFD_MOCK_STAGE_MAX],
+			    const uint64_t before[KFD_MOCK_STAGE_MAX],
+			    const uint64_t after[KFD_MOCK_STAGE_MAX])
+{
+	int i;
+
+	for (i = 0; i < KFD_MOCK_STAGE_MAX; i++)
+		acc[i] += after[i] - before[i];
+}
+
+static HSAKMT_STATUS alloc_queue_memory(struct thread_ctx *ctx)
+{
+	HsaMemFlags flags = {0};
+	HSAKMT_STATUS ret;
+
+	flags.ui32.PageSize = HSA_PAGE_SIZE_4KB;
+	flags.ui32.HostAccess = 1;
+	flags.ui32.ExecuteAccess = 1;
+
+	ret = hsaKmtAllocMemory(0, QUEUE_SIZE, flags, &ctx->ring);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+	ret = hsaKmtMapMemoryToGPU(ctx->ring, QUEUE_SIZE, NULL);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto free_ring;
+
+	/* AQL queues need read/write pointers in GPU accessible memory */
+	ret = hsaKmtAllocMemory(0, PAGE_SIZE, flags, (void **)&ctx->rw_ptrs);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto unmap_ring;
+	ret = hsaKmtMapMemoryToGPU(ctx->rw_ptrs, PAGE_SIZE, NULL);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto free_ptrs;
+
+	return HSAKMT_STATUS_SUCCESS;
+
+free_ptrs:
+	hsaKmtFreeMemory(ctx->rw_ptrs, PAGE_SIZE);
+unmap_ring:
+	hsaKmtUnmapMemoryToGPU(ctx->ring);
+free_ring:
+	hsaKmtFreeMemory(ctx->ring, QUEUE_SIZE);
+	return ret;
+}
+
+static void free_queue_memory(struct thread_ctx *ctx)
+{
+	hsaKmtUnmapMemoryToGPU(ctx->rw_ptrs);
+	hsaKmtFreeMemory(ctx->rw_ptrs, PAGE_SIZE);
+	hsaKmtUnmapMemoryToGPU(ctx->ring);
+	hsaKmtFreeMemory(ctx->ring, QUEUE_SIZE);
+}
+
+static HSAKMT_STATUS run_one(struct thread_ctx *ctx, bool record)
+{
+	const struct bench_config *cfg = ctx->cfg;
+	uint64_t st0[KFD_MOCK_STAGE_MAX], st1[KFD_MOCK_STAGE_MAX];
+	uint64_t st2[KFD_MOCK_STAGE_MAX];
+	uint64_t t0, t1, t2, t3;
+	HsaQueueResource res;
+	HSAKMT_STATUS ret;
+
+	memset(&res, 0, sizeof(res));
+	res.Queue_read_ptr_aql = &ctx->rw_ptrs[0];
+	res.Queue_write_ptr_aql = &ctx->rw_ptrs[1];
+
+	read_stage_times(st0);
+	t0 = now_ns();
+	ret = hsaKmtCreateQueue(cfg->node, cfg->type, 100,
+				HSA_QUEUE_PRIORITY_NORMAL, ctx->ring,
+				QUEUE_SIZE, NULL, &res);
+	t1 = now_ns();
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+	read_stage_times(st1);
+
+	/* Ring with the current write pointer, nothing has been submitted
+	 * so the CP or SDMA engine has no work to fetch.
+	 */
+	t2 = now_ns();
+	if (cfg->type == HSA_QUEUE_COMPUTE_AQL)
+		__atomic_store_n(res.Queue_DoorBell_aql, 0, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(res.Queue_DoorBell, 0, __ATOMIC_RELEASE);
+	t3 = now_ns();
+
+	read_stage_times(st2);
+	ret = hsaKmtDestroyQueue(res.QueueId);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		return ret;
+
+	if (record) {
+		uint64_t t4 = now_ns();
+		uint64_t st3[KFD_MOCK_STAGE_MAX];
+
+		read_stage_times(st3);
+		ctx->samples[METRIC_CREATE][ctx->count] = t1 - t0;
+		ctx->samples[METRIC_DOORBELL][ctx->count] = t3 - t2;
+		/* Includes the stage read above, a few ns at most */
+		ctx->samples[METRIC_DESTROY][ctx->count] = t4 - t3;
+		add_stage_delta(ctx->stage_ns[METRIC_CREATE], st0, st1);
+		add_stage_delta(ctx->stage_ns[METRIC_DESTROY], st2, st3);
+		ctx->count++;
+	}
+
+	return HSAKMT_STATUS_SUCCESS;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct thread_ctx *ctx = arg;
+	unsigned int i;
+
+	ctx->status = alloc_queue_memory(ctx);
+	pthread_barrier_wait(ctx->barrier);
+	if (ctx->status != HSAKMT_STATUS_SUCCESS)
+		return NULL;
+
+	for (i = 0; i < ctx->cfg->warmup; i++) {
+		ctx->status = run_one(ctx, false);
+		if (ctx->status != HSAKMT_STATUS_SUCCESS)
+			goto out;
+	}
+
+	pthread_barrier_wait(ctx->barrier);
+
+	for (i = 0; i < ctx->cfg->iterations; i++) {
+		ctx->status = run_one(ctx, true);
+		if (ctx->status != HSAKMT_STATUS_SUCCESS)
+			break;
+	}
+
+out:
+	free_queue_memory(ctx);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+	size_t idx = (size_t)(p * (n - 1) + 0.5);
+
+	return sorted[idx < n ? idx : n - 1];
+}
+
+static void compute_stats(uint64_t *samples, size_t n, struct stats *s)
+{
+	double sum = 0;
+	size_t i;
+
+	memset(s, 0, sizeof(*s));
+	if (!n)
+		return;
+
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	s->min = samples[0];
+	s->p50 = percentile(samples, n, 0.50);
+	s->p90 = percentile(samples, n, 0.90);
+	s->p99 = percentile(samples, n, 0.99);
+	s->p999 = percentile(samples, n, 0.999);
+	s->max = samples[n - 1];
+	s->mean = sum / n;
+}
+
+static void print_header(const struct bench_config *cfg)
+{
+	if (cfg->format == FORMAT_JSON)
+		printf("{\n  \"node\": %u,\n  \"queue_type\": %u,\n"
+		       "  \"iterations\": %u,\n  \"mock\": %s,\n  \"results\": [",
+		       cfg->node, cfg->type, cfg->iterations,
+		       getenv("KFD_MOCK") ? "true" : "false");
+	else if (cfg->format == FORMAT_CSV)
+		printf("threads,metric,samples,min_ns,p50_ns,p90_ns,p99_ns,"
+		       "p999_ns,max_ns,mean_ns,ops_per_sec\n");
+}
+
+static void print_footer(const struct bench_config *cfg)
+{
+	if (cfg->format == FORMAT_JSON)
+		printf("\n  ]\n}\n");
+}
+
+static void print_result(const struct bench_config *cfg, unsigned int threads,
+			 bool first, const struct stats *s, size_t n,
+			 double wall_s, const uint64_t stage_ns[METRIC_MAX][KFD_MOCK_STAGE_MAX])
+{
+	double ops = wall_s > 0 ? n / wall_s : 0;
+	int m, i;
+
+	switch (cfg->format) {
+	case FORMAT_TEXT:
+		printf("\nthreads: %u  samples: %zu  create+destroy: %.0f ops/s\n",
+		       threads, n, ops);
+		printf("%-10s %10s %10s %10s %10s %10s %10s %10s\n", "(ns)",
+		       "min", "p50", "p90", "p99", "p99.9", "max", "mean");
+		for (m = 0; m < METRIC_MAX; m++)
+			printf("%-10s %10lu %10lu %10lu %10lu %10lu %10lu %10.0f\n",
+			       metric_names[m], s[m].min, s[m].p50, s[m].p90,
+			       s[m].p99, s[m].p999, s[m].max, s[m].mean);
+		if (!get_stage_times)
+			break;
+		printf("per-call stage breakdown (mean ns):\n");
+		for (m = 0; m < METRIC_DOORBELL; m++) {
+			double other = s[m].mean;
+
+			printf("  %-8s", metric_names[m]);
+			for (i = 0; i < KFD_MOCK_STAGE_MAX; i++) {
+				double v = n ? (double)stage_ns[m][i] / n : 0;
+
+				printf(" %s=%.0f", stage_names[i], v);
+				other -= v;
+			}
+			printf(" thunk=%.0f\n", other);
+		}
+		break;
+	case FORMAT_CSV:
+		for (m = 0; m < METRIC_MAX; m++)
+			printf("%u,%s,%zu,%lu,%lu,%lu,%lu,%lu,%lu,%.1f,%.1f\n",
+			       threads, metric_names[m], n, s[m].min, s[m].p50,
+			       s[m].p90, s[m].p99, s[m].p999, s[m].max,
+			       s[m].mean, ops);
+		break;
+	case FORMAT_JSON:
+		printf("%s\n    {\"threads\": %u, \"samples\": %zu, "
+		       "\"ops_per_sec\": %.1f", first ? "" : ",", threads, n, ops);
+		for (m = 0; m < METRIC_MAX; m++) {
+			printf(",\n     \"%s\": {\"min\": %lu, \"p50\": %lu, "
+			       "\"p90\": %lu, \"p99\": %lu, \"p999\": %lu, "
+			       "\"max\": %lu, \"mean\": %.1f",
+			       metric_names[m], s[m].min, s[m].p50, s[m].p90,
+			       s[m].p99, s[m].p999, s[m].max, s[m].mean);
+			if (get_stage_times && m != METRIC_DOORBELL) {
+				printf(", \"stages\": {");
+				for (i = 0; i < KFD_MOCK_STAGE_MAX; i++)
+					printf("%s\"%s\": %.1f", i ? ", " : "",
+					       stage_names[i],
+					       n ? (double)stage_ns[m][i] / n : 0);
+				printf("}");
+			}
+			printf("}");
+		}
+		printf("}");
+		break;
+	default:
+		break;
+	}
+}
+
+static int run_sweep_point(const struct bench_config *cfg, unsigned int threads,
+			   bool first)
+{
+	uint64_t stage_ns[METRIC_MAX][KFD_MOCK_STAGE_MAX];
+	uint64_t *merged[METRIC_MAX] = {NULL};
+	struct thread_ctx *ctx;
+	pthread_barrier_t barrier;
+	struct stats s[METRIC_MAX];
+	uint64_t start, end;
+	size_t n = 0;
+	unsigned int t;
+	int m, i, ret = -1;
+
+	ctx = calloc(threads, sizeof(*ctx));
+	if (!ctx)
+		return -1;
+
+	memset(stage_ns, 0, sizeof(stage_ns));
+	pthread_barrier_init(&barrier, NULL, threads + 1);
+
+	for (t = 0; t < threads; t++) {
+		ctx[t].cfg = cfg;
+		ctx[t].barrier = &barrier;
+		for (m = 0; m < METRIC_MAX; m++) {
+			ctx[t].samples[m] = calloc(cfg->iterations, sizeof(uint64_t));
+			if (!ctx[t].samples[m])
+				goto out;
+		}
+	}
+
+	for (t = 0; t < threads; t++)
+		pthread_create(&ctx[t].thread, NULL, bench_thread, &ctx[t]);
+
+	/* Allocation, then warmup */
+	pthread_barrier_wait(&barrier);
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	for (t = 0; t < threads; t++)
+		pthread_join(ctx[t].thread, NULL);
+	end = now_ns();
+
+	for (t = 0; t < threads; t++) {
+		if (ctx[t].status != HSAKMT_STATUS_SUCCESS) {
+			fprintf(stderr, "thread %u failed with status %d\n",
+				t, ctx[t].status);
+			goto out;
+		}
+		n += ctx[t].count;
+	}
+
+	for (m = 0; m < METRIC_MAX; m++) {
+		size_t off = 0;
+
+		merged[m] = malloc(n * sizeof(uint64_t) + 1);
+		if (!merged[m])
+			goto out;
+		for (t = 0; t < threads; t++) {
+			memcpy(merged[m] + off, ctx[t].samples[m],
+			       ctx[t].count * sizeof(uint64_t));
+			off += ctx[t].count;
+			for (i = 0; i < KFD_MOCK_STAGE_MAX; i++)
+				stage_ns[m][i] += ctx[t].stage_ns[m][i];
+		}
+		compute_stats(merged[m], n, &s[m]);
+	}
+
+	print_result(cfg, threads, first, s, n, (end - start) / 1e9, stage_ns);
+	ret = 0;
+
+out:
+	for (m = 0; m < METRIC_MAX; m++)
+		free(merged[m]);
+	for (t = 0; t < threads; t++)
+		for (m = 0; m < METRIC_MAX; m++)
+			free(ctx[t].samples[m]);
+	pthread_barrier_destroy(&barrier);
+	free(ctx);
+	return ret;
+}
+
+static int parse_thread_counts(struct bench_config *cfg, const char *arg)
+{
+	char *copy = strdup(arg), *tok, *save = NULL;
+	unsigned long v;
+
+	if (!copy)
+		return -1;
+
+	cfg->num_thread_counts = 0;
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		v = strtoul(tok, NULL, 0);
+		if (!v || v > MAX_THREADS || cfg->num_thread_counts == MAX_THREADS) {
+			free(copy);
+			return -1;
+		}
+		cfg->thread_counts[cfg->num_thread_counts++] = v;
+	}
+	free(copy);
+
+	return cfg->num_thread_counts ? 0 : -1;
+}
+
+/* Re-executes the benchmark with libkfdmock.so from the same directory
+ * preloaded, so it can run without a GPU.
+ */
+static void reexec_with_mock(char **argv, unsigned int num_gpus)
+{
+	char exe[PATH_MAX], preload[PATH_MAX + 32], gpus[16];
+	ssize_t len;
+
+	len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (len < 0) {
+		perror("readlink");
+		exit(1);
+	}
+	exe[len] = '\0';
+
+	snprintf(preload, sizeof(preload), "%s/libkfdmock.so", dirname(strdup(exe)));
+	snprintf(gpus, sizeof(gpus), "%u", num_gpus);
+	setenv("LD_PRELOAD", preload, 1);
+	setenv("KFD_MOCK", "1", 1);
+	setenv("KFD_MOCK_NUM_GPUS", gpus, 0);
+
+	execv(exe, argv);
+	perror("execv");
+	exit(1);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n, --iterations N   measured create/destroy pairs per thread (default 1000)\n"
+		"  -w, --warmup N       unmeasured pairs per thread (default 10)\n"
+		"  -t, --threads LIST   comma separated thread counts to sweep (default 1)\n"
+		"  -q, --queue TYPE     compute, sdma or aql (default compute)\n"
+		"  -N, --node N         HSA node to create queues on (default first GPU)\n"
+		"  -f, --format FMT     text, json or csv (default text)\n"
+		"  -m, --mock [GPUS]    run against the mock KFD with GPUS GPUs (default 1)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{"iterations", required_argument, NULL, 'n'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"threads", required_argument, NULL, 't'},
+		{"queue", required_argument, NULL, 'q'},
+		{"node", required_argument, NULL, 'N'},
+		{"format", required_argument, NULL, 'f'},
+		{"mock", optional_argument, NULL, 'm'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	struct bench_config cfg = {
+		.node = UINT_MAX,
+		.iterations = 1000,
+		.warmup = 10,
+		.thread_counts = {1},
+		.num_thread_counts = 1,
+		.type = HSA_QUEUE_COMPUTE,
+		.format = FORMAT_TEXT,
+	};
+	HsaSystemProperties sys_props;
+	HsaNodeProperties node_props;
+	unsigned int i, mock_gpus = 0;
+	int opt, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "n:w:t:q:N:f:m::h", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			cfg.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.warmup = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			if (parse_thread_counts(&cfg, optarg)) {
+				fprintf(stderr, "Invalid thread list %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'q':
+			if (!strcmp(optarg, "compute"))
+				cfg.type = HSA_QUEUE_COMPUTE;
+			else if (!strcmp(optarg, "sdma"))
+				cfg.type = HSA_QUEUE_SDMA;
+			else if (!strcmp(optarg, "aql"))
+				cfg.type = HSA_QUEUE_COMPUTE_AQL;
+			else {
+				fprintf(stderr, "Unknown queue type %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'N':
+			cfg.node = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				cfg.format = FORMAT_TEXT;
+			else if (!strcmp(optarg, "json"))
+				cfg.format = FORMAT_JSON;
+			else if (!strcmp(optarg, "csv"))
+				cfg.format = FORMAT_CSV;
+			else {
+				fprintf(stderr, "Unknown format %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			mock_gpus = optarg ? strtoul(optarg, NULL, 0) : 1;
+			if (!mock_gpus)
+				mock_gpus = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!cfg.iterations) {
+		fprintf(stderr, "Iteration count must be positive\n");
+		return 1;
+	}
+
+	if (mock_gpus && !getenv("KFD_MOCK"))
+		reexec_with_mock(argv, mock_gpus);
+
+	get_stage_times = (kfd_mock_stage_times_fn)dlsym(RTLD_DEFAULT,
+							 KFD_MOCK_STAGE_TIMES_FN);
+
+	if (hsaKmtOpenKFD() != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to open KFD\n");
+		return 1;
+	}
+	if (hsaKmtAcquireSystemProperties(&sys_props) != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to acquire system properties\n");
+		ret = 1;
+		goto close;
+	}
+
+	if (cfg.node == UINT_MAX) {
+		for (i = 0; i < sys_props.NumNodes; i++) {
+			if (hsaKmtGetNodeProperties(i, &node_props) == HSAKMT_STATUS_SUCCESS &&
+			    node_props.NumFComputeCores) {
+				cfg.node = i;
+				break;
+			}
+		}
+		if (cfg.node == UINT_MAX) {
+			fprintf(stderr, "No GPU node found\n");
+			ret = 1;
+			goto release;
+		}
+	}
+
+	print_header(&cfg);
+	for (i = 0; i < cfg.num_thread_counts; i++) {
+		if (run_sweep_point(&cfg, cfg.thread_counts[i], i == 0)) {
+			ret = 1;
+			break;
+		}
+	}
+	print_footer(&cfg);
+
+release:
+	hsaKmtReleaseSystemProperties();
+close:
+	hsaKmtCloseKFD();
+	return ret;
+}
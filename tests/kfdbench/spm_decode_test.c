@@ -0,0 +1,281 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+/* Checks the SPM chunk codec, hsaKmtSPMEncodeChunk and hsaKmtSPMDecodeChunk.
+ * Neither needs KFD, so the test runs without the mock. Besides round trips
+ * of encoded chunks it decodes chunks built byte by byte, which pins the
+ * little endian file format and lets it corrupt single columns behind a
+ * valid checksum.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hsakmt.h"
+
+#define NUM_COUNTERS		5
+#define NUM_SAMPLES		1000
+
+/* On-disk header, see spm_decode.c */
+#define CHUNK_MAGIC		0x43505348
+#define CHUNK_VERSION		1
+#define CHUNK_HEADER_SIZE	32
+#define MAX_CHUNK_SIZE		256
+
+#define FNV1A_OFFSET		0xcbf29ce484222325ULL
+#define FNV1A_PRIME		0x100000001b3ULL
+
+static unsigned int num_failures;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, __VA_ARGS__);			\
+			fprintf(stderr, "\n");				\
+			num_failures++;					\
+		}							\
+	} while (0)
+
+static void put_le(uint8_t *p, uint64_t v, unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < size; i++, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+/* Builds a chunk of one counter from the raw bytes of its two columns, the
+ * timestamps and the values, and returns its size. The column ends are given
+ * separately so that they can disagree with the varints.
+ */
+static uint64_t build_chunk(uint8_t *chunk, uint32_t num_samples,
+			    const uint8_t *columns, uint32_t ts_end,
+			    uint32_t values_end)
+{
+	const uint32_t table_size = 2 * sizeof(uint32_t);
+	uint8_t *table = chunk + CHUNK_HEADER_SIZE;
+	uint64_t checksum = FNV1A_OFFSET;
+	uint32_t i;
+
+	put_le(table, ts_end, 4);
+	put_le(table + 4, values_end, 4);
+	memcpy(table + table_size, columns, values_end);
+	for (i = 0; i < table_size + values_end; i++)
+		checksum = (checksum ^ table[i]) * FNV1A_PRIME;
+
+	put_le(chunk, CHUNK_MAGIC, 4);
+	put_le(chunk + 4, CHUNK_VERSION, 2);
+	put_le(chunk + 6, CHUNK_HEADER_SIZE, 2);
+	put_le(chunk + 8, 1, 4);
+	put_le(chunk + 12, num_samples, 4);
+	put_le(chunk + 16, table_size + values_end, 8);
+	put_le(chunk + 24, checksum, 8);
+
+	return CHUNK_HEADER_SIZE + table_size + values_end;
+}
+
+static HSAKMT_STATUS decode(const void *chunk, HSAuint64 size,
+			    HSAuint64 *timestamps, HSAuint64 *values,
+			    HSAuint32 max_samples)
+{
+	HSAuint32 num_counters, num_samples;
+
+	return hsaKmtSPMDecodeChunk(chunk, size, max_samples, timestamps,
+				    values, &num_counters, &num_samples, NULL);
+}
+
+/* Encodes NUM_SAMPLES samples at offset misalign of the buffer and decodes
+ * them from another misaligned copy
+ */
+static void check_round_trip(unsigned int misalign)
+{
+	HSAuint64 *timestamps, *values, *out_timestamps, *out_values;
+	HSAuint64 max_size, size, chunk_size;
+	HSAuint32 num_counters, num_samples;
+	uint8_t *buf, *copy;
+	HSAKMT_STATUS ret;
+	uint32_t s, c;
+
+	timestamps = malloc(NUM_SAMPLES * sizeof(*timestamps));
+	out_timestamps = malloc(NUM_SAMPLES * sizeof(*out_timestamps));
+	values = malloc(NUM_COUNTERS * NUM_SAMPLES * sizeof(*values));
+	out_values = malloc(NUM_COUNTERS * NUM_SAMPLES * sizeof(*out_values));
+	if (!timestamps || !out_timestamps || !values || !out_values) {
+		CHECK(false, "out of memory");
+		goto out_free;
+	}
+
+	/* Small deltas take the fast paths, the others every varint length */
+	srand(1);
+	for (s = 0; s < NUM_SAMPLES; s++) {
+		timestamps[s] = 1000000 + s * 37ULL;
+		values[s] = s & 7;
+		values[NUM_SAMPLES + s] = (HSAuint64)rand() << 32 | rand();
+		values[2 * NUM_SAMPLES + s] = s % 3 ? 0 : UINT64_MAX;
+		values[3 * NUM_SAMPLES + s] = s < NUM_SAMPLES / 2 ? 100 - s : s;
+		values[4 * NUM_SAMPLES + s] = 1ULL << (s % 64);
+	}
+
+	ret = hsaKmtSPMEncodeChunk(NUM_COUNTERS, NUM_SAMPLES, timestamps,
+				   values, 0, NULL, &max_size);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS, "sizing the chunk returned %d", ret);
+	buf = malloc(max_size + misalign);
+	copy = malloc(max_size + misalign + 2);
+	if (!buf || !copy) {
+		CHECK(false, "out of memory");
+		goto out_free_bufs;
+	}
+
+	size = max_size - 1;
+	ret = hsaKmtSPMEncodeChunk(NUM_COUNTERS, NUM_SAMPLES, timestamps,
+				   values, 0, buf + misalign, &size);
+	CHECK(ret == HSAKMT_STATUS_BUFFER_TOO_SMALL,
+	      "encoding to a short buffer returned %d", ret);
+
+	size = max_size;
+	ret = hsaKmtSPMEncodeChunk(NUM_COUNTERS, NUM_SAMPLES, timestamps,
+				   values, 0, buf + misalign, &size);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS, "encoding returned %d", ret);
+	if (ret != HSAKMT_STATUS_SUCCESS)
+		goto out_free_bufs;
+	memcpy(copy + misalign + 2, buf + misalign, size);
+
+	/* Sizing the arrays needs only the header */
+	ret = hsaKmtSPMDecodeChunk(copy + misalign + 2, CHUNK_HEADER_SIZE, 0,
+				   NULL, NULL, &num_counters, &num_samples,
+				   &chunk_size);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS && num_counters == NUM_COUNTERS &&
+	      num_samples == NUM_SAMPLES && chunk_size == size,
+	      "chunk info returned %d, %u counters, %u samples, %llu bytes",
+	      ret, num_counters, num_samples, (unsigned long long)chunk_size);
+
+	ret = decode(copy + misalign + 2, size, out_timestamps, out_values,
+		     NUM_SAMPLES);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS, "decoding at offset %u returned %d",
+	      misalign + 2, ret);
+	CHECK(!memcmp(timestamps, out_timestamps,
+		      NUM_SAMPLES * sizeof(*timestamps)),
+	      "timestamps differ at offset %u", misalign + 2);
+	for (c = 0; c < NUM_COUNTERS; c++)
+		CHECK(!memcmp(&values[c * NUM_SAMPLES],
+			      &out_values[c * NUM_SAMPLES],
+			      NUM_SAMPLES * sizeof(*values)),
+		      "counter %u differs at offset %u", c, misalign + 2);
+
+	ret = decode(copy + misalign + 2, size - 1, out_timestamps,
+		     out_values, NUM_SAMPLES);
+	CHECK(ret == HSAKMT_STATUS_BUFFER_TOO_SMALL,
+	      "decoding a truncated chunk returned %d", ret);
+	ret = decode(copy + misalign + 2, size, out_timestamps, out_values,
+		     NUM_SAMPLES - 1);
+	CHECK(ret == HSAKMT_STATUS_BUFFER_TOO_SMALL,
+	      "decoding to short arrays returned %d", ret);
+
+	/* Any flipped bit behind the header fails the checksum */
+	copy[misalign + 2 + size / 2] ^= 0x10;
+	ret = decode(copy + misalign + 2, size, out_timestamps, out_values,
+		     NUM_SAMPLES);
+	CHECK(ret == HSAKMT_STATUS_INVALID_PARAMETER,
+	      "decoding a corrupted chunk returned %d", ret);
+
+out_free_bufs:
+	free(copy);
+	free(buf);
+out_free:
+	free(out_values);
+	free(values);
+	free(out_timestamps);
+	free(timestamps);
+}
+
+static void check_crafted_chunks(void)
+{
+	/* Timestamps 5, 3 and 131 are the zigzag deltas 10, 3 and 256, the
+	 * last one a two byte varint. The values 1, 1, 1 are deltas 2, 0, 0.
+	 */
+	static const uint8_t columns[] = { 0x0a, 0x03, 0x80, 0x02,
+					   0x02, 0x00, 0x00 };
+	/* Ten bytes hold 64 bits, an eleventh would shift past them */
+	static const uint8_t max_varint[] = { 0x80, 0x80, 0x80, 0x80, 0x80,
+					      0x80, 0x80, 0x80, 0x80, 0x01,
+					      0x00 };
+	static const uint8_t long_varint[] = { 0x80, 0x80, 0x80, 0x80, 0x80,
+					       0x80, 0x80, 0x80, 0x80, 0x80,
+					       0x01, 0x00 };
+	uint8_t buf[MAX_CHUNK_SIZE + 1], *chunk = buf + 1;
+	HSAuint64 timestamps[3], values[3], size;
+	HSAKMT_STATUS ret;
+
+	size = build_chunk(chunk, 3, columns, 4, sizeof(columns));
+	ret = decode(chunk, size, timestamps, values, 3);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS, "decoding a crafted chunk returned %d",
+	      ret);
+	CHECK(timestamps[0] == 5 && timestamps[1] == 3 && timestamps[2] == 131,
+	      "crafted timestamps decoded to %llu, %llu, %llu",
+	      (unsigned long long)timestamps[0],
+	      (unsigned long long)timestamps[1],
+	      (unsigned long long)timestamps[2]);
+	CHECK(values[0] == 1 && values[1] == 1 && values[2] == 1,
+	      "crafted values decoded to %llu, %llu, %llu",
+	      (unsigned long long)values[0], (unsigned long long)values[1],
+	      (unsigned long long)values[2]);
+
+	/* The timestamp column ends in the middle of its last varint */
+	size = build_chunk(chunk, 3, columns, 3, sizeof(columns));
+	ret = decode(chunk, size, timestamps, values, 3);
+	CHECK(ret == HSAKMT_STATUS_INVALID_PARAMETER,
+	      "decoding a truncated column returned %d", ret);
+
+	/* The timestamp column holds a varint more than it should */
+	size = build_chunk(chunk, 2, columns, 4, sizeof(columns));
+	ret = decode(chunk, size, timestamps, values, 3);
+	CHECK(ret == HSAKMT_STATUS_INVALID_PARAMETER,
+	      "decoding an overlong column returned %d", ret);
+
+	size = build_chunk(chunk, 1, max_varint, 10, sizeof(max_varint));
+	ret = decode(chunk, size, timestamps, values, 1);
+	CHECK(ret == HSAKMT_STATUS_SUCCESS && timestamps[0] == 1ULL << 62,
+	      "decoding a ten byte varint returned %d, %llx", ret,
+	      (unsigned long long)timestamps[0]);
+
+	size = build_chunk(chunk, 1, long_varint, 11, sizeof(long_varint));
+	ret = decode(chunk, size, timestamps, values, 1);
+	CHECK(ret == HSAKMT_STATUS_INVALID_PARAMETER,
+	      "decoding an eleven byte varint returned %d", ret);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int misalign;
+
+	for (misalign = 0; misalign < 8; misalign++)
+		check_round_trip(misalign);
+	check_crafted_chunks();
+
+	printf("SPM decode test %s\n", num_failures ? "failed" : "passed");
+
+	return num_failures ? 1 : 0;
+}
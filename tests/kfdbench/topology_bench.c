@@ -0,0 +1,346 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Measures how long libhsakmt takes to snapshot the topology, i.e. the
+ * cost of hsaKmtAcquireSystemProperties, on synthetic 1, 8 and 32 GPU
+ * systems. Each system is a fixture tree (see topology_fixture.h) read by
+ * a child process running against the mock KFD, so the benchmark runs on
+ * machines without a GPU.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hsakmt.h"
+#include "topology_fixture.h"
+
+#define MAX_SYSTEMS		16
+
+/* Set in the child processes, "<GPUs>,<index of the system>" */
+#define BENCH_CHILD_ENV		"TOPOLOGY_BENCH_CHILD"
+
+enum output_format {
+	FORMAT_TEXT,
+	FORMAT_JSON,
+	FORMAT_CSV,
+};
+
+struct bench_config {
+	unsigned int iterations;
+	unsigned int warmup;
+	unsigned int gpu_counts[MAX_SYSTEMS];
+	unsigned int num_gpu_counts;
+	enum output_format format;
+	const char *output_dir;
+};
+
+struct stats {
+	uint64_t min, p50, p90, p99, max;
+	double mean;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+	size_t idx = (size_t)(p * (n - 1) + 0.5);
+
+	return sorted[idx < n ? idx : n - 1];
+}
+
+static void compute_stats(uint64_t *samples, size_t n, struct stats *s)
+{
+	double sum = 0;
+	size_t i;
+
+	memset(s, 0, sizeof(*s));
+	if (!n)
+		return;
+
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	s->min = samples[0];
+	s->p50 = percentile(samples, n, 0.50);
+	s->p90 = percentile(samples, n, 0.90);
+	s->p99 = percentile(samples, n, 0.99);
+	s->max = samples[n - 1];
+	s->mean = sum / n;
+}
+
+static void print_header(const struct bench_config *cfg)
+{
+	if (cfg->format == FORMAT_JSON)
+		printf("{\n  \"iterations\": %u,\n  \"results\": [", cfg->iterations);
+	else if (cfg->format == FORMAT_CSV)
+		printf("gpus,nodes,samples,min_ns,p50_ns,p90_ns,p99_ns,max_ns,mean_ns\n");
+	else
+		printf("%-6s %6s %12s %12s %12s %12s %12s %12s\n", "gpus", "nodes",
+		       "min(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)", "mean(us)");
+}
+
+static void print_footer(const struct bench_config *cfg)
+{
+	if (cfg->format == FORMAT_JSON)
+		printf("\n  ]\n}\n");
+}
+
+static void print_result(const struct bench_config *cfg, unsigned int gpus,
+			 unsigned int nodes, bool first, const struct stats *s,
+			 size_t n)
+{
+	switch (cfg->format) {
+	case FORMAT_TEXT:
+		printf("%-6u %6u %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f\n",
+		       gpus, nodes, s->min / 1e3, s->p50 / 1e3, s->p90 / 1e3,
+		       s->p99 / 1e3, s->max / 1e3, s->mean / 1e3);
+		break;
+	case FORMAT_CSV:
+		printf("%u,%u,%zu,%lu,%lu,%lu,%lu,%lu,%.1f\n", gpus, nodes, n,
+		       s->min, s->p50, s->p90, s->p99, s->max, s->mean);
+		break;
+	case FORMAT_JSON:
+		printf("%s\n    {\"gpus\": %u, \"nodes\": %u, \"samples\": %zu, "
+		       "\"min\": %lu, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, "
+		       "\"max\": %lu, \"mean\": %.1f}", first ? "" : ",", gpus,
+		       nodes, n, s->min, s->p50, s->p90, s->p99, s->max, s->mean);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Runs in the child process, with libhsakmt pointed at the fixture */
+static int run_system(const struct bench_config *cfg, unsigned int gpus,
+		      bool first)
+{
+	HsaSystemProperties sys_props;
+	uint64_t *samples, t0;
+	struct stats s;
+	unsigned int i;
+	int ret = 1;
+
+	samples = calloc(cfg->iterations, sizeof(uint64_t));
+	if (!samples)
+		return 1;
+
+	if (hsaKmtOpenKFD() != HSAKMT_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to open KFD\n");
+		goto out;
+	}
+
+	for (i = 0; i < cfg->warmup + cfg->iterations; i++) {
+		t0 = now_ns();
+		if (hsaKmtAcquireSystemProperties(&sys_props) != HSAKMT_STATUS_SUCCESS) {
+			fprintf(stderr, "Failed to acquire system properties\n");
+			goto close;
+		}
+		if (i >= cfg->warmup)
+			samples[i - cfg->warmup] = now_ns() - t0;
+		hsaKmtReleaseSystemProperties();
+	}
+
+	if (sys_props.NumNodes != gpus + 1) {
+		fprintf(stderr, "Expected %u nodes, found %u\n", gpus + 1,
+			sys_props.NumNodes);
+		goto close;
+	}
+
+	compute_stats(samples, cfg->iterations, &s);
+	print_result(cfg, gpus, sys_props.NumNodes, first, &s, cfg->iterations);
+	ret = 0;
+
+close:
+	hsaKmtCloseKFD();
+out:
+	free(samples);
+	return ret;
+}
+
+static int parse_gpu_counts(struct bench_config *cfg, const char *arg)
+{
+	char *copy = strdup(arg), *tok, *save = NULL;
+	unsigned long v;
+
+	if (!copy)
+		return -1;
+
+	cfg->num_gpu_counts = 0;
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		v = strtoul(tok, NULL, 0);
+		if (!v || v > KFD_FIXTURE_MAX_GPUS || cfg->num_gpu_counts == MAX_SYSTEMS) {
+			free(copy);
+			return -1;
+		}
+		cfg->gpu_counts[cfg->num_gpu_counts++] = v;
+	}
+	free(copy);
+
+	return cfg->num_gpu_counts ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n, --iterations N   measured snapshots per system (default 100)\n"
+		"  -w, --warmup N       unmeasured snapshots per system (default 5)\n"
+		"  -g, --gpus LIST      comma separated GPU counts (default 1,8,32)\n"
+		"  -f, --format FMT     text, json or csv (default text)\n"
+		"  -o, --output DIR     only write the fixtures to DIR/gpu<N>\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{"iterations", required_argument, NULL, 'n'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"gpus", required_argument, NULL, 'g'},
+		{"format", required_argument, NULL, 'f'},
+		{"output", required_argument, NULL, 'o'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	struct bench_config cfg = {
+		.iterations = 100,
+		.warmup = 5,
+		.gpu_counts = {1, 8, 32},
+		.num_gpu_counts = 3,
+		.format = FORMAT_TEXT,
+	};
+	char dir[PATH_MAX], root[PATH_MAX + 16], env[32];
+	unsigned int i, gpus, index;
+	const char *child;
+	int opt, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "n:w:g:f:o:h", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			cfg.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.warmup = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			if (parse_gpu_counts(&cfg, optarg)) {
+				fprintf(stderr, "Invalid GPU list %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				cfg.format = FORMAT_TEXT;
+			else if (!strcmp(optarg, "json"))
+				cfg.format = FORMAT_JSON;
+			else if (!strcmp(optarg, "csv"))
+				cfg.format = FORMAT_CSV;
+			else {
+				fprintf(stderr, "Unknown format %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			cfg.output_dir = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!cfg.iterations) {
+		fprintf(stderr, "Iteration count must be positive\n");
+		return 1;
+	}
+
+	child = getenv(BENCH_CHILD_ENV);
+	if (child) {
+		if (sscanf(child, "%u,%u", &gpus, &index) != 2)
+			return 1;
+		return run_system(&cfg, gpus, index == 0);
+	}
+
+	if (cfg.output_dir) {
+		for (i = 0; i < cfg.num_gpu_counts; i++) {
+			snprintf(root, sizeof(root), "%s/gpu%u", cfg.output_dir,
+				 cfg.gpu_counts[i]);
+			if (kfd_fixture_write(root, cfg.gpu_counts[i])) {
+				fprintf(stderr, "Failed to write %s: %s\n", root,
+					strerror(errno));
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	snprintf(dir, sizeof(dir), "%s/kfdfixture.XXXXXX",
+		 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	print_header(&cfg);
+	for (i = 0; i < cfg.num_gpu_counts; i++) {
+		snprintf(root, sizeof(root), "%s/gpu%u", dir, cfg.gpu_counts[i]);
+		snprintf(env, sizeof(env), "%u,%u", cfg.gpu_counts[i], i);
+		if (kfd_fixture_write(root, cfg.gpu_counts[i]) ||
+		    kfd_fixture_run_child(argv, root, cfg.gpu_counts[i],
+					  BENCH_CHILD_ENV, env)) {
+			fprintf(stderr, "Benchmark of %u GPUs failed\n",
+				cfg.gpu_counts[i]);
+			ret = 1;
+			break;
+		}
+	}
+	print_footer(&cfg);
+
+	kfd_fixture_remove(dir);
+	return ret;
+}
@@ -0,0 +1,389 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Synthetic sysfs and procfs trees, see topology_fixture.h */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "topology_fixture.h"
+
+/* Caches of each CPU: private L1D, L1I and L2, and an L3 shared by all */
+static const struct {
+	unsigned int level;
+	const char *type;
+	const char *size;
+	unsigned int ways;
+	bool shared;
+} cpu_caches[] = {
+	{ 1, "Data", "32K", 8, false },
+	{ 1, "Instruction", "32K", 8, false },
+	{ 2, "Unified", "512K", 8, false },
+	{ 3, "Unified", "16384K", 16, true },
+};
+
+static int write_file(const char *dir, const char *name, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+
+	return fclose(f);
+}
+
+/* Creates the directory and all missing parents, like mkdir -p */
+static int make_dir(char *path, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+
+	va_start(ap, fmt);
+	vsnprintf(path, size, fmt, ap);
+	va_end(ap);
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	return (mkdir(path, 0755) && errno != EEXIST) ? -1 : 0;
+}
+
+static int write_iolink(const char *node_dir, unsigned int link,
+			unsigned int from, unsigned int to, bool xgmi,
+			bool unknown_bw)
+{
+	char dir[PATH_MAX];
+
+	if (make_dir(dir, sizeof(dir), "%s/io_links/%u", node_dir, link))
+		return -1;
+
+	return write_file(dir, "properties",
+			  "type %u\nversion_major 0\nversion_minor 0\n"
+			  "node_from %u\nnode_to %u\nweight %u\n"
+			  "min_latency 0\nmax_latency 0\n"
+			  "min_bandwidth %u\nmax_bandwidth %u\n"
+			  "recommended_transfer_size 0\nflags 1\n",
+			  xgmi ? 11 : 2, from, to, xgmi ? 15 : 20,
+			  unknown_bw ? 0 : xgmi ? 23000 : 312,
+			  unknown_bw ? 0 : xgmi ? 46000 : 16000);
+}
+
+static int write_kfd_topology(const char *root, unsigned int num_gpus,
+			      unsigned int num_cpus,
+			      const struct kfd_fixture_opts *opts)
+{
+	char dir[PATH_MAX], node_dir[PATH_MAX], topo[PATH_MAX];
+	unsigned int i, j, link, num_peers, num_links, hive_id;
+	int ret = 0;
+
+	if (make_dir(topo, sizeof(topo), "%s%s", root, KFD_FIXTURE_TOPOLOGY) ||
+	    make_dir(dir, sizeof(dir), "%s/nodes", topo))
+		return -1;
+	ret |= write_file(topo, "generation_id", "1\n");
+	ret |= write_file(topo, "system_properties",
+			  "platform_oem 0\nplatform_id 0\nplatform_rev 0\n");
+
+	/* CPU node */
+	num_links = 0;
+	for (i = 0; i < num_gpus; i++)
+		num_links += KFD_FIXTURE_CPU_LINK(opts, i);
+	if (make_dir(node_dir, sizeof(node_dir), "%s/nodes/0", topo))
+		return -1;
+	ret |= write_file(node_dir, "gpu_id", "0\n");
+	ret |= write_file(node_dir, "name", "\n");
+	ret |= write_file(node_dir, "properties",
+			  "cpu_cores_count %u\nsimd_count 0\nmem_banks_count 1\n"
+			  "caches_count 0\nio_links_count %u\ncpu_core_id_base 0\n"
+			  "simd_id_base 0\nmax_waves_per_simd 0\nlds_size_in_kb 0\n"
+			  "gds_size_in_kb 0\nnum_gws 0\nwave_front_size 0\n"
+			  "array_count 0\nsimd_arrays_per_engine 0\n"
+			  "cu_per_simd_array 0\nsimd_per_cu 0\n"
+			  "max_slots_scratch_cu 0\ngfx_target_version 0\n"
+			  "vendor_id 0\ndevice_id 0\nlocation_id 0\ndomain 0\n"
+			  "drm_render_minor 0\nhive_id 0\nnum_sdma_engines 0\n"
+			  "num_sdma_xgmi_engines 0\nnum_sdma_queues_per_engine 0\n"
+			  "num_cp_queues 0\nmax_engine_clk_ccompute 3000\n",
+			  num_cpus, num_links);
+	if (make_dir(dir, sizeof(dir), "%s/mem_banks/0", node_dir))
+		return -1;
+	ret |= write_file(dir, "properties",
+			  "heap_type 0\nsize_in_bytes 68719476736\nflags 0\n"
+			  "width 64\nmem_clk_max 3200\n");
+	if (make_dir(dir, sizeof(dir), "%s/caches", node_dir) ||
+	    make_dir(dir, sizeof(dir), "%s/io_links", node_dir))
+		return -1;
+	link = 0;
+	for (i = 0; i < num_gpus; i++)
+		if (KFD_FIXTURE_CPU_LINK(opts, i))
+			ret |= write_iolink(node_dir, link++, 0, i + 1, false, false);
+
+	for (i = 0; i < num_gpus; i++) {
+		/* Only GPUs of the same hive are linked to each other, libhsakmt
+		 * adds the indirect links through the CPU
+		 */
+		num_peers = 0;
+		for (j = 0; j < num_gpus; j++)
+			if (j != i && KFD_FIXTURE_HIVE(opts, j) == KFD_FIXTURE_HIVE(opts, i))
+				num_peers++;
+		hive_id = num_peers ? 0x1234 + KFD_FIXTURE_HIVE(opts, i) : 0;
+		num_links = num_peers + KFD_FIXTURE_CPU_LINK(opts, i);
+
+		if (make_dir(node_dir, sizeof(node_dir), "%s/nodes/%u", topo, i + 1))
+			return -1;
+		ret |= write_file(node_dir, "gpu_id", "%u\n", KFD_FIXTURE_GPU_ID(i));
+		ret |= write_file(node_dir, "name", "vega10\n");
+		ret |= write_file(node_dir, "properties",
+				  "cpu_cores_count 0\nsimd_count 256\nmem_banks_count 1\n"
+				  "caches_count 1\nio_links_count %u\ncpu_core_id_base 0\n"
+				  "simd_id_base %u\nmax_waves_per_simd 10\n"
+				  "lds_size_in_kb 64\ngds_size_in_kb 0\nnum_gws 64\n"
+				  "wave_front_size 64\narray_count 4\n"
+				  "simd_arrays_per_engine 1\ncu_per_simd_array 16\n"
+				  "simd_per_cu 4\nmax_slots_scratch_cu 32\n"
+				  "gfx_target_version 90000\nvendor_id 4098\n"
+				  "device_id 26720\nlocation_id %u\ndomain 0\n"
+				  "drm_render_minor %u\nhive_id %u\n"
+				  "unique_id %u\nnum_sdma_engines 2\n"
+				  "num_sdma_xgmi_engines 0\n"
+				  "num_sdma_queues_per_engine 8\nnum_cp_queues 24\n"
+				  "max_engine_clk_fcompute 1500\n"
+				  "local_mem_size 17163091968\nfw_version 405\n"
+				  "capability 671588992\nsdma_fw_version 430\n",
+				  num_links, 0x80000000 + i * 0x1000, (i + 1) << 8,
+				  KFD_FIXTURE_RENDER_MINOR(i), hive_id, 0x5000 + i);
+		if (make_dir(dir, sizeof(dir), "%s/mem_banks/0", node_dir))
+			return -1;
+		ret |= write_file(dir, "properties",
+				  "heap_type %u\nsize_in_bytes 17163091968\nflags 0\n"
+				  "width 2048\nmem_clk_max 945\n",
+				  KFD_FIXTURE_LARGE_BAR(opts, i) ? 1 : 2);
+		if (make_dir(dir, sizeof(dir), "%s/caches/0", node_dir))
+			return -1;
+		ret |= write_file(dir, "properties",
+				  "processor_id_low %u\nlevel 2\nsize 4096\n"
+				  "cache_line_size 128\ncache_lines_per_tag 1\n"
+				  "association 16\nlatency 0\ntype 5\n"
+				  "sibling_map 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1\n",
+				  0x80000000 + i * 0x1000);
+		if (make_dir(dir, sizeof(dir), "%s/io_links", node_dir))
+			return -1;
+		link = 0;
+		if (KFD_FIXTURE_CPU_LINK(opts, i))
+			ret |= write_iolink(node_dir, link++, i + 1, 0, false, false);
+		for (j = 0; j < num_gpus; j++)
+			if (j != i && KFD_FIXTURE_HIVE(opts, j) == KFD_FIXTURE_HIVE(opts, i))
+				ret |= write_iolink(node_dir, link++, i + 1, j + 1, true,
+						    opts->unknown_xgmi_bw);
+	}
+
+	return ret ? -1 : 0;
+}
+
+/* Formats a CPU mask the way sysfs shows shared_cpu_map: 32 bit groups of
+ * 8 hex digits separated by commas, most significant group first.
+ */
+static void format_cpu_map(char *buf, size_t size, unsigned int first,
+			   unsigned int count)
+{
+	unsigned int groups = (first + count + 31) / 32, g, bit;
+	size_t len = 0;
+	uint32_t mask;
+
+	for (g = groups; g-- > 0; ) {
+		mask = 0;
+		for (bit = 0; bit < 32; bit++)
+			if (g * 32 + bit >= first && g * 32 + bit < first + count)
+				mask |= 1U << bit;
+		len += snprintf(buf + len, size - len, "%08x%s", mask, g ? "," : "");
+		if (len >= size)
+			break;
+	}
+}
+
+static int write_cpu_topology(const char *root, unsigned int num_cpus)
+{
+	char dir[PATH_MAX], map[256];
+	unsigned int cpu, idx;
+	FILE *f;
+	int ret = 0;
+
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		for (idx = 0; idx < sizeof(cpu_caches) / sizeof(cpu_caches[0]); idx++) {
+			unsigned int first = cpu_caches[idx].shared ? 0 : cpu;
+			unsigned int count = cpu_caches[idx].shared ? num_cpus : 1;
+
+			if (make_dir(dir, sizeof(dir),
+				     "%s/sys/devices/system/node/node0/cpu%u/cache/index%u",
+				     root, cpu, idx))
+				return -1;
+			format_cpu_map(map, sizeof(map), first, count);
+			ret |= write_file(dir, "level", "%u\n", cpu_caches[idx].level);
+			ret |= write_file(dir, "type", "%s\n", cpu_caches[idx].type);
+			ret |= write_file(dir, "size", "%s\n", cpu_caches[idx].size);
+			ret |= write_file(dir, "coherency_line_size", "64\n");
+			ret |= write_file(dir, "ways_of_associativity", "%u\n",
+					  cpu_caches[idx].ways);
+			ret |= write_file(dir, "physical_line_partition", "1\n");
+			if (count > 1)
+				ret |= write_file(dir, "shared_cpu_list", "%u-%u\n",
+						  first, first + count - 1);
+			else
+				ret |= write_file(dir, "shared_cpu_list", "%u\n", first);
+			ret |= write_file(dir, "shared_cpu_map", "%s\n", map);
+		}
+	}
+
+	/* One thread per core, all in package 0 */
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		if (make_dir(dir, sizeof(dir), "%s/sys/devices/system/cpu/cpu%u/topology",
+			     root, cpu))
+			return -1;
+		ret |= write_file(dir, "physical_package_id", "0\n");
+		ret |= write_file(dir, "core_id", "%u\n", cpu);
+		ret |= write_file(dir, "thread_siblings_list", "%u\n", cpu);
+	}
+
+	if (make_dir(dir, sizeof(dir), "%s/sys/devices/system/cpu", root))
+		return -1;
+	ret |= write_file(dir, "online", num_cpus > 1 ? "0-%u\n" : "0\n",
+			  num_cpus - 1);
+
+	if (make_dir(dir, sizeof(dir), "%s/proc/sys/kernel/random", root))
+		return -1;
+	ret |= write_file(dir, "boot_id", "a1b2c3d4-0000-4000-8000-000000000001\n");
+
+	snprintf(dir, sizeof(dir), "%s/proc/cpuinfo", root);
+	f = fopen(dir, "w");
+	if (!f)
+		return -1;
+	for (cpu = 0; cpu < num_cpus; cpu++)
+		fprintf(f, "processor\t: %u\nvendor_id\t: AuthenticAMD\n"
+			"model name\t: AMD EPYC 7742 64-Core Processor\n"
+			"apicid\t\t: %u\n\n", cpu, cpu);
+	ret |= fclose(f);
+
+	return ret ? -1 : 0;
+}
+
+int kfd_fixture_write(const char *root, unsigned int num_gpus)
+{
+	static const struct kfd_fixture_opts defaults;
+
+	return kfd_fixture_write_opts(root, num_gpus, &defaults);
+}
+
+int kfd_fixture_write_opts(const char *root, unsigned int num_gpus,
+			   const struct kfd_fixture_opts *opts)
+{
+	unsigned int num_cpus = get_nprocs();
+
+	if (num_gpus > KFD_FIXTURE_MAX_GPUS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (write_kfd_topology(root, num_gpus, num_cpus, opts) ||
+	    write_cpu_topology(root, num_cpus))
+		return -1;
+
+	return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag,
+			struct FTW *ftwbuf)
+{
+	return remove(path);
+}
+
+void kfd_fixture_remove(const char *root)
+{
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int kfd_fixture_run_child(char **argv, const char *root, unsigned int num_gpus,
+			  const char *name, const char *value)
+{
+	char exe[PATH_MAX], preload[PATH_MAX + 32];
+	int status;
+	ssize_t len;
+	pid_t pid;
+
+	len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (len < 0) {
+		perror("readlink");
+		return -1;
+	}
+	exe[len] = '\0';
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (!pid) {
+		snprintf(preload, sizeof(preload), "%s/libkfdmock.so", dirname(strdup(exe)));
+		setenv("LD_PRELOAD", preload, 1);
+		setenv("KFD_MOCK", "1", 1);
+		snprintf(preload, sizeof(preload), "%u", num_gpus);
+		setenv("KFD_MOCK_NUM_GPUS", preload, 1);
+		setenv("HSAKMT_SYSFS_ROOT", root, 1);
+		setenv("HSAKMT_PROCFS_ROOT", root, 1);
+		setenv(name, value, 1);
+		execv(exe, argv);
+		perror("execv");
+		_exit(1);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -1;
+
+	return (WIFEXITED(status) && !WEXITSTATUS(status)) ? 0 : -1;
+}
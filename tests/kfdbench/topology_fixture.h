@@ -0,0 +1,94 @@
+/*
+ * Copyright © 2021 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including
+ * the next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TOPOLOGY_FIXTURE_H_INCLUDED
+#define TOPOLOGY_FIXTURE_H_INCLUDED
+
+/* Synthetic sysfs and procfs trees for running libhsakmt's topology code
+ * without a GPU. kfd_fixture_write creates below @root:
+ *
+ *   sys/devices/virtual/kfd/kfd/topology	KFD topology, node 0 is a CPU,
+ *						nodes 1..N are Vega10 dGPUs
+ *   sys/devices/system/node/node0/cpuN	CPU caches
+ *   sys/devices/system/cpu/cpuN/topology	CPU package, core and thread IDs
+ *   sys/devices/system/cpu/online
+ *   proc/cpuinfo
+ *   proc/sys/kernel/random/boot_id
+ *
+ * The GPUs are connected to the CPU over PCIe and fully connected to each
+ * other over XGMI, and all of their VRAM is host visible (large BAR).
+ * kfd_fixture_write_opts can split the GPUs into several XGMI hives, give
+ * some of them a small BAR, leave some without a link to the CPU and
+ * leave out the XGMI link bandwidths. The number of CPUs is the number of
+ * online processors, which libhsakmt sizes its CPU tables by.
+ *
+ * Point libhsakmt at the tree with HSAKMT_SYSFS_ROOT=@root and
+ * HSAKMT_PROCFS_ROOT=@root.
+ */
+
+#define KFD_FIXTURE_TOPOLOGY		"/sys/devices/virtual/kfd/kfd/topology"
+#define KFD_FIXTURE_MAX_GPUS		64
+#define KFD_FIXTURE_GPU_ID(i)		(0x1000 + (i))
+#define KFD_FIXTURE_RENDER_MINOR(i)	(128 + (i))
+
+/* Variations of the default system, zero for the defaults */
+struct kfd_fixture_opts {
+	unsigned int hive_size;		/* GPUs per XGMI hive, 0 for one hive */
+	unsigned int small_bar_every;	/* every Nth GPU has private VRAM only */
+	unsigned int cpu_link_every;	/* only every Nth GPU, starting with
+					 * the first, is linked to the CPU
+					 */
+	unsigned int unknown_xgmi_bw;	/* XGMI links report no bandwidth */
+};
+
+/* Whether GPU @i (0 based) of the fixture has a large BAR */
+#define KFD_FIXTURE_LARGE_BAR(opts, i) \
+	(!(opts)->small_bar_every || ((i) + 1) % (opts)->small_bar_every)
+
+/* Whether GPU @i (0 based) of the fixture is linked to the CPU */
+#define KFD_FIXTURE_CPU_LINK(opts, i) \
+	(!(opts)->cpu_link_every || !((i) % (opts)->cpu_link_every))
+
+/* Hive of GPU @i (0 based), GPUs with the same index share XGMI links */
+#define KFD_FIXTURE_HIVE(opts, i) \
+	((opts)->hive_size ? (i) / (opts)->hive_size : 0)
+
+/* Returns 0 on success, -1 with errno set on failure */
+int kfd_fixture_write(const char *root, unsigned int num_gpus);
+int kfd_fixture_write_opts(const char *root, unsigned int num_gpus,
+			   const struct kfd_fixture_opts *opts);
+
+/* Removes a tree created by kfd_fixture_write */
+void kfd_fixture_remove(const char *root);
+
+/* Runs the calling program again in a child process, with the mock KFD from
+ * the same directory preloaded and libhsakmt reading the tree at @root.
+ * @name is set to @value in the child's environment, so it can tell that
+ * it is the child. Returns 0 if the child exited with status 0.
+ */
+int kfd_fixture_run_child(char **argv, const char *root, unsigned int num_gpus,
+			  const char *name, const char *value);
+
+#endif
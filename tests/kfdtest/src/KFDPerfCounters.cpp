@@ -21,6 +21,7 @@
  *
  */
 
+#include <vector>
 #include "KFDPerfCounters.hpp"
 
 void KFDPerfCountersTest::SetUp() {
@@ -254,6 +255,97 @@ TEST_F(KFDPerfCountersTest, StartStopQueryTrace) {
     TEST_END
 }
 
+/* Registers more counters than the block has slots, which takes several
+ * passes. Each pass fills in its counters at the positions they would have
+ * in a single pass: the buffer is pre-filled with a marker, and after pass p
+ * only counters p, p + passes, ... may have been added.
+ */
+TEST_F(KFDPerfCountersTest, MultiPassTrace) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    const uint64_t unwritten = ~0ULL;
+    HsaPmcTraceRoot root;
+    HsaCounterProperties* pProps;
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    pProps = NULL;
+    ASSERT_SUCCESS(hsaKmtPmcGetCounterProperties(defaultGPUNode, &pProps));
+
+    /* Verifying that there is at least one block */
+    ASSERT_NE(0, pProps->NumBlocks) << "No performance counters blocks";
+
+    HsaCounterBlockProperties *block = &pProps->Blocks[0];
+    bool priv_block_found = false;
+    for (HSAuint32 i = 0; i < pProps->NumBlocks; i++) {
+        if (block->Counters[0].Type <= HSA_PROFILE_TYPE_PRIVILEGED_STREAMING) {
+            priv_block_found = true;
+            break;
+        }
+        block = reinterpret_cast<HsaCounterBlockProperties *>(&block->Counters[block->NumCounters]);
+    }
+
+    if (!priv_block_found) {
+        LOG() << "Skipping test: No privileged block is found."
+            << std::endl;
+        return;
+    }
+
+    /* Two full passes and one counter more, repeating the block's counter
+     * IDs as needed
+     */
+    const HSAuint32 numConcurrent = block->NumConcurrent;
+    const HSAuint32 numCounters = 2 * numConcurrent + 1;
+    const HSAuint32 expectedPasses = 3;
+    std::vector<HsaCounter> counters(numCounters);
+    for (HSAuint32 i = 0; i < numCounters; i++)
+        counters[i] = block->Counters[i % block->NumCounters];
+
+    ASSERT_SUCCESS(hsaKmtPmcRegisterTrace(defaultGPUNode, numCounters,
+                                          &counters[0], &root));
+    EXPECT_EQ(expectedPasses, root.NumberOfPasses);
+    EXPECT_GE(root.TraceBufferMinSizeBytes, numCounters * sizeof(uint64_t));
+
+    if (getuid()) { /* Non-root */
+        LOG() << "Skipping tracing: Privileged counters requires the user as root." << std::endl;
+        EXPECT_SUCCESS(hsaKmtPmcUnregisterTrace(defaultGPUNode, root.TraceId));
+        return;
+    }
+
+    ASSERT_SUCCESS(hsaKmtPmcAcquireTraceAccess(defaultGPUNode, root.TraceId));
+
+    HsaMemoryBuffer membuf(PAGE_SIZE, defaultGPUNode);
+    ASSERT_GE(membuf.Size(), numCounters * sizeof(uint64_t));
+    uint64_t *buf = membuf.As<uint64_t*>();
+    for (HSAuint32 i = 0; i < numCounters; i++)
+        buf[i] = unwritten;
+
+    /* Every start after a stop traces the next pass */
+    for (HSAuint32 pass = 0; pass < root.NumberOfPasses; pass++) {
+        ASSERT_SUCCESS(hsaKmtPmcStartTrace(root.TraceId, membuf.As<void*>(),
+                                           membuf.Size()));
+        Delay(START_STOP_DELAY / 10);
+        ASSERT_SUCCESS(hsaKmtPmcStopTrace(root.TraceId));
+        ASSERT_SUCCESS(hsaKmtPmcQueryTrace(root.TraceId));
+
+        for (HSAuint32 i = 0; i < numCounters; i++) {
+            if (i % root.NumberOfPasses <= pass)
+                EXPECT_NE(unwritten, buf[i]) << "Counter " << i << " missing after pass " << pass;
+            else
+                EXPECT_EQ(unwritten, buf[i]) << "Counter " << i << " written in pass " << pass;
+        }
+    }
+
+    for (HSAuint32 i = 0; i < numCounters; i++)
+        LOG() << "Counter " << std::dec << i << ": " << buf[i] << std::endl;
+
+    EXPECT_SUCCESS(hsaKmtPmcReleaseTraceAccess(0, root.TraceId));
+    EXPECT_SUCCESS(hsaKmtPmcUnregisterTrace(defaultGPUNode, root.TraceId));
+
+    TEST_END
+}
+
 TEST_F(KFDPerfCountersTest, ClockCountersBasicTest) {
     TEST_START(TESTPROFILE_RUNALL)
 
@@ -71,6 +71,34 @@ TEST_F(KFDQMTest, CreateDestroyCpQueue) {
     TEST_END
 }
 
+TEST_F(KFDQMTest, StaleQueueIdRejected) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    PM4Queue queue;
+
+    ASSERT_SUCCESS(queue.Create(defaultGPUNode));
+    HSA_QUEUEID staleId = queue.GetResource()->QueueId;
+    EXPECT_SUCCESS(queue.Destroy());
+
+    /* Recreating the queue may reuse the same slot, but must not
+     * make the handle of the destroyed queue valid again.
+     */
+    ASSERT_SUCCESS(queue.Create(defaultGPUNode));
+    EXPECT_NE(staleId, queue.GetResource()->QueueId);
+
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER, hsaKmtDestroyQueue(staleId));
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER,
+              hsaKmtUpdateQueue(staleId, 100, HSA_QUEUE_PRIORITY_NORMAL, NULL, 0, NULL));
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER, hsaKmtDestroyQueue(INVALID_QUEUEID));
+
+    EXPECT_SUCCESS(queue.Destroy());
+
+    TEST_END
+}
+
 TEST_F(KFDQMTest, SubmitNopCpQueue) {
     TEST_START(TESTPROFILE_RUNALL)
 
@@ -968,6 +996,53 @@ TEST_F(KFDQMTest, BasicCuMaskingEven) {
     TEST_END
 }
 
+/**
+ * Check that the CU mask partitioner splits all active CUs into disjoint
+ * masks and that the builder enables the requested number of CUs
+ */
+TEST_F(KFDQMTest, CuMaskPartition) {
+    TEST_START(TESTPROFILE_RUNALL);
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    const HsaNodeProperties *pNodeProperties = m_NodeInfo.GetNodeProperties(defaultGPUNode);
+    uint32_t ActiveCU = (pNodeProperties->NumFComputeCores / pNodeProperties->NumSIMDPerCU);
+    uint32_t maskNumDwords = (ActiveCU + 31) / 32;
+    uint32_t maskNumBits = maskNumDwords * 32;
+    std::vector<HSAuint32> mask(maskNumDwords);
+
+    ASSERT_SUCCESS(hsaKmtBuildQueueCUMask(defaultGPUNode, ActiveCU / 2 + 1, maskNumBits, &mask[0]));
+    uint32_t nCUs = 0;
+    for (uint32_t i = 0; i < maskNumDwords; i++)
+        nCUs += __builtin_popcount(mask[i]);
+    EXPECT_EQ(ActiveCU / 2 + 1, nCUs);
+
+    for (uint32_t nPartitions = 1; nPartitions <= 8 && nPartitions <= ActiveCU; nPartitions++) {
+        std::vector<HSAuint32> masks(nPartitions * maskNumDwords);
+        std::vector<HSAuint32> all(maskNumDwords);
+
+        ASSERT_SUCCESS(hsaKmtPartitionQueueCUMask(defaultGPUNode, nPartitions, maskNumBits, &masks[0]));
+
+        for (uint32_t p = 0; p < nPartitions; p++) {
+            uint32_t partCUs = 0;
+
+            for (uint32_t i = 0; i < maskNumDwords; i++) {
+                EXPECT_EQ(0, all[i] & masks[p * maskNumDwords + i]);
+                all[i] |= masks[p * maskNumDwords + i];
+                partCUs += __builtin_popcount(masks[p * maskNumDwords + i]);
+            }
+            EXPECT_GE(partCUs, ActiveCU / nPartitions - 1);
+        }
+
+        nCUs = 0;
+        for (uint32_t i = 0; i < maskNumDwords; i++)
+            nCUs += __builtin_popcount(all[i]);
+        EXPECT_EQ(ActiveCU, nCUs);
+    }
+
+    TEST_END
+}
+
 TEST_F(KFDQMTest, QueuePriorityOnDifferentPipe) {
     TEST_START(TESTPROFILE_RUNALL);
 
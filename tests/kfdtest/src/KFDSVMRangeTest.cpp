@@ -22,6 +22,7 @@
  */
 #include "KFDSVMRangeTest.hpp"
 #include <sys/mman.h>
+#include <utility>
 #include <vector>
 #include "PM4Queue.hpp"
 #include "PM4Packet.hpp"
@@ -172,6 +173,141 @@ TEST_F(KFDSVMRangeTest, SetGetAttributesTest) {
     TEST_END
 }
 
+static void ExpectPageAttributes(char *pBuf, unsigned int page,
+                                 HSAuint32 preferredLoc, HSAuint32 granularity) {
+    HSA_SVM_ATTRIBUTE attributes[] = {
+                                         {HSA_SVM_ATTR_PREFERRED_LOC, 0},
+                                         {HSA_SVM_ATTR_GRANULARITY, 0},
+                                     };
+
+    EXPECT_SUCCESS(hsaKmtSVMGetAttr(pBuf + page * PAGE_SIZE, PAGE_SIZE, 2, attributes));
+    EXPECT_EQ(preferredLoc, attributes[0].value) << "page " << page;
+    EXPECT_EQ(granularity, attributes[1].value) << "page " << page;
+}
+
+/*
+ * Sets attributes on several ranges with one call and reads them back page by page.
+ * Disjoint ranges are grouped by attributes before they are set, overlapping ranges
+ * must still be set in the caller's order, and FailedRange is an index into the
+ * caller's array whatever order the ranges were set in.
+ */
+TEST_F(KFDSVMRangeTest, SetAttrBatchTest) {
+    TEST_REQUIRE_ENV_CAPABILITIES(ENVCAPS_64BITLINUX);
+    TEST_START(TESTPROFILE_RUNALL)
+
+    if (!SVMAPISupported())
+        return;
+
+    int defaultGPUNode = m_NodeInfo.HsaDefaultGPUNode();
+    ASSERT_GE(defaultGPUNode, 0) << "failed to get default GPU Node";
+
+    if (m_FamilyId < FAMILY_AI) {
+        LOG() << std::hex << "Skipping test: No svm range support for family ID 0x" << m_FamilyId << "." << std::endl;
+        return;
+    }
+
+    const unsigned int nPages = 8;
+    unsigned int i;
+    HSAuint32 failedRange;
+    HsaSVMRangeAttributes ranges[nPages];
+    HSA_SVM_ATTRIBUTE gpuAttributes[] = {
+                                            {HSA_SVM_ATTR_PREFERRED_LOC, (HSAuint32)defaultGPUNode},
+                                            {HSA_SVM_ATTR_GRANULARITY, 5},
+                                        };
+    HSA_SVM_ATTRIBUTE sysAttributes[] = {
+                                            {HSA_SVM_ATTR_PREFERRED_LOC, 0},
+                                            {HSA_SVM_ATTR_GRANULARITY, 7},
+                                        };
+    HSA_SVM_ATTRIBUTE undefinedAttributes[] = {
+                                                  {HSA_SVM_ATTR_PREFERRED_LOC, INVALID_NODEID},
+                                                  {HSA_SVM_ATTR_GRANULARITY, 6},
+                                              };
+    HSA_SVM_ATTRIBUTE invalidAttributes[] = {
+                                                {HSA_SVM_ATTR_ACCESS, 0xFFFF},
+                                            };
+
+    char *pBuf = reinterpret_cast<char *>(mmap(0, nPages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                               MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+    ASSERT_NE(MAP_FAILED, pBuf);
+
+    LOG() << "Setting interleaved disjoint ranges" << std::endl;
+    /* Even pages prefer the GPU, odd pages system memory, in no particular order */
+    const unsigned int pageOrder[nPages] = {6, 1, 0, 7, 4, 3, 2, 5};
+    for (i = 0; i < nPages; i++) {
+        ranges[i].StartAddress = pBuf + pageOrder[i] * PAGE_SIZE;
+        ranges[i].SizeInBytes = PAGE_SIZE;
+        ranges[i].NumAttributes = 2;
+        ranges[i].Attributes = pageOrder[i] & 1 ? sysAttributes : gpuAttributes;
+    }
+    EXPECT_SUCCESS(hsaKmtSVMSetAttrBatch(nPages, ranges, NULL));
+    for (i = 0; i < nPages; i++) {
+        if (i & 1)
+            ExpectPageAttributes(pBuf, i, 0, 7);
+        else
+            ExpectPageAttributes(pBuf, i, defaultGPUNode, 5);
+    }
+
+    LOG() << "Setting overlapping ranges" << std::endl;
+    /* Pages 0-3, then 2-5, then 3: each range overrides the previous ones */
+    ranges[0].StartAddress = pBuf;
+    ranges[0].SizeInBytes = 4 * PAGE_SIZE;
+    ranges[0].Attributes = gpuAttributes;
+    ranges[1].StartAddress = pBuf + 2 * PAGE_SIZE;
+    ranges[1].SizeInBytes = 4 * PAGE_SIZE;
+    ranges[1].Attributes = sysAttributes;
+    ranges[2].StartAddress = pBuf + 3 * PAGE_SIZE;
+    ranges[2].SizeInBytes = PAGE_SIZE;
+    ranges[2].Attributes = undefinedAttributes;
+    EXPECT_SUCCESS(hsaKmtSVMSetAttrBatch(3, ranges, NULL));
+    ExpectPageAttributes(pBuf, 0, defaultGPUNode, 5);
+    ExpectPageAttributes(pBuf, 1, defaultGPUNode, 5);
+    ExpectPageAttributes(pBuf, 2, 0, 7);
+    ExpectPageAttributes(pBuf, 3, INVALID_NODEID, 6);
+    ExpectPageAttributes(pBuf, 4, 0, 7);
+    ExpectPageAttributes(pBuf, 5, 0, 7);
+
+    /* The same ranges in reverse order: the first range wins everywhere */
+    std::swap(ranges[0], ranges[2]);
+    EXPECT_SUCCESS(hsaKmtSVMSetAttrBatch(3, ranges, NULL));
+    for (i = 0; i < 4; i++)
+        ExpectPageAttributes(pBuf, i, defaultGPUNode, 5);
+    ExpectPageAttributes(pBuf, 4, 0, 7);
+    ExpectPageAttributes(pBuf, 5, 0, 7);
+
+    LOG() << "Checking the failed range" << std::endl;
+    for (i = 0; i < 4; i++) {
+        ranges[i].StartAddress = pBuf + (3 - i) * PAGE_SIZE;
+        ranges[i].SizeInBytes = PAGE_SIZE;
+        ranges[i].NumAttributes = 2;
+        ranges[i].Attributes = i & 1 ? sysAttributes : gpuAttributes;
+    }
+
+    ranges[2].StartAddress = pBuf + PAGE_SIZE / 2;
+    failedRange = 0;
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_PARAMETER, hsaKmtSVMSetAttrBatch(4, ranges, &failedRange));
+    EXPECT_EQ(2U, failedRange);
+    ranges[2].StartAddress = pBuf + PAGE_SIZE;
+
+    ranges[1].NumAttributes = 1;
+    ranges[1].Attributes = invalidAttributes;
+    failedRange = 0;
+    EXPECT_EQ(HSAKMT_STATUS_INVALID_NODE_UNIT, hsaKmtSVMSetAttrBatch(4, ranges, &failedRange));
+    EXPECT_EQ(1U, failedRange);
+    ranges[1].NumAttributes = 2;
+    ranges[1].Attributes = sysAttributes;
+
+    /* The driver rejects the unmapped page, which isn't the first range set */
+    munmap(pBuf + 7 * PAGE_SIZE, PAGE_SIZE);
+    ranges[0].StartAddress = pBuf + 7 * PAGE_SIZE;
+    failedRange = 0xFFFFFFFF;
+    EXPECT_NE(HSAKMT_STATUS_SUCCESS, hsaKmtSVMSetAttrBatch(4, ranges, &failedRange));
+    EXPECT_EQ(0U, failedRange);
+
+    munmap(pBuf, (nPages - 1) * PAGE_SIZE);
+
+    TEST_END
+}
+
 TEST_F(KFDSVMRangeTest, XNACKModeTest) {
     TEST_REQUIRE_ENV_CAPABILITIES(ENVCAPS_64BITLINUX);
     TEST_START(TESTPROFILE_RUNALL);
@@ -257,3 +257,48 @@ TEST_F(KFDTopologyTest, GetNodeIoLinkProperties) {
 
     TEST_END
 }
+
+// Verifies that the topology snapshot matches what the copying
+// hsaKmtGetNode*Properties functions return, and that a snapshot stays
+// valid after the topology it came from was refreshed.
+TEST_F(KFDTopologyTest, TopologySnapshot) {
+    TEST_START(TESTPROFILE_RUNALL)
+
+    const HsaTopologySnapshot *pSnapshot, *pNewSnapshot;
+    HsaSystemProperties systemProperties;
+
+    ASSERT_SUCCESS(hsaKmtAcquireTopologySnapshot(&pSnapshot));
+    ASSERT_EQ(m_SystemProperties.NumNodes, pSnapshot->SystemProperties.NumNodes);
+
+    for (unsigned node = 0; node < m_SystemProperties.NumNodes; node++) {
+        const HsaNodeSnapshot *pNode = &pSnapshot->Nodes[node];
+        HsaNodeProperties nodeProperties;
+
+        EXPECT_SUCCESS(hsaKmtGetNodeProperties(node, &nodeProperties));
+        EXPECT_EQ(0, memcmp(&nodeProperties, &pNode->Node, sizeof(nodeProperties)));
+
+        std::vector<HsaMemoryProperties> memoryProperties(nodeProperties.NumMemoryBanks);
+        EXPECT_SUCCESS(hsaKmtGetNodeMemoryProperties(node, nodeProperties.NumMemoryBanks,
+                                                     memoryProperties.data()));
+        EXPECT_EQ(0, memcmp(memoryProperties.data(), pNode->MemoryProperties,
+                            nodeProperties.NumMemoryBanks * sizeof(HsaMemoryProperties)));
+
+        std::vector<HsaIoLinkProperties> ioLinkProperties(nodeProperties.NumIOLinks);
+        EXPECT_SUCCESS(hsaKmtGetNodeIoLinkProperties(node, nodeProperties.NumIOLinks,
+                                                     ioLinkProperties.data()));
+        EXPECT_EQ(0, memcmp(ioLinkProperties.data(), pNode->IoLinkProperties,
+                            nodeProperties.NumIOLinks * sizeof(HsaIoLinkProperties)));
+    }
+
+    // Refreshing the topology publishes a new snapshot, the old one stays readable
+    ASSERT_SUCCESS(hsaKmtAcquireSystemProperties(&systemProperties));
+    ASSERT_SUCCESS(hsaKmtAcquireTopologySnapshot(&pNewSnapshot));
+    EXPECT_NE(pSnapshot, pNewSnapshot);
+    EXPECT_EQ(0, memcmp(&pSnapshot->Nodes[0].Node, &pNewSnapshot->Nodes[0].Node,
+                        sizeof(HsaNodeProperties)));
+
+    EXPECT_SUCCESS(hsaKmtReleaseTopologySnapshot(pNewSnapshot));
+    EXPECT_SUCCESS(hsaKmtReleaseTopologySnapshot(pSnapshot));
+
+    TEST_END
+}